@@ -0,0 +1,519 @@
+/** \file   t64bench.c
+ * \brief   Benchmark of the t64 image handling
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Generates a synthetic t64 image and times t64_open(), t64_verify(),
+ * t64_write(), prg_extract_all() and t64_create() on it, reporting the best
+ * time of a number of runs and the throughput in records/s and MB/s.
+ *
+ * t64_open() maps the image lazily, so its benchmark also reads all data of
+ * the image (summing the bytes), otherwise the pages are never touched and the
+ * throughput would be meaningless.
+ *
+ * The image has a configurable number of records with random payload sizes,
+ * a percentage of records with a corrupt end address (like the one in
+ * `data/kikstart-iii-corrupt-endaddr.t64`) and optional padding after the
+ * last record. All files are created in a temporary directory, which is
+ * removed afterwards.
+ *
+ * Use `make bench` to build and run with the default settings, or
+ * `make bench BENCH_ARGS="-n 65535"` to pass arguments.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _WIN32
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+# include <direct.h>
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+
+#include "base.h"
+#include "optparse.h"
+#include "petasc.h"
+#include "prg.h"
+#include "t64types.h"
+#include "t64.h"
+
+
+/** \brief  Number of records to generate
+ */
+static long records = 10000;
+
+/** \brief  Minimum payload size of a record
+ */
+static long min_size = 256;
+
+/** \brief  Maximum payload size of a record
+ */
+static long max_size = 16384;
+
+/** \brief  Percentage of records with a corrupt end address
+ */
+static long corrupt = 10;
+
+/** \brief  Number of padding bytes after the last record
+ */
+static long padding = 0;
+
+/** \brief  Number of runs per benchmark, the best time is reported
+ */
+static long runs = 5;
+
+/** \brief  Number of worker threads for create and extract (0: one per CPU)
+ */
+static long jobs = 0;
+
+/** \brief  Seed for the random number generator
+ */
+static long seed = 1;
+
+/** \brief  Directory to create the temporary directory in
+ */
+static const char *base_dir = ".";
+
+
+/** \brief  Command line options
+ */
+static const option_decl_t options[] = {
+    { 'n', "records", &records, OPT_INT,
+        "number of records (1-65535, default: 10000)" },
+    { 0, "min-size", &min_size, OPT_INT,
+        "minimum payload size of a record (default: 256)" },
+    { 0, "max-size", &max_size, OPT_INT,
+        "maximum payload size of a record (default: 16384)" },
+    { 0, "corrupt", &corrupt, OPT_INT,
+        "percentage of records with a corrupt end address (default: 10)" },
+    { 0, "padding", &padding, OPT_INT,
+        "bytes of padding after the last record (default: 0)" },
+    { 'r', "runs", &runs, OPT_INT,
+        "number of runs per benchmark (default: 5)" },
+    { 'j', "jobs", &jobs, OPT_INT,
+        "number of worker threads (default: one per processor)" },
+    { 0, "seed", &seed, OPT_INT,
+        "seed for the random number generator (default: 1)" },
+    { 0, "dir", &base_dir, OPT_STR,
+        "directory for temporary files (default: current directory)" },
+
+    { 0, NULL, NULL, 0, NULL }
+};
+
+
+/** \brief  State of the random number generator
+ */
+static uint64_t rng_state;
+
+
+/** \brief  Get next pseudo-random number (xorshift64)
+ *
+ * \return  random number
+ */
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+
+/** \brief  Get random number in the range [\a lo, \a hi]
+ *
+ * \param[in]   lo  lowest value
+ * \param[in]   hi  highest value
+ *
+ * \return  random number
+ */
+static size_t rng_range(size_t lo, size_t hi)
+{
+    return lo + (size_t)(rng_next() % (uint64_t)(hi - lo + 1));
+}
+
+
+/** \brief  Generate synthetic t64 image
+ *
+ * \param[out]  size        size of the image
+ * \param[out]  payload     total size of the payloads (excluding padding)
+ *
+ * \return  image data, free with base_free()
+ */
+static uint8_t *generate_image(size_t *size, size_t *payload)
+{
+    static const char magic[] = "C64S tape image file";
+    uint8_t *data;
+    size_t *sizes;
+    size_t offset;
+    size_t total = 0;
+    long i;
+
+    /* determine payload sizes first to get the image size */
+    sizes = base_malloc(sizeof *sizes * (size_t)records);
+    for (i = 0; i < records; i++) {
+        sizes[i] = rng_range((size_t)min_size, (size_t)max_size);
+        total += sizes[i];
+    }
+    offset = T64_RECORDS_OFFSET + (size_t)records * T64_RECORD_SIZE;
+    *size = offset + total + (size_t)padding;
+    *payload = total;
+    data = base_calloc(*size, 1);
+
+    /* header */
+    memcpy(data + T64_HDR_MAGIC, magic, sizeof magic - 1);
+    set_uint16(data + T64_HDR_VERSION, 0x0101);
+    set_uint16(data + T64_HDR_REC_MAX, (uint16_t)records);
+    set_uint16(data + T64_HDR_REC_USED, (uint16_t)records);
+    asc_to_pet_str(data + T64_HDR_NAME, "t64bench", T64_HDR_NAME_LEN);
+    for (i = T64_HDR_NAME_LEN - 1; i >= 0; i--) {
+        if (data[T64_HDR_NAME + i] != 0x00) {
+            break;
+        }
+        data[T64_HDR_NAME + i] = 0x20;
+    }
+
+    /* records and payloads */
+    for (i = 0; i < records; i++) {
+        uint8_t *rec = data + T64_RECORDS_OFFSET + (size_t)i * T64_RECORD_SIZE;
+        uint16_t start = 0x0801;
+        uint16_t end = (uint16_t)(start + sizes[i]);
+        char name[T64_REC_FILENAME_LEN + 1];
+        size_t k;
+        int n;
+
+        if (rng_range(1, 100) <= (size_t)corrupt) {
+            /* end address that doesn't match the payload size */
+            end = 0xc3c6;
+        }
+        rec[T64_REC_C64S_FILETYPE] = 0x01;
+        rec[T64_REC_C1541_FILETYPE] = 0x82;
+        set_uint16(rec + T64_REC_START_ADDR, start);
+        set_uint16(rec + T64_REC_END_ADDR, end);
+        set_uint32(rec + T64_REC_CONTENTS, (uint32_t)offset);
+        n = snprintf(name, sizeof name, "file%05ld", i);
+        asc_to_pet_str(rec + T64_REC_FILENAME, name, T64_REC_FILENAME_LEN);
+        memset(rec + T64_REC_FILENAME + n, 0x20,
+               (size_t)(T64_REC_FILENAME_LEN - n));
+
+        for (k = 0; k < sizes[i]; k++) {
+            data[offset + k] = (uint8_t)rng_next();
+        }
+        offset += sizes[i];
+    }
+    base_free(sizes);
+    return data;
+}
+
+
+/** \brief  Create temporary directory in \a base_dir
+ *
+ * \return  path of directory, free with base_free(), or `NULL` on error
+ */
+static char *make_temp_dir(void)
+{
+    static const char name[] = "/t64bench-XXXXXX";
+    size_t len = strlen(base_dir);
+    char *path = base_malloc(len + sizeof name);
+
+    memcpy(path, base_dir, len);
+    memcpy(path + len, name, sizeof name);
+#ifdef _WIN32
+    if (_mktemp(path) == NULL || _mkdir(path) != 0) {
+#else
+    if (mkdtemp(path) == NULL) {
+#endif
+        base_free(path);
+        return NULL;
+    }
+    return path;
+}
+
+
+/** \brief  Sum of the image data, keeps the compiler from dropping the reads
+ */
+static volatile uint32_t checksum;
+
+
+/** \brief  Read all data of \a image
+ *
+ * \param[in]   image   t64 image
+ */
+static void touch_data(const t64_image_t *image)
+{
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < image->size; i++) {
+        sum += image->data[i];
+    }
+    checksum = sum;
+}
+
+
+/** \brief  Print benchmark result
+ *
+ * \param[in]   name    benchmark name
+ * \param[in]   ns      best time in nanoseconds
+ * \param[in]   bytes   number of bytes processed
+ */
+static void print_result(const char *name, uint64_t ns, size_t bytes)
+{
+    double secs = (double)ns / 1e9;
+
+    if (secs <= 0.0) {
+        secs = 1e-9;
+    }
+    printf("%-16s %10.3f ms %14.0f records/s %10.1f MB/s\n",
+           name, secs * 1e3, (double)records / secs,
+           (double)bytes / secs / (1024.0 * 1024.0));
+}
+
+
+/** \brief  Update best time
+ *
+ * \param[in,out]   best    best time so far
+ * \param[in]       start   start time of run
+ */
+static void update_best(uint64_t *best, uint64_t start)
+{
+    uint64_t t = base_clock_ns() - start;
+
+    if (t < *best) {
+        *best = t;
+    }
+}
+
+
+/** \brief  Run the benchmarks in the current directory
+ *
+ * \param[in]   size    size of image
+ * \param[in]   payload total size of payloads
+ *
+ * \return  bool
+ */
+static bool run_benchmarks(size_t size, size_t payload)
+{
+    t64_image_t *image;
+    uint64_t t_open = UINT64_MAX;
+    uint64_t t_verify = UINT64_MAX;
+    uint64_t t_write = UINT64_MAX;
+    uint64_t t_extract = UINT64_MAX;
+    uint64_t t_create = UINT64_MAX;
+    const char **names;
+    char *buffer;
+    size_t name_len;
+    long r;
+    long i;
+
+    /* t64_open(), including reading the mapped data */
+    for (r = 0; r < runs; r++) {
+        uint64_t start = base_clock_ns();
+
+        image = t64_open("bench.t64", true);
+        if (image == NULL) {
+            return false;
+        }
+        touch_data(image);
+        update_best(&t_open, start);
+        t64_free(image);
+    }
+    print_result("t64_open", t_open, size);
+
+    /* t64_verify(), on a freshly opened image each run */
+    for (r = 0; r < runs; r++) {
+        uint64_t start;
+
+        image = t64_open("bench.t64", true);
+        if (image == NULL) {
+            return false;
+        }
+        start = base_clock_ns();
+        t64_verify(image, true);
+        update_best(&t_verify, start);
+        t64_free(image);
+    }
+    print_result("t64_verify", t_verify, size);
+
+    /* t64_write() of a verified image */
+    image = t64_open("bench.t64", true);
+    if (image == NULL) {
+        return false;
+    }
+    t64_verify(image, true);
+    for (r = 0; r < runs; r++) {
+        uint64_t start = base_clock_ns();
+
+        if (!t64_write(image, "fixed.t64")) {
+            t64_free(image);
+            return false;
+        }
+        update_best(&t_write, start);
+    }
+    print_result("t64_write", t_write, size);
+
+    /* prg_extract_all() writes into the current directory */
+    for (r = 0; r < runs; r++) {
+        uint64_t start = base_clock_ns();
+
+        if (!prg_extract_all(image, (int)jobs, true)) {
+            t64_free(image);
+            return false;
+        }
+        update_best(&t_extract, start);
+    }
+    t64_free(image);
+    print_result("prg_extract_all", t_extract, payload);
+
+    /* t64_create() from the extracted files */
+    name_len = sizeof "file00000.prg";
+    names = base_malloc(sizeof *names * (size_t)records);
+    buffer = base_malloc(name_len * (size_t)records);
+    for (i = 0; i < records; i++) {
+        char *name = buffer + (size_t)i * name_len;
+
+        snprintf(name, name_len, "file%05u.prg", (unsigned int)(i & 0xffff));
+        names[i] = name;
+    }
+    for (r = 0; r < runs; r++) {
+        uint64_t start = base_clock_ns();
+
+        image = t64_create("created.t64", names, (int)records, (int)jobs, true);
+        update_best(&t_create, start);
+        if (image == NULL) {
+            base_free(names);
+            base_free(buffer);
+            return false;
+        }
+        t64_free(image);
+    }
+    print_result("t64_create", t_create, payload);
+
+    base_free(names);
+    base_free(buffer);
+    return true;
+}
+
+
+/** \brief  Benchmark driver
+ *
+ * \param[in]   argc    argument count
+ * \param[in]   argv    argument vector
+ *
+ * \return  EXIT_SUCCESS or EXIT_FAILURE
+ */
+int main(int argc, char *argv[])
+{
+    uint8_t *data;
+    size_t size;
+    size_t payload;
+    char *dir;
+    char *cwd;
+    int result;
+    bool status;
+    long i;
+
+    optparse_init(options, "t64bench", VERSION);
+    result = optparse_exec(argc, argv);
+    optparse_exit();
+    if (result == OPT_EXIT_ERROR) {
+        return EXIT_FAILURE;
+    } else if (result < 0) {
+        return EXIT_SUCCESS;
+    }
+
+    if (records < 1 || records > 0xffff) {
+        fprintf(stderr, "t64bench: error: record count must be 1-65535.\n");
+        return EXIT_FAILURE;
+    }
+    if (min_size < 1 || max_size < min_size || max_size > 0xf7fe) {
+        fprintf(stderr,
+                "t64bench: error: payload sizes must be 1-63486, with "
+                "--min-size <= --max-size.\n");
+        return EXIT_FAILURE;
+    }
+    if (corrupt < 0 || corrupt > 100 || padding < 0 || runs < 1) {
+        fprintf(stderr, "t64bench: error: invalid argument(s).\n");
+        return EXIT_FAILURE;
+    }
+    if ((double)records * (double)max_size > (double)UINT32_MAX) {
+        fprintf(stderr, "t64bench: error: image would exceed 4GB.\n");
+        return EXIT_FAILURE;
+    }
+
+    rng_state = (uint64_t)seed * 0x9e3779b97f4a7c15u + 1u;
+    data = generate_image(&size, &payload);
+
+    dir = make_temp_dir();
+    if (dir == NULL) {
+        fprintf(stderr, "t64bench: error: failed to create temporary "
+                "directory in '%s': %s.\n", base_dir, strerror(errno));
+        base_free(data);
+        return EXIT_FAILURE;
+    }
+    cwd = getcwd(NULL, 0);
+    if (cwd == NULL || chdir(dir) != 0) {
+        fprintf(stderr, "t64bench: error: failed to enter '%s'.\n", dir);
+        free(cwd);
+        base_free(dir);
+        base_free(data);
+        return EXIT_FAILURE;
+    }
+
+    printf("t64bench: %ld records, payload %ld-%ld bytes, %ld%% corrupt, "
+           "%ld bytes padding, image size %zu bytes, best of %ld runs\n",
+           records, min_size, max_size, corrupt, padding, size, runs);
+
+    status = fwrite_wrapper("bench.t64", data, size);
+    base_free(data);
+    if (status) {
+        status = run_benchmarks(size, payload);
+    }
+    if (!status) {
+        fprintf(stderr, "t64bench: error %d: %s (%s)\n",
+                t64_errno, t64_strerror(t64_errno), strerror(errno));
+    }
+
+    /* clean up */
+    for (i = 0; i < records; i++) {
+        char name[32];
+
+        snprintf(name, sizeof name, "file%05ld.prg", i);
+        remove(name);
+    }
+    remove("bench.t64");
+    remove("fixed.t64");
+    remove("created.t64");
+    if (chdir(cwd) != 0 || rmdir(dir) != 0) {
+        fprintf(stderr, "t64bench: warning: failed to remove '%s'.\n", dir);
+    }
+    free(cwd);
+    base_free(dir);
+    return status ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,445 @@
+/** \file   aio.c
+ * \brief   Asynchronous reads of file heads for batch mode
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Verifying an image only needs its header and directory, which are at the
+ * start of the file. On slow or networked storage the time is spent waiting
+ * for each open and read to complete, not on transferring data. This module
+ * keeps a configurable number of open/read requests in flight using io_uring,
+ * so those waits overlap with each other and with the verification of images
+ * that have already been read.
+ *
+ * The ring is driven through the raw system calls, so liburing isn't needed.
+ * Without io_uring support (other systems, older kernels or io_uring being
+ * blocked by a sandbox) aio_new() returns `NULL` and batch mode reads the
+ * images synchronously on its workers, as before.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_IO_URING
+# define _GNU_SOURCE    /* syscall() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_IO_URING
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
+
+#include "base.h"
+
+#include "aio.h"
+
+
+#ifdef HAVE_IO_URING
+
+/** \brief  Request stage encoded in the low bit of the user data of an SQE
+ */
+#define AIO_STAGE_OPEN  0
+#define AIO_STAGE_READ  1
+
+
+/** \brief  Asynchronous I/O context (io_uring)
+ */
+struct aio_s {
+    int                     fd;         /**< ring file descriptor */
+    unsigned int            depth;      /**< maximum requests in flight */
+    void *                  sq_ring;    /**< mapping of the submission ring */
+    size_t                  sq_ring_size;   /**< size of \a sq_ring */
+    void *                  cq_ring;    /**< mapping of the completion ring,
+                                             may be \a sq_ring */
+    size_t                  cq_ring_size;   /**< size of \a cq_ring */
+    struct io_uring_sqe *   sqes;       /**< submission queue entries */
+    size_t                  sqes_size;  /**< size of \a sqes */
+    unsigned int *          sq_head;    /**< submission ring head */
+    unsigned int *          sq_tail;    /**< submission ring tail */
+    unsigned int            sq_mask;    /**< submission ring mask */
+    unsigned int *          sq_array;   /**< submission ring index array */
+    unsigned int *          cq_head;    /**< completion ring head */
+    unsigned int *          cq_tail;    /**< completion ring tail */
+    unsigned int            cq_mask;    /**< completion ring mask */
+    struct io_uring_cqe *   cqes;       /**< completion queue entries */
+    unsigned int            pending;    /**< SQEs queued but not submitted */
+};
+
+
+/** \brief  Get next free submission queue entry of \a aio
+ *
+ * \param[in,out]   aio context
+ *
+ * \return  cleared SQE
+ *
+ * \note    The caller guarantees there's room: never more than \a aio->depth
+ *          requests are in flight, each with at most one SQE queued.
+ */
+static struct io_uring_sqe *aio_get_sqe(aio_t *aio)
+{
+    unsigned int tail = *(aio->sq_tail);
+    unsigned int index = tail & aio->sq_mask;
+    struct io_uring_sqe *sqe = aio->sqes + index;
+
+    memset(sqe, 0, sizeof *sqe);
+    aio->sq_array[index] = index;
+    /* the kernel only looks at the entry once the tail has been updated */
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->pending++;
+    return sqe;
+}
+
+
+/** \brief  Queue open of request \a index
+ *
+ * \param[in,out]   aio     context
+ * \param[in]       req     request
+ * \param[in]       index   index of \a req
+ */
+static void aio_queue_open(aio_t *aio, const aio_req_t *req, size_t index)
+{
+    struct io_uring_sqe *sqe = aio_get_sqe(aio);
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)req->path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = ((uint64_t)index << 1) | AIO_STAGE_OPEN;
+}
+
+
+/** \brief  Queue read of the head of request \a index
+ *
+ * \param[in,out]   aio     context
+ * \param[in]       req     request with an open file
+ * \param[in]       index   index of \a req
+ */
+static void aio_queue_read(aio_t *aio, const aio_req_t *req, size_t index)
+{
+    struct io_uring_sqe *sqe = aio_get_sqe(aio);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = req->fd;
+    sqe->addr = (uint64_t)(uintptr_t)req->buffer;
+    sqe->len = (uint32_t)(req->size < AIO_HEAD_SIZE
+                          ? req->size : AIO_HEAD_SIZE);
+    sqe->off = 0;
+    sqe->user_data = ((uint64_t)index << 1) | AIO_STAGE_READ;
+}
+
+
+/** \brief  Submit queued SQEs and wait for at least one completion
+ *
+ * Returns without waiting when the kernel is temporarily out of resources
+ * (`EAGAIN`) or the completion queue needs reaping first (`EBUSY`), the
+ * SQEs that weren't submitted are submitted by the next call.
+ *
+ * \param[in,out]   aio context
+ *
+ * \note    Any other error means the ring is unusable while requests may
+ *          still be in flight, writing into buffers the caller has already
+ *          given out, so that's treated as fatal.
+ */
+static void aio_enter(aio_t *aio)
+{
+    while (true) {
+        long result = syscall(__NR_io_uring_enter, aio->fd, aio->pending, 1,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (result >= 0) {
+            aio->pending -= (unsigned int)result;
+            return;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            return;
+        }
+        if (errno != EINTR) {
+            fprintf(stderr, "t64fix: fatal: io_uring_enter() failed: %s\n",
+                    strerror(errno));
+            abort();
+        }
+    }
+}
+
+
+/** \brief  Create asynchronous I/O context
+ *
+ * \param[in]   depth   maximum number of requests in flight (clamped to
+ *                      1-AIO_DEPTH_MAX)
+ *
+ * \return  new context or `NULL` if io_uring isn't available
+ */
+aio_t *aio_new(unsigned int depth)
+{
+    struct io_uring_params params;
+    aio_t *aio;
+    long fd;
+
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > AIO_DEPTH_MAX) {
+        depth = AIO_DEPTH_MAX;
+    }
+
+    memset(&params, 0, sizeof params);
+    fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    aio = base_malloc(sizeof *aio);
+    aio->fd = (int)fd;
+    aio->depth = depth < params.sq_entries ? depth : params.sq_entries;
+    aio->pending = 0;
+    aio->sq_ring_size = params.sq_off.array
+        + params.sq_entries * sizeof(unsigned int);
+    aio->cq_ring_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (aio->cq_ring_size > aio->sq_ring_size) {
+            aio->sq_ring_size = aio->cq_ring_size;
+        }
+        aio->cq_ring_size = aio->sq_ring_size;
+    }
+
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, aio->fd, IORING_OFF_SQ_RING);
+    if (aio->sq_ring == MAP_FAILED) {
+        close(aio->fd);
+        base_free(aio);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        aio->cq_ring = aio->sq_ring;
+    } else {
+        aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, aio->fd,
+                            IORING_OFF_CQ_RING);
+        if (aio->cq_ring == MAP_FAILED) {
+            munmap(aio->sq_ring, aio->sq_ring_size);
+            close(aio->fd);
+            base_free(aio);
+            return NULL;
+        }
+    }
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, aio->fd, IORING_OFF_SQES);
+    if (aio->sqes == MAP_FAILED) {
+        if (aio->cq_ring != aio->sq_ring) {
+            munmap(aio->cq_ring, aio->cq_ring_size);
+        }
+        munmap(aio->sq_ring, aio->sq_ring_size);
+        close(aio->fd);
+        base_free(aio);
+        return NULL;
+    }
+
+    aio->sq_head = (unsigned int *)((uint8_t *)aio->sq_ring
+                                    + params.sq_off.head);
+    aio->sq_tail = (unsigned int *)((uint8_t *)aio->sq_ring
+                                    + params.sq_off.tail);
+    aio->sq_mask = *(unsigned int *)((uint8_t *)aio->sq_ring
+                                     + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned int *)((uint8_t *)aio->sq_ring
+                                     + params.sq_off.array);
+    aio->cq_head = (unsigned int *)((uint8_t *)aio->cq_ring
+                                    + params.cq_off.head);
+    aio->cq_tail = (unsigned int *)((uint8_t *)aio->cq_ring
+                                    + params.cq_off.tail);
+    aio->cq_mask = *(unsigned int *)((uint8_t *)aio->cq_ring
+                                     + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)((uint8_t *)aio->cq_ring
+                                        + params.cq_off.cqes);
+    return aio;
+}
+
+
+/** \brief  Free asynchronous I/O context
+ *
+ * \param[in,out]   aio context
+ */
+void aio_free(aio_t *aio)
+{
+    munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ring != aio->sq_ring) {
+        munmap(aio->cq_ring, aio->cq_ring_size);
+    }
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(aio->fd);
+    base_free(aio);
+}
+
+
+/** \brief  Read the heads of the files in \a reqs
+ *
+ * Opens each file, gets its size and reads its first AIO_HEAD_SIZE bytes into
+ * the buffer of the request, keeping up to the depth of \a aio requests in
+ * flight. Calls \a func from the calling thread as soon as a request has
+ * completed, successfully or not, in the order of completion.
+ *
+ * Requests that fail (including those the kernel doesn't support) get their
+ * \a error set, the caller is expected to fall back to reading the file
+ * normally, which will also produce the proper error.
+ *
+ * \param[in,out]   aio     context
+ * \param[in,out]   reqs    requests (\a path and \a buffer set)
+ * \param[in]       count   number of elements in \a reqs
+ * \param[in]       func    function to call for each completed request
+ * \param[in]       arg     argument for \a func
+ */
+void aio_read_heads(aio_t *aio,
+                    aio_req_t *reqs,
+                    size_t count,
+                    aio_func_t func,
+                    void *arg)
+{
+    size_t next = 0;
+    size_t done = 0;
+    unsigned int inflight = 0;
+
+    while (done < count) {
+        unsigned int head;
+        unsigned int tail;
+
+        while (inflight < aio->depth && next < count) {
+            reqs[next].len = 0;
+            reqs[next].size = 0;
+            reqs[next].error = 0;
+            reqs[next].fd = -1;
+            aio_queue_open(aio, reqs + next, next);
+            next++;
+            inflight++;
+        }
+
+        aio_enter(aio);
+
+        head = *(aio->cq_head);
+        tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const struct io_uring_cqe *cqe = aio->cqes + (head & aio->cq_mask);
+            size_t index = (size_t)(cqe->user_data >> 1);
+            aio_req_t *req = reqs + index;
+            bool finished = true;
+
+            if ((cqe->user_data & 1) == AIO_STAGE_OPEN) {
+                struct stat st;
+
+                if (cqe->res < 0) {
+                    req->error = -cqe->res;
+                } else {
+                    req->fd = cqe->res;
+                    errno = 0;
+                    if (fstat(req->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                        /* let the normal read path handle pipes etc */
+                        req->error = errno != 0 ? errno : EINVAL;
+                    } else {
+                        req->size = (size_t)st.st_size;
+                        aio_queue_read(aio, req, index);
+                        finished = false;
+                    }
+                }
+            } else {
+                if (cqe->res < 0) {
+                    req->error = -cqe->res;
+                } else {
+                    req->len = (size_t)cqe->res;
+                }
+            }
+            head++;
+
+            if (finished) {
+                if (req->fd >= 0) {
+                    close(req->fd);
+                    req->fd = -1;
+                }
+                inflight--;
+                done++;
+                func(arg, index);
+            }
+        }
+        __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#else
+
+/** \brief  Create asynchronous I/O context
+ *
+ * Not available in this build.
+ *
+ * \param[in]   depth   maximum number of requests in flight (unused)
+ *
+ * \return  `NULL`
+ */
+aio_t *aio_new(unsigned int depth)
+{
+    (void)depth;
+    return NULL;
+}
+
+
+/** \brief  Free asynchronous I/O context
+ *
+ * \param[in,out]   aio context (unused)
+ */
+void aio_free(aio_t *aio)
+{
+    (void)aio;
+}
+
+
+/** \brief  Read the heads of the files in \a reqs
+ *
+ * Not available in this build, all requests fail with `ENOSYS`.
+ *
+ * \param[in,out]   aio     context (unused)
+ * \param[in,out]   reqs    requests
+ * \param[in]       count   number of elements in \a reqs
+ * \param[in]       func    function to call for each completed request
+ * \param[in]       arg     argument for \a func
+ */
+void aio_read_heads(aio_t *aio,
+                    aio_req_t *reqs,
+                    size_t count,
+                    aio_func_t func,
+                    void *arg)
+{
+    size_t i;
+
+    (void)aio;
+    for (i = 0; i < count; i++) {
+        reqs[i].len = 0;
+        reqs[i].size = 0;
+        reqs[i].error = ENOSYS;
+        reqs[i].fd = -1;
+        func(arg, i);
+    }
+}
+
+#endif
@@ -0,0 +1,83 @@
+/** \file   aio.h
+ * \brief   Asynchronous reads of file heads for batch mode - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_AIO_H
+#define HAVE_AIO_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/** \brief  Number of bytes read from the start of each file
+ *
+ * Enough for the header and a directory of 126 records, larger directories
+ * are completed with a normal read.
+ */
+#define AIO_HEAD_SIZE       4096
+
+/** \brief  Default number of reads in flight
+ */
+#define AIO_DEPTH_DEFAULT   64
+
+/** \brief  Maximum number of reads in flight
+ */
+#define AIO_DEPTH_MAX       4096
+
+
+/** \brief  Read request
+ */
+typedef struct aio_req_s {
+    const char *    path;   /**< path of file */
+    uint8_t *       buffer; /**< buffer of AIO_HEAD_SIZE bytes */
+    size_t          len;    /**< number of bytes read into \a buffer */
+    size_t          size;   /**< size of the file */
+    int             error;  /**< `errno` of failed request, 0 on success */
+    int             fd;     /**< file descriptor while in flight */
+} aio_req_t;
+
+
+/** \brief  Function called for each completed request
+ *
+ * \param[in]   arg     argument passed to aio_read_heads()
+ * \param[in]   index   index of the request
+ */
+typedef void (*aio_func_t)(void *arg, size_t index);
+
+
+/** \brief  Opaque asynchronous I/O context
+ */
+typedef struct aio_s aio_t;
+
+
+aio_t * aio_new(unsigned int depth);
+void    aio_free(aio_t *aio);
+void    aio_read_heads(aio_t *aio,
+                       aio_req_t *reqs,
+                       size_t count,
+                       aio_func_t func,
+                       void *arg);
+
+#endif
@@ -0,0 +1,612 @@
+/** \file   archive.c
+ * \brief   Compressed input (gzip, zip)
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Detects gzip streams and zip archives by their magic bytes and inflates
+ * them straight into a single buffer, so compressed images never need to be
+ * unpacked to disk. The compressed data is expected in memory, usually mapped
+ * by base_map_file().
+ *
+ * Inflating requires zlib (`HAVE_ZLIB`, see the Makefile). Without zlib only
+ * stored (uncompressed) zip members can be read.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+
+#include "base.h"
+
+#include "archive.h"
+
+
+/** \brief  Initial size of the output buffer when the size isn't known
+ */
+#define ARCHIVE_BLOCK_SIZE  65536
+
+/** \brief  Maximum ratio of a size hint to the compressed size
+ *
+ * Sizes stored in the archive are only trusted this far for allocating the
+ * output buffer up front, larger data grows the buffer while inflating.
+ */
+#define ARCHIVE_HINT_RATIO  8
+
+/** \brief  Size of the gzip header without optional fields */
+#define GZIP_HDR_SIZE       10
+/** \brief  Size of the gzip trailer (CRC32 and ISIZE) */
+#define GZIP_TRAILER_SIZE   8
+
+/** \brief  Zip local file header signature */
+#define ZIP_LOCAL_SIG       0x04034b50U
+/** \brief  Zip central directory entry signature */
+#define ZIP_CENTRAL_SIG     0x02014b50U
+/** \brief  Zip end of central directory signature */
+#define ZIP_EOCD_SIG        0x06054b50U
+
+/** \brief  Size of a zip local file header without name and extra field */
+#define ZIP_LOCAL_SIZE      30
+/** \brief  Size of a zip central directory entry without variable fields */
+#define ZIP_CENTRAL_SIZE    46
+/** \brief  Size of the zip end of central directory record without comment */
+#define ZIP_EOCD_SIZE       22
+/** \brief  Maximum size of the zip archive comment */
+#define ZIP_COMMENT_MAX     65535
+
+/* offsets in a local file header */
+#define ZIP_LOCAL_NAME_LEN      26  /**< length of the name */
+#define ZIP_LOCAL_EXTRA_LEN     28  /**< length of the extra field */
+
+/* offsets in a central directory entry */
+#define ZIP_CENTRAL_FLAGS       8   /**< general purpose flags */
+#define ZIP_CENTRAL_METHOD      10  /**< compression method */
+#define ZIP_CENTRAL_CRC         16  /**< CRC32 of the uncompressed data */
+#define ZIP_CENTRAL_CSIZE       20  /**< compressed size */
+#define ZIP_CENTRAL_USIZE       24  /**< uncompressed size */
+#define ZIP_CENTRAL_NAME_LEN    28  /**< length of the name */
+#define ZIP_CENTRAL_EXTRA_LEN   30  /**< length of the extra field */
+#define ZIP_CENTRAL_COMMENT_LEN 32  /**< length of the comment */
+#define ZIP_CENTRAL_LOCAL       42  /**< offset of the local header */
+
+/* offsets in the end of central directory record */
+#define ZIP_EOCD_COUNT          10  /**< total number of entries */
+#define ZIP_EOCD_CD_SIZE        12  /**< size of the central directory */
+#define ZIP_EOCD_CD_OFFSET      16  /**< offset of the central directory */
+
+/** \brief  Zip member is encrypted (general purpose flag) */
+#define ZIP_FLAG_ENCRYPTED      0x0001
+
+/** \brief  Zip compression method: stored */
+#define ZIP_METHOD_STORED       0
+/** \brief  Zip compression method: deflate */
+#define ZIP_METHOD_DEFLATE      8
+
+
+/** \brief  Maximum size of decompressed data
+ */
+static size_t archive_limit = ARCHIVE_LIMIT_MAX;
+
+
+/** \brief  Set maximum size of decompressed data
+ *
+ * Decompressing data that turns out larger fails with T64_ERR_ARCHIVE, which
+ * protects against decompression bombs. The default is ARCHIVE_LIMIT_MAX, the
+ * largest possible T64 image.
+ *
+ * This must be called before images are opened on other threads, the limit
+ * isn't protected by a lock.
+ *
+ * \param[in]   limit   maximum size in bytes, 0 or more than
+ *                      ARCHIVE_LIMIT_MAX for ARCHIVE_LIMIT_MAX
+ */
+void archive_set_limit(size_t limit)
+{
+    if (limit == 0 || limit > ARCHIVE_LIMIT_MAX) {
+        limit = ARCHIVE_LIMIT_MAX;
+    }
+    archive_limit = limit;
+}
+
+
+/** \brief  Get maximum size of decompressed data
+ *
+ * \return  maximum size in bytes
+ */
+size_t archive_get_limit(void)
+{
+    return archive_limit;
+}
+
+
+/** \brief  Detect compressed data by its magic bytes
+ *
+ * \param[in]   data    data
+ * \param[in]   size    size of \a data
+ *
+ * \return  type of \a data
+ */
+archive_type_t archive_detect(const uint8_t *data, size_t size)
+{
+    if (size >= GZIP_HDR_SIZE + GZIP_TRAILER_SIZE
+            && data[0] == 0x1f && data[1] == 0x8b) {
+        return ARCHIVE_GZIP;
+    }
+    if (size >= ZIP_EOCD_SIZE && data[0] == 'P' && data[1] == 'K'
+            && ((data[2] == 0x03 && data[3] == 0x04)
+                || (data[2] == 0x05 && data[3] == 0x06))) {
+        return ARCHIVE_ZIP;
+    }
+    return ARCHIVE_NONE;
+}
+
+
+#ifdef HAVE_ZLIB
+
+/** \brief  Allocation function for zlib, using base_malloc()
+ *
+ * \param[in]   opaque  unused
+ * \param[in]   items   number of items
+ * \param[in]   size    size of an item
+ *
+ * \return  pointer to memory
+ */
+static voidpf archive_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    (void)opaque;
+    return base_malloc((size_t)items * (size_t)size);
+}
+
+
+/** \brief  Free function for zlib, using base_free()
+ *
+ * \param[in]   opaque  unused
+ * \param[in]   ptr     memory to free
+ */
+static void archive_zfree(voidpf opaque, voidpf ptr)
+{
+    (void)opaque;
+    base_free(ptr);
+}
+
+
+/** \brief  Inflate \a size bytes of \a data into a new buffer
+ *
+ * The buffer is allocated with \a expected bytes up front and only grown when
+ * the data turns out larger, so with a correct size hint the data is inflated
+ * straight into its final buffer. The hint comes from the archive, so it's
+ * limited to ARCHIVE_HINT_RATIO times \a size, and the buffer never grows
+ * beyond \a limit.
+ *
+ * \param[out]  dest        inflated data, free with base_free()
+ * \param[in]   data        compressed data
+ * \param[in]   size        size of \a data
+ * \param[in]   expected    expected size of the inflated data (0 if unknown)
+ * \param[in]   limit       maximum size of the inflated data
+ * \param[in]   window_bits window bits for inflateInit2(): negative for raw
+ *                          deflate data, 16 + MAX_WBITS for gzip streams
+ *
+ * \return  size of the inflated data or -1 on error
+ * \throw   T64_ERR_ARCHIVE
+ */
+static long archive_inflate(uint8_t **dest,
+                            const uint8_t *data,
+                            size_t size,
+                            size_t expected,
+                            size_t limit,
+                            int window_bits)
+{
+    z_stream zs;
+    uint8_t *buffer;
+    size_t bufsize;
+    size_t in_used = 0;
+    size_t out_used = 0;
+    int zr;
+
+    *dest = NULL;
+    memset(&zs, 0, sizeof zs);
+    zs.zalloc = archive_zalloc;
+    zs.zfree = archive_zfree;
+    if (inflateInit2(&zs, window_bits) != Z_OK) {
+        t64_errno = T64_ERR_ARCHIVE;
+        return -1;
+    }
+
+    bufsize = size > SIZE_MAX / ARCHIVE_HINT_RATIO
+        ? SIZE_MAX : size * ARCHIVE_HINT_RATIO;
+    if (bufsize < ARCHIVE_BLOCK_SIZE) {
+        bufsize = ARCHIVE_BLOCK_SIZE;
+    }
+    if (expected > 0 && expected < bufsize) {
+        bufsize = expected;
+    }
+    if (bufsize > limit) {
+        bufsize = limit > 0 ? limit : 1;
+    }
+    buffer = base_malloc(bufsize);
+
+    while (true) {
+        size_t avail;
+
+        /* zlib counts in uInt, feed huge buffers in pieces */
+        if (zs.avail_in == 0 && in_used < size) {
+            avail = size - in_used;
+            if (avail > UINT_MAX) {
+                avail = UINT_MAX;
+            }
+            /* zlib doesn't write to its input */
+            zs.next_in = (Bytef *)(uintptr_t)(data + in_used);
+            zs.avail_in = (uInt)avail;
+            in_used += avail;
+        }
+        if (out_used == bufsize) {
+            if (bufsize >= limit) {
+                /* too large, don't let a decompression bomb exhaust memory */
+                inflateEnd(&zs);
+                base_free(buffer);
+                t64_errno = T64_ERR_ARCHIVE;
+                return -1;
+            }
+            bufsize = bufsize > limit / 2 ? limit : bufsize * 2;
+            buffer = base_realloc(buffer, bufsize);
+        }
+        avail = bufsize - out_used;
+        if (avail > UINT_MAX) {
+            avail = UINT_MAX;
+        }
+        zs.next_out = buffer + out_used;
+        zs.avail_out = (uInt)avail;
+
+        zr = inflate(&zs, Z_NO_FLUSH);
+        out_used += avail - zs.avail_out;
+
+        if (zr == Z_STREAM_END) {
+            size_t consumed = in_used - zs.avail_in;
+
+            /* concatenated gzip members inflate to concatenated data */
+            if (window_bits > MAX_WBITS && consumed + 2 <= size
+                    && data[consumed] == 0x1f && data[consumed + 1] == 0x8b) {
+                inflateReset(&zs);
+                continue;
+            }
+            break;
+        }
+        if ((zr == Z_BUF_ERROR && zs.avail_in == 0 && in_used == size)
+                || (zr != Z_OK && zr != Z_BUF_ERROR)) {
+            /* truncated or corrupt */
+            inflateEnd(&zs);
+            base_free(buffer);
+            t64_errno = T64_ERR_ARCHIVE;
+            return -1;
+        }
+    }
+    inflateEnd(&zs);
+
+    if (out_used > limit || out_used > LONG_MAX) {
+        base_free(buffer);
+        t64_errno = T64_ERR_ARCHIVE;
+        return -1;
+    }
+    if (out_used > 0 && out_used < bufsize) {
+        buffer = base_realloc(buffer, out_used);
+    }
+    *dest = buffer;
+    return (long)out_used;
+}
+
+#endif
+
+
+/** \brief  Inflate gzip stream \a data
+ *
+ * The size stored in the gzip trailer is used to allocate the output buffer,
+ * so normally there's a single allocation of exactly the right size. Data
+ * larger than archive_get_limit() is rejected.
+ *
+ * \param[out]  dest    inflated data, free with base_free()
+ * \param[in]   data    gzip stream
+ * \param[in]   size    size of \a data
+ *
+ * \return  size of the inflated data or -1 on error
+ * \throw   T64_ERR_ARCHIVE
+ */
+long archive_gunzip(uint8_t **dest, const uint8_t *data, size_t size)
+{
+#ifdef HAVE_ZLIB
+    *dest = NULL;
+    if (archive_detect(data, size) != ARCHIVE_GZIP) {
+        t64_errno = T64_ERR_ARCHIVE;
+        return -1;
+    }
+    /* ISIZE: size modulo 2^32, only a hint */
+    return archive_inflate(dest, data, size, get_uint32(data + size - 4),
+                           archive_limit, 16 + MAX_WBITS);
+#else
+    (void)data;
+    (void)size;
+    *dest = NULL;
+    t64_errno = T64_ERR_ARCHIVE;
+    return -1;
+#endif
+}
+
+
+/** \brief  Initialize iterator over the members of zip archive \a data
+ *
+ * Locates the central directory, use archive_zip_iter_next() to move to the
+ * first member. ZIP64 archives aren't supported.
+ *
+ * \param[out]  iter    zip iterator
+ * \param[in]   data    zip archive
+ * \param[in]   size    size of \a data
+ *
+ * \return  false if \a data isn't a (supported) zip archive
+ * \throw   T64_ERR_ARCHIVE
+ */
+bool archive_zip_iter_init(archive_zip_iter_t *iter,
+                           const uint8_t *data,
+                           size_t size)
+{
+    size_t eocd;
+    size_t stop;
+    uint32_t cd_size;
+    uint32_t cd_offset;
+
+    memset(iter, 0, sizeof *iter);
+    iter->data = data;
+    iter->size = size;
+    iter->index = -1;
+
+    if (size < ZIP_EOCD_SIZE) {
+        t64_errno = T64_ERR_ARCHIVE;
+        return false;
+    }
+
+    /* the end of central directory record is followed by the comment */
+    eocd = size - ZIP_EOCD_SIZE;
+    stop = eocd > ZIP_COMMENT_MAX ? eocd - ZIP_COMMENT_MAX : 0;
+    while (get_uint32(data + eocd) != ZIP_EOCD_SIG) {
+        if (eocd == stop) {
+            t64_errno = T64_ERR_ARCHIVE;
+            return false;
+        }
+        eocd--;
+    }
+
+    cd_size = get_uint32(data + eocd + ZIP_EOCD_CD_SIZE);
+    cd_offset = get_uint32(data + eocd + ZIP_EOCD_CD_OFFSET);
+    if (cd_offset == 0xffffffffU || (size_t)cd_offset + cd_size > eocd) {
+        /* ZIP64 or garbage */
+        t64_errno = T64_ERR_ARCHIVE;
+        return false;
+    }
+    iter->next = cd_offset;
+    iter->remaining = get_uint16(data + eocd + ZIP_EOCD_COUNT);
+    iter->valid = true;
+    return true;
+}
+
+
+/** \brief  Move \a iter to the next member of the zip archive
+ *
+ * \param[in,out]   iter    zip iterator
+ *
+ * \return  false when there are no more members, check `iter->valid` to see
+ *          if the archive was malformed
+ * \throw   T64_ERR_ARCHIVE
+ */
+bool archive_zip_iter_next(archive_zip_iter_t *iter)
+{
+    const uint8_t *entry;
+    size_t entry_size;
+
+    if (!iter->valid || iter->remaining == 0) {
+        return false;
+    }
+    entry = iter->data + iter->next;
+    if (iter->next + ZIP_CENTRAL_SIZE > iter->size
+            || get_uint32(entry) != ZIP_CENTRAL_SIG) {
+        goto archive_zip_iter_next_error;
+    }
+    entry_size = (size_t)ZIP_CENTRAL_SIZE
+        + get_uint16(entry + ZIP_CENTRAL_NAME_LEN)
+        + get_uint16(entry + ZIP_CENTRAL_EXTRA_LEN)
+        + get_uint16(entry + ZIP_CENTRAL_COMMENT_LEN);
+    if (iter->next + entry_size > iter->size) {
+        goto archive_zip_iter_next_error;
+    }
+
+    iter->name = entry + ZIP_CENTRAL_SIZE;
+    iter->name_len = get_uint16(entry + ZIP_CENTRAL_NAME_LEN);
+    iter->method = get_uint16(entry + ZIP_CENTRAL_METHOD);
+    if (get_uint16(entry + ZIP_CENTRAL_FLAGS) & ZIP_FLAG_ENCRYPTED) {
+        /* can't do anything with those, make extracting fail */
+        iter->method = UINT_MAX;
+    }
+    iter->crc = get_uint32(entry + ZIP_CENTRAL_CRC);
+    iter->csize = get_uint32(entry + ZIP_CENTRAL_CSIZE);
+    iter->usize = get_uint32(entry + ZIP_CENTRAL_USIZE);
+    iter->local = get_uint32(entry + ZIP_CENTRAL_LOCAL);
+
+    iter->next += entry_size;
+    iter->remaining--;
+    iter->index++;
+    return true;
+
+archive_zip_iter_next_error:
+    iter->valid = false;
+    t64_errno = T64_ERR_ARCHIVE;
+    return false;
+}
+
+
+/** \brief  Check if the current member of \a iter is a T64 image
+ *
+ * Only looks at the name: it has to end in ".t64", ignoring case.
+ *
+ * \param[in]   iter    zip iterator
+ *
+ * \return  bool
+ */
+bool archive_zip_iter_is_t64(const archive_zip_iter_t *iter)
+{
+    const uint8_t *ext;
+
+    if (iter->name_len < 4) {
+        return false;
+    }
+    ext = iter->name + iter->name_len - 4;
+    return ext[0] == '.'
+        && tolower(ext[1]) == 't' && ext[2] == '6' && ext[3] == '4';
+}
+
+
+/** \brief  Extract the current member of \a iter into a new buffer
+ *
+ * The buffer is allocated once with the size from the central directory and
+ * the member is inflated (or copied, when stored) straight into it. Members
+ * larger than archive_get_limit() are rejected, and inflating stops as soon as
+ * a member turns out larger than its size in the central directory.
+ *
+ * \param[in]   iter    zip iterator
+ * \param[out]  dest    member data, free with base_free()
+ *
+ * \return  size of the member or -1 on error
+ * \throw   T64_ERR_ARCHIVE
+ */
+long archive_zip_iter_extract(const archive_zip_iter_t *iter, uint8_t **dest)
+{
+    const uint8_t *local = iter->data + iter->local;
+    size_t offset;
+    long size;
+
+    *dest = NULL;
+    if (iter->local + ZIP_LOCAL_SIZE > iter->size
+            || get_uint32(local) != ZIP_LOCAL_SIG) {
+        t64_errno = T64_ERR_ARCHIVE;
+        return -1;
+    }
+    /* name and extra field may differ from the central directory */
+    offset = iter->local + ZIP_LOCAL_SIZE
+        + get_uint16(local + ZIP_LOCAL_NAME_LEN)
+        + get_uint16(local + ZIP_LOCAL_EXTRA_LEN);
+    if (offset + iter->csize > iter->size || iter->usize > archive_limit
+            || iter->usize > LONG_MAX) {
+        t64_errno = T64_ERR_ARCHIVE;
+        return -1;
+    }
+
+    if (iter->method == ZIP_METHOD_STORED && iter->csize == iter->usize) {
+        *dest = base_malloc(iter->usize > 0 ? iter->usize : 1);
+        memcpy(*dest, iter->data + offset, iter->usize);
+        size = (long)iter->usize;
+#ifdef HAVE_ZLIB
+    } else if (iter->method == ZIP_METHOD_DEFLATE) {
+        size = archive_inflate(dest, iter->data + offset, iter->csize,
+                               iter->usize, iter->usize, -MAX_WBITS);
+        if (size < 0) {
+            return -1;
+        }
+#endif
+    } else {
+        t64_errno = T64_ERR_ARCHIVE;
+        return -1;
+    }
+
+#ifdef HAVE_ZLIB
+    if ((size_t)size != iter->usize
+            || crc32(0L, *dest, (uInt)size) != iter->crc) {
+        base_free(*dest);
+        *dest = NULL;
+        t64_errno = T64_ERR_ARCHIVE;
+        return -1;
+    }
+#endif
+    return size;
+}
+
+
+/** \brief  Decompress \a data into a new buffer
+ *
+ * For zip archives \a member selects the member to extract by index. A
+ * negative \a member selects the first member whose name ends in ".t64", or
+ * the only member of the archive.
+ *
+ * \param[out]  dest    decompressed data, free with base_free()
+ * \param[in]   data    gzip stream or zip archive
+ * \param[in]   size    size of \a data
+ * \param[in]   member  index of zip member, -1 to pick the T64 image
+ *
+ * \return  size of the decompressed data or -1 on error
+ * \throw   T64_ERR_ARCHIVE
+ * \throw   T64_ERR_INDEX
+ * \throw   T64_ERR_T64_INVALID (no T64 image in the archive)
+ */
+long archive_read(uint8_t **dest, const uint8_t *data, size_t size, int member)
+{
+    archive_zip_iter_t iter;
+    archive_zip_iter_t first;
+
+    *dest = NULL;
+    switch (archive_detect(data, size)) {
+        case ARCHIVE_GZIP:
+            if (member > 0) {
+                t64_errno = T64_ERR_INDEX;
+                return -1;
+            }
+            return archive_gunzip(dest, data, size);
+
+        case ARCHIVE_ZIP:
+            if (!archive_zip_iter_init(&iter, data, size)) {
+                return -1;
+            }
+            while (archive_zip_iter_next(&iter)) {
+                if (iter.index == 0) {
+                    first = iter;
+                }
+                if (member < 0 ? archive_zip_iter_is_t64(&iter)
+                               : iter.index == member) {
+                    return archive_zip_iter_extract(&iter, dest);
+                }
+            }
+            if (!iter.valid) {
+                return -1;
+            }
+            if (member < 0 && iter.index == 0) {
+                return archive_zip_iter_extract(&first, dest);
+            }
+            t64_errno = member < 0 ? T64_ERR_T64_INVALID : T64_ERR_INDEX;
+            return -1;
+
+        case ARCHIVE_NONE:
+            /* fall through */
+        default:
+            t64_errno = T64_ERR_ARCHIVE;
+            return -1;
+    }
+}
@@ -0,0 +1,90 @@
+/** \file   archive.h
+ * \brief   Compressed input (gzip, zip) - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_ARCHIVE_H
+#define HAVE_ARCHIVE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/** \brief  Maximum size of decompressed data, the largest possible T64 image
+ */
+#define ARCHIVE_LIMIT_MAX   ((size_t)UINT32_MAX)
+
+
+/** \brief  Types of input detected by archive_detect()
+ */
+typedef enum archive_type_e {
+    ARCHIVE_NONE,   /**< not compressed */
+    ARCHIVE_GZIP,   /**< gzip stream */
+    ARCHIVE_ZIP     /**< zip archive */
+} archive_type_t;
+
+
+/** \brief  Iterator over the members of a zip archive
+ *
+ * Walks the central directory of the archive, the members themselves are only
+ * touched by archive_zip_iter_extract().
+ */
+typedef struct archive_zip_iter_s {
+    const uint8_t * data;       /**< archive data */
+    size_t          size;       /**< size of \a data */
+    size_t          next;       /**< offset of the next central directory
+                                     entry */
+    unsigned int    remaining;  /**< central directory entries left */
+    int             index;      /**< index of the current member */
+    const uint8_t * name;       /**< name of the current member (not
+                                     nul-terminated) */
+    size_t          name_len;   /**< length of \a name */
+    unsigned int    method;     /**< compression method */
+    uint32_t        crc;        /**< CRC32 of the uncompressed data */
+    size_t          csize;      /**< compressed size */
+    size_t          usize;      /**< uncompressed size */
+    size_t          local;      /**< offset of the local header */
+    bool            valid;      /**< no malformed entries were found */
+} archive_zip_iter_t;
+
+
+void            archive_set_limit(size_t limit);
+size_t          archive_get_limit(void);
+archive_type_t  archive_detect(const uint8_t *data, size_t size);
+long            archive_gunzip(uint8_t **dest,
+                               const uint8_t *data,
+                               size_t size);
+bool            archive_zip_iter_init(archive_zip_iter_t *iter,
+                                      const uint8_t *data,
+                                      size_t size);
+bool            archive_zip_iter_next(archive_zip_iter_t *iter);
+bool            archive_zip_iter_is_t64(const archive_zip_iter_t *iter);
+long            archive_zip_iter_extract(const archive_zip_iter_t *iter,
+                                         uint8_t **dest);
+long            archive_read(uint8_t **dest,
+                             const uint8_t *data,
+                             size_t size,
+                             int member);
+
+#endif
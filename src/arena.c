@@ -0,0 +1,183 @@
+/** \file   arena.c
+ * \brief   Resettable arena allocator
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Allocations are carved out of large blocks by bumping a pointer and can't be
+ * freed individually, instead the whole arena is reset at once. This fits
+ * batch mode, where each worker opens, verifies and frees one image after the
+ * other: with an arena per worker the image, its records and its data don't
+ * touch the heap allocator at all once the arena has grown large enough.
+ *
+ * An arena isn't thread-safe, each thread needs its own.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "base.h"
+
+#include "arena.h"
+
+
+/** \brief  Alignment of allocations
+ *
+ * Enough for any of the types stored in an arena (C99 lacks `max_align_t`).
+ */
+#define ARENA_ALIGN     16
+
+
+/** \brief  Block of memory of an arena
+ *
+ * The usable memory follows the header, blocks are kept in a list with the
+ * current block first.
+ */
+typedef struct arena_block_s {
+    struct arena_block_s *  next;   /**< previous (full) block */
+    size_t                  size;   /**< usable size of the block */
+    size_t                  used;   /**< bytes allocated from the block */
+} arena_block_t;
+
+
+/** \brief  Arena
+ */
+struct arena_s {
+    arena_block_t * blocks;     /**< blocks, current block first */
+    size_t          block_size; /**< minimum size of new blocks */
+    size_t          total;      /**< total usable size of all blocks */
+};
+
+
+/** \brief  Offset of the usable memory in a block
+ */
+#define ARENA_BLOCK_HEADER \
+    ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+
+/** \brief  Allocate new block of at least \a size bytes
+ *
+ * \param[in]   size    usable size of the block
+ *
+ * \return  new block
+ */
+static arena_block_t *arena_block_new(size_t size)
+{
+    arena_block_t *block = base_malloc(ARENA_BLOCK_HEADER + size);
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+
+/** \brief  Create new arena
+ *
+ * \param[in]   block_size  minimum size of blocks, 0 for ARENA_BLOCK_SIZE
+ *
+ * \return  new arena, free with arena_free()
+ */
+arena_t *arena_new(size_t block_size)
+{
+    arena_t *arena = base_malloc(sizeof *arena);
+
+    if (block_size == 0) {
+        block_size = ARENA_BLOCK_SIZE;
+    }
+    arena->blocks = arena_block_new(block_size);
+    arena->block_size = block_size;
+    arena->total = block_size;
+    return arena;
+}
+
+
+/** \brief  Allocate \a size bytes from \a arena
+ *
+ * Allocates a new block if the current block is full, allocation never fails:
+ * running out of memory is handled by base_malloc().
+ *
+ * \param[in,out]   arena   arena
+ * \param[in]       size    number of bytes to allocate
+ *
+ * \return  pointer to memory, aligned to ARENA_ALIGN bytes
+ */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    arena_block_t *block = arena->blocks;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (block->size - block->used < size) {
+        block = arena_block_new(size > arena->block_size
+                                ? size : arena->block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->total += block->size;
+    }
+    ptr = (uint8_t *)block + ARENA_BLOCK_HEADER + block->used;
+    block->used += size;
+    return ptr;
+}
+
+
+/** \brief  Release all allocations of \a arena
+ *
+ * If the arena needed more than one block since the last reset, the blocks
+ * are replaced with a single block of their combined size, so the arena
+ * settles on one block for a workload.
+ *
+ * \param[in,out]   arena   arena
+ */
+void arena_reset(arena_t *arena)
+{
+    arena_block_t *block = arena->blocks;
+
+    if (block->next != NULL) {
+        while (block != NULL) {
+            arena_block_t *next = block->next;
+
+            base_free(block);
+            block = next;
+        }
+        arena->blocks = arena_block_new(arena->total);
+    } else {
+        block->used = 0;
+    }
+}
+
+
+/** \brief  Free \a arena and all its blocks
+ *
+ * \param[in,out]   arena   arena
+ */
+void arena_free(arena_t *arena)
+{
+    arena_block_t *block = arena->blocks;
+
+    while (block != NULL) {
+        arena_block_t *next = block->next;
+
+        base_free(block);
+        block = next;
+    }
+    base_free(arena);
+}
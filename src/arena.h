@@ -0,0 +1,50 @@
+/** \file   arena.h
+ * \brief   Resettable arena allocator - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_ARENA_H
+#define HAVE_ARENA_H
+
+#include <stdlib.h>
+
+
+/** \brief  Default block size of an arena
+ *
+ * Large enough for the header, directory and records of all but the largest
+ * images, so batch mode usually needs a single block per worker.
+ */
+#define ARENA_BLOCK_SIZE    (1UL<<16)
+
+
+/** \brief  Opaque arena type
+ */
+typedef struct arena_s arena_t;
+
+
+arena_t *   arena_new(size_t block_size);
+void *      arena_alloc(arena_t *arena, size_t size);
+void        arena_reset(arena_t *arena);
+void        arena_free(arena_t *arena);
+
+#endif
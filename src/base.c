@@ -23,6 +23,11 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#ifndef _WIN32
+# define _POSIX_C_SOURCE 200809L
+# define _DEFAULT_SOURCE    /* syscall() on glibc */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -32,8 +37,29 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <ctype.h>
 #include <errno.h>
 #include <assert.h>
+#ifdef _WIN32
+# include <windows.h>
+# include <io.h>
+# include <fcntl.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+#else
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <sys/uio.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <time.h>
+# ifdef __linux__
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <linux/fs.h>
+# endif
+#endif
 
 #include "base.h"
+#include "stats.h"
 
 /* #define BASE_DEBUG */
 
@@ -47,12 +73,63 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define FRA_BLOCK_SIZE  (1UL<<16)
 
 
-/** \brief  Global error code
+/** \brief  Error code
  *
  * If this is set to T64_ERR_IO, the C library `errno` will contain further
  * information on what happened.
+ *
+ * Each thread has its own copy, so worker threads can report errors without
+ * stepping on each other.
+ */
+BASE_THREAD_LOCAL int t64_errno;
+
+
+/** \brief  Default malloc function of the allocator
+ *
+ * \param[in]   size    number of bytes to allocate
+ * \param[in]   data    user data (unused)
+ *
+ * \return  pointer to allocated memory or NULL on failure
+ */
+static void *default_malloc(size_t size, void *data)
+{
+    (void)data;
+    return malloc(size);
+}
+
+
+/** \brief  Default realloc function of the allocator
+ *
+ * \param[in]   ptr     memory to reallocate
+ * \param[in]   size    new size of \a ptr
+ * \param[in]   data    user data (unused)
+ *
+ * \return  pointer to reallocated memory or NULL on failure
+ */
+static void *default_realloc(void *ptr, size_t size, void *data)
+{
+    (void)data;
+    return realloc(ptr, size);
+}
+
+
+/** \brief  Default free function of the allocator
+ *
+ * \param[in]   ptr     memory to free
+ * \param[in]   data    user data (unused)
+ */
+static void default_free(void *ptr, void *data)
+{
+    (void)data;
+    free(ptr);
+}
+
+
+/** \brief  Allocator used by base_malloc() and friends
  */
-int t64_errno;
+static base_allocator_t allocator = {
+    default_malloc, default_realloc, default_free, NULL, NULL
+};
 
 
 /** \brief  Error messages
@@ -70,7 +147,14 @@ static const char *t64_err_msgs[] = {
     "track number out of range",
     "sector number out of range",
     "invalid filename",
-    "RLE error"
+    "RLE error",
+    "image data not loaded",
+    "disk full",
+    "invalid or unsupported archive",
+    "can't write into a compressed image",
+    "invalid request",
+    "invalid catalog file",
+    "invalid or unsupported patch"
 };
 
 
@@ -95,16 +179,52 @@ const char *t64_strerror(int code)
  * \param[in]   n   number of bytes requested to malloc(3) or realloc(3)
  *
  * \note    Sets t64_errno to `T64_ERR_OOM`, which is only useful for debuggers
- *          since abort() is called right after printing the message.
+ *          since abort() is called right after printing the message, unless
+ *          the out-of-memory handler of the allocator doesn't return.
  */
 static void base_err_alloc(size_t n)
 {
     t64_errno = T64_ERR_OOM;
-    fprintf(stderr, "failed to allocate %zu bytes, calling abort\n", n);
+    if (allocator.oom_func != NULL) {
+        allocator.oom_func(n, allocator.data);
+    } else {
+        fprintf(stderr, "failed to allocate %zu bytes, calling abort\n", n);
+    }
     abort();
 }
 
 
+/** \brief  Check if \a path refers to stdin/stdout
+ *
+ * A path of "-" means stdin when reading and stdout when writing.
+ *
+ * \param[in]   path    path
+ *
+ * \return  true if \a path is "-"
+ */
+bool base_is_stdio(const char *path)
+{
+    return path != NULL && path[0] == '-' && path[1] == '\0';
+}
+
+
+/** \brief  Switch \a fp to binary mode
+ *
+ * Only does something on Windows, where stdin and stdout are opened in text
+ * mode.
+ *
+ * \param[in,out]   fp  stream
+ */
+void base_set_binary(FILE *fp)
+{
+#ifdef _WIN32
+    _setmode(_fileno(fp), _O_BINARY);
+#else
+    (void)fp;
+#endif
+}
+
+
 /** \brief  Read unsigned 16-bit little endian value
  *
  * \param[in]   p   data containing the value
@@ -137,7 +257,8 @@ void set_uint16(uint8_t *p, uint16_t v)
  */
 uint32_t get_uint32(const uint8_t *p)
 {
-    return (uint32_t)(get_uint16(p) + (1<<16) * p[2] + (1<<24) * p[3]);
+    return (uint32_t)get_uint16(p) | ((uint32_t)p[2] << 16)
+        | ((uint32_t)p[3] << 24);
 }
 
 
@@ -193,7 +314,7 @@ unsigned int num_blocks(unsigned int n)
  * \endcode
  *
  * \param[out]  dest    pointer to memory to store buffer pointer
- * \param[in]   path    path to file
+ * \param[in]   path    path to file, "-" for stdin
  *
  * \returns size of buffer allocated, or -1 on error
  */
@@ -205,13 +326,19 @@ long fread_alloc(uint8_t **dest, const char *path)
     size_t bufread = 0;
     size_t result;
     FILE *fp;
+    STATS_START(t_read);
 
     errno = 0;
     *dest = NULL;
-    fp = fopen(path, "rb");
-    if (fp == NULL) {
-        t64_errno = T64_ERR_IO;
-        return -1;
+    if (base_is_stdio(path)) {
+        fp = stdin;
+        base_set_binary(fp);
+    } else {
+        fp = fopen(path, "rb");
+        if (fp == NULL) {
+            t64_errno = T64_ERR_IO;
+            return -1;
+        }
     }
 
     buffer = base_malloc(FRA_BLOCK_SIZE);
@@ -236,7 +363,8 @@ long fread_alloc(uint8_t **dest, const char *path)
                     base_free(buffer);
                 } else {
                     /* realloc buffer, if it fails we still have the data: */
-                    tmp = realloc(buffer, bufread);
+                    tmp = allocator.realloc_func(buffer, bufread,
+                                                 allocator.data);
                     if (tmp) {
                         buffer = tmp;
                     } else {
@@ -248,13 +376,19 @@ long fread_alloc(uint8_t **dest, const char *path)
                     printf("reallocated to %zu bytes\n", bufsize);
 #endif
                 }
-                fclose(fp);
+                if (fp != stdin) {
+                    fclose(fp);
+                }
+                STATS_STOP(STATS_PHASE_READ, t_read);
+                STATS_ADD(STATS_BYTES_READ, bufread);
                 return (long)bufread;
             } else {
                 /* I/O error */
                 t64_errno = T64_ERR_IO;
                 base_free(buffer);
-                fclose(fp);
+                if (fp != stdin) {
+                    fclose(fp);
+                }
                 return -1;
             }
         } else {
@@ -272,9 +406,542 @@ long fread_alloc(uint8_t **dest, const char *path)
 }
 
 
+/** \brief  Map file into memory
+ *
+ * Create a private, copy-on-write mapping of file \a path. The file itself is
+ * opened read-only and never modified: writes into the mapping only touch the
+ * process' copy of the affected pages.
+ *
+ * Only regular, non-empty files can be mapped. If mapping fails the caller is
+ * expected to fall back to fread_alloc(), which also takes care of reporting
+ * a proper error for non-existing files etc.
+ *
+ * \param[in]   path    path to file
+ * \param[out]  size    size of the mapping
+ *
+ * \return  pointer to mapped data or `NULL` on failure
+ * \throw   T64_ERR_IO
+ */
+uint8_t *base_map_file(const char *path, size_t *size)
+{
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+    LARGE_INTEGER fsize;
+    void *view = NULL;
+
+    *size = 0;
+    if (base_is_stdio(path)) {
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    if (!GetFileSizeEx(file, &fsize) || fsize.QuadPart <= 0
+            || (unsigned long long)fsize.QuadPart > (size_t)-1) {
+        CloseHandle(file);
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (mapping != NULL) {
+        view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        /* the view keeps a reference to the mapping object */
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    if (view == NULL) {
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    *size = (size_t)fsize.QuadPart;
+    STATS_ADD(STATS_BYTES_READ, *size);
+    return view;
+#else
+    struct stat st;
+    void *data;
+    int fd;
+    STATS_START(t_read);
+
+    *size = 0;
+    if (base_is_stdio(path)) {
+        /* stdin can't be mapped, leave it to fread_alloc() */
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        close(fd);
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+                fd, 0);
+    /* the mapping stays valid after closing the descriptor */
+    close(fd);
+    if (data == MAP_FAILED) {
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    STATS_STOP(STATS_PHASE_READ, t_read);
+    STATS_ADD(STATS_BYTES_READ, *size);
+    return data;
+#endif
+}
+
+
+/** \brief  Unmap file mapped with base_map_file()
+ *
+ * \param[in]   data    mapped data
+ * \param[in]   size    size of mapping
+ */
+void base_unmap_file(uint8_t *data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+
+/** \brief  Determine if \a path1 and \a path2 refer to the same file
+ *
+ * \param[in]   path1   path to file
+ * \param[in]   path2   path to file
+ *
+ * \return  true if both paths are the same file, or when that cannot be
+ *          determined reliably
+ */
+bool base_same_file(const char *path1, const char *path2)
+{
+#ifdef _WIN32
+    /* no reliable inode numbers, assume the worst */
+    (void)path1;
+    (void)path2;
+    return true;
+#else
+    struct stat st1;
+    struct stat st2;
+
+    if (stat(path1, &st1) != 0 || stat(path2, &st2) != 0) {
+        /* if either is missing, they can't be the same */
+        return false;
+    }
+    return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+#endif
+}
+
+
+/** \brief  Get size of regular file \a fp
+ *
+ * \param[in]   fp      file handle
+ * \param[out]  size    file size
+ *
+ * \return  false if the size couldn't be determined or if \a fp isn't a
+ *          regular file
+ */
+bool base_fsize(FILE *fp, size_t *size)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+
+    if (_fstat64(_fileno(fp), &st) != 0 || (st.st_mode & _S_IFMT) != _S_IFREG) {
+        return false;
+    }
+#else
+    struct stat st;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+#endif
+    *size = (size_t)st.st_size;
+    return true;
+}
+
+
+/** \brief  Get size of regular file \a path
+ *
+ * \param[in]   path    path to file
+ * \param[out]  size    file size
+ *
+ * \return  false if the size couldn't be determined or if \a path isn't a
+ *          regular file
+ * \throw   T64_ERR_IO
+ */
+bool base_file_size(const char *path, size_t *size)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+
+    if (_stat64(path, &st) != 0 || (st.st_mode & _S_IFMT) != _S_IFREG) {
+#else
+    struct stat st;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+#endif
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
+    *size = (size_t)st.st_size;
+    return true;
+}
+
+
+/** \brief  Get size and modification time of regular file \a path
+ *
+ * \param[in]   path    path to file
+ * \param[out]  size    file size
+ * \param[out]  mtime   modification time in nanoseconds since the epoch (only
+ *                      whole seconds on Windows)
+ *
+ * \return  false if \a path couldn't be stat'ed or isn't a regular file
+ * \throw   T64_ERR_IO
+ */
+bool base_file_stat(const char *path, size_t *size, int64_t *mtime)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+
+    if (_stat64(path, &st) != 0 || (st.st_mode & _S_IFMT) != _S_IFREG) {
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
+    *mtime = (int64_t)st.st_mtime * 1000000000;
+#else
+    struct stat st;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
+# ifdef __APPLE__
+    *mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000
+        + st.st_mtimespec.tv_nsec;
+# else
+    *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+# endif
+#endif
+    *size = (size_t)st.st_size;
+    return true;
+}
+
+
+/** \brief  Flush \a fp and force its data onto the storage device
+ *
+ * \param[in]   fp  file handle
+ *
+ * \return  bool
+ * \throw   T64_ERR_IO
+ */
+bool base_fsync(FILE *fp)
+{
+    if (fflush(fp) != 0) {
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
+#ifdef _WIN32
+    if (_commit(_fileno(fp)) != 0) {
+#else
+    if (fsync(fileno(fp)) != 0) {
+#endif
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief  Create temporary file next to \a path
+ *
+ * Creates a new, uniquely named file in the same directory as \a path, so it
+ * can later be moved over \a path with base_rename_replace(). On POSIX systems
+ * the file gets the permissions of \a path if that exists, otherwise those of
+ * a new file (0666 minus the umask) instead of the 0600 of mkstemp().
+ *
+ * Reading the umask means setting it briefly, so for a new \a path this must
+ * not be called while other threads are creating files.
+ *
+ * \param[in]   path        path of file the temporary file is for
+ * \param[out]  tmp_path    path of the temporary file, free after use
+ *
+ * \return  file handle opened for reading and writing, or `NULL` on error
+ * \throw   T64_ERR_IO
+ */
+FILE *base_fopen_tmp(const char *path, char **tmp_path)
+{
+    static const char suffix[] = ".t64fix-XXXXXX";
+    size_t len = strlen(path);
+    char *name;
+    FILE *fp;
+
+    name = base_malloc(len + sizeof suffix);
+    memcpy(name, path, len);
+    memcpy(name + len, suffix, sizeof suffix);
+#ifdef _WIN32
+    if (_mktemp(name) == NULL) {
+        base_free(name);
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    fp = fopen(name, "w+b");
+#else
+    {
+        struct stat st;
+        mode_t mode;
+        int fd = mkstemp(name);
+
+        if (fd < 0) {
+            base_free(name);
+            t64_errno = T64_ERR_IO;
+            return NULL;
+        }
+        if (stat(path, &st) == 0) {
+            mode = st.st_mode & 07777;
+        } else {
+            mode_t mask = umask(0);
+
+            umask(mask);
+            mode = 0666 & ~mask;
+        }
+        if (fchmod(fd, mode) != 0) {
+            fp = NULL;
+        } else {
+            fp = fdopen(fd, "w+b");
+        }
+        if (fp == NULL) {
+            close(fd);
+            unlink(name);
+        }
+    }
+#endif
+    if (fp == NULL) {
+        base_free(name);
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    *tmp_path = name;
+    return fp;
+}
+
+
+/** \brief  Atomically replace file \a to with file \a from
+ *
+ * On POSIX systems the directory containing \a to is synced afterwards, so the
+ * rename itself survives a crash as well.
+ *
+ * \param[in]   from    path of replacement file
+ * \param[in]   to      path of file to replace
+ *
+ * \return  bool
+ * \throw   T64_ERR_IO
+ */
+bool base_rename_replace(const char *from, const char *to)
+{
+#ifdef _WIN32
+    if (!MoveFileExA(from, to,
+                MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH)) {
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
+    return true;
+#else
+    const char *base;
+    char *dir;
+    int fd;
+
+    if (rename(from, to) != 0) {
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
+    /* sync the directory entry */
+    base = base_basename(to, NULL);
+    if (base == to) {
+        dir = base_strdup(".");
+    } else {
+        size_t len = (size_t)(base - to);
+
+        dir = base_malloc(len + 1);
+        memcpy(dir, to, len);
+        dir[len] = '\0';
+    }
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    base_free(dir);
+    return true;
+#endif
+}
+
+
+/** \brief  Copy contents of \a src to \a dest
+ *
+ * Both files are expected to be positioned at their start.
+ *
+ * \param[in]   src     source file
+ * \param[in]   dest    destination file
+ *
+ * \return  bool
+ * \throw   T64_ERR_IO
+ */
+bool base_fcopy(FILE *src, FILE *dest)
+{
+    uint8_t *buffer = base_malloc(FRA_BLOCK_SIZE);
+    bool result = true;
+    size_t len;
+
+    while ((len = fread(buffer, 1, FRA_BLOCK_SIZE, src)) > 0) {
+        if (fwrite(buffer, 1, len, dest) != len) {
+            result = false;
+            break;
+        }
+        STATS_ADD(STATS_BYTES_READ, len);
+        STATS_ADD(STATS_BYTES_WRITTEN, len);
+    }
+    if (ferror(src)) {
+        result = false;
+    }
+    if (!result) {
+        t64_errno = T64_ERR_IO;
+    }
+    base_free(buffer);
+    return result;
+}
+
+
+#ifdef __linux__
+/** \brief  Copy \a size bytes from \a in to \a out inside the kernel
+ *
+ * Tries to share the data blocks of \a in with \a out (a reflink, on file
+ * systems like Btrfs and XFS), then copy_file_range(2), which can use server
+ * side copies on network file systems and avoids copying through user space
+ * anyway. Both files are expected to be positioned at their start.
+ *
+ * \param[in]   in      source file descriptor
+ * \param[in]   out     destination file descriptor, empty
+ * \param[in]   size    size of the source file
+ *
+ * \return  false if neither is supported for these files, nothing has been
+ *          copied then and \a errno is 0, otherwise \a errno is set
+ */
+static bool base_copy_kernel(int in, int out, size_t size)
+{
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        return true;
+    }
+#endif
+#ifdef __NR_copy_file_range
+    while (size > 0) {
+        long n = syscall(__NR_copy_file_range, in, NULL, out, NULL, size, 0U);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            /* other file system, not supported, or the file shrunk: the
+             * fallback can still handle the first, the rest is an error */
+            if (n == 0 || (errno != EXDEV && errno != ENOSYS
+                        && errno != EOPNOTSUPP && errno != EINVAL)) {
+                if (n == 0) {
+                    errno = EIO;
+                }
+                return false;
+            }
+            if (lseek(out, 0, SEEK_CUR) == 0) {
+                errno = 0;
+            }
+            return false;
+        }
+        size -= (size_t)n;
+    }
+    return true;
+#else
+    (void)in;
+    (void)out;
+    (void)size;
+    errno = 0;
+    return false;
+#endif
+}
+#endif
+
+
+/** \brief  Create \a to as a copy of \a from
+ *
+ * On Linux the copy is made by the kernel where possible: as a reflink, which
+ * takes no time or space at all on copy-on-write file systems, or with
+ * copy_file_range(2). Otherwise the data is copied through a buffer.
+ *
+ * \param[in]   from    path of source file
+ * \param[in]   to      path of destination, created or truncated
+ *
+ * \return  destination opened for reading and writing, or `NULL` on error
+ * \throw   T64_ERR_IO
+ */
+FILE *base_copy_file(const char *from, const char *to)
+{
+    FILE *src;
+    FILE *dest;
+    bool ok;
+
+    errno = 0;
+    src = fopen(from, "rb");
+    if (src == NULL) {
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    dest = fopen(to, "w+b");
+    if (dest == NULL) {
+        t64_errno = T64_ERR_IO;
+        fclose(src);
+        return NULL;
+    }
+
+#ifdef __linux__
+    {
+        size_t size;
+
+        ok = base_fsize(src, &size)
+            && base_copy_kernel(fileno(src), fileno(dest), size);
+        if (!ok && errno != 0) {
+            t64_errno = T64_ERR_IO;
+            fclose(src);
+            fclose(dest);
+            remove(to);
+            return NULL;
+        }
+    }
+#else
+    ok = false;
+#endif
+    if (!ok && !base_fcopy(src, dest)) {
+        fclose(src);
+        fclose(dest);
+        remove(to);
+        return NULL;
+    }
+    fclose(src);
+    return dest;
+}
+
+
 /** \brief  Wrapper around fwrite(3)
  *
- * \param[in]   path    filename/path
+ * \param[in]   path    filename/path, "-" for stdout
  * \param[in]   data    data to write to \a path
  * \param[in]   size    number of bytes of \a data to write
  *
@@ -283,15 +950,31 @@ long fread_alloc(uint8_t **dest, const char *path)
 bool fwrite_wrapper(const char *path, const uint8_t *data, size_t size)
 {
     bool result = true;
-    FILE *fd = fopen(path, "wb");
-    if (fd == NULL) {
-        t64_errno = T64_ERR_IO;
-        result = false;
+    FILE *fd;
+    STATS_START(t_write);
+
+    if (base_is_stdio(path)) {
+        base_set_binary(stdout);
+        if (fwrite(data, 1, size, stdout) != size || fflush(stdout) != 0) {
+            t64_errno = T64_ERR_IO;
+            result = false;
+        }
     } else {
-        if (fwrite(data, 1, size, fd) != size) {
+        fd = fopen(path, "wb");
+        if (fd == NULL) {
+            t64_errno = T64_ERR_IO;
             result = false;
+        } else {
+            if (fwrite(data, 1, size, fd) != size) {
+                result = false;
+            }
+            fclose(fd);
         }
-        fclose(fd);
+    }
+    STATS_STOP(STATS_PHASE_WRITE, t_write);
+    if (result) {
+        STATS_ADD(STATS_BYTES_WRITTEN, size);
+        STATS_ADD(STATS_FILES_WRITTEN, 1);
     }
     return result;
 }
@@ -299,37 +982,119 @@ bool fwrite_wrapper(const char *path, const uint8_t *data, size_t size)
 
 /** \brief  Write a prg file to the OS
  *
- * \param[in]   path    path of file
+ * The start address and the program data are written with a single vectored
+ * write (two plain writes on Windows), without going through stdio.
+ *
+ * \param[in]   path    path of file, "-" for stdout
  * \param[in]   data    program file data, excluding start address
  * \param[in]   size    size of program file data, excluding start address
  * \param[in]   start   start address to use for program file
  *
  * \return  bool
+ * \throw   T64_ERR_IO
  */
 bool fwrite_prg(const char *path, const uint8_t *data, size_t size, int start)
 {
-    bool result = false;
-    FILE *fd = fopen(path, "wb");
+    uint8_t addr[2];
+    bool result = true;
+    int fd;
+    STATS_START(t_write);
+
+    addr[0] = (uint8_t)(start & 0xff);
+    addr[1] = (uint8_t)((start >> 8) & 0xff);
+
+    /* anything still buffered must end up before the file data */
+    if (base_is_stdio(path) && fflush(stdout) != 0) {
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
 
-    if (fd == NULL) {
+#ifdef _WIN32
+    if (base_is_stdio(path)) {
+        base_set_binary(stdout);
+        fd = _fileno(stdout);
+    } else {
+        fd = _open(path, _O_WRONLY|_O_CREAT|_O_TRUNC|_O_BINARY,
+                   _S_IREAD|_S_IWRITE);
+    }
+    if (fd < 0) {
         t64_errno = T64_ERR_IO;
         return false;
+    }
+    if (_write(fd, addr, 2) != 2) {
+        result = false;
     } else {
-        /* write start address */
-        if (fputc((unsigned char)(start & 0xff), fd) == EOF) {
-            goto fwrite_prg_exit;
-        }
-        if (fputc((unsigned char)((start >> 8) & 0xff), fd) == EOF) {
-            goto fwrite_prg_exit;
+        while (size > 0) {
+            unsigned int chunk;
+            int n;
+
+            chunk = size > 0x40000000 ? 0x40000000 : (unsigned int)size;
+            n = _write(fd, data, chunk);
+
+            if (n <= 0) {
+                result = false;
+                break;
+            }
+            data += n;
+            size -= (size_t)n;
         }
-        if (fwrite(data, 1, size, fd) != size) {
-            goto fwrite_prg_exit;
+    }
+    if (!base_is_stdio(path) && _close(fd) != 0) {
+        result = false;
+    }
+#else
+    {
+        struct iovec iov[2];
+        struct iovec *vec = iov;
+        int count = 2;
+
+        if (base_is_stdio(path)) {
+            fd = STDOUT_FILENO;
         } else {
-            result = true;
+            fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        }
+        if (fd < 0) {
+            t64_errno = T64_ERR_IO;
+            return false;
+        }
+        iov[0].iov_base = addr;
+        iov[0].iov_len = 2;
+        iov[1].iov_base = (void *)(uintptr_t)data;
+        iov[1].iov_len = size;
+
+        while (count > 0) {
+            ssize_t n = writev(fd, vec, count);
+
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                result = false;
+                break;
+            }
+            /* skip what's been written, handles short writes */
+            while (count > 0 && (size_t)n >= vec->iov_len) {
+                n -= (ssize_t)vec->iov_len;
+                vec++;
+                count--;
+            }
+            if (count > 0) {
+                vec->iov_base = (uint8_t *)vec->iov_base + n;
+                vec->iov_len -= (size_t)n;
+            }
+        }
+        if (!base_is_stdio(path) && close(fd) != 0) {
+            result = false;
         }
     }
-fwrite_prg_exit:
-    fclose(fd);
+#endif
+    STATS_STOP(STATS_PHASE_WRITE, t_write);
+    if (!result) {
+        t64_errno = T64_ERR_IO;
+    } else {
+        STATS_ADD(STATS_BYTES_WRITTEN, size + 2);
+        STATS_ADD(STATS_FILES_WRITTEN, 1);
+    }
     return result;
 }
 
@@ -339,6 +1104,34 @@ fwrite_prg_exit:
  * Memory allocation functions, akin to xmalloc()
  */
 
+/** \brief  Set allocator used by base_malloc() and friends
+ *
+ * Allows library users to plug in their own allocator. The functions of
+ * \a allocator return NULL on failure, in which case its out-of-memory
+ * handler is called, which must not return. Without a handler a message is
+ * printed on stderr and abort() is called, as with the default allocator.
+ *
+ * This must be called before any other library function: memory allocated
+ * with one allocator cannot be freed by another one. Memory obtained from
+ * base_map_file() isn't affected.
+ *
+ * \param[in]   new_allocator   allocator (copied), `NULL` to restore malloc(3)
+ *                              and friends
+ */
+void base_set_allocator(const base_allocator_t *new_allocator)
+{
+    if (new_allocator == NULL) {
+        allocator.malloc_func = default_malloc;
+        allocator.realloc_func = default_realloc;
+        allocator.free_func = default_free;
+        allocator.oom_func = NULL;
+        allocator.data = NULL;
+    } else {
+        allocator = *new_allocator;
+    }
+}
+
+
 /** \brief  Allocate \a size bytes on the heap
  *
  * \param[in]   size    number of bytes to allocate
@@ -349,10 +1142,12 @@ fwrite_prg_exit:
  */
 void *base_malloc(size_t size)
 {
-    void *ptr = malloc(size);
+    void *ptr = allocator.malloc_func(size, allocator.data);
     if (ptr == NULL) {
         base_err_alloc(size);
     }
+    STATS_ADD(STATS_ALLOCS, 1);
+    STATS_ADD(STATS_ALLOC_BYTES, size);
     return ptr;
 }
 
@@ -368,23 +1163,32 @@ void *base_malloc(size_t size)
  */
 void *base_calloc(size_t nmemb, size_t size)
 {
-    void *ptr = calloc(nmemb, size);
+    void *ptr;
+
+    if (size > 0 && nmemb > SIZE_MAX / size) {
+        base_err_alloc(SIZE_MAX);
+    }
+    ptr = allocator.malloc_func(nmemb * size, allocator.data);
     if (ptr == NULL) {
         base_err_alloc(nmemb * size);
     }
+    memset(ptr, 0, nmemb * size);
+    STATS_ADD(STATS_ALLOCS, 1);
+    STATS_ADD(STATS_ALLOC_BYTES, nmemb * size);
     return ptr;
 }
 
 
 /** \brief  Free memory at \a ptr
  *
- * Wrapper around free() for symmetry with base_malloc()/base_realloc().
+ * Wrapper around the free function of the allocator, for symmetry with
+ * base_malloc()/base_realloc().
  *
  * \param[in]   ptr memory to free
  */
 void base_free(void *ptr)
 {
-    free(ptr);
+    allocator.free_func(ptr, allocator.data);
 }
 
 
@@ -399,11 +1203,13 @@ void base_free(void *ptr)
  */
 void *base_realloc(void *ptr, size_t size)
 {
-    void *tmp = realloc(ptr, size);
+    void *tmp = allocator.realloc_func(ptr, size, allocator.data);
 
     if (tmp == NULL) {
         base_err_alloc(size);
     }
+    STATS_ADD(STATS_ALLOCS, 1);
+    STATS_ADD(STATS_ALLOC_BYTES, size);
     return tmp;
 }
 
@@ -575,3 +1381,30 @@ int popcount_byte(uint8_t b)
     return c;
 }
 
+
+/** \brief  Get monotonic clock value in nanoseconds
+ *
+ * Only useful for measuring intervals, the starting point is undefined.
+ *
+ * \return  nanoseconds
+ */
+uint64_t base_clock_ns(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000u
+        + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000u
+        / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
@@ -31,6 +31,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 # include <stdarg.h>
 #endif
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -46,7 +47,14 @@ typedef enum t64_error_code_t {
     T64_ERR_D64_TRACK_RANGE,    /**< d64 track number out of range */
     T64_ERR_D64_SECTOR_RANGE,   /**< d64 sector number out of range */
     T64_ERR_D64_INVALID_FILENAME,   /**< d64 invalid filename */
-    T64_ERR_D64_RLE             /**< d64 RLE error */
+    T64_ERR_D64_RLE,            /**< d64 RLE error */
+    T64_ERR_PARTIAL,            /**< operation needs data not loaded */
+    T64_ERR_D64_FULL,           /**< d64 disk or directory full */
+    T64_ERR_ARCHIVE,            /**< invalid or unsupported archive */
+    T64_ERR_COMPRESSED,         /**< can't write into a compressed image */
+    T64_ERR_REQUEST,            /**< malformed daemon request */
+    T64_ERR_CATALOG,            /**< invalid catalog file */
+    T64_ERR_PATCH               /**< invalid or unsupported patch */
 } T64ErrorCode;
 
 
@@ -56,7 +64,7 @@ typedef enum t64_error_code_t {
 
 /** \brief  Maximum valid error code
  */
-#define T64_ERRNO_MAX   T64_ERR_INDEX
+#define T64_ERRNO_MAX   T64_ERR_PATCH
 
 
 /** \def    base_debug
@@ -74,8 +82,43 @@ typedef enum t64_error_code_t {
 #endif
 
 
+/** \def    BASE_THREAD_LOCAL
+ * \brief   Storage class specifier for per-thread variables
+ *
+ * Used for `t64_errno` so each worker thread in batch mode gets its own error
+ * code, much like the C library's `errno`.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+# define BASE_THREAD_LOCAL  __thread
+#elif defined(_MSC_VER)
+# define BASE_THREAD_LOCAL  __declspec(thread)
+#else
+# define BASE_THREAD_LOCAL
+#endif
+
 
-extern int      t64_errno;
+extern BASE_THREAD_LOCAL int t64_errno;
+
+
+/** \brief  Memory allocator used by base_malloc() and friends
+ *
+ * See base_set_allocator().
+ */
+typedef struct base_allocator_s {
+    /** \brief  Allocate \a size bytes, return NULL on failure */
+    void *(*malloc_func)(size_t size, void *data);
+    /** \brief  Resize \a ptr to \a size bytes, return NULL on failure */
+    void *(*realloc_func)(void *ptr, size_t size, void *data);
+    /** \brief  Free \a ptr (can be NULL) */
+    void  (*free_func)(void *ptr, void *data);
+    /** \brief  Handle allocation failure of \a size bytes
+     *
+     * Must not return (e.g. longjmp() out or exit), NULL means print a message
+     * on stderr and call abort().
+     */
+    void  (*oom_func)(size_t size, void *data);
+    void *data;     /**< user data passed to the functions */
+} base_allocator_t;
 
 
 uint16_t        get_uint16(const uint8_t *p);
@@ -84,8 +127,22 @@ uint32_t        get_uint32(const uint8_t *p);
 void            set_uint32(uint8_t *p, uint32_t v);
 unsigned int    num_blocks(unsigned int n);
 int             popcount_byte(uint8_t b);
+uint64_t        base_clock_ns(void);
 
+bool            base_is_stdio(const char *path);
+void            base_set_binary(FILE *fp);
 long            fread_alloc(uint8_t **dest, const char *path);
+uint8_t *       base_map_file(const char *path, size_t *size);
+void            base_unmap_file(uint8_t *data, size_t size);
+bool            base_same_file(const char *path1, const char *path2);
+bool            base_fsize(FILE *fp, size_t *size);
+bool            base_file_size(const char *path, size_t *size);
+bool            base_file_stat(const char *path, size_t *size, int64_t *mtime);
+bool            base_fsync(FILE *fp);
+FILE *          base_fopen_tmp(const char *path, char **tmp_path);
+bool            base_rename_replace(const char *from, const char *to);
+bool            base_fcopy(FILE *src, FILE *dest);
+FILE *          base_copy_file(const char *from, const char *to);
 
 bool            fwrite_wrapper(const char *path, const uint8_t *data,
                                size_t size);
@@ -94,6 +151,7 @@ bool            fwrite_prg(const char *path, const uint8_t *data,
 const char *    t64_strerror(int code);
 
 
+void            base_set_allocator(const base_allocator_t *allocator);
 void *          base_malloc(size_t size);
 void *          base_calloc(size_t nmemb, size_t size);
 void *          base_realloc(void *ptr, size_t size);
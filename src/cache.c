@@ -0,0 +1,427 @@
+/** \file   cache.c
+ * \brief   Persistent cache of verification results
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Stores the outcome of t64_verify() for images, keyed on the path, size and
+ * modification time of the image, so unchanged images can be skipped on the
+ * next run.
+ *
+ * The cache file is a text file with a header line followed by one line per
+ * image: "<size> <mtime> <fixes> <path>", with the modification time in
+ * nanoseconds since the epoch. The path is last so it may contain spaces.
+ * Invalid lines are ignored. The file is replaced atomically when saved.
+ *
+ * Lookups only read the cache and can be done concurrently from worker
+ * threads, stores must be done while no lookups are in progress.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "base.h"
+#include "outbuf.h"
+
+#include "cache.h"
+
+
+/** \brief  Header line of a cache file
+ */
+#define CACHE_HEADER    "# t64fix verify cache v1\n"
+
+
+/** \brief  Cache entry
+ */
+typedef struct cache_entry_s {
+    char *          path;   /**< path of image */
+    uint64_t        size;   /**< size of image */
+    int64_t         mtime;  /**< modification time in nanoseconds */
+    int             fixes;  /**< number of fixes t64_verify() required */
+    bool            owned;  /**< \a path is allocated, not in the file data */
+    size_t          seq;    /**< order of insertion, newest entry wins */
+} cache_entry_t;
+
+
+/** \brief  Cache object
+ */
+struct cache_s {
+    char *          path;       /**< path of cache file */
+    char *          text;       /**< contents of cache file */
+    cache_entry_t * entries;    /**< entries */
+    size_t          size;       /**< number of slots in \a entries */
+    size_t          used;       /**< number of used slots in \a entries */
+    size_t          sorted;     /**< number of entries sorted on path */
+    bool            dirty;      /**< the cache needs to be saved */
+};
+
+
+/** \brief  qsort(3) callback: sort entries on path, then insertion order
+ *
+ * \param[in]   p1  entry
+ * \param[in]   p2  entry
+ *
+ * \return  <0, 0 or >0
+ */
+static int compar_entry(const void *p1, const void *p2)
+{
+    const cache_entry_t *e1 = p1;
+    const cache_entry_t *e2 = p2;
+    int result = strcmp(e1->path, e2->path);
+
+    if (result == 0) {
+        result = e1->seq < e2->seq ? -1 : (e1->seq > e2->seq ? 1 : 0);
+    }
+    return result;
+}
+
+
+/** \brief  Find entry for \a path in the sorted entries of \a cache
+ *
+ * \param[in]   cache   cache
+ * \param[in]   path    image path
+ *
+ * \return  entry or `NULL` when not found
+ */
+static cache_entry_t *cache_find(const cache_t *cache, const char *path)
+{
+    size_t lo = 0;
+    size_t hi = cache->sorted;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int result = strcmp(path, cache->entries[mid].path);
+
+        if (result == 0) {
+            return cache->entries + mid;
+        } else if (result < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+
+/** \brief  Append entry to \a cache
+ *
+ * \param[in,out]   cache   cache
+ * \param[in]       path    image path
+ * \param[in]       size    image size
+ * \param[in]       mtime   image modification time
+ * \param[in]       fixes   number of fixes
+ * \param[in]       owned   \a path is heap-allocated
+ */
+static void cache_append(cache_t *cache,
+                         char *path,
+                         uint64_t size,
+                         int64_t mtime,
+                         int fixes,
+                         bool owned)
+{
+    cache_entry_t *entry;
+
+    if (cache->used == cache->size) {
+        cache->size = cache->size == 0 ? 256 : cache->size * 2;
+        cache->entries = base_realloc(cache->entries,
+                                      sizeof *(cache->entries) * cache->size);
+    }
+    entry = cache->entries + cache->used;
+    entry->path = path;
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->fixes = fixes;
+    entry->owned = owned;
+    entry->seq = cache->used;
+    cache->used++;
+}
+
+
+/** \brief  Sort entries of \a cache and remove duplicates
+ *
+ * Of entries with the same path the one added last is kept.
+ *
+ * \param[in,out]   cache   cache
+ */
+static void cache_sort(cache_t *cache)
+{
+    size_t i;
+    size_t n = 0;
+
+    qsort(cache->entries, cache->used, sizeof *(cache->entries),
+          compar_entry);
+    for (i = 0; i < cache->used; i++) {
+        cache_entry_t *entry = cache->entries + i;
+
+        if (i + 1 < cache->used
+                && strcmp(entry->path, cache->entries[i + 1].path) == 0) {
+            /* superseded by the next entry */
+            if (entry->owned) {
+                base_free(entry->path);
+            }
+            continue;
+        }
+        cache->entries[n++] = *entry;
+    }
+    for (i = 0; i < n; i++) {
+        cache->entries[i].seq = i;
+    }
+    cache->used = n;
+    cache->sorted = n;
+}
+
+
+/** \brief  Parse a line of a cache file
+ *
+ * \param[in,out]   cache   cache
+ * \param[in]       line    nul-terminated line
+ */
+static void cache_parse_line(cache_t *cache, char *line)
+{
+    unsigned long long size;
+    long long mtime;
+    long fixes;
+    char *endptr;
+
+    errno = 0;
+    size = strtoull(line, &endptr, 10);
+    if (endptr == line || *endptr != ' ' || errno != 0) {
+        return;
+    }
+    line = endptr + 1;
+    mtime = strtoll(line, &endptr, 10);
+    if (endptr == line || *endptr != ' ' || errno != 0) {
+        return;
+    }
+    line = endptr + 1;
+    fixes = strtol(line, &endptr, 10);
+    if (endptr == line || *endptr != ' ' || errno != 0
+            || fixes < 0 || fixes > 0xffff) {
+        return;
+    }
+    line = endptr + 1;
+    if (*line == '\0') {
+        return;
+    }
+    cache_append(cache, line, (uint64_t)size, (int64_t)mtime, (int)fixes,
+                 false);
+}
+
+
+/** \brief  Load cache from file \a path
+ *
+ * A missing cache file results in an empty cache, the file will be created
+ * when saving.
+ *
+ * \param[in]   path    path of cache file
+ *
+ * \return  cache or `NULL` when the file exists but could not be read
+ * \throw   T64_ERR_IO
+ */
+cache_t *cache_load(const char *path)
+{
+    cache_t *cache;
+    uint8_t *data;
+    long len;
+
+    cache = base_malloc(sizeof *cache);
+    cache->path = base_strdup(path);
+    cache->text = NULL;
+    cache->entries = NULL;
+    cache->size = 0;
+    cache->used = 0;
+    cache->sorted = 0;
+    cache->dirty = false;
+
+    errno = 0;
+    len = fread_alloc(&data, path);
+    if (len < 0) {
+        if (errno == ENOENT) {
+            return cache;
+        }
+        cache_free(cache);
+        return NULL;
+    }
+    cache->text = base_realloc(data, (size_t)len + 1);
+    cache->text[len] = '\0';
+
+    if (strncmp(cache->text, CACHE_HEADER, sizeof CACHE_HEADER - 1) == 0) {
+        char *line = cache->text + sizeof CACHE_HEADER - 1;
+
+        while (*line != '\0') {
+            char *eol = strchr(line, '\n');
+
+            if (eol != NULL) {
+                *eol = '\0';
+            }
+            cache_parse_line(cache, line);
+            if (eol == NULL) {
+                break;
+            }
+            line = eol + 1;
+        }
+    }
+    cache_sort(cache);
+    return cache;
+}
+
+
+/** \brief  Look up cached verification result
+ *
+ * \param[in]   cache   cache
+ * \param[in]   path    image path
+ * \param[in]   size    current size of image
+ * \param[in]   mtime   current modification time of image
+ * \param[out]  fixes   number of fixes required by the image
+ *
+ * \return  true if \a path is in \a cache and unchanged
+ */
+bool cache_lookup(const cache_t *cache,
+                  const char *path,
+                  size_t size,
+                  int64_t mtime,
+                  int *fixes)
+{
+    const cache_entry_t *entry = cache_find(cache, path);
+
+    if (entry == NULL || entry->size != (uint64_t)size
+            || entry->mtime != mtime) {
+        return false;
+    }
+    *fixes = entry->fixes;
+    return true;
+}
+
+
+/** \brief  Store verification result in \a cache
+ *
+ * \param[in,out]   cache   cache
+ * \param[in]       path    image path
+ * \param[in]       size    size of image when verified
+ * \param[in]       mtime   modification time of image when verified
+ * \param[in]       fixes   number of fixes required by the image
+ */
+void cache_store(cache_t *cache,
+                 const char *path,
+                 size_t size,
+                 int64_t mtime,
+                 int fixes)
+{
+    cache_entry_t *entry;
+
+    if (strchr(path, '\n') != NULL) {
+        /* can't be stored in the cache file */
+        return;
+    }
+    entry = cache_find(cache, path);
+    if (entry != NULL) {
+        if (entry->size == (uint64_t)size && entry->mtime == mtime
+                && entry->fixes == fixes) {
+            return;
+        }
+        entry->size = (uint64_t)size;
+        entry->mtime = mtime;
+        entry->fixes = fixes;
+    } else {
+        cache_append(cache, base_strdup(path), (uint64_t)size, mtime, fixes,
+                     true);
+    }
+    cache->dirty = true;
+}
+
+
+/** \brief  Save \a cache to its file, if it was changed
+ *
+ * The cache is written to a temporary file which then replaces the cache file.
+ *
+ * \param[in,out]   cache   cache
+ *
+ * \return  bool
+ * \throw   T64_ERR_IO
+ */
+bool cache_save(cache_t *cache)
+{
+    outbuf_t out;
+    char *tmp_path;
+    FILE *fp;
+    size_t i;
+    bool ok;
+
+    if (!cache->dirty) {
+        return true;
+    }
+    cache_sort(cache);
+
+    fp = base_fopen_tmp(cache->path, &tmp_path);
+    if (fp == NULL) {
+        return false;
+    }
+    outbuf_init(&out, fp);
+    outbuf_puts(&out, CACHE_HEADER);
+    for (i = 0; i < cache->used; i++) {
+        const cache_entry_t *entry = cache->entries + i;
+
+        outbuf_printf(&out, "%" PRIu64 " %" PRId64 " %d %s\n",
+                      entry->size, entry->mtime, entry->fixes, entry->path);
+    }
+    ok = outbuf_flush(&out);
+    outbuf_free(&out);
+    if (fclose(fp) != 0) {
+        t64_errno = T64_ERR_IO;
+        ok = false;
+    }
+    if (ok) {
+        ok = base_rename_replace(tmp_path, cache->path);
+    }
+    if (!ok) {
+        remove(tmp_path);
+    } else {
+        cache->dirty = false;
+    }
+    base_free(tmp_path);
+    return ok;
+}
+
+
+/** \brief  Free \a cache
+ *
+ * \param[in,out]   cache   cache
+ */
+void cache_free(cache_t *cache)
+{
+    size_t i;
+
+    for (i = 0; i < cache->used; i++) {
+        if (cache->entries[i].owned) {
+            base_free(cache->entries[i].path);
+        }
+    }
+    base_free(cache->entries);
+    base_free(cache->text);
+    base_free(cache->path);
+    base_free(cache);
+}
@@ -0,0 +1,53 @@
+/** \file   cache.h
+ * \brief   Persistent cache of verification results - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_CACHE_H
+#define HAVE_CACHE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/** \brief  Opaque cache type
+ */
+typedef struct cache_s cache_t;
+
+
+cache_t *   cache_load(const char *path);
+bool        cache_lookup(const cache_t *cache,
+                         const char *path,
+                         size_t size,
+                         int64_t mtime,
+                         int *fixes);
+void        cache_store(cache_t *cache,
+                        const char *path,
+                        size_t size,
+                        int64_t mtime,
+                        int fixes);
+bool        cache_save(cache_t *cache);
+void        cache_free(cache_t *cache);
+
+#endif
@@ -0,0 +1,1088 @@
+/** \file   catalog.c
+ * \brief   Searchable catalog of the records of many images
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * A catalog is a binary file listing the images of a corpus and the records
+ * of each image, written by batch mode with `--index`. The file is laid out
+ * so it can be memory mapped and searched in place: fixed-size entries, a
+ * string table and, for each searchable key, an array of entry numbers sorted
+ * on that key, so lookups are a binary search touching only a few pages.
+ *
+ * All integers are little endian. Layout:
+ *
+ * | offset | contents                                                     |
+ * |--------|--------------------------------------------------------------|
+ * | 0x00   | header (64 bytes, see CATALOG_HDR_*)                         |
+ * |        | image entries (40 bytes each, see CATALOG_IMG_*)             |
+ * |        | record entries (48 bytes each, see CATALOG_REC_*)            |
+ * |        | record numbers sorted on filename, start address, end        |
+ * |        | address and hash, image numbers sorted on tape name (32-bit) |
+ * |        | strings (NUL-terminated ASCII, offset 0 is the empty string) |
+ *
+ * Names are compared ignoring ASCII case, ties are broken on entry number.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "base.h"
+#include "outbuf.h"
+#include "petasc.h"
+
+#include "catalog.h"
+
+
+/** \brief  Magic bytes at the start of a catalog file
+ */
+#define CATALOG_MAGIC       "T64FIXCT"
+
+/** \brief  Length of CATALOG_MAGIC
+ */
+#define CATALOG_MAGIC_LEN   8
+
+/** \brief  Catalog file format version
+ */
+#define CATALOG_VERSION     1
+
+
+#define CATALOG_HDR_SIZE        0x40    /**< size of the header */
+#define CATALOG_HDR_VERSION     0x08    /**< format version, 32-bit */
+#define CATALOG_HDR_IMAGES      0x0c    /**< number of images */
+#define CATALOG_HDR_RECORDS     0x10    /**< number of records */
+#define CATALOG_HDR_STR_SIZE    0x14    /**< size of the string table */
+#define CATALOG_HDR_IMAGES_OFS  0x18    /**< offset of the image entries */
+#define CATALOG_HDR_RECORDS_OFS 0x1c    /**< offset of the record entries */
+#define CATALOG_HDR_STR_OFS     0x20    /**< offset of the string table */
+#define CATALOG_HDR_BY_NAME     0x24    /**< offset of records by filename */
+#define CATALOG_HDR_BY_START    0x28    /**< offset of records by start address */
+#define CATALOG_HDR_BY_END      0x2c    /**< offset of records by end address */
+#define CATALOG_HDR_BY_HASH     0x30    /**< offset of records by hash */
+#define CATALOG_HDR_BY_TAPE     0x34    /**< offset of images by tape name */
+#define CATALOG_HDR_FILE_SIZE   0x38    /**< size of the catalog file */
+
+#define CATALOG_IMG_SIZE        0x28    /**< size of an image entry */
+#define CATALOG_IMG_PATH        0x00    /**< string offset of the path */
+#define CATALOG_IMG_TAPE        0x04    /**< string offset of the tape name */
+#define CATALOG_IMG_PET_TAPE    0x08    /**< PETSCII tape name */
+#define CATALOG_IMG_FIRST       0x20    /**< number of the first record */
+#define CATALOG_IMG_COUNT       0x24    /**< number of records */
+
+#define CATALOG_REC_SIZE        0x30    /**< size of a record entry */
+#define CATALOG_REC_HASH        0x00    /**< hash64() of the data, 64-bit */
+#define CATALOG_REC_IMAGE       0x08    /**< number of the image */
+#define CATALOG_REC_NAME        0x0c    /**< string offset of the filename */
+#define CATALOG_REC_PET_NAME    0x10    /**< PETSCII filename */
+#define CATALOG_REC_OFFSET      0x20    /**< offset of the data in the image */
+#define CATALOG_REC_START       0x24    /**< start address, 16-bit */
+#define CATALOG_REC_REAL_END    0x26    /**< real end address, 16-bit */
+#define CATALOG_REC_END         0x28    /**< end address in directory, 16-bit */
+#define CATALOG_REC_INDEX       0x2a    /**< index in the image, 16-bit */
+#define CATALOG_REC_C64S        0x2c    /**< C64S file type */
+#define CATALOG_REC_C1541       0x2d    /**< C1541 file type */
+#define CATALOG_REC_STATUS      0x2e    /**< `t64_status_t` */
+#define CATALOG_REC_FLAGS       0x2f    /**< flags (CATALOG_FLAG_*) */
+
+/** \brief  Record flag: the hash is valid
+ */
+#define CATALOG_FLAG_HASHED     0x01
+
+
+/** \brief  Catalog builder
+ */
+struct catalog_builder_s {
+    outbuf_t    images;         /**< image entries */
+    outbuf_t    records;        /**< record entries */
+    outbuf_t    strings;        /**< string table */
+    uint32_t    image_count;    /**< number of image entries */
+    uint32_t    record_count;   /**< number of record entries */
+};
+
+
+/** \brief  Catalog opened with catalog_open()
+ */
+struct catalog_s {
+    uint8_t *       data;           /**< mapped catalog file */
+    size_t          size;           /**< size of \a data */
+    uint32_t        image_count;    /**< number of images */
+    uint32_t        record_count;   /**< number of records */
+    uint32_t        strings_size;   /**< size of \a strings */
+    const uint8_t * images;         /**< image entries */
+    const uint8_t * records;        /**< record entries */
+    const char *    strings;        /**< string table */
+    const uint8_t * by_name;        /**< record numbers sorted on filename */
+    const uint8_t * by_start;       /**< record numbers sorted on start */
+    const uint8_t * by_end;         /**< record numbers sorted on end */
+    const uint8_t * by_hash;        /**< record numbers sorted on hash */
+    const uint8_t * by_tape;        /**< image numbers sorted on tape name */
+};
+
+
+/** \brief  Sort key used when writing a catalog
+ */
+typedef struct catalog_sort_s {
+    const char *    text;   /**< name (name keys) */
+    uint64_t        value;  /**< value (other keys) */
+    uint32_t        id;     /**< entry number */
+} catalog_sort_t;
+
+
+/** \brief  Get 64-bit little endian value
+ *
+ * \param[in]   p   data
+ *
+ * \return  value
+ */
+static uint64_t get_uint64(const uint8_t *p)
+{
+    return (uint64_t)get_uint32(p) | ((uint64_t)get_uint32(p + 4) << 32);
+}
+
+
+/** \brief  Set 64-bit little endian value
+ *
+ * \param[out]  p   data
+ * \param[in]   v   value
+ */
+static void set_uint64(uint8_t *p, uint64_t v)
+{
+    set_uint32(p, (uint32_t)v);
+    set_uint32(p + 4, (uint32_t)(v >> 32));
+}
+
+
+/** \brief  Compare strings ignoring ASCII case
+ *
+ * \param[in]   s1  first string
+ * \param[in]   s2  second string
+ *
+ * \return  <0, 0 or >0
+ */
+static int catalog_strcmp(const char *s1, const char *s2)
+{
+    while (true) {
+        int c1 = tolower((unsigned char)*s1++);
+        int c2 = tolower((unsigned char)*s2++);
+
+        if (c1 != c2 || c1 == 0) {
+            return c1 - c2;
+        }
+    }
+}
+
+
+/** \brief  Compare string \a s with the name of search \a term
+ *
+ * Compares ignoring ASCII case, a prefix term matches any string starting
+ * with its text. Consistent with catalog_strcmp(), so the matching strings
+ * form a single run in a sorted column.
+ *
+ * \param[in]   s       string
+ * \param[in]   term    search term
+ *
+ * \return  <0 if \a s sorts before the matches, 0 on match, >0 if after
+ */
+static int catalog_text_cmp(const char *s, const catalog_term_t *term)
+{
+    size_t i;
+
+    for (i = 0; i < term->len; i++) {
+        int c1 = tolower((unsigned char)s[i]);
+        int c2 = tolower((unsigned char)term->text[i]);
+
+        if (c1 != c2) {
+            return c1 - c2;
+        }
+    }
+    return term->prefix || s[i] == '\0' ? 0 : 1;
+}
+
+
+/** \brief  Convert PETSCII name to ASCII, dropping trailing spaces
+ *
+ * \param[out]  dest    destination, at least \a len + 1 bytes
+ * \param[in]   name    PETSCII name
+ * \param[in]   len     maximum length of \a name
+ */
+static void catalog_ascii(char *dest, const uint8_t *name, size_t len)
+{
+    pet_to_asc_str(dest, name, len);
+    len = strlen(dest);
+    while (len > 0 && dest[len - 1] == 0x20) {
+        dest[--len] = '\0';
+    }
+}
+
+
+/** \brief  Create catalog builder
+ *
+ * \return  new builder, free with catalog_builder_free()
+ */
+catalog_builder_t *catalog_builder_new(void)
+{
+    catalog_builder_t *builder = base_malloc(sizeof *builder);
+
+    outbuf_init(&(builder->images), NULL);
+    outbuf_init(&(builder->records), NULL);
+    outbuf_init(&(builder->strings), NULL);
+    builder->image_count = 0;
+    builder->record_count = 0;
+    /* offset 0 is the empty string */
+    outbuf_putc(&(builder->strings), '\0');
+    return builder;
+}
+
+
+/** \brief  Add string \a s to the string table of \a builder
+ *
+ * \param[in,out]   builder catalog builder
+ * \param[in]       s       string
+ *
+ * \return  offset of \a s in the string table
+ */
+static uint32_t catalog_builder_string(catalog_builder_t *builder,
+                                       const char *s)
+{
+    uint32_t offset;
+
+    if (*s == '\0') {
+        return 0;
+    }
+    offset = (uint32_t)builder->strings.used;
+    outbuf_write(&(builder->strings), s, strlen(s) + 1);
+    return offset;
+}
+
+
+/** \brief  Add image and its records to \a builder
+ *
+ * \param[in,out]   builder     catalog builder
+ * \param[in]       path        path of the image
+ * \param[in]       tapename    PETSCII tape name (T64_HDR_NAME_LEN bytes)
+ * \param[in]       records     verified records of the image
+ * \param[in]       count       number of elements in \a records
+ */
+void catalog_builder_add(catalog_builder_t *builder,
+                         const char *path,
+                         const uint8_t *tapename,
+                         const t64_record_t *records,
+                         int count)
+{
+    uint8_t image[CATALOG_IMG_SIZE];
+    char name[T64_HDR_NAME_LEN + 1];
+    int i;
+
+    catalog_ascii(name, tapename, T64_HDR_NAME_LEN);
+    memset(image, 0, sizeof image);
+    set_uint32(image + CATALOG_IMG_PATH, catalog_builder_string(builder, path));
+    set_uint32(image + CATALOG_IMG_TAPE, catalog_builder_string(builder, name));
+    memcpy(image + CATALOG_IMG_PET_TAPE, tapename, T64_HDR_NAME_LEN);
+    set_uint32(image + CATALOG_IMG_FIRST, builder->record_count);
+    set_uint32(image + CATALOG_IMG_COUNT, (uint32_t)count);
+    outbuf_write(&(builder->images), image, sizeof image);
+
+    for (i = 0; i < count; i++) {
+        const t64_record_t *record = records + i;
+        uint8_t entry[CATALOG_REC_SIZE];
+
+        catalog_ascii(name, record->filename, T64_REC_FILENAME_LEN);
+        memset(entry, 0, sizeof entry);
+        set_uint64(entry + CATALOG_REC_HASH, record->hash);
+        set_uint32(entry + CATALOG_REC_IMAGE, builder->image_count);
+        set_uint32(entry + CATALOG_REC_NAME,
+                   catalog_builder_string(builder, name));
+        memcpy(entry + CATALOG_REC_PET_NAME, record->filename,
+               T64_REC_FILENAME_LEN);
+        set_uint32(entry + CATALOG_REC_OFFSET, record->offset);
+        set_uint16(entry + CATALOG_REC_START, record->start_addr);
+        set_uint16(entry + CATALOG_REC_REAL_END, record->real_end_addr);
+        set_uint16(entry + CATALOG_REC_END, record->end_addr);
+        set_uint16(entry + CATALOG_REC_INDEX, (uint16_t)record->index);
+        entry[CATALOG_REC_C64S] = record->c64s_ftype;
+        entry[CATALOG_REC_C1541] = record->c1541_ftype;
+        entry[CATALOG_REC_STATUS] = (uint8_t)record->status;
+        entry[CATALOG_REC_FLAGS] = record->hashed ? CATALOG_FLAG_HASHED : 0;
+        outbuf_write(&(builder->records), entry, sizeof entry);
+        builder->record_count++;
+    }
+    builder->image_count++;
+}
+
+
+/** \brief  Compare sort keys on name for qsort()
+ *
+ * \param[in]   p1  first key
+ * \param[in]   p2  second key
+ *
+ * \return  <0, 0 or >0
+ */
+static int catalog_sort_text_cmp(const void *p1, const void *p2)
+{
+    const catalog_sort_t *key1 = p1;
+    const catalog_sort_t *key2 = p2;
+    int result = catalog_strcmp(key1->text, key2->text);
+
+    if (result != 0) {
+        return result;
+    }
+    return key1->id < key2->id ? -1 : key1->id > key2->id;
+}
+
+
+/** \brief  Compare sort keys on value for qsort()
+ *
+ * \param[in]   p1  first key
+ * \param[in]   p2  second key
+ *
+ * \return  <0, 0 or >0
+ */
+static int catalog_sort_value_cmp(const void *p1, const void *p2)
+{
+    const catalog_sort_t *key1 = p1;
+    const catalog_sort_t *key2 = p2;
+
+    if (key1->value != key2->value) {
+        return key1->value < key2->value ? -1 : 1;
+    }
+    return key1->id < key2->id ? -1 : key1->id > key2->id;
+}
+
+
+/** \brief  Sort \a keys and write their entry numbers to \a out
+ *
+ * \param[in,out]   out     writer
+ * \param[in,out]   keys    sort keys
+ * \param[in]       count   number of elements in \a keys
+ * \param[in]       compar  comparison function
+ */
+static void catalog_write_column(outbuf_t *out,
+                                 catalog_sort_t *keys,
+                                 size_t count,
+                                 int (*compar)(const void *, const void *))
+{
+    size_t i;
+
+    qsort(keys, count, sizeof *keys, compar);
+    for (i = 0; i < count; i++) {
+        uint8_t id[4];
+
+        set_uint32(id, keys[i].id);
+        outbuf_write(out, id, sizeof id);
+    }
+}
+
+
+/** \brief  Write catalog of \a builder to \a path
+ *
+ * The catalog is written to a temporary file which then replaces \a path.
+ *
+ * \param[in,out]   builder catalog builder
+ * \param[in]       path    path of catalog file
+ *
+ * \return  bool
+ * \throw   T64_ERR_IO
+ * \throw   T64_ERR_CATALOG (too large)
+ */
+bool catalog_builder_write(catalog_builder_t *builder, const char *path)
+{
+    const uint8_t *records = (const uint8_t *)builder->records.data;
+    const uint8_t *images = (const uint8_t *)builder->images.data;
+    const char *strings = builder->strings.data;
+    uint8_t header[CATALOG_HDR_SIZE];
+    catalog_sort_t *keys;
+    uint64_t offset;
+    uint64_t column = (uint64_t)builder->record_count * 4;
+    size_t count;
+    size_t i;
+    outbuf_t out;
+    char *tmp_path;
+    FILE *fp;
+    bool ok;
+
+    /* section offsets */
+    memset(header, 0, sizeof header);
+    memcpy(header, CATALOG_MAGIC, CATALOG_MAGIC_LEN);
+    offset = CATALOG_HDR_SIZE;
+    set_uint32(header + CATALOG_HDR_VERSION, CATALOG_VERSION);
+    set_uint32(header + CATALOG_HDR_IMAGES, builder->image_count);
+    set_uint32(header + CATALOG_HDR_RECORDS, builder->record_count);
+    set_uint32(header + CATALOG_HDR_STR_SIZE, (uint32_t)builder->strings.used);
+    set_uint32(header + CATALOG_HDR_IMAGES_OFS, (uint32_t)offset);
+    offset += builder->images.used;
+    set_uint32(header + CATALOG_HDR_RECORDS_OFS, (uint32_t)offset);
+    offset += builder->records.used;
+    set_uint32(header + CATALOG_HDR_BY_NAME, (uint32_t)offset);
+    offset += column;
+    set_uint32(header + CATALOG_HDR_BY_START, (uint32_t)offset);
+    offset += column;
+    set_uint32(header + CATALOG_HDR_BY_END, (uint32_t)offset);
+    offset += column;
+    set_uint32(header + CATALOG_HDR_BY_HASH, (uint32_t)offset);
+    offset += column;
+    set_uint32(header + CATALOG_HDR_BY_TAPE, (uint32_t)offset);
+    offset += (uint64_t)builder->image_count * 4;
+    set_uint32(header + CATALOG_HDR_STR_OFS, (uint32_t)offset);
+    offset += builder->strings.used;
+    if (offset > UINT32_MAX) {
+        t64_errno = T64_ERR_CATALOG;
+        return false;
+    }
+    set_uint32(header + CATALOG_HDR_FILE_SIZE, (uint32_t)offset);
+
+    fp = base_fopen_tmp(path, &tmp_path);
+    if (fp == NULL) {
+        return false;
+    }
+    outbuf_init(&out, fp);
+    outbuf_write(&out, header, sizeof header);
+    outbuf_append(&out, &(builder->images));
+    outbuf_append(&out, &(builder->records));
+
+    /* sorted columns */
+    count = builder->record_count > builder->image_count
+        ? builder->record_count : builder->image_count;
+    keys = base_malloc(sizeof *keys * (count + 1));
+    for (i = 0; i < builder->record_count; i++) {
+        const uint8_t *entry = records + i * CATALOG_REC_SIZE;
+
+        keys[i].text = strings + get_uint32(entry + CATALOG_REC_NAME);
+        keys[i].id = (uint32_t)i;
+    }
+    catalog_write_column(&out, keys, builder->record_count,
+                         catalog_sort_text_cmp);
+    for (i = 0; i < builder->record_count; i++) {
+        keys[i].value = get_uint16(records + i * CATALOG_REC_SIZE
+                                   + CATALOG_REC_START);
+        keys[i].id = (uint32_t)i;
+    }
+    catalog_write_column(&out, keys, builder->record_count,
+                         catalog_sort_value_cmp);
+    for (i = 0; i < builder->record_count; i++) {
+        keys[i].value = get_uint16(records + i * CATALOG_REC_SIZE
+                                   + CATALOG_REC_REAL_END);
+        keys[i].id = (uint32_t)i;
+    }
+    catalog_write_column(&out, keys, builder->record_count,
+                         catalog_sort_value_cmp);
+    for (i = 0; i < builder->record_count; i++) {
+        keys[i].value = get_uint64(records + i * CATALOG_REC_SIZE
+                                   + CATALOG_REC_HASH);
+        keys[i].id = (uint32_t)i;
+    }
+    catalog_write_column(&out, keys, builder->record_count,
+                         catalog_sort_value_cmp);
+    for (i = 0; i < builder->image_count; i++) {
+        keys[i].text = strings + get_uint32(images + i * CATALOG_IMG_SIZE
+                                            + CATALOG_IMG_TAPE);
+        keys[i].id = (uint32_t)i;
+    }
+    catalog_write_column(&out, keys, builder->image_count,
+                         catalog_sort_text_cmp);
+    base_free(keys);
+
+    outbuf_append(&out, &(builder->strings));
+    ok = outbuf_flush(&out);
+    outbuf_free(&out);
+    if (fclose(fp) != 0) {
+        t64_errno = T64_ERR_IO;
+        ok = false;
+    }
+    if (ok) {
+        ok = base_rename_replace(tmp_path, path);
+    }
+    if (!ok) {
+        remove(tmp_path);
+    }
+    base_free(tmp_path);
+    return ok;
+}
+
+
+/** \brief  Free catalog \a builder
+ *
+ * \param[in,out]   builder catalog builder
+ */
+void catalog_builder_free(catalog_builder_t *builder)
+{
+    outbuf_free(&(builder->images));
+    outbuf_free(&(builder->records));
+    outbuf_free(&(builder->strings));
+    base_free(builder);
+}
+
+
+/** \brief  Get section of \a size bytes at the offset in header field \a field
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   field   offset in header of the section offset
+ * \param[in]   size    size of the section
+ *
+ * \return  section or `NULL` if it's not inside the file
+ */
+static const uint8_t *catalog_section(const catalog_t *catalog,
+                                      size_t field,
+                                      uint64_t size)
+{
+    uint64_t offset = get_uint32(catalog->data + field);
+
+    if (offset < CATALOG_HDR_SIZE || offset > catalog->size
+            || size > catalog->size - offset) {
+        return NULL;
+    }
+    return catalog->data + offset;
+}
+
+
+/** \brief  Open catalog file
+ *
+ * Maps the file and checks its header, the entries are only looked at by the
+ * queries.
+ *
+ * \param[in]   path    path of catalog file
+ *
+ * \return  catalog or `NULL` on failure
+ * \throw   T64_ERR_IO
+ * \throw   T64_ERR_CATALOG
+ */
+catalog_t *catalog_open(const char *path)
+{
+    catalog_t *catalog = base_malloc(sizeof *catalog);
+    uint64_t column;
+
+    errno = 0;
+    catalog->data = base_map_file(path, &(catalog->size));
+    if (catalog->data == NULL) {
+        base_free(catalog);
+        return NULL;
+    }
+    if (catalog->size < CATALOG_HDR_SIZE
+            || memcmp(catalog->data, CATALOG_MAGIC, CATALOG_MAGIC_LEN) != 0
+            || get_uint32(catalog->data + CATALOG_HDR_VERSION)
+                != CATALOG_VERSION) {
+        goto catalog_open_error;
+    }
+    catalog->image_count = get_uint32(catalog->data + CATALOG_HDR_IMAGES);
+    catalog->record_count = get_uint32(catalog->data + CATALOG_HDR_RECORDS);
+    catalog->strings_size = get_uint32(catalog->data + CATALOG_HDR_STR_SIZE);
+    column = (uint64_t)catalog->record_count * 4;
+
+    catalog->images = catalog_section(catalog, CATALOG_HDR_IMAGES_OFS,
+            (uint64_t)catalog->image_count * CATALOG_IMG_SIZE);
+    catalog->records = catalog_section(catalog, CATALOG_HDR_RECORDS_OFS,
+            (uint64_t)catalog->record_count * CATALOG_REC_SIZE);
+    catalog->strings = (const char *)catalog_section(catalog,
+            CATALOG_HDR_STR_OFS, catalog->strings_size);
+    catalog->by_name = catalog_section(catalog, CATALOG_HDR_BY_NAME, column);
+    catalog->by_start = catalog_section(catalog, CATALOG_HDR_BY_START, column);
+    catalog->by_end = catalog_section(catalog, CATALOG_HDR_BY_END, column);
+    catalog->by_hash = catalog_section(catalog, CATALOG_HDR_BY_HASH, column);
+    catalog->by_tape = catalog_section(catalog, CATALOG_HDR_BY_TAPE,
+            (uint64_t)catalog->image_count * 4);
+    if (catalog->images == NULL || catalog->records == NULL
+            || catalog->strings == NULL || catalog->by_name == NULL
+            || catalog->by_start == NULL || catalog->by_end == NULL
+            || catalog->by_hash == NULL || catalog->by_tape == NULL
+            || catalog->strings_size == 0
+            || catalog->strings[catalog->strings_size - 1] != '\0') {
+        goto catalog_open_error;
+    }
+    return catalog;
+
+catalog_open_error:
+    base_unmap_file(catalog->data, catalog->size);
+    base_free(catalog);
+    t64_errno = T64_ERR_CATALOG;
+    return NULL;
+}
+
+
+/** \brief  Close \a catalog
+ *
+ * \param[in,out]   catalog catalog
+ */
+void catalog_close(catalog_t *catalog)
+{
+    base_unmap_file(catalog->data, catalog->size);
+    base_free(catalog);
+}
+
+
+/** \brief  Get string at \a offset in the string table of \a catalog
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   offset  offset in string table
+ *
+ * \return  string, empty for invalid offsets
+ */
+static const char *catalog_string(const catalog_t *catalog, uint32_t offset)
+{
+    return offset < catalog->strings_size ? catalog->strings + offset : "";
+}
+
+
+/** \brief  Get image entry \a id of \a catalog
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   id      image number
+ *
+ * \return  image entry or `NULL` if \a id is invalid
+ */
+static const uint8_t *catalog_image(const catalog_t *catalog, uint32_t id)
+{
+    if (id >= catalog->image_count) {
+        return NULL;
+    }
+    return catalog->images + (size_t)id * CATALOG_IMG_SIZE;
+}
+
+
+/** \brief  Get record entry \a id of \a catalog
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   id      record number
+ *
+ * \return  record entry or `NULL` if \a id is invalid
+ */
+static const uint8_t *catalog_record(const catalog_t *catalog, uint32_t id)
+{
+    if (id >= catalog->record_count) {
+        return NULL;
+    }
+    return catalog->records + (size_t)id * CATALOG_REC_SIZE;
+}
+
+
+/** \brief  Get record \a id of \a catalog
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   id      record number
+ * \param[out]  entry   record
+ *
+ * \return  false if \a id or the image of the record is invalid
+ */
+static bool catalog_entry(const catalog_t *catalog,
+                          uint32_t id,
+                          catalog_entry_t *entry)
+{
+    const uint8_t *record = catalog_record(catalog, id);
+    const uint8_t *image;
+
+    if (record == NULL) {
+        return false;
+    }
+    image = catalog_image(catalog, get_uint32(record + CATALOG_REC_IMAGE));
+    if (image == NULL) {
+        return false;
+    }
+    entry->path = catalog_string(catalog, get_uint32(image + CATALOG_IMG_PATH));
+    entry->tapename = catalog_string(catalog,
+                                     get_uint32(image + CATALOG_IMG_TAPE));
+    entry->filename = catalog_string(catalog,
+                                     get_uint32(record + CATALOG_REC_NAME));
+    memcpy(entry->pet_filename, record + CATALOG_REC_PET_NAME,
+           T64_REC_FILENAME_LEN);
+    entry->index = get_uint16(record + CATALOG_REC_INDEX);
+    entry->offset = get_uint32(record + CATALOG_REC_OFFSET);
+    entry->start_addr = get_uint16(record + CATALOG_REC_START);
+    entry->end_addr = get_uint16(record + CATALOG_REC_END);
+    entry->real_end_addr = get_uint16(record + CATALOG_REC_REAL_END);
+    entry->c64s_ftype = record[CATALOG_REC_C64S];
+    entry->c1541_ftype = record[CATALOG_REC_C1541];
+    switch (record[CATALOG_REC_STATUS]) {
+        case T64_REC_FIXED:
+            entry->status = T64_REC_FIXED;
+            break;
+        case T64_REC_SKIPPED:
+            entry->status = T64_REC_SKIPPED;
+            break;
+        default:
+            entry->status = T64_REC_OK;
+            break;
+    }
+    entry->hashed = (record[CATALOG_REC_FLAGS] & CATALOG_FLAG_HASHED) != 0;
+    entry->hash = get_uint64(record + CATALOG_REC_HASH);
+    return true;
+}
+
+
+/** \brief  Parse number for a search term
+ *
+ * Accepts decimal, hexadecimal with a '$' or "0x" prefix, and for hashes
+ * plain hexadecimal.
+ *
+ * \param[in]   s       text
+ * \param[in]   hex     parse plain digits as hexadecimal
+ * \param[in]   max     maximum value
+ * \param[out]  value   value
+ *
+ * \return  false if \a s isn't a valid number
+ */
+static bool catalog_parse_number(const char *s,
+                                 bool hex,
+                                 uint64_t max,
+                                 uint64_t *value)
+{
+    unsigned long long result;
+    char *endptr;
+    int base = hex ? 16 : 10;
+
+    if (*s == '$') {
+        s++;
+        base = 16;
+    } else if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s += 2;
+        base = 16;
+    }
+    if (!isxdigit((unsigned char)*s)) {
+        return false;
+    }
+    errno = 0;
+    result = strtoull(s, &endptr, base);
+    if (errno != 0 || *endptr != '\0' || result > max) {
+        return false;
+    }
+    *value = result;
+    return true;
+}
+
+
+/** \brief  Parse search term \a arg
+ *
+ * Terms are \<key\>=\<value\>, with key one of "name", "tape", "start", "end"
+ * or "hash". A name or tape value ending in '*' matches any name starting
+ * with the rest of the value.
+ *
+ * \param[in]   arg     search term
+ * \param[out]  term    parsed term (refers to \a arg)
+ *
+ * \return  false if \a arg isn't a valid term
+ */
+bool catalog_parse_term(const char *arg, catalog_term_t *term)
+{
+    static const struct {
+        const char *    name;
+        catalog_key_t   key;
+    } keys[] = {
+        { "name",   CATALOG_KEY_NAME },
+        { "tape",   CATALOG_KEY_TAPE },
+        { "start",  CATALOG_KEY_START },
+        { "end",    CATALOG_KEY_END },
+        { "hash",   CATALOG_KEY_HASH }
+    };
+    const char *value = strchr(arg, '=');
+    size_t len;
+    size_t i;
+
+    if (value == NULL) {
+        return false;
+    }
+    len = (size_t)(value - arg);
+    value++;
+    for (i = 0; i < sizeof keys / sizeof keys[0]; i++) {
+        if (strlen(keys[i].name) == len && strncmp(arg, keys[i].name, len) == 0) {
+            break;
+        }
+    }
+    if (i == sizeof keys / sizeof keys[0]) {
+        return false;
+    }
+
+    term->key = keys[i].key;
+    term->text = value;
+    term->len = strlen(value);
+    term->prefix = false;
+    term->value = 0;
+    switch (term->key) {
+        case CATALOG_KEY_NAME:  /* fall through */
+        case CATALOG_KEY_TAPE:
+            if (term->len > 0 && value[term->len - 1] == '*') {
+                term->len--;
+                term->prefix = true;
+            }
+            return true;
+        case CATALOG_KEY_START: /* fall through */
+        case CATALOG_KEY_END:
+            return catalog_parse_number(value, false, 0xffff, &(term->value));
+        case CATALOG_KEY_HASH:
+            return catalog_parse_number(value, true, UINT64_MAX,
+                                        &(term->value));
+        default:
+            return false;
+    }
+}
+
+
+/** \brief  Get sorted column of \a catalog for \a key
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   key     search key
+ * \param[out]  count   number of elements in the column
+ *
+ * \return  column
+ */
+static const uint8_t *catalog_column(const catalog_t *catalog,
+                                     catalog_key_t key,
+                                     uint32_t *count)
+{
+    *count = catalog->record_count;
+    switch (key) {
+        case CATALOG_KEY_NAME:
+            return catalog->by_name;
+        case CATALOG_KEY_START:
+            return catalog->by_start;
+        case CATALOG_KEY_END:
+            return catalog->by_end;
+        case CATALOG_KEY_HASH:
+            return catalog->by_hash;
+        case CATALOG_KEY_TAPE:
+            *count = catalog->image_count;
+            return catalog->by_tape;
+        default:
+            *count = 0;
+            return NULL;
+    }
+}
+
+
+/** \brief  Compare entry \a id of the column searched for \a term with \a term
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   term    search term
+ * \param[in]   id      record number, or image number for tape terms
+ *
+ * \return  <0 if the entry sorts before the matches, 0 on match, >0 if after
+ */
+static int catalog_cmp(const catalog_t *catalog,
+                       const catalog_term_t *term,
+                       uint32_t id)
+{
+    const uint8_t *entry;
+    uint64_t value;
+
+    if (term->key == CATALOG_KEY_TAPE) {
+        entry = catalog_image(catalog, id);
+        return catalog_text_cmp(entry == NULL ? "" : catalog_string(catalog,
+                    get_uint32(entry + CATALOG_IMG_TAPE)), term);
+    }
+    entry = catalog_record(catalog, id);
+    if (entry == NULL) {
+        return -1;
+    }
+    switch (term->key) {
+        case CATALOG_KEY_NAME:
+            return catalog_text_cmp(catalog_string(catalog,
+                        get_uint32(entry + CATALOG_REC_NAME)), term);
+        case CATALOG_KEY_START:
+            value = get_uint16(entry + CATALOG_REC_START);
+            break;
+        case CATALOG_KEY_END:
+            value = get_uint16(entry + CATALOG_REC_REAL_END);
+            break;
+        case CATALOG_KEY_HASH:
+            value = get_uint64(entry + CATALOG_REC_HASH);
+            break;
+        case CATALOG_KEY_TAPE:  /* fall through */
+        default:
+            return -1;
+    }
+    if (value != term->value) {
+        return value < term->value ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/** \brief  Binary search sorted \a column for the first entry not before \a term
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   term    search term
+ * \param[in]   column  sorted column for the key of \a term
+ * \param[in]   count   number of elements in \a column
+ * \param[in]   after   find the first entry after the matches instead
+ *
+ * \return  index in \a column
+ */
+static uint32_t catalog_bound(const catalog_t *catalog,
+                              const catalog_term_t *term,
+                              const uint8_t *column,
+                              uint32_t count,
+                              bool after)
+{
+    uint32_t lo = 0;
+    uint32_t hi = count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int result = catalog_cmp(catalog, term, get_uint32(column + mid * 4));
+
+        if (result < 0 || (after && result == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/** \brief  Check if \a entry matches search \a term
+ *
+ * \param[in]   entry   record
+ * \param[in]   term    search term
+ *
+ * \return  bool
+ */
+static bool catalog_match(const catalog_entry_t *entry,
+                          const catalog_term_t *term)
+{
+    switch (term->key) {
+        case CATALOG_KEY_NAME:
+            return catalog_text_cmp(entry->filename, term) == 0;
+        case CATALOG_KEY_TAPE:
+            return catalog_text_cmp(entry->tapename, term) == 0;
+        case CATALOG_KEY_START:
+            return entry->start_addr == term->value;
+        case CATALOG_KEY_END:
+            return entry->real_end_addr == term->value;
+        case CATALOG_KEY_HASH:
+            return entry->hashed && entry->hash == term->value;
+        default:
+            return false;
+    }
+}
+
+
+/** \brief  Compare record numbers for qsort()
+ *
+ * \param[in]   p1  first record number
+ * \param[in]   p2  second record number
+ *
+ * \return  <0, 0 or >0
+ */
+static int catalog_id_cmp(const void *p1, const void *p2)
+{
+    uint32_t id1 = *(const uint32_t *)p1;
+    uint32_t id2 = *(const uint32_t *)p2;
+
+    return id1 < id2 ? -1 : id1 > id2;
+}
+
+
+/** \brief  Find the records in \a catalog matching all \a terms
+ *
+ * The first term is looked up with a binary search of its sorted column, the
+ * records found are then checked against the other terms. Without terms all
+ * records match. \a func is called for each match in catalog order.
+ *
+ * \param[in]   catalog catalog
+ * \param[in]   terms   search terms
+ * \param[in]   count   number of elements in \a terms
+ * \param[in]   func    function to call for each matching record
+ * \param[in]   arg     argument for \a func
+ *
+ * \return  number of matching records
+ */
+size_t catalog_query(const catalog_t *catalog,
+                     const catalog_term_t *terms,
+                     size_t count,
+                     catalog_func_t func,
+                     void *arg)
+{
+    uint32_t *ids;
+    size_t used = 0;
+    size_t matches = 0;
+    size_t size;
+    size_t i;
+
+    if (count == 0) {
+        size = catalog->record_count;
+        ids = base_malloc(sizeof *ids * (size + 1));
+        for (i = 0; i < size; i++) {
+            ids[used++] = (uint32_t)i;
+        }
+    } else {
+        uint32_t column_size;
+        const uint8_t *column = catalog_column(catalog, terms[0].key,
+                                               &column_size);
+        uint32_t first = catalog_bound(catalog, terms, column, column_size,
+                                       false);
+        uint32_t last = catalog_bound(catalog, terms, column, column_size,
+                                      true);
+
+        size = (size_t)(last - first) + 1;
+        ids = base_malloc(sizeof *ids * size);
+        for (i = first; i < last; i++) {
+            uint32_t id = get_uint32(column + i * 4);
+            const uint8_t *image;
+            uint32_t r;
+            uint32_t n;
+
+            if (terms[0].key != CATALOG_KEY_TAPE) {
+                ids[used++] = id;
+                continue;
+            }
+            /* all records of the image */
+            image = catalog_image(catalog, id);
+            if (image == NULL) {
+                continue;
+            }
+            r = get_uint32(image + CATALOG_IMG_FIRST);
+            n = get_uint32(image + CATALOG_IMG_COUNT);
+            if (r > catalog->record_count || n > catalog->record_count - r) {
+                continue;
+            }
+            if (size - used < n) {
+                size = size * 2 + n;
+                ids = base_realloc(ids, sizeof *ids * size);
+            }
+            while (n-- > 0) {
+                ids[used++] = r++;
+            }
+        }
+    }
+
+    qsort(ids, used, sizeof *ids, catalog_id_cmp);
+    for (i = 0; i < used; i++) {
+        catalog_entry_t entry;
+        size_t t;
+
+        if (!catalog_entry(catalog, ids[i], &entry)) {
+            continue;
+        }
+        for (t = 0; t < count; t++) {
+            if (!catalog_match(&entry, terms + t)) {
+                break;
+            }
+        }
+        if (t == count) {
+            func(arg, &entry);
+            matches++;
+        }
+    }
+    base_free(ids);
+    return matches;
+}
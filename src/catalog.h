@@ -0,0 +1,116 @@
+/** \file   catalog.h
+ * \brief   Searchable catalog of the records of many images - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_CATALOG_H
+#define HAVE_CATALOG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "t64types.h"
+
+
+/** \brief  Keys that can be searched in a catalog
+ */
+typedef enum {
+    CATALOG_KEY_NAME,   /**< ASCII filename (ignoring case) */
+    CATALOG_KEY_TAPE,   /**< ASCII tape name (ignoring case) */
+    CATALOG_KEY_START,  /**< start address */
+    CATALOG_KEY_END,    /**< real end address */
+    CATALOG_KEY_HASH    /**< hash64() of the file data */
+} catalog_key_t;
+
+
+/** \brief  Search term: \<key\>=\<value\>
+ */
+typedef struct catalog_term_s {
+    catalog_key_t   key;    /**< key to search */
+    const char *    text;   /**< name to look for (name and tape keys) */
+    size_t          len;    /**< length of \a text */
+    bool            prefix; /**< \a text is a prefix (value ended in '*') */
+    uint64_t        value;  /**< value to look for (other keys) */
+} catalog_term_t;
+
+
+/** \brief  Record found in a catalog
+ *
+ * The strings point into the catalog and stay valid until it's closed.
+ */
+typedef struct catalog_entry_s {
+    const char *    path;           /**< path of the image */
+    const char *    tapename;       /**< ASCII tape name */
+    const char *    filename;       /**< ASCII filename */
+    uint8_t         pet_filename[T64_REC_FILENAME_LEN]; /**< PETSCII filename */
+    int             index;          /**< index of the record in the image */
+    uint32_t        offset;         /**< offset of the file data in the image */
+    uint16_t        start_addr;     /**< start address */
+    uint16_t        end_addr;       /**< end address in the directory */
+    uint16_t        real_end_addr;  /**< real end address */
+    uint8_t         c64s_ftype;     /**< C64S file type */
+    uint8_t         c1541_ftype;    /**< C1541 file type */
+    t64_status_t    status;         /**< record status after verifying */
+    bool            hashed;         /**< \a hash is valid */
+    uint64_t        hash;           /**< hash64() of the file data */
+} catalog_entry_t;
+
+
+/** \brief  Function called for each record matching a query
+ *
+ * \param[in]   arg     argument passed to catalog_query()
+ * \param[in]   entry   record
+ */
+typedef void (*catalog_func_t)(void *arg, const catalog_entry_t *entry);
+
+
+/** \brief  Opaque catalog builder type
+ */
+typedef struct catalog_builder_s catalog_builder_t;
+
+/** \brief  Opaque catalog type
+ */
+typedef struct catalog_s catalog_t;
+
+
+catalog_builder_t * catalog_builder_new(void);
+void                catalog_builder_add(catalog_builder_t *builder,
+                                        const char *path,
+                                        const uint8_t *tapename,
+                                        const t64_record_t *records,
+                                        int count);
+bool                catalog_builder_write(catalog_builder_t *builder,
+                                          const char *path);
+void                catalog_builder_free(catalog_builder_t *builder);
+
+catalog_t *         catalog_open(const char *path);
+void                catalog_close(catalog_t *catalog);
+bool                catalog_parse_term(const char *arg, catalog_term_t *term);
+size_t              catalog_query(const catalog_t *catalog,
+                                  const catalog_term_t *terms,
+                                  size_t count,
+                                  catalog_func_t func,
+                                  void *arg);
+
+#endif
@@ -50,13 +50,53 @@ static const char *dos_types[] = {
 };
 
 
-/** \brief  Speed zones table for D64 images
+/** \brief  Number of sectors of each track
+ *
+ * Precomputed from the 1541's speed zones: tracks 1-17 have 21 sectors, tracks
+ * 18-24 have 19, tracks 25-30 have 18 and tracks 31-40 have 17 sectors. The
+ * layout is the same for all DOS types, 35-track images just stop earlier.
+ */
+static const uint8_t track_sectors[D64_TRACK_MAX_EXT + 1] = {
+    0,      /* track 0 doesn't exist */
+    /* tracks 1-17 */
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    /* tracks 18-24 */
+    19, 19, 19, 19, 19, 19, 19,
+    /* tracks 25-30 */
+    18, 18, 18, 18, 18, 18,
+    /* tracks 31-40 */
+    17, 17, 17, 17, 17, 17, 17, 17, 17, 17
+};
+
+
+/** \brief  Index of the first block of each track
+ *
+ * Entry D64_TRACK_MAX_EXT + 1 contains the number of blocks of a 40-track
+ * image, and entry D64_TRACK_MAX + 1 that of a 35-track image.
  */
-static const d64_speedzone_t speedzones[] = {
-    {  1, 17, 21 },
-    { 18, 24, 19 },
-    { 25, 30, 18 },
-    { 31, 40, 17 }
+static const uint16_t track_blocks[D64_TRACK_MAX_EXT + 2] = {
+    0,      /* track 0 doesn't exist */
+    /* tracks 1-17 */
+      0,  21,  42,  63,  84, 105, 126, 147, 168,
+    189, 210, 231, 252, 273, 294, 315, 336,
+    /* tracks 18-24 */
+    357, 376, 395, 414, 433, 452, 471,
+    /* tracks 25-30 */
+    490, 508, 526, 544, 562, 580,
+    /* tracks 31-40, followed by the number of blocks on a 40-track disk */
+    598, 615, 632, 649, 666, 683, 700, 717, 734,
+    751, 768
+};
+
+
+/** \brief  Number of tracks for each DOS type
+ */
+static const int dos_tracks[] = {
+    D64_TRACK_MAX,      /* CBM DOS */
+    D64_TRACK_MAX_EXT,  /* SpeedDOS */
+    D64_TRACK_MAX_EXT,  /* DolphinDOS */
+    D64_TRACK_MAX_EXT,  /* Professional DOS */
+    D64_TRACK_MAX_EXT   /* Prologic DOS */
 };
 
 
@@ -73,36 +113,15 @@ static const d64_speedzone_t speedzones[] = {
  */
 long d64_block_offset(int track, int sector)
 {
-    int zone = 0;
-    long offset = 0;
-    int tracks;
-
-    /* preliminary checks on track and sector number */
     if (track < D64_TRACK_MIN || track > D64_TRACK_MAX_EXT) {
         t64_errno = T64_ERR_D64_TRACK_RANGE;
         return -1;
     }
-    if (sector < D64_SECTOR_MIN || sector > D64_SECTOR_MAX) {
+    if (sector < D64_SECTOR_MIN || sector >= track_sectors[track]) {
         t64_errno = T64_ERR_D64_SECTOR_RANGE;
         return -1;
     }
-
-    while (zone < (int)(sizeof speedzones / sizeof speedzones[0])
-            && (track > speedzones[zone].track_max)) {
-        /* add complete zone */
-        tracks = speedzones[zone].track_max - speedzones[zone].track_min + 1;
-        offset += tracks * D64_BLOCK_SIZE_RAW * speedzones[zone].sectors;
-        zone++;
-    }
-
-    /* final sector number check */
-    if (sector >= speedzones[zone].sectors) {
-        return -1;
-    }
-
-    tracks = track - speedzones[zone].track_min;
-    offset += tracks * D64_BLOCK_SIZE_RAW * speedzones[zone].sectors;
-    return offset + sector * D64_BLOCK_SIZE_RAW;
+    return (long)(track_blocks[track] + sector) * D64_BLOCK_SIZE_RAW;
 }
 
 
@@ -133,22 +152,35 @@ long d64_track_offset(int track)
  */
 int d64_track_max_sector(int track)
 {
-    int zone = 0;
-
-    if (track < D64_TRACK_MIN) {
+    if (track < D64_TRACK_MIN || track > D64_TRACK_MAX_EXT) {
         t64_errno = T64_ERR_D64_TRACK_RANGE;
         return -1;
     }
+    return track_sectors[track] - 1;
+}
 
-    while (zone < (int)(sizeof speedzones / sizeof speedzones[0])) {
-        if (track <= speedzones[zone].track_max) {
-            /* found zone */
-            return speedzones[zone].sectors - 1;
-        }
-        zone++;
-    }
-    t64_errno = T64_ERR_D64_TRACK_RANGE;
-    return -1;
+
+/** \brief  Get number of tracks of \a d64
+ *
+ * \param[in]   d64     D64 handle
+ *
+ * \return  number of tracks for the DOS type of \a d64
+ */
+int d64_track_count(const d64_t *d64)
+{
+    return dos_tracks[d64->type];
+}
+
+
+/** \brief  Get number of blocks of \a d64
+ *
+ * \param[in]   d64     D64 handle
+ *
+ * \return  number of blocks for the DOS type of \a d64
+ */
+int d64_block_count(const d64_t *d64)
+{
+    return track_blocks[dos_tracks[d64->type] + 1];
 }
 
 
@@ -165,11 +197,7 @@ int d64_track_max_sector(int track)
  */
 bool d64_track_is_valid(const d64_t *d64, int track)
 {
-    int track_max;
-
-    track_max = (d64->type == D64_TYPE_CBMDOS ? 35 : 40);
-
-    if (track < D64_TRACK_MIN || track > track_max) {
+    if (track < D64_TRACK_MIN || track > dos_tracks[d64->type]) {
         t64_errno = T64_ERR_D64_TRACK_RANGE;
         return false;
     }
@@ -189,14 +217,11 @@ bool d64_track_is_valid(const d64_t *d64, int track)
  */
 bool d64_block_is_valid(const d64_t *d64, int track, int sector)
 {
-    int sector_max;
-
-    if (!d64_track_is_valid(d64, track)) {
-        return false;   /* error codes already set */
+    if (track < D64_TRACK_MIN || track > dos_tracks[d64->type]) {
+        t64_errno = T64_ERR_D64_TRACK_RANGE;
+        return false;
     }
-
-    sector_max = d64_track_max_sector(track);
-    if (sector < D64_SECTOR_MIN || sector > sector_max) {
+    if (sector < D64_SECTOR_MIN || sector >= track_sectors[track]) {
         t64_errno = T64_ERR_D64_SECTOR_RANGE;
         return false;
     }
@@ -204,6 +229,32 @@ bool d64_block_is_valid(const d64_t *d64, int track, int sector)
 }
 
 
+/** \brief  Get pointer to block (\a track,\a sector) in \a d64
+ *
+ * \param[in]   d64     D64 handle
+ * \param[in]   track   track number of block
+ * \param[in]   sector  sector number of sector
+ *
+ * \return  pointer into the data of \a d64 or `NULL` on failure
+ * \throw   T64_ERR_D64_TRACK_RANGE
+ * \throw   T64_ERR_D64_SECTOR_RANGE
+ */
+const uint8_t *d64_block_ptr(const d64_t *d64, int track, int sector)
+{
+    long offset;
+
+    if (!d64_block_is_valid(d64, track, sector)) {
+        return NULL;
+    }
+    offset = d64_block_offset(track, sector);
+    if (offset < 0 || (size_t)offset + D64_BLOCK_SIZE_RAW > d64->size) {
+        t64_errno = T64_ERR_D64_TRACK_RANGE;
+        return NULL;
+    }
+    return d64->data + offset;
+}
+
+
 /** \brief  Read block (\a track,\a sector) in \a d64 into \a buffer
  *
  * \param[in]   d64     D64 handle
@@ -219,18 +270,12 @@ bool d64_block_read(const d64_t *d64,
                         uint8_t *buffer,
                         int track, int sector)
 {
-    long offset;
+    const uint8_t *block = d64_block_ptr(d64, track, sector);
 
-    if (!d64_track_is_valid(d64, track)) {
+    if (block == NULL) {
         return false;
     }
-
-    offset = d64_block_offset(track, sector);
-    if (offset < 0) {
-        return false;
-    }
-
-    memcpy(buffer, d64->data + offset, D64_BLOCK_SIZE_RAW);
+    memcpy(buffer, block, D64_BLOCK_SIZE_RAW);
     return true;
 }
 
@@ -294,7 +339,7 @@ void d64_alloc(d64_t *d64, d64_type_t type)
         size = D64_SIZE_EXTENDED;
     }
 
-    d64->data = calloc(size, 1LU);
+    d64->data = base_calloc(size, 1LU);
     d64->size = size;
 }
 
@@ -306,10 +351,10 @@ void d64_alloc(d64_t *d64, d64_type_t type)
 void d64_free(d64_t *d64)
 {
     if (d64->path != NULL) {
-        free(d64->path);
+        base_free(d64->path);
     }
     if (d64->data != NULL) {
-        free(d64->data);
+        base_free(d64->data);
     }
 }
 
@@ -332,7 +377,7 @@ bool d64_read(d64_t *d64, const char *path, d64_type_t type)
     if (result != D64_SIZE_CBMDOS && result != D64_SIZE_EXTENDED) {
         /* Failed */
         base_debug("error: invalid image size\n");
-        free(d64->data);
+        base_free(d64->data);
         d64->data = NULL;
         return false;
     }
@@ -395,15 +440,12 @@ bool d64_write(d64_t *d64, const char *path)
     /* use new path? */
     if (path != NULL) {
         if (d64->path != NULL) {
-            free(d64->path);
-            d64->path = base_strdup(path);
+            base_free(d64->path);
         }
+        d64->path = base_strdup(path);
     }
 
-    if (fwrite_wrapper(d64->path, d64->data, d64->size)) {
-        return false;
-    }
-    return true;
+    return fwrite_wrapper(d64->path, d64->data, d64->size);
 }
 
 
@@ -529,8 +571,7 @@ void d64_dirent_read(d64_dirent_t *dirent, const uint8_t *data)
     /* $18-$1d */
     memcpy(dirent->geos, data + D64_DIRENT_GEOS, D64_DIRENT_GEOS_SIZE);
     /* $1e-$1f */
-    dirent->blocks = (uint8_t)(data[D64_DIRENT_BLOCKS_LSB]
-            + 256 * data[D64_DIRENT_BLOCKS_MSB]);
+    dirent->blocks = get_uint16(data + D64_DIRENT_BLOCKS_LSB);
 
     /* get file size in bytes */
     if (d64_block_is_valid(dirent->d64, dirent->track, dirent->sector)) {
@@ -758,18 +799,196 @@ bool d64_block_iter_next(d64_block_iter_t *iter)
  */
 long d64_file_size(d64_t *d64, int track, int sector)
 {
-    d64_block_iter_t iter;
-    long size = 0;
+    d64_chain_map_t map;
+    d64_chain_t chain;
 
-    if (!d64_block_iter_init(&iter, d64, track, sector)) {
+    d64_chain_map_init(&map, d64);
+    if (d64_chain_walk(&map, track, sector, &chain) != D64_CHAIN_OK) {
         return -1;
     }
+    return chain.size;
+}
+
 
-    while (d64_block_iter_next(&iter)) {
-        size += D64_BLOCK_SIZE_DATA;
+/** \brief  Initialize zero-copy D64 block iterator
+ *
+ * Unlike d64_block_iter_init() the iterator doesn't copy any blocks, its
+ * \a data member points into the data of \a d64.
+ *
+ * \param[out]  iter    D64 block iterator
+ * \param[in]   d64     D64 image
+ * \param[in]   track   track number
+ * \param[in]   sector  sector number
+ *
+ * \return  bool
+ * \throw   T64_ERR_D64_TRACK_RANGE
+ * \throw   T64_ERR_D64_SECTOR_RANGE
+ */
+bool d64_block_ptr_iter_init(d64_block_ptr_iter_t *iter,
+                             const d64_t *d64,
+                             int track, int sector)
+{
+    iter->d64 = d64;
+    iter->track = track;
+    iter->sector = sector;
+    iter->data = d64_block_ptr(d64, track, sector);
+    iter->valid = iter->data != NULL;
+    return iter->valid;
+}
+
+
+/** \brief  Move zero-copy D64 block iterator to the next block in the chain
+ *
+ * \param[in,out]   iter    D64 block iterator
+ *
+ * \return  false at the end of the chain or when the link is invalid, in
+ *          which case \a iter keeps pointing at the last valid block
+ * \throw   T64_ERR_D64_TRACK_RANGE
+ * \throw   T64_ERR_D64_SECTOR_RANGE
+ */
+bool d64_block_ptr_iter_next(d64_block_ptr_iter_t *iter)
+{
+    const uint8_t *next;
+    int next_track;
+    int next_sector;
+
+    if (!iter->valid) {
+        return false;
+    }
+    next_track = iter->data[D64_BLOCK_TRACK];
+    next_sector = iter->data[D64_BLOCK_SECTOR];
+    if (next_track == 0) {
+        return false;
+    }
+    next = d64_block_ptr(iter->d64, next_track, next_sector);
+    if (next == NULL) {
+        return false;
     }
-    /* the sector number points to the last data byte */
-    return size + iter.data[D64_BLOCK_SECTOR] - 1;
+    iter->data = next;
+    iter->track = next_track;
+    iter->sector = next_sector;
+    return true;
+}
+
+
+/** \brief  Get index of block (\a track,\a sector) in the image
+ *
+ * \param[in]   track   track number
+ * \param[in]   sector  sector number
+ *
+ * \return  block index
+ *
+ * \note    expects a valid block
+ */
+static int d64_block_index(int track, int sector)
+{
+    return track_blocks[track] + sector;
+}
+
+
+/** \brief  Test and set bit for (\a track,\a sector) in \a map
+ *
+ * \param[in,out]   map     chain map
+ * \param[in]       track   track number
+ * \param[in]       sector  sector number
+ *
+ * \return  true if the block was already visited
+ */
+static bool d64_chain_map_visit(d64_chain_map_t *map, int track, int sector)
+{
+    int index = d64_block_index(track, sector);
+    uint8_t mask = (uint8_t)(1 << (index & 7));
+    bool visited = (map->visited[index >> 3] & mask) != 0;
+
+    map->visited[index >> 3] |= mask;
+    return visited;
+}
+
+
+/** \brief  Initialize chain map for walking the block chains of \a d64
+ *
+ * \param[out]  map     chain map
+ * \param[in]   d64     D64 image
+ */
+void d64_chain_map_init(d64_chain_map_t *map, const d64_t *d64)
+{
+    map->d64 = d64;
+    memset(map->visited, 0, sizeof map->visited);
+}
+
+
+/** \brief  Walk block chain starting at (\a track,\a sector)
+ *
+ * Follows the links of the chain without copying any blocks, marking each
+ * block as visited in \a map. Walking all chains of a disk through the same
+ * map takes time proportional to the number of blocks on the disk: a chain
+ * running into a block that was already visited is either a loop (the block
+ * belongs to the chain itself) or cross-linked with a chain walked earlier.
+ * Only in that case the chain is walked again, to tell the two apart.
+ *
+ * \param[in,out]   map     chain map
+ * \param[in]       track   track number of the first block
+ * \param[in]       sector  sector number of the first block
+ * \param[out]      chain   result, \a track and \a sector are set to the
+ *                          offending block on error
+ *
+ * \return  status of the chain
+ */
+d64_chain_status_t d64_chain_walk(d64_chain_map_t *map,
+                                  int track, int sector,
+                                  d64_chain_t *chain)
+{
+    d64_block_ptr_iter_t iter;
+
+    chain->blocks = 0;
+    chain->size = 0;
+    chain->track = track;
+    chain->sector = sector;
+
+    if (!d64_block_ptr_iter_init(&iter, map->d64, track, sector)) {
+        chain->status = D64_CHAIN_INVALID;
+        return chain->status;
+    }
+
+    while (true) {
+        if (d64_chain_map_visit(map, iter.track, iter.sector)) {
+            break;
+        }
+        chain->blocks++;
+        if (!d64_block_ptr_iter_next(&iter)) {
+            if (iter.data[D64_BLOCK_TRACK] != 0) {
+                /* link to an invalid block */
+                chain->track = iter.data[D64_BLOCK_TRACK];
+                chain->sector = iter.data[D64_BLOCK_SECTOR];
+                chain->status = D64_CHAIN_INVALID;
+                return chain->status;
+            }
+            /* the sector number points to the last data byte */
+            chain->size = (long)(chain->blocks - 1) * D64_BLOCK_SIZE_DATA
+                + iter.data[D64_BLOCK_SECTOR] - 1;
+            chain->status = D64_CHAIN_OK;
+            return chain->status;
+        }
+    }
+
+    /* ran into a visited block: is it part of this chain? */
+    chain->track = iter.track;
+    chain->sector = iter.sector;
+    chain->status = D64_CHAIN_CROSS_LINKED;
+    if (chain->blocks > 0) {
+        d64_block_ptr_iter_t again;
+        int i;
+
+        d64_block_ptr_iter_init(&again, map->d64, track, sector);
+        for (i = 0; i < chain->blocks; i++) {
+            if (again.track == iter.track && again.sector == iter.sector) {
+                chain->status = D64_CHAIN_LOOP;
+                break;
+            }
+            d64_block_ptr_iter_next(&again);
+        }
+    }
+    return chain->status;
 }
 
 
@@ -836,6 +1055,233 @@ bool d64_dir_read(d64_dir_t *dir)
 }
 
 
+/** \brief  Mark directory block (\a track,\a sector) of \a view as visited
+ *
+ * \param[in,out]   view    D64 directory view
+ * \param[in]       track   track number
+ * \param[in]       sector  sector number
+ *
+ * \return  false if the block was visited before (the chain loops)
+ */
+static bool d64_dir_view_visit(d64_dir_view_t *view, int track, int sector)
+{
+    int index = d64_block_index(track, sector);
+    uint8_t mask = (uint8_t)(1 << (index & 7));
+
+    if (view->visited[index >> 3] & mask) {
+        return false;
+    }
+    view->visited[index >> 3] |= mask;
+    return true;
+}
+
+
+/** \brief  Initialize lazy directory view of \a d64
+ *
+ * The view is positioned before the first entry, call d64_dir_view_next() to
+ * get to it. Unlike `d64_dir_t` nothing is copied or decoded up front.
+ *
+ * \param[out]  view    D64 directory view
+ * \param[in]   d64     D64 image
+ *
+ * \return  false if the BAM or the first directory block is invalid
+ * \throw   T64_ERR_D64_TRACK_RANGE
+ * \throw   T64_ERR_D64_SECTOR_RANGE
+ */
+bool d64_dir_view_init(d64_dir_view_t *view, const d64_t *d64)
+{
+    const uint8_t *bam;
+
+    view->d64 = d64;
+    view->diskname = NULL;
+    view->diskid = NULL;
+    view->block = NULL;
+    view->entry = NULL;
+    view->track = D64_DIR_TRACK;
+    view->sector = D64_DIR_SECTOR;
+    view->index = -1;
+    memset(view->visited, 0, sizeof view->visited);
+
+    bam = d64_block_ptr(d64, D64_BAM_TRACK, D64_BAM_SECTOR);
+    if (bam == NULL) {
+        return false;
+    }
+    view->diskname = bam + D64_BAM_DISKNAME;
+    view->diskid = bam + D64_BAM_DISKID;
+
+    view->block = d64_block_ptr(d64, D64_DIR_TRACK, D64_DIR_SECTOR);
+    if (view->block == NULL) {
+        return false;
+    }
+    d64_dir_view_visit(view, D64_DIR_TRACK, D64_DIR_SECTOR);
+    return true;
+}
+
+
+/** \brief  Move \a view to the next used directory entry
+ *
+ * Skips unused (scratched) entries and follows the directory chain until it
+ * ends, so directories with more than `D64_DIRENT_MAX` entries (some 40-track
+ * DOS variants) are handled. A chain linking back to an earlier directory
+ * block or to an invalid block ends the directory.
+ *
+ * \param[in,out]   view    D64 directory view
+ *
+ * \return  false when there are no more entries
+ */
+bool d64_dir_view_next(d64_dir_view_t *view)
+{
+    while (view->block != NULL) {
+        int offset = (view->index + 1) % D64_DIRENTS_PER_BLOCK
+            * D64_DIRENT_SIZE;
+
+        if (view->index >= 0 && offset == 0) {
+            /* done with this block, follow the link */
+            int track = view->block[D64_BLOCK_TRACK];
+            int sector = view->block[D64_BLOCK_SECTOR];
+
+            view->block = NULL;
+            view->entry = NULL;
+            if (track == 0) {
+                return false;
+            }
+            view->block = d64_block_ptr(view->d64, track, sector);
+            if (view->block == NULL
+                    || !d64_dir_view_visit(view, track, sector)) {
+                view->block = NULL;
+                return false;
+            }
+            view->track = track;
+            view->sector = sector;
+        }
+        view->index++;
+        view->entry = view->block + offset;
+        if (view->entry[D64_DIRENT_FILETYPE] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief  Move \a view to the next entry named \a name
+ *
+ * Stops at the first match, so finding a file early in the directory doesn't
+ * walk the rest of it.
+ *
+ * \param[in,out]   view    D64 directory view
+ * \param[in]       name    PETSCII name, without the $a0 padding
+ * \param[in]       len     length of \a name (at most 16)
+ *
+ * \return  true if found
+ */
+bool d64_dir_view_find(d64_dir_view_t *view, const uint8_t *name, size_t len)
+{
+    if (len > CBMDOS_FILENAME_MAX) {
+        return false;
+    }
+    while (d64_dir_view_next(view)) {
+        const uint8_t *entry_name = view->entry + D64_DIRENT_FILENAME;
+
+        if (memcmp(entry_name, name, len) == 0
+                && (len == CBMDOS_FILENAME_MAX || entry_name[len] == 0xa0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief  Get PETSCII name of the current entry of \a view
+ *
+ * \param[in]   view    D64 directory view
+ *
+ * \return  pointer to the name (16 bytes, padded with $a0) inside the image
+ */
+const uint8_t *d64_dir_view_name(const d64_dir_view_t *view)
+{
+    return view->entry + D64_DIRENT_FILENAME;
+}
+
+
+/** \brief  Get file type (and locked/closed bits) of current entry of \a view
+ *
+ * \param[in]   view    D64 directory view
+ *
+ * \return  file type byte
+ */
+uint8_t d64_dir_view_filetype(const d64_dir_view_t *view)
+{
+    return view->entry[D64_DIRENT_FILETYPE];
+}
+
+
+/** \brief  Get size in blocks of the current entry of \a view
+ *
+ * \param[in]   view    D64 directory view
+ *
+ * \return  number of blocks as stored in the directory
+ */
+uint16_t d64_dir_view_blocks(const d64_dir_view_t *view)
+{
+    return get_uint16(view->entry + D64_DIRENT_BLOCKS_LSB);
+}
+
+
+/** \brief  Get first block of the file of the current entry of \a view
+ *
+ * \param[in]   view    D64 directory view
+ * \param[out]  track   track number
+ * \param[out]  sector  sector number
+ */
+void d64_dir_view_start(const d64_dir_view_t *view, int *track, int *sector)
+{
+    *track = view->entry[D64_DIRENT_TRACK];
+    *sector = view->entry[D64_DIRENT_SECTOR];
+}
+
+
+/** \brief  Decode the current entry of \a view into \a dirent
+ *
+ * This decodes all fields, including the file size in bytes, which walks the
+ * file's block chain.
+ *
+ * \param[in]   view    D64 directory view
+ * \param[out]  dirent  D64 directory entry
+ */
+void d64_dir_view_dirent(const d64_dir_view_t *view, d64_dirent_t *dirent)
+{
+    /* d64_dirent_t isn't const-correct, but the image isn't modified */
+    dirent->d64 = (d64_t *)(uintptr_t)view->d64;
+    dirent->size = 0;
+    d64_dirent_read(dirent, view->entry);
+}
+
+
+/** \brief  Translate the filenames of all entries in directory \a block
+ *
+ * Translates the names of the D64_DIRENTS_PER_BLOCK entries in a raw directory
+ * block in one call, removing the padding. Unused entries are translated as
+ * well, use the file type to tell them apart.
+ *
+ * \param[in]   block   raw directory block (D64_BLOCK_SIZE_RAW bytes)
+ * \param[out]  names   target strings, D64_DIRENTS_PER_BLOCK strings of
+ *                      \a stride bytes each
+ * \param[in]   stride  distance between strings in \a names, at least
+ *                      CBMDOS_FILENAME_MAX + 1
+ * \param[in]   mode    conversion mode
+ */
+void d64_dir_block_names(const uint8_t *block,
+                         char *names,
+                         size_t stride,
+                         pet_conv_t mode)
+{
+    pet_to_asc_names(names, stride,
+                     block + D64_DIRENT_FILENAME, D64_DIRENT_SIZE,
+                     CBMDOS_FILENAME_MAX, D64_DIRENTS_PER_BLOCK, mode);
+}
+
+
 /** \brief  Dump directory \a dir on stdout
  *
  * \param[in]   dir D64 directory
@@ -887,28 +1333,11 @@ static uint8_t *d64_bament_ptr(d64_t *d64, int track)
 }
 
 
-static int d64_bament_popcount(d64_t *d64, int track)
-{
-    uint8_t bament[D64_BAMENT_SIZE];
-    int count;
-    int sec_count;
-
-    d64_bament_read(d64, bament, track);
-    sec_count = d64_track_max_sector(track) + 1;
-
-    count = popcount_byte(bament[D64_BAMENT_BITMAP + 0]);
-    count += popcount_byte(bament[D64_BAMENT_BITMAP + 1]);
-    count += popcount_byte((uint8_t)(bament[D64_BAMENT_BITMAP + 2]
-                                     & ((1 << (sec_count & 0x07)) -1)));
-
-    return count;
-}
-
-
 /** \brief  Mark a block (\a track,\a sector) used/unused
  *
  * Clear bit in BAM entry bitmap for (\a track, \a sector) and update the
- * `blocks free count` byte in the BAM entry.
+ * `blocks free count` byte in the BAM entry. The count is only adjusted when
+ * the bit actually changes, so there's no need to recount the bitmap.
  *
  * \param[in]   d64     D64 handle
  * \param[in]   track   track number
@@ -919,24 +1348,404 @@ static void d64_bam_mark_block(d64_t *d64, int track, int sector, bool used)
 {
     uint8_t *bament;
     uint8_t *bitmap;
+    uint8_t mask;
 
     assert(d64 != NULL);
     assert(d64_block_is_valid(d64, track, sector));
 
     bament = d64_bament_ptr(d64, track);
-    bitmap = bament + 1 + (sector >> 3);
+    bitmap = bament + D64_BAMENT_BITMAP + (sector >> 3);
+    mask = (uint8_t)(1U << (sector & 0x07));
 
-    /* set sector-used bit in bitmap */
-    if (used) {
+    if (used && (*bitmap & mask)) {
         /* clear bit: marking the sector used */
-        *bitmap &= (uint8_t)~(1U << (sector & 0x07));
-    } else {
+        *bitmap &= (uint8_t)~mask;
+        bament[D64_BAMENT_COUNT]--;
+    } else if (!used && !(*bitmap & mask)) {
         /* set bit: marking the sector free */
-        *bitmap |= (uint8_t)(1U << (sector & 0x07));
+        *bitmap |= mask;
+        bament[D64_BAMENT_COUNT]++;
     }
+}
 
-    /* update blocks free count byte from bitmap */
-    bament[D64_BAMENT_COUNT] = (uint8_t)d64_bament_popcount(d64, track);
+
+/** \brief  Find a free sector on \a track, starting at \a start
+ *
+ * Full tracks are skipped using the free count of the BAM entry.
+ *
+ * \param[in]   d64     D64 handle
+ * \param[in]   track   track number
+ * \param[in]   start   sector to start looking at
+ * \param[out]  sector  free sector found
+ *
+ * \return  true if a free sector was found
+ */
+static bool d64_track_find_free(d64_t *d64, int track, int start, int *sector)
+{
+    const uint8_t *bament = d64_bament_ptr(d64, track);
+    int count = d64_track_max_sector(track) + 1;
+    int i;
+
+    if (bament[D64_BAMENT_COUNT] == 0) {
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        int s = (start + i) % count;
+
+        if (bament[D64_BAMENT_BITMAP + (s >> 3)] & (1 << (s & 0x07))) {
+            *sector = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief  Allocate a block for file data in \a d64
+ *
+ * Follows the strategy of the 1541: the first block of a file (\a track is 0)
+ * goes on the free track closest to the directory track. Following blocks go
+ * \a interleave sectors further on the same track, moving away from the
+ * directory track when the track is full and trying the other half of the
+ * disk when there's no room left on this half.
+ *
+ * \param[in,out]   d64         D64 handle
+ * \param[in]       interleave  sector interleave
+ * \param[in,out]   track       track number of the previous block of the file
+ *                              or 0, set to the track of the new block
+ * \param[in,out]   sector      sector number of the previous block, set to
+ *                              the sector of the new block
+ *
+ * \return  true on success
+ * \throw   T64_ERR_D64_FULL
+ *
+ * \note    Only works for 35 track images, see d64_bament_ptr()
+ */
+bool d64_block_alloc(d64_t *d64, int interleave, int *track, int *sector)
+{
+    int start = 0;
+    int dist;
+    int t;
+
+    if (*track != 0) {
+        int dir = *track < D64_DIR_TRACK ? -1 : 1;
+
+        start = *sector + interleave;
+        /* same track, then away from the directory, then the other half */
+        for (t = *track; t >= D64_TRACK_MIN && t <= D64_TRACK_MAX; t += dir) {
+            if (d64_track_find_free(d64, t, start, sector)) {
+                goto d64_block_alloc_found;
+            }
+        }
+        for (t = D64_DIR_TRACK - dir;
+                t >= D64_TRACK_MIN && t <= D64_TRACK_MAX; t -= dir) {
+            if (d64_track_find_free(d64, t, start, sector)) {
+                goto d64_block_alloc_found;
+            }
+        }
+    } else {
+        for (dist = 1; dist < D64_TRACK_MAX; dist++) {
+            t = D64_DIR_TRACK - dist;
+            if (t >= D64_TRACK_MIN && d64_track_find_free(d64, t, 0, sector)) {
+                goto d64_block_alloc_found;
+            }
+            t = D64_DIR_TRACK + dist;
+            if (t <= D64_TRACK_MAX && d64_track_find_free(d64, t, 0, sector)) {
+                goto d64_block_alloc_found;
+            }
+        }
+    }
+    t64_errno = T64_ERR_D64_FULL;
+    return false;
+
+d64_block_alloc_found:
+    *track = t;
+    d64_bam_mark_block(d64, t, *sector, true);
+    return true;
+}
+
+
+/** \brief  Mark block (\a track,\a sector) free in the BAM of \a d64
+ *
+ * \param[in,out]   d64     D64 handle
+ * \param[in]       track   track number
+ * \param[in]       sector  sector number
+ */
+void d64_block_free(d64_t *d64, int track, int sector)
+{
+    d64_bam_mark_block(d64, track, sector, false);
+}
+
+
+/** \brief  Walk chain at (\a track,\a sector) for d64_validate()
+ *
+ * \param[in,out]   result  validation result
+ * \param[in,out]   map     chain map
+ * \param[in]       track   track number of the first block
+ * \param[in]       sector  sector number of the first block
+ *
+ * \return  number of blocks in the chain
+ */
+static int d64_validate_chain(d64_validation_t *result,
+                              d64_chain_map_t *map,
+                              int track, int sector)
+{
+    d64_chain_t chain;
+
+    switch (d64_chain_walk(map, track, sector, &chain)) {
+        case D64_CHAIN_OK:
+            break;
+        case D64_CHAIN_INVALID:
+            result->chains_invalid++;
+            break;
+        case D64_CHAIN_LOOP:
+            result->chains_looped++;
+            break;
+        case D64_CHAIN_CROSS_LINKED:
+            result->chains_cross_linked++;
+            break;
+        default:
+            break;
+    }
+    return chain.blocks;
+}
+
+
+/** \brief  Validate the BAM of \a d64 against the block chains
+ *
+ * Walks the directory and the chains of all closed files (including the side
+ * sectors of REL files) through a single chain map, then compares the map
+ * with the BAM in one sweep over all blocks. Each block is visited once, so
+ * the time taken is proportional to the size of the image.
+ *
+ * \param[in]   d64     D64 image
+ * \param[out]  result  validation result
+ *
+ * \return  true if the image is consistent
+ *
+ * \note    Only the BAM for the first 35 tracks is checked, the location of the
+ *          BAM of the extra tracks differs between the 40-track DOS types.
+ *          Blocks on the extra tracks are still counted as used.
+ */
+bool d64_validate(const d64_t *d64, d64_validation_t *result)
+{
+    d64_chain_map_t map;
+    d64_dir_view_t view;
+    int track;
+    int sector;
+
+    memset(result, 0, sizeof *result);
+    d64_chain_map_init(&map, d64);
+
+    /* BAM and directory */
+    d64_chain_map_visit(&map, D64_BAM_TRACK, D64_BAM_SECTOR);
+    d64_validate_chain(result, &map, D64_DIR_TRACK, D64_DIR_SECTOR);
+
+    /* files */
+    if (d64_dir_view_init(&view, d64)) {
+        while (d64_dir_view_next(&view)) {
+            uint8_t filetype = d64_dir_view_filetype(&view);
+            int blocks;
+
+            if (!(filetype & CBMDOS_CLOSED_MASK)) {
+                result->files_unclosed++;
+                continue;
+            }
+            d64_dir_view_start(&view, &track, &sector);
+            blocks = d64_validate_chain(result, &map, track, sector);
+            if ((filetype & CBMDOS_FILETYPE_MASK) == CBMDOS_FILETYPE_REL) {
+                blocks += d64_validate_chain(result, &map,
+                                             view.entry[D64_DIRENT_SSB_TRACK],
+                                             view.entry[D64_DIRENT_SSB_SECTOR]);
+            }
+            if (blocks != d64_dir_view_blocks(&view)) {
+                result->sizes_wrong++;
+            }
+            result->files++;
+        }
+    }
+
+    /* compare the blocks visited with the BAM */
+    for (track = D64_TRACK_MIN; track <= d64_track_count(d64); track++) {
+        uint8_t bament[D64_BAMENT_SIZE];
+        bool has_bam = d64_bament_read(d64, bament, track);
+        int free_count = 0;
+
+        for (sector = 0; sector < track_sectors[track]; sector++) {
+            int index = d64_block_index(track, sector);
+            bool used = (map.visited[index >> 3] >> (index & 7)) & 1;
+            bool free = has_bam
+                && ((bament[D64_BAMENT_BITMAP + (sector >> 3)]
+                            >> (sector & 7)) & 1);
+
+            if (used) {
+                result->blocks_used++;
+                if (free) {
+                    result->blocks_unallocated++;
+                }
+            } else if (has_bam && !free) {
+                result->blocks_lost++;
+            }
+            free_count += free;
+        }
+        if (has_bam && free_count != bament[D64_BAMENT_COUNT]) {
+            result->counts_wrong++;
+        }
+    }
+
+    return result->blocks_unallocated == 0
+        && result->blocks_lost == 0
+        && result->counts_wrong == 0
+        && result->sizes_wrong == 0
+        && result->chains_invalid == 0
+        && result->chains_looped == 0
+        && result->chains_cross_linked == 0;
+}
+
+
+/** \brief  Get a free directory entry in \a d64
+ *
+ * Adds a directory block (with the usual interleave of 3) when all blocks of
+ * the directory are full.
+ *
+ * \param[in,out]   d64 D64 handle
+ *
+ * \return  pointer to raw directory entry or `NULL` when the directory is full
+ * \throw   T64_ERR_D64_FULL
+ */
+static uint8_t *d64_dirent_alloc(d64_t *d64)
+{
+    uint8_t *block;
+    int sector = D64_DIR_SECTOR;
+    int blocks;
+    int next;
+    int i;
+
+    /* the directory can't be longer than its track, catches loops as well */
+    for (blocks = 0; blocks <= D64_SECTOR_MAX; blocks++) {
+        block = d64->data + d64_block_offset(D64_DIR_TRACK, sector);
+        for (i = 0; i < D64_BLOCK_SIZE_RAW; i += D64_DIRENT_SIZE) {
+            if (block[i + D64_DIRENT_FILETYPE] == 0) {
+                /* keep the link to the next block in entry 0 */
+                memset(block + i + D64_DIRENT_FILETYPE, 0,
+                       D64_DIRENT_SIZE - D64_DIRENT_FILETYPE);
+                return block + i;
+            }
+        }
+        if (block[D64_BLOCK_TRACK] != D64_DIR_TRACK) {
+            break;
+        }
+        sector = block[D64_BLOCK_SECTOR];
+        if (sector > d64_track_max_sector(D64_DIR_TRACK)) {
+            break;
+        }
+    }
+    if (blocks > D64_SECTOR_MAX || block[D64_BLOCK_TRACK] != 0
+            || !d64_track_find_free(d64, D64_DIR_TRACK, sector + 3, &next)) {
+        t64_errno = T64_ERR_D64_FULL;
+        return NULL;
+    }
+
+    /* link new directory block */
+    d64_bam_mark_block(d64, D64_DIR_TRACK, next, true);
+    block[D64_BLOCK_TRACK] = D64_DIR_TRACK;
+    block[D64_BLOCK_SECTOR] = (uint8_t)next;
+    block = d64->data + d64_block_offset(D64_DIR_TRACK, next);
+    memset(block, 0, D64_BLOCK_SIZE_RAW);
+    block[D64_BLOCK_SECTOR] = 0xff;
+    return block;
+}
+
+
+/** \brief  Write program file to \a d64
+ *
+ * Allocates the blocks with the 1541's interleave of 10, writes the start
+ * address followed by \a data into them and adds a directory entry. Nothing
+ * is changed if the file doesn't fit.
+ *
+ * \param[in,out]   d64         D64 handle
+ * \param[in]       name        PETSCII filename, padded with $a0
+ * \param[in]       filetype    filetype byte, including the closed bit
+ * \param[in]       start       start address
+ * \param[in]       data        program data, excluding start address
+ * \param[in]       size        size of \a data
+ *
+ * \return  true on success
+ * \throw   T64_ERR_D64_FULL
+ *
+ * \note    Only works for 35 track images, see d64_bament_ptr()
+ */
+bool d64_file_write_prg(d64_t *d64,
+                        const uint8_t *name,
+                        uint8_t filetype,
+                        uint16_t start,
+                        const uint8_t *data,
+                        size_t size)
+{
+    uint8_t *dirent;
+    uint8_t (*blocks)[2];
+    size_t count = (size + 2 + D64_BLOCK_SIZE_DATA - 1) / D64_BLOCK_SIZE_DATA;
+    size_t pos = 0;     /* position in file, including start address */
+    size_t i;
+    int track = 0;
+    int sector = 0;
+
+    if (count > D64_BLOCKS_MAX) {
+        t64_errno = T64_ERR_D64_FULL;
+        return false;
+    }
+    dirent = d64_dirent_alloc(d64);
+    if (dirent == NULL) {
+        return false;
+    }
+
+    /* allocate all blocks first so a full disk doesn't leave a partial file */
+    blocks = base_malloc(sizeof *blocks * count);
+    for (i = 0; i < count; i++) {
+        if (!d64_block_alloc(d64, 10, &track, &sector)) {
+            while (i-- > 0) {
+                d64_block_free(d64, blocks[i][0], blocks[i][1]);
+            }
+            base_free(blocks);
+            return false;
+        }
+        blocks[i][0] = (uint8_t)track;
+        blocks[i][1] = (uint8_t)sector;
+    }
+
+    for (i = 0; i < count; i++) {
+        uint8_t *block = d64->data + d64_block_offset(blocks[i][0],
+                                                      blocks[i][1]);
+        uint8_t *dest = block + D64_BLOCK_DATA;
+        size_t len = size + 2 - pos;
+
+        if (len > D64_BLOCK_SIZE_DATA) {
+            len = D64_BLOCK_SIZE_DATA;
+        }
+        memset(block, 0, D64_BLOCK_SIZE_RAW);
+        if (i + 1 < count) {
+            block[D64_BLOCK_TRACK] = blocks[i + 1][0];
+            block[D64_BLOCK_SECTOR] = blocks[i + 1][1];
+        } else {
+            /* last block: index of the last byte used */
+            block[D64_BLOCK_SECTOR] = (uint8_t)(len + 1);
+        }
+        if (pos == 0) {
+            set_uint16(dest, start);
+            memcpy(dest + 2, data, len - 2);
+        } else {
+            memcpy(dest, data + pos - 2, len);
+        }
+        pos += len;
+    }
+
+    dirent[D64_DIRENT_FILETYPE] = filetype;
+    dirent[D64_DIRENT_TRACK] = blocks[0][0];
+    dirent[D64_DIRENT_SECTOR] = blocks[0][1];
+    memcpy(dirent + D64_DIRENT_FILENAME, name, CBMDOS_FILENAME_MAX);
+    set_uint16(dirent + D64_DIRENT_BLOCKS_LSB, (uint16_t)count);
+    base_free(blocks);
+    return true;
 }
 
 
@@ -974,12 +1783,12 @@ void d64_bam_init(d64_t *d64)
         uint8_t *bament = d64_bament_ptr(d64, track);
         int sec_count = d64_track_max_sector(track) + 1;
 
-        /* blocks free count */
-        bament[0] = (uint8_t)sec_count;
-        /* block free bitmap */
+        /* blocks free count and block free bitmap */
         if (track == D64_DIR_TRACK) {
+            bament[0] = (uint8_t)(sec_count - 2);
             bament[1] = 0xfc;   /* 0 (BAM) & 1 (DIR) used, 2-7 free */
         } else {
+            bament[0] = (uint8_t)sec_count;
             bament[1] = 0xff;   /* 0-7 free */
         }
         bament[2] = 0xff;   /* 8-15 */
@@ -1009,6 +1818,9 @@ void d64_new(d64_t *d64)
     d64->size = D64_SIZE_CBMDOS;
     d64->data = base_calloc(d64->size, 1UL);
     d64_bam_init(d64);
+    /* empty directory block at (18,1) */
+    d64->data[d64_block_offset(D64_DIR_TRACK, D64_DIR_SECTOR)
+        + D64_BLOCK_SECTOR] = 0xff;
 }
 
 
@@ -1023,8 +1835,9 @@ void d64_set_diskname_asc(d64_t *d64, const char *name)
     int i = 0;
 
     memset(diskname, 0xa0, D64_DISKNAME_MAXLEN);
-    while (*name != '\0' && i < D64_DISKNAME_MAXLEN) {
+    while (name[i] != '\0' && i < D64_DISKNAME_MAXLEN) {
         diskname[i] = asc_to_pet((uint8_t)name[i]);
+        i++;
     }
 }
 
@@ -1041,7 +1854,7 @@ void d64_set_diskid_asc(d64_t *d64, const char *id)
 
     diskid[0] = 0xa0;
     diskid[1] = 0xa0;
-    while (*id != '\0' && i < D64_DISKID_MAXLEN) {
+    while (id[i] != '\0' && i < D64_DISKID_MAXLEN) {
         diskid[i] = asc_to_pet((uint8_t)id[i]);
         i++;
     }
@@ -1059,7 +1872,7 @@ void d64_set_diskname_pet(d64_t *d64, const uint8_t *name)
     int i = 0;
 
     memset(diskname, 0xa0, D64_DISKNAME_MAXLEN);
-    while (*name != '\0' && i < D64_DISKNAME_MAXLEN) {
+    while (name[i] != '\0' && i < D64_DISKNAME_MAXLEN) {
         diskname[i] = name[i];
         i++;
     }
@@ -1078,7 +1891,7 @@ void d64_set_diskid_pet(d64_t *d64, const uint8_t *id)
 
     diskid[0] = 0xa0;
     diskid[1] = 0xa0;
-    while (*id != '\0' && i < D64_DISKID_MAXLEN) {
+    while (id[i] != '\0' && i < D64_DISKID_MAXLEN) {
         diskid[i] = id[i];
         i++;
     }
@@ -32,6 +32,7 @@
 #include <stdbool.h>
 
 #include "cbmdos.h"
+#include "petasc.h"
 
 
 /** \brief  Size of a standard 35-track D64 image without error info
@@ -47,6 +48,11 @@
  */
 #define D64_TRACK_MIN       1
 
+/** \brief  Number of blocks in a 40-track D64 image
+ */
+#define D64_BLOCKS_MAX      (D64_SIZE_EXTENDED / 256)
+
+
 /** \brief  Maximum track number for standard (35-track) D64 images
  */
 #define D64_TRACK_MAX       35
@@ -85,6 +91,10 @@
  */
 #define D64_BLOCK_SIZE_DATA 254
 
+/** \brief  Number of directory entries in a directory block
+ */
+#define D64_DIRENTS_PER_BLOCK   (D64_BLOCK_SIZE_RAW / D64_DIRENT_SIZE)
+
 /** \brief  Offset in a raw block of the next track
  */
 #define D64_BLOCK_TRACK 0
@@ -317,6 +327,28 @@ typedef struct d64_dir_s {
 } d64_dir_t;
 
 
+/** \brief  Lazy D64 directory view
+ *
+ * Walks the directory chain without copying anything, \a entry points to the
+ * raw data of the current entry inside the image. Use the d64_dir_view_*()
+ * accessors to decode only the fields that are needed.
+ */
+typedef struct d64_dir_view_s {
+    const d64_t *   d64;        /**< D64 image */
+    const uint8_t * diskname;   /**< PETSCII disk name, inside the BAM */
+    const uint8_t * diskid;     /**< PETSCII disk ID + DOS type, inside the
+                                     BAM */
+    const uint8_t * block;      /**< current directory block */
+    const uint8_t * entry;      /**< current entry, inside \a block */
+    int             track;      /**< track number of \a block */
+    int             sector;     /**< sector number of \a block */
+    int             index;      /**< index of the current entry, counting
+                                     unused entries */
+    uint8_t         visited[D64_BLOCKS_MAX / 8];    /**< bitmap of visited
+                                                         directory blocks */
+} d64_dir_view_t;
+
+
 /** \brief  D64 block iterator object
  *
  * A block is a raw (256 bytes) sector in a D64 image
@@ -331,9 +363,75 @@ typedef struct d64_block_iter_s {
 } d64_block_iter_t;
 
 
+/** \brief  Zero-copy D64 block iterator object
+ *
+ * Like `d64_block_iter_t`, but \a data points into the image data instead of
+ * containing a copy of the block.
+ */
+typedef struct d64_block_ptr_iter_s {
+    const d64_t *   d64;    /**< D64 image */
+    const uint8_t * data;   /**< current block data, inside \a d64 */
+    int             track;  /**< current block track number */
+    int             sector; /**< current block sector number */
+    bool            valid;  /**< iterator is valid */
+} d64_block_ptr_iter_t;
+
+
+/** \brief  Result of walking a block chain
+ */
+typedef enum d64_chain_status_e {
+    D64_CHAIN_OK,           /**< chain ends properly */
+    D64_CHAIN_INVALID,      /**< chain contains an invalid block */
+    D64_CHAIN_LOOP,         /**< chain links back to one of its own blocks */
+    D64_CHAIN_CROSS_LINKED  /**< chain links into a chain walked earlier */
+} d64_chain_status_t;
+
+
+/** \brief  Blocks visited while walking the block chains of a D64
+ */
+typedef struct d64_chain_map_s {
+    const d64_t *   d64;                            /**< D64 image */
+    uint8_t         visited[D64_BLOCKS_MAX / 8];    /**< bitmap of visited
+                                                         blocks */
+} d64_chain_map_t;
+
+
+/** \brief  Block chain information
+ */
+typedef struct d64_chain_s {
+    int                 blocks; /**< number of blocks (up to any error) */
+    long                size;   /**< size in bytes of the data in the chain,
+                                     only valid if the chain is OK */
+    int                 track;  /**< track number of the offending block */
+    int                 sector; /**< sector number of the offending block */
+    d64_chain_status_t  status; /**< status of the chain */
+} d64_chain_t;
+
+
+/** \brief  Result of validating a D64 image with d64_validate()
+ */
+typedef struct d64_validation_s {
+    int files;              /**< number of closed files checked */
+    int files_unclosed;     /**< number of unclosed ("splat") files, their
+                                 blocks aren't counted as used */
+    int blocks_used;        /**< blocks used by the BAM, directory and files */
+    int blocks_unallocated; /**< used blocks marked free in the BAM */
+    int blocks_lost;        /**< blocks marked used in the BAM that aren't
+                                 part of any chain */
+    int counts_wrong;       /**< tracks with a wrong free count in the BAM */
+    int sizes_wrong;        /**< files with a wrong block count in the
+                                 directory */
+    int chains_invalid;     /**< chains linking to an invalid block */
+    int chains_looped;      /**< chains linking back to themselves */
+    int chains_cross_linked;/**< chains linking into another chain */
+} d64_validation_t;
+
+
 
 long d64_block_offset(int track, int sector);
 long d64_track_offset(int track);
+int  d64_track_count(const d64_t *d64);
+int  d64_block_count(const d64_t *d64);
 bool d64_track_is_valid(const d64_t *d64, int track);
 void d64_init(d64_t *d64);
 void d64_alloc(d64_t *d64, d64_type_t type);
@@ -343,6 +441,7 @@ bool d64_write(d64_t *d64, const char *path);
 void d64_dump_info(const d64_t *d64);
 void d64_dump_bam(const d64_t *d64);
 
+const uint8_t *d64_block_ptr(const d64_t *d64, int track, int sector);
 bool d64_block_read(const d64_t *d64,
                         uint8_t *buffer,
                         int track, int sector);
@@ -370,6 +469,23 @@ void d64_dir_init(d64_dir_t *dir, d64_t * d64);
 bool d64_dir_read(d64_dir_t *dir);
 void d64_dir_dump(d64_dir_t *dir);
 
+bool            d64_dir_view_init(d64_dir_view_t *view, const d64_t *d64);
+bool            d64_dir_view_next(d64_dir_view_t *view);
+bool            d64_dir_view_find(d64_dir_view_t *view,
+                                  const uint8_t *name,
+                                  size_t len);
+const uint8_t * d64_dir_view_name(const d64_dir_view_t *view);
+uint8_t         d64_dir_view_filetype(const d64_dir_view_t *view);
+uint16_t        d64_dir_view_blocks(const d64_dir_view_t *view);
+void            d64_dir_view_start(const d64_dir_view_t *view,
+                                   int *track, int *sector);
+void            d64_dir_view_dirent(const d64_dir_view_t *view,
+                                    d64_dirent_t *dirent);
+void            d64_dir_block_names(const uint8_t *block,
+                                    char *names,
+                                    size_t stride,
+                                    pet_conv_t mode);
+
 
 bool d64_bament_read(const d64_t *d64, uint8_t *bament, int track);
 
@@ -386,6 +502,16 @@ bool d64_block_iter_next(d64_block_iter_t *iter);
 
 long d64_file_size(d64_t *d64, int track, int sector);
 
+bool d64_block_ptr_iter_init(d64_block_ptr_iter_t *iter,
+                             const d64_t *d64,
+                             int track, int sector);
+bool d64_block_ptr_iter_next(d64_block_ptr_iter_t *iter);
+
+void d64_chain_map_init(d64_chain_map_t *map, const d64_t *d64);
+d64_chain_status_t d64_chain_walk(d64_chain_map_t *map,
+                                  int track, int sector,
+                                  d64_chain_t *chain);
+
 
 /*
  * Write support
@@ -395,6 +521,16 @@ void d64_bam_init(d64_t *d64);
 
 void d64_new(d64_t *d64);
 
+bool d64_block_alloc(d64_t *d64, int interleave, int *track, int *sector);
+void d64_block_free(d64_t *d64, int track, int sector);
+bool d64_validate(const d64_t *d64, d64_validation_t *result);
+bool d64_file_write_prg(d64_t *d64,
+                        const uint8_t *name,
+                        uint8_t filetype,
+                        uint16_t start,
+                        const uint8_t *data,
+                        size_t size);
+
 void d64_set_diskname_asc(d64_t *d64, const char *name);
 void d64_set_diskname_pet(d64_t *d64, const uint8_t *name);
 void d64_set_diskid_asc(d64_t *d64, const char *id);
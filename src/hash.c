@@ -0,0 +1,180 @@
+/** \file   hash.c
+ * \brief   Fast non-cryptographic hash
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * An implementation of the XXH64 algorithm by Yann Collet (seed 0), producing
+ * the same values as the reference implementation, so hashes can be compared
+ * with those of other tools. The input is consumed in 32-byte stripes by four
+ * independent accumulators, which lets the CPU (or the compiler's vectorizer)
+ * work on the lanes in parallel.
+ *
+ * This is meant for finding identical file data, not for security: collisions
+ * can be constructed easily.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+
+#define PRIME64_1   0x9E3779B185EBCA87ULL   /**< XXH64 prime 1 */
+#define PRIME64_2   0xC2B2AE3D27D4EB4FULL   /**< XXH64 prime 2 */
+#define PRIME64_3   0x165667B19E3779F9ULL   /**< XXH64 prime 3 */
+#define PRIME64_4   0x85EBCA77C2B2AE63ULL   /**< XXH64 prime 4 */
+#define PRIME64_5   0x27D4EB2F165667C5ULL   /**< XXH64 prime 5 */
+
+
+/** \brief  Rotate \a x left by \a n bits
+ *
+ * \param[in]   x   value
+ * \param[in]   n   number of bits (1-63)
+ *
+ * \return  rotated value
+ */
+static inline uint64_t rotl64(uint64_t x, unsigned int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+
+/** \brief  Read 64-bit little endian word
+ *
+ * \param[in]   p   data
+ *
+ * \return  word
+ */
+static inline uint64_t read64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8)
+        | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+        | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40)
+        | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+
+/** \brief  Read 32-bit little endian word
+ *
+ * \param[in]   p   data
+ *
+ * \return  word
+ */
+static inline uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+        | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+/** \brief  Mix 64-bit \a input into accumulator \a acc
+ *
+ * \param[in]   acc     accumulator
+ * \param[in]   input   input word
+ *
+ * \return  new accumulator value
+ */
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+
+/** \brief  Merge accumulator \a val into hash \a acc
+ *
+ * \param[in]   acc hash
+ * \param[in]   val accumulator
+ *
+ * \return  new hash value
+ */
+static inline uint64_t hash_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= hash_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+/** \brief  Calculate 64-bit hash of \a data
+ *
+ * \param[in]   data    data
+ * \param[in]   len     length of \a data
+ *
+ * \return  XXH64 of \a data with seed 0
+ */
+uint64_t hash64(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const uint8_t *limit = end - 32;
+        uint64_t v1 = PRIME64_1 + PRIME64_2;
+        uint64_t v2 = PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - PRIME64_1;
+
+        do {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = PRIME64_5;
+    }
+    h += (uint64_t)len;
+
+    /* tail */
+    while (end - p >= 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (uint64_t)*p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    /* avalanche */
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
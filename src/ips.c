@@ -0,0 +1,243 @@
+/** \file   ips.c
+ * \brief   IPS patch files
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Writes and applies patches in the IPS format, which is supported by most
+ * patching tools: the string "PATCH", followed by records of a 24-bit offset,
+ * a 16-bit size and the data to store at that offset (all big endian), ending
+ * with the string "EOF". A record with a size of 0 is an RLE record: a 16-bit
+ * count and a single byte to repeat. A 24-bit size directly following "EOF"
+ * truncates the patched file, an extension some tools use.
+ *
+ * The only changes t64fix makes are to the header and directory, so the
+ * offsets are well within the 16MB an IPS patch can address.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "base.h"
+#include "outbuf.h"
+
+#include "ips.h"
+
+
+/** \brief  Magic string at the start of an IPS patch
+ */
+#define IPS_MAGIC       "PATCH"
+
+/** \brief  Length of \ref IPS_MAGIC
+ */
+#define IPS_MAGIC_LEN   5
+
+/** \brief  Marker at the end of an IPS patch
+ */
+#define IPS_EOF         "EOF"
+
+/** \brief  Length of \ref IPS_EOF
+ */
+#define IPS_EOF_LEN     3
+
+/** \brief  Offset that would be read as \ref IPS_EOF
+ */
+#define IPS_EOF_OFFSET  0x454f46
+
+/** \brief  Maximum size of the data of a record
+ */
+#define IPS_RECORD_MAX  0xffff
+
+
+/** \brief  Read 24-bit big endian value
+ *
+ * \param[in]   p   data containing the value
+ *
+ * \return  value
+ */
+static size_t ips_get_uint24(const uint8_t *p)
+{
+    return ((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2];
+}
+
+
+/** \brief  Read 16-bit big endian value
+ *
+ * \param[in]   p   data containing the value
+ *
+ * \return  value
+ */
+static size_t ips_get_uint16(const uint8_t *p)
+{
+    return ((size_t)p[0] << 8) | p[1];
+}
+
+
+/** \brief  Start IPS patch
+ *
+ * \param[in,out]   out writer
+ */
+void ips_begin(outbuf_t *out)
+{
+    outbuf_write(out, IPS_MAGIC, IPS_MAGIC_LEN);
+}
+
+
+/** \brief  Add record storing \a size bytes of \a data at \a offset
+ *
+ * Runs longer than an IPS record can hold are split over multiple records.
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       offset  offset in the patched file
+ * \param[in]       data    data to store
+ * \param[in]       size    number of bytes in \a data
+ *
+ * \return  false if the data lies beyond the offsets IPS can address
+ * \throw   T64_ERR_PATCH
+ */
+bool ips_record(outbuf_t *out, size_t offset, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        size_t len = size > IPS_RECORD_MAX ? IPS_RECORD_MAX : size;
+        uint8_t header[5];
+
+        if (offset > IPS_OFFSET_MAX || offset == IPS_EOF_OFFSET) {
+            t64_errno = T64_ERR_PATCH;
+            return false;
+        }
+        header[0] = (uint8_t)((offset >> 16) & 0xff);
+        header[1] = (uint8_t)((offset >> 8) & 0xff);
+        header[2] = (uint8_t)(offset & 0xff);
+        header[3] = (uint8_t)((len >> 8) & 0xff);
+        header[4] = (uint8_t)(len & 0xff);
+        outbuf_write(out, header, sizeof header);
+        outbuf_write(out, data, len);
+        offset += len;
+        data += len;
+        size -= len;
+    }
+    return true;
+}
+
+
+/** \brief  End IPS patch
+ *
+ * \param[in,out]   out writer
+ */
+void ips_end(outbuf_t *out)
+{
+    outbuf_write(out, IPS_EOF, IPS_EOF_LEN);
+}
+
+
+/** \brief  Make sure \a data can hold \a end bytes
+ *
+ * Data written past the end by a patch extends the file, a gap is filled with
+ * zeros.
+ *
+ * \param[in,out]   data    data, allocated with base_malloc()
+ * \param[in,out]   size    size of \a data
+ * \param[in]       end     required size
+ */
+static void ips_grow(uint8_t **data, size_t *size, size_t end)
+{
+    if (end > *size) {
+        *data = base_realloc(*data, end);
+        memset(*data + *size, 0, end - *size);
+        *size = end;
+    }
+}
+
+
+/** \brief  Apply IPS patch to \a data
+ *
+ * \param[in]       patch       patch data
+ * \param[in]       patch_size  size of \a patch
+ * \param[in,out]   data        data to patch, allocated with base_malloc(),
+ *                              reallocated if the patch extends it
+ * \param[in,out]   size        size of \a data
+ *
+ * \return  false if \a patch isn't a valid IPS patch, \a data may have been
+ *          partially patched
+ * \throw   T64_ERR_PATCH
+ */
+bool ips_apply(const uint8_t *patch,
+               size_t patch_size,
+               uint8_t **data,
+               size_t *size)
+{
+    size_t pos = IPS_MAGIC_LEN;
+
+    if (patch_size < IPS_MAGIC_LEN
+            || memcmp(patch, IPS_MAGIC, IPS_MAGIC_LEN) != 0) {
+        t64_errno = T64_ERR_PATCH;
+        return false;
+    }
+
+    while (patch_size - pos >= IPS_EOF_LEN) {
+        size_t offset;
+        size_t len;
+
+        if (memcmp(patch + pos, IPS_EOF, IPS_EOF_LEN) == 0) {
+            pos += IPS_EOF_LEN;
+            if (patch_size - pos == 3) {
+                /* truncate extension */
+                len = ips_get_uint24(patch + pos);
+                if (len < *size) {
+                    *size = len;
+                }
+                pos += 3;
+            }
+            if (pos != patch_size) {
+                break;
+            }
+            return true;
+        }
+
+        if (patch_size - pos < 5) {
+            break;
+        }
+        offset = ips_get_uint24(patch + pos);
+        len = ips_get_uint16(patch + pos + 3);
+        pos += 5;
+        if (len > 0) {
+            if (patch_size - pos < len) {
+                break;
+            }
+            ips_grow(data, size, offset + len);
+            memcpy(*data + offset, patch + pos, len);
+            pos += len;
+        } else {
+            /* RLE record: count and value */
+            if (patch_size - pos < 3) {
+                break;
+            }
+            len = ips_get_uint16(patch + pos);
+            ips_grow(data, size, offset + len);
+            memset(*data + offset, patch[pos + 2], len);
+            pos += 3;
+        }
+    }
+    t64_errno = T64_ERR_PATCH;
+    return false;
+}
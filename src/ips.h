@@ -0,0 +1,51 @@
+/** \file   ips.h
+ * \brief   IPS patch files - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_IPS_H
+#define HAVE_IPS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "outbuf.h"
+
+
+/** \brief  Maximum offset of a byte that can be patched
+ *
+ * Offsets are stored as 24-bit big endian values.
+ */
+#define IPS_OFFSET_MAX  0xffffff
+
+
+void ips_begin(outbuf_t *out);
+bool ips_record(outbuf_t *out, size_t offset, const uint8_t *data, size_t size);
+void ips_end(outbuf_t *out);
+bool ips_apply(const uint8_t *patch,
+               size_t patch_size,
+               uint8_t **data,
+               size_t *size);
+
+#endif
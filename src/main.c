@@ -30,10 +30,24 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <pthread.h>
 
+#include "aio.h"
+#include "arena.h"
+#include "archive.h"
 #include "base.h"
+#include "cache.h"
+#include "catalog.h"
+#include "ips.h"
 #include "optparse.h"
+#include "outbuf.h"
+#include "pool.h"
 #include "prg.h"
+#include "report.h"
+#include "scan.h"
+#include "server.h"
+#include "stats.h"
 #include "t64types.h"
 #include "t64.h"
 
@@ -58,10 +72,189 @@ static long extract = -1;
  */
 static bool extract_all = 0;
 
+/** \brief  Path of IPS patch to write with the fixes
+ */
+static const char *patch_path = NULL;
+
+/** \brief  Path of IPS patch to apply to the image
+ */
+static const char *apply_path = NULL;
+
+/** \brief  Archive format for `--extract-all` with `--output`
+ */
+static const char *archive_name = NULL;
+
 /** \brief  T64 archive to create
  */
 static const char *create_file = NULL;
 
+/** \brief  Batch mode flag
+ *
+ * Verify all non-option arguments instead of just the first one.
+ */
+static bool batch = 0;
+
+/** \brief  File containing a list of images to verify in batch mode
+ */
+static const char *batch_list = NULL;
+
+/** \brief  Recursive mode flag
+ *
+ * Verify all .t64 images in the directories given as non-option arguments and
+ * their subdirectories. Implies batch mode.
+ */
+static bool recursive = 0;
+
+/** \brief  Path of the socket to serve requests on in daemon mode
+ */
+static const char *daemon_socket = NULL;
+
+/** \brief  Fix image(s) in place
+ */
+static bool in_place = 0;
+
+/** \brief  Durability policy for `--in-place` ("none", "fsync" or "atomic")
+ */
+static const char *sync_mode = NULL;
+
+/** \brief  Number of worker threads to use
+ *
+ * Use 0 to get a worker per processor.
+ */
+static long jobs = 0;
+
+/** \brief  Number of image reads to keep in flight in batch mode
+ *
+ * Use 0 to read images synchronously on the workers.
+ */
+static long io_depth = AIO_DEPTH_DEFAULT;
+
+/** \brief  Maximum size of decompressed images in MiB
+ *
+ * Use 0 for the default: 4096 (the largest possible T64 image), or
+ * SERVER_INFLATE_MAX in daemon mode.
+ */
+static long inflate_limit = 0;
+
+/** \brief  Report format name for `--format` ("text", "ndjson" or "csv")
+ */
+static const char *format_name = NULL;
+
+/** \brief  Report format
+ */
+static report_format_t report_format = REPORT_TEXT;
+
+/** \brief  Generate machine-readable reports on stdout
+ *
+ * Set when a format other than "text" was requested without `--quiet`, the
+ * human-readable output is suppressed in that case.
+ */
+static bool report = 0;
+
+/** \brief  Path to verification cache file for batch mode
+ */
+static const char *cache_path = NULL;
+
+/** \brief  Only check if images are OK, see t64_check()
+ */
+static bool check = 0;
+
+/** \brief  Rewrite the image without unused records and padding
+ *
+ * Used with `--output` or `--in-place`, see t64_write_compact().
+ */
+static bool compact = 0;
+
+/** \brief  Report files stored more than once in batch mode
+ *
+ * Reads the complete images to hash the data of their files.
+ */
+static bool dupes = 0;
+
+/** \brief  Path of catalog file to write in batch mode
+ */
+static const char *index_path = NULL;
+
+/** \brief  Path of catalog file to search
+ */
+static const char *query_path = NULL;
+
+/** \brief  Convert image to a D64 image
+ */
+static const char *d64_file = NULL;
+
+/** \brief  Print timing and counters on stderr
+ */
+static bool stats = 0;
+
+
+/** \brief  Number of jobs to submit to the pool before reporting results
+ *
+ * Results are reported in the order the images were given, so the batch is
+ * processed in chunks to keep memory usage bounded.
+ */
+#define BATCH_CHUNK_SIZE    4096
+
+
+/** \brief  Batch input: an image file or a T64 member of a zip archive
+ */
+typedef struct batch_input_s {
+    const char *    path;       /**< path to image, "<archive>:<member name>"
+                                     for zip members (allocated) */
+    const char *    archive;    /**< path to zip archive or `NULL` */
+    int             member;     /**< index of member in \a archive */
+} batch_input_t;
+
+
+/** \brief  File of an image verified in batch mode with `--dupes`
+ */
+typedef struct batch_file_s {
+    uint64_t        hash;       /**< hash64() of the file data */
+    size_t          size;       /**< size of the file data */
+    size_t          seq;        /**< order in which the file was reported */
+    report_copy_t   copy;       /**< image, index and name of the file */
+} batch_file_t;
+
+
+/** \brief  Batch verify job
+ *
+ * Contains everything a worker needs to verify an image and report back, so
+ * workers don't have to touch any of the static state in this file.
+ */
+typedef struct batch_job_s {
+    const char *    path;       /**< path to image */
+    const char *    archive;    /**< path to zip archive or `NULL` */
+    int             member;     /**< index of member in \a archive */
+    bool            quiet;      /**< don't output anything (per-job copy) */
+    bool            check;      /**< only check the image, \a fixes is 1 if
+                                     it isn't OK */
+    bool            in_place;   /**< write fixes back into the image */
+    t64_sync_t      sync;       /**< durability policy for \a in_place */
+    int             fixes;      /**< number of fixes required, -1 on error */
+    int             error;      /**< `t64_errno` on error */
+    int             sys_errno;  /**< C library `errno` on I/O error */
+    report_format_t format;     /**< report format */
+    outbuf_t        report;     /**< report of the image (memory writer) */
+    const cache_t * cache;      /**< verification cache (optional) */
+    bool            cached;     /**< result was taken from \a cache */
+    bool            have_stat;  /**< \a size and \a mtime are valid */
+    size_t          size;       /**< size of image before verifying */
+    int64_t         mtime;      /**< modification time before verifying */
+    arena_t * const *arenas;    /**< arena per worker, reset after each job */
+    bool            prefetched; /**< \a head holds the start of the image */
+    const uint8_t * head;       /**< start of the image, read asynchronously */
+    size_t          head_len;   /**< number of bytes in \a head */
+    size_t          head_size;  /**< size of the image file */
+    bool            dupes;      /**< read all data to hash the files */
+    bool            patching;   /**< write an IPS patch of the fixes */
+    outbuf_t        patch;      /**< IPS patch of the fixes (memory writer) */
+    bool            keep;       /**< keep a copy of the records of the image
+                                     (`--dupes` and `--index`) */
+    t64_record_t *  records;    /**< copy of the verified records */
+    int             nrecords;   /**< number of elements in \a records */
+    uint8_t         tapename[T64_HDR_NAME_LEN]; /**< tape name of the image */
+} batch_job_t;
+
 
 /** \brief  Command line options
  */
@@ -71,11 +264,53 @@ static const option_decl_t options[] = {
     { 'e', "extract", &extract, OPT_INT,
         "extract program file" },
     { 'o', "output", &outfile, OPT_STR,
-        "write fixed file to <outfile>" },
+        "write fixed file (or tar archive with -x) to <outfile>, - for stdout" },
     { 'x', "extract-all", &extract_all, OPT_BOOL,
         "extract all program files" },
+    { 0, "patch", &patch_path, OPT_STR,
+        "write fixes as IPS patch <file> (one stream in batch mode), - for stdout" },
+    { 0, "apply", &apply_path, OPT_STR,
+        "apply IPS patch <file> to the image, writing the result to -o" },
+    { 0, "archive", &archive_name, OPT_STR,
+        "archive format for -x with -o: tar (default) or cpio" },
     { 'c', "create", &create_file, OPT_STR,
         "create T64 image from a list of PRG files" },
+    { 0, "to-d64", &d64_file, OPT_STR,
+        "convert image to D64 image <file>, - for stdout" },
+    { 'b', "batch", &batch, OPT_BOOL,
+        "verify all images given on the command line" },
+    { 'l', "list", &batch_list, OPT_STR,
+        "verify all images listed in <file>, one per line" },
+    { 'r', "recursive", &recursive, OPT_BOOL,
+        "verify all .t64 images in the given directories and below" },
+    { 0, "check", &check, OPT_BOOL,
+        "only check if image(s) are OK, stopping at the first defect" },
+    { 'i', "in-place", &in_place, OPT_BOOL,
+        "fix image(s) in place, only writing changed header/directory data" },
+    { 0, "compact", &compact, OPT_BOOL,
+        "with -o or -i: drop unused records and padding, store data contiguously" },
+    { 0, "sync", &sync_mode, OPT_STR,
+        "durability of --in-place fixes: none, fsync or atomic" },
+    { 'j', "jobs", &jobs, OPT_INT,
+        "number of worker threads (default: one per processor)" },
+    { 0, "io-depth", &io_depth, OPT_INT,
+        "number of batch image reads kept in flight (default: 64, 0: off)" },
+    { 0, "format", &format_name, OPT_STR,
+        "report format: text (default), ndjson or csv" },
+    { 0, "cache", &cache_path, OPT_STR,
+        "keep batch results in <file>, skipping unchanged images" },
+    { 0, "dupes", &dupes, OPT_BOOL,
+        "report files stored more than once in batch mode" },
+    { 0, "index", &index_path, OPT_STR,
+        "write a searchable catalog of the batch images to <file>" },
+    { 0, "query", &query_path, OPT_STR,
+        "list records in catalog <file> matching all arguments (key=value)" },
+    { 0, "daemon", &daemon_socket, OPT_STR,
+        "serve verify/fix/list/extract requests on Unix socket <path>" },
+    { 0, "inflate-limit", &inflate_limit, OPT_INT,
+        "maximum size of decompressed images in MiB (default: 4096, daemon: 64)" },
+    { 0, "stats", &stats, OPT_BOOL,
+        "print timing of the phases and counters on stderr" },
 
     { 0, NULL, NULL, 0, NULL }
 };
@@ -92,12 +327,28 @@ static void help_prologue(void)
     printf("    t64fix demos.t64\n");
     printf("  Fix t64 file and save as new file:\n");
     printf("    t64fix demos.t64 -o demos-fixed.t64\n");
+    printf("  Fix t64 file in place:\n");
+    printf("    t64fix -i demos.t64\n");
     printf("  Extract all files as .PRG files:\n");
     printf("    t64fix -x demos.t64\n");
+    printf("  Extract all files into a tar archive on stdout:\n");
+    printf("    t64fix -x demos.t64 -o - | tar -t\n");
+    printf("  Extract all files into a cpio archive:\n");
+    printf("    t64fix -x demos.t64 --archive cpio -o demos.cpio\n");
     printf("  Extract a single .PRG file at index 2:\n");
     printf("    t64fix -e 2 demos.t64\n");
+    printf("  Fix t64 file in a pipeline:\n");
+    printf("    curl -s $URL | t64fix - -o - > demos-fixed.t64\n");
     printf("  Create t64 file:\n");
     printf("    t64fix -c awesome.t64 rasterblast.prg freezer.prg\n");
+    printf("  Verify many t64 files using four threads:\n");
+    printf("    t64fix -b -j 4 *.t64\n");
+    printf("  Verify all t64 files in a directory tree:\n");
+    printf("    t64fix -r ~/c64/tapes\n");
+    printf("  Serve requests on a socket until interrupted:\n");
+    printf("    t64fix --daemon /run/t64fix.sock\n");
+    printf("  Report on many t64 files as newline-delimited JSON:\n");
+    printf("    t64fix -b --format=ndjson *.t64\n");
 }
 
 
@@ -112,7 +363,7 @@ static void print_error(void)
     if (t64_errno == T64_ERR_IO) {
         fprintf(stderr, " (%d: %s)\n", errno, strerror(errno));
     } else {
-        putchar('\n');
+        fputc('\n', stderr);
     }
 }
 
@@ -121,21 +372,58 @@ static void print_error(void)
  *
  * Open a t64 image and print an error message on stderr on failure.
  *
- * \param[in]   path    path to t64 file
+ * \param[in]   path        path to t64 file
+ * \param[in]   dir_only    only read header and directory
  *
  * \return  t64 image or `NULL` on failure
  */
-static t64_image_t *open_image_wrapper(const char *path)
+static t64_image_t *open_image_wrapper(const char *path, bool dir_only)
 {
-    t64_image_t *image = t64_open(path, quiet);
+    t64_image_t *image;
+
+    if (dir_only) {
+        image = t64_open_dir(path, quiet);
+    } else {
+        image = t64_open(path, quiet);
+    }
 
     if (image == NULL) {
+        int saved_errno = errno;
+
         print_error();
+        /* keep errno intact for report_single() */
+        errno = saved_errno;
     }
     return image;
 }
 
 
+/** \brief  Write report of a single image on stdout
+ *
+ * \param[in]   path    path to t64 file
+ * \param[in]   image   verified image or `NULL` to report the current error
+ * \param[in]   fixed   fixes were written back into the image
+ */
+static void report_single(const char *path,
+                          const t64_image_t *image,
+                          bool fixed)
+{
+    outbuf_t out;
+
+    outbuf_init(&out, stdout);
+    report_begin(&out, report_format);
+    if (image != NULL) {
+        report_image(&out, report_format, path, image, fixed);
+    } else {
+        report_error(&out, report_format, path, t64_errno, errno);
+    }
+    if (!outbuf_flush(&out)) {
+        print_error();
+    }
+    outbuf_free(&out);
+}
+
+
 /** \brief  Create t64 file and write .PRG file(s) to it
  *
  * \param[in]   args    list of .PRG files
@@ -154,7 +442,7 @@ static bool cmd_create(const char **args, int nargs)
         return false;
     }
 
-    image = t64_create(create_file, args, nargs, quiet);
+    image = t64_create(create_file, args, nargs, (int)jobs, quiet);
     if (image != NULL) {
         if (!t64_write(image, create_file)) {
             fprintf(stderr,
@@ -175,31 +463,96 @@ static bool cmd_create(const char **args, int nargs)
 }
 
 
+/** \brief  Write the fixes of \a image as IPS patch \a path
+ *
+ * \param[in]   image   verified image
+ * \param[in]   path    path of the patch, "-" for stdout
+ *
+ * \return  bool
+ */
+static bool write_patch(const t64_image_t *image, const char *path)
+{
+    outbuf_t out;
+    bool result;
+
+    outbuf_init(&out, NULL);
+    result = t64_write_patch(image, &out) >= 0
+        && fwrite_wrapper(path, (const uint8_t *)out.data, out.used);
+    outbuf_free(&out);
+    return result;
+}
+
+
+/** \brief  Write compacted \a image to \a dest
+ *
+ * \param[in]   image   verified image
+ * \param[in]   dest    path of the compacted image, "-" for stdout
+ *
+ * \return  bool
+ */
+static bool write_compact(const t64_image_t *image, const char *dest)
+{
+    long size = t64_write_compact(image, dest);
+
+    if (size < 0) {
+        return false;
+    }
+    if (!quiet) {
+        printf("t64fix: compacted image from %zu to %ld bytes\n",
+               image->size, size);
+    }
+    return true;
+}
+
+
 /** \brief  Verify t64 file, optionally write fixed file
  *
  * Verify t64 file and write fixed file to host when `--outfile` was used.
  *
  * \param[in]   path    path to t64 file
  *
- * \return  true if image OK, false if not OK or when an I/O error occurred
+ * \return  true if image OK, false if not OK or when an I/O error occurred;
+ *          with `--outfile` true if the fixed image was written
  */
 static bool cmd_verify(const char *path)
 {
     t64_image_t *image;
     bool status = false;
+    bool dir_only;
 
-    /* open image */
-    image = open_image_wrapper(path);
+    /* t64_write() copies the image file and only writes the header and
+     * directory, the data is only needed for the hashes in reports, for a
+     * fixed image on stdout or over the image itself and for compacting */
+    dir_only = !report
+        && (outfile == NULL
+            || (!compact && !base_is_stdio(path) && !base_is_stdio(outfile)
+                && !base_same_file(path, outfile)));
+    image = open_image_wrapper(path, dir_only);
     if (image != NULL) {
         /* verify image */
-        status = t64_verify(image, quiet);
+        status = t64_verify(image, quiet) == 0;
         if (!quiet) {
             t64_dump(image);
         }
+        if (report) {
+            report_single(path, image, false);
+        }
+        if (outfile != NULL) {
+            /* fixing succeeded if the fixed image is written, like `-i` */
+            status = true;
+        }
 
+        /* write patch before the fixes are applied to the image data */
+        if (patch_path != NULL && !write_patch(image, patch_path)) {
+            status = false;
+            if (!quiet) {
+                print_error();
+            }
+        }
         /* write image to host? */
         if (outfile != NULL) {
-            if (!t64_write(image, outfile)) {
+            if (compact ? !write_compact(image, outfile)
+                        : !t64_write(image, outfile)) {
                 status = false;
                 if (!quiet) {
                     print_error();
@@ -207,6 +560,198 @@ static bool cmd_verify(const char *path)
             }
         }
         t64_free(image);
+    } else if (report) {
+        report_single(path, NULL, false);
+    }
+    return status;
+}
+
+
+/** \brief  Check if t64 file is OK
+ *
+ * Only reads the header and directory and stops at the first defect, without
+ * printing the details.
+ *
+ * \param[in]   path    path to t64 file
+ *
+ * \return  true if image OK
+ */
+static bool cmd_check(const char *path)
+{
+    t64_image_t *image;
+    bool status;
+
+    image = t64_open_dir(path, true);
+    if (image == NULL) {
+        if (!quiet) {
+            print_error();
+        }
+        return false;
+    }
+    status = t64_check(image);
+    if (!quiet) {
+        printf("%s: %s\n", path, status ? "OK" : "faulty");
+    }
+    t64_free(image);
+    return status;
+}
+
+
+/** \brief  Apply IPS patch `--apply` to the image at \a path
+ *
+ * The patched image is written to `--output`, the image itself isn't changed.
+ *
+ * \param[in]   path    path to image, "-" for stdin
+ *
+ * \return  bool
+ */
+static bool cmd_apply(const char *path)
+{
+    uint8_t *data;
+    uint8_t *patch;
+    long size;
+    long patch_size;
+    size_t new_size;
+    bool status;
+
+    if (outfile == NULL) {
+        fprintf(stderr,
+                "t64fix: error: `--apply` requires `--output`.\n");
+        return false;
+    }
+    size = fread_alloc(&data, path);
+    if (size < 0) {
+        print_error();
+        return false;
+    }
+    patch_size = fread_alloc(&patch, apply_path);
+    if (patch_size < 0) {
+        print_error();
+        base_free(data);
+        return false;
+    }
+
+    new_size = (size_t)size;
+    status = ips_apply(patch, (size_t)patch_size, &data, &new_size)
+        && fwrite_wrapper(outfile, data, new_size);
+    if (!status) {
+        print_error();
+    } else if (!quiet) {
+        printf("t64fix: wrote patched image '%s'\n", outfile);
+    }
+    base_free(patch);
+    base_free(data);
+    return status;
+}
+
+
+/** \brief  Get durability policy from `--sync` argument
+ *
+ * \param[out]  sync    durability policy
+ *
+ * \return  false if the `--sync` argument is invalid
+ */
+static bool get_sync_mode(t64_sync_t *sync)
+{
+    if (sync_mode == NULL || strcmp(sync_mode, "none") == 0) {
+        *sync = T64_SYNC_NONE;
+    } else if (strcmp(sync_mode, "fsync") == 0) {
+        *sync = T64_SYNC_FSYNC;
+    } else if (strcmp(sync_mode, "atomic") == 0) {
+        *sync = T64_SYNC_ATOMIC;
+    } else {
+        fprintf(stderr,
+                "t64fix: error: invalid argument '%s' for `--sync`, expected "
+                "'none', 'fsync' or 'atomic'.\n", sync_mode);
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief  Get archive format from `--archive` argument
+ *
+ * \param[out]  format  archive format
+ *
+ * \return  false if the `--archive` argument is invalid
+ */
+static bool get_archive_format(prg_archive_t *format)
+{
+    if (archive_name == NULL || strcmp(archive_name, "tar") == 0) {
+        *format = PRG_ARCHIVE_TAR;
+    } else if (strcmp(archive_name, "cpio") == 0) {
+        *format = PRG_ARCHIVE_CPIO;
+    } else {
+        fprintf(stderr,
+                "t64fix: error: invalid argument '%s' for `--archive`, "
+                "expected 'tar' or 'cpio'.\n", archive_name);
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief  Verify t64 file and write fixes back into the file
+ *
+ * \param[in]   path    path to t64 file
+ * \param[in]   sync    durability policy
+ *
+ * \return  true if the image was OK or succesfully fixed
+ */
+static bool cmd_fix_in_place(const char *path, t64_sync_t sync)
+{
+    t64_image_t *image;
+    bool status = false;
+    long written;
+
+    if (base_is_stdio(path)) {
+        fprintf(stderr, "t64fix: error: cannot fix stdin in place.\n");
+        return false;
+    }
+
+    /* compacting copies the data out of the image */
+    image = open_image_wrapper(path, !compact);
+    if (image != NULL) {
+        t64_verify(image, quiet);
+        if (!quiet) {
+            t64_dump(image);
+        }
+        if (compact) {
+            status = write_compact(image, path);
+            if (!status) {
+                print_error();
+            }
+            if (report) {
+                report_single(path, status ? image : NULL, image->fixes > 0);
+            }
+            t64_free(image);
+            return status;
+        }
+        if (patch_path != NULL && !write_patch(image, patch_path)) {
+            /* don't touch the image without the patch to undo it */
+            print_error();
+            t64_free(image);
+            return false;
+        }
+        written = t64_write_in_place(image, sync);
+        if (written < 0) {
+            print_error();
+            if (report) {
+                report_single(path, NULL, false);
+            }
+        } else {
+            if (report) {
+                report_single(path, image, written > 0);
+            }
+            if (!quiet && written > 0) {
+                printf("t64fix: wrote %ld bytes of fixes to '%s'\n",
+                       written, path);
+            }
+            status = true;
+        }
+        t64_free(image);
+    } else if (report) {
+        report_single(path, NULL, false);
     }
     return status;
 }
@@ -224,12 +769,12 @@ static bool cmd_extract_indexed(const char *path)
     bool status = false;
 
     /* attempt to extract file from image */
-    image = open_image_wrapper(path);
+    image = open_image_wrapper(path, false);
     if (image != NULL) {
         /* fix the image quietly so `real_end_addr` is properly set */
         t64_verify(image, true);
 
-        status = prg_extract(image, (int)extract, quiet);
+        status = prg_extract(image, (int)extract, outfile, quiet);
         if (!status) {
             print_error();
         }
@@ -248,42 +793,1311 @@ static bool cmd_extract_indexed(const char *path)
 static bool cmd_extract_all(const char *path)
 {
     t64_image_t *image;
+    prg_archive_t format;
     bool status = false;
 
-    image = open_image_wrapper(path);
+    if (!get_archive_format(&format)) {
+        return false;
+    }
+    image = open_image_wrapper(path, false);
     if (image != NULL) {
         /* fix the image quietly so `real_end_addr` is properly set */
         t64_verify(image, true);
 
-        status = prg_extract_all(image, quiet);
+        if (outfile != NULL) {
+            status = prg_extract_archive(image, outfile, format, quiet);
+            if (!status) {
+                print_error();
+            }
+        } else {
+            status = prg_extract_all(image, (int)jobs, quiet);
+        }
         t64_free(image);
     }
     return status;
 }
 
 
+/** \brief  Convert image at \a path to a D64 image
+ *
+ * \param[in]   path    path to t64 image
+ *
+ * \return  bool
+ */
+static bool cmd_to_d64(const char *path)
+{
+    t64_image_t *image;
+    bool status = false;
+
+    image = open_image_wrapper(path, false);
+    if (image != NULL) {
+        /* fix the image quietly so `real_end_addr` is properly set */
+        t64_verify(image, true);
+
+        status = prg_extract_d64(image, d64_file, quiet);
+        if (!status) {
+            print_error();
+        }
+        t64_free(image);
+    }
+    return status;
+}
 
-/** \brief  Program driver
+
+/** \brief  Read list of image paths from file \a path
  *
- * \param[in]   argc    argument count
- * \param[in]   argv    argument vector
+ * Reads \a path and splits it into lines, skipping empty lines. The strings in
+ * the list point into \a *buffer, which needs to be freed after use, as does
+ * the list itself.
  *
- * \return  EXIT_SUCCESS or EXIT_FAILURE
+ * \param[in]   path    path to file with image paths, one per line
+ * \param[out]  buffer  file contents
+ * \param[out]  count   number of paths in the list
+ *
+ * \return  list of paths or `NULL` on error
  */
-int main(int argc, char *argv[])
+static const char **read_batch_list(const char *path,
+                                    char **buffer,
+                                    size_t *count)
 {
-    const char **args;
-    int result;     /* optparse result */
-    bool status;    /* command status */
+    const char **list;
+    uint8_t *data;
+    char *text;
+    size_t size;
+    size_t used = 0;
+    size_t i;
+    long len;
 
-    optparse_init(options, "t64fix", VERSION);
-    optparse_set_prologue(help_prologue);
+    *buffer = NULL;
+    *count = 0;
 
-    if (argc < 2) {
-        /* display help and exit */
-        optparse_help();
-        optparse_exit();
-        return EXIT_FAILURE;
+    len = fread_alloc(&data, path);
+    if (len < 0) {
+        return NULL;
+    }
+    /* add terminating nul */
+    text = base_realloc(data, (size_t)len + 1);
+    text[len] = '\0';
+
+    size = 64;
+    list = base_malloc(sizeof *list * size);
+
+    i = 0;
+    while (i < (size_t)len) {
+        char *line = text + i;
+
+        /* find end of line and terminate it */
+        while (i < (size_t)len && text[i] != '\n') {
+            i++;
+        }
+        text[i] = '\0';
+        if (text + i > line && text[i - 1] == '\r') {
+            text[i - 1] = '\0';
+        }
+        i++;
+
+        if (*line != '\0') {
+            if (used == size) {
+                size *= 2;
+                list = base_realloc(list, sizeof *list * size);
+            }
+            list[used++] = line;
+        }
+    }
+
+    *buffer = text;
+    *count = used;
+    return list;
+}
+
+
+/** \brief  Check if \a path has a ".zip" extension, ignoring case
+ *
+ * \param[in]   path    path
+ *
+ * \return  bool
+ */
+static bool is_zip_path(const char *path)
+{
+    size_t len = strlen(path);
+
+    return len > 4 && path[len - 4] == '.'
+        && tolower((unsigned char)path[len - 3]) == 'z'
+        && tolower((unsigned char)path[len - 2]) == 'i'
+        && tolower((unsigned char)path[len - 1]) == 'p';
+}
+
+
+/** \brief  Create batch inputs for \a paths, expanding zip archives
+ *
+ * Zip archives (recognized by their extension) are replaced with their T64
+ * members, found in one pass over the central directory of the archive.
+ * Archives that can't be read or don't contain any T64 images are kept as-is,
+ * opening them will report the error.
+ *
+ * \param[in]       paths   paths of images
+ * \param[in,out]   count   number of paths, set to number of inputs
+ *
+ * \return  inputs, free with batch_inputs_free()
+ */
+static batch_input_t *batch_inputs_new(const char **paths, size_t *count)
+{
+    batch_input_t *inputs;
+    size_t size = *count;
+    size_t used = 0;
+    size_t i;
+
+    inputs = base_malloc(sizeof *inputs * size);
+    for (i = 0; i < *count; i++) {
+        const char *path = paths[i];
+        archive_zip_iter_t iter;
+        uint8_t *data;
+        size_t len;
+        size_t before = used;
+
+        if (is_zip_path(path)
+                && (data = base_map_file(path, &len)) != NULL) {
+            if (archive_zip_iter_init(&iter, data, len)) {
+                while (archive_zip_iter_next(&iter)) {
+                    size_t plen = strlen(path);
+                    char *name;
+
+                    if (!archive_zip_iter_is_t64(&iter)) {
+                        continue;
+                    }
+                    if (used == size) {
+                        size *= 2;
+                        inputs = base_realloc(inputs, sizeof *inputs * size);
+                    }
+                    name = base_malloc(plen + 1 + iter.name_len + 1);
+                    memcpy(name, path, plen);
+                    name[plen] = ':';
+                    memcpy(name + plen + 1, iter.name, iter.name_len);
+                    name[plen + 1 + iter.name_len] = '\0';
+                    inputs[used].path = name;
+                    inputs[used].archive = path;
+                    inputs[used].member = iter.index;
+                    used++;
+                }
+                if (!iter.valid) {
+                    /* report the archive itself as broken */
+                    while (used > before) {
+                        base_free((void *)(uintptr_t)inputs[--used].path);
+                    }
+                }
+            }
+            base_unmap_file(data, len);
+            if (used > before) {
+                continue;
+            }
+        }
+        if (used == size) {
+            size *= 2;
+            inputs = base_realloc(inputs, sizeof *inputs * size);
+        }
+        inputs[used].path = path;
+        inputs[used].archive = NULL;
+        inputs[used].member = -1;
+        used++;
+    }
+    *count = used;
+    return inputs;
+}
+
+
+/** \brief  Free batch inputs created with batch_inputs_new()
+ *
+ * \param[in,out]   inputs  batch inputs
+ * \param[in]       count   number of inputs
+ */
+static void batch_inputs_free(batch_input_t *inputs, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (inputs[i].archive != NULL) {
+            base_free((void *)(uintptr_t)inputs[i].path);
+        }
+    }
+    base_free(inputs);
+}
+
+
+/** \brief  Keep a copy of the tape name and records of \a image in \a job
+ *
+ * The image itself lives in the arena of the worker, which is reset as soon
+ * as the job is done.
+ *
+ * \param[in,out]   job     batch job
+ * \param[in]       image   verified image
+ */
+static void batch_job_keep(batch_job_t *job, const t64_image_t *image)
+{
+    job->nrecords = image->rec_used;
+    job->records = base_malloc(sizeof *(job->records)
+                               * ((size_t)job->nrecords + 1));
+    memcpy(job->records, image->records,
+           sizeof *(job->records) * (size_t)job->nrecords);
+    memcpy(job->tapename, image->tapename, T64_HDR_NAME_LEN);
+}
+
+
+/** \brief  Verify a single image in batch mode
+ *
+ * Worker function for the thread pool: only touches the job object and the
+ * arena of the worker, which is reset when done.
+ *
+ * \param[in,out]   arg     batch job
+ * \param[in]       worker  worker index
+ */
+static void batch_verify_job(void *arg, int worker)
+{
+    batch_job_t *job = arg;
+    arena_t *arena = job->arenas[worker];
+    t64_image_t *image;
+
+    t64_errno = T64_ERR_NONE;
+    errno = 0;
+
+    if (job->cache != NULL && job->archive == NULL) {
+        /* stat before opening: a change after this will be caught next run */
+        job->have_stat = base_file_stat(job->path, &(job->size),
+                                        &(job->mtime));
+        if (job->have_stat && !job->keep
+                && cache_lookup(job->cache, job->path, job->size, job->mtime,
+                                &(job->fixes))
+                && !((job->in_place || job->patching) && job->fixes > 0)) {
+            job->cached = true;
+            if (job->format != REPORT_TEXT) {
+                report_cached(&job->report, job->format, job->path,
+                              job->fixes);
+            }
+            return;
+        }
+        t64_errno = T64_ERR_NONE;
+        errno = 0;
+    }
+
+    if (job->archive != NULL) {
+        image = t64_open_member_arena(job->archive, job->member, job->quiet,
+                                      arena);
+    } else if (job->dupes || job->format != REPORT_TEXT) {
+        /* the data is needed for the hashes */
+        image = t64_open_member_arena(job->path, -1, job->quiet, arena);
+    } else if (job->prefetched) {
+        image = t64_open_dir_head(job->path, job->head, job->head_len,
+                                  job->head_size, job->quiet, arena);
+    } else {
+        image = t64_open_dir_arena(job->path, job->quiet, arena);
+    }
+    if (image == NULL) {
+        job->fixes = -1;
+        job->error = t64_errno;
+        job->sys_errno = errno;
+    } else if (job->check) {
+        job->fixes = t64_check(image) ? 0 : 1;
+    } else {
+        job->fixes = t64_verify(image, job->quiet);
+        if (job->keep) {
+            batch_job_keep(job, image);
+        }
+        /* before fixing in place, which updates the data of the image */
+        if (job->patching && job->fixes > 0
+                && t64_write_patch(image, &job->patch) < 0) {
+            job->fixes = -1;
+            job->error = t64_errno;
+            job->sys_errno = 0;
+        } else if (job->in_place
+                && t64_write_in_place(image, job->sync) < 0) {
+            job->fixes = -1;
+            job->error = t64_errno;
+            job->sys_errno = errno;
+        }
+    }
+
+    if (job->format != REPORT_TEXT) {
+        if (job->fixes < 0) {
+            report_error(&job->report, job->format, job->path, job->error,
+                         job->sys_errno);
+        } else {
+            report_image(&job->report, job->format, job->path, image,
+                         job->in_place && job->fixes > 0);
+        }
+    }
+    if (image != NULL) {
+        t64_free(image);
+    }
+    arena_reset(arena);
+}
+
+
+/** \brief  Print result of batch \a job on stdout
+ *
+ * \param[in]   job batch job
+ */
+static void batch_print_result(const batch_job_t *job)
+{
+    if (job->fixes < 0) {
+        if (job->error == T64_ERR_IO) {
+            printf("%s: error: %s (%s)\n",
+                   job->path, t64_strerror(job->error),
+                   strerror(job->sys_errno));
+        } else {
+            printf("%s: error: %s\n", job->path, t64_strerror(job->error));
+        }
+    } else if (job->fixes > 0 && job->check) {
+        printf("%s: faulty\n", job->path);
+    } else if (job->fixes > 0) {
+        printf("%s: %s (%d fixes)\n", job->path,
+               job->in_place ? "fixed" : "faulty", job->fixes);
+    } else {
+        printf("%s: OK\n", job->path);
+    }
+}
+
+
+/** \brief  Batch state: result counters and report writer
+ */
+typedef struct batch_state_s {
+    outbuf_t    out;        /**< writer for stdout (`--format` only) */
+    cache_t *   cache;      /**< verification cache (optional) */
+    size_t      count;      /**< number of images reported */
+    size_t      cached;     /**< number of results taken from \a cache */
+    size_t      ok;         /**< number of OK images */
+    size_t      faulty;     /**< number of faulty (or fixed) images */
+    size_t      failed;     /**< number of errors */
+    arena_t **  arenas;     /**< arena per worker of the pool */
+    int         workers;    /**< number of elements in \a arenas */
+    aio_t *     aio;        /**< context for reading ahead (optional) */
+    batch_file_t *files;    /**< hashed files of all images (`--dupes`) */
+    size_t      files_used; /**< number of elements in \a files */
+    size_t      files_size; /**< number of slots in \a files */
+    char **     paths;      /**< copies of the paths in \a files */
+    size_t      paths_used; /**< number of elements in \a paths */
+    size_t      paths_size; /**< number of slots in \a paths */
+    catalog_builder_t *catalog; /**< catalog for `--index` (optional) */
+    FILE *      patch_fp;   /**< patch stream for `--patch` (optional) */
+    outbuf_t    patch;      /**< writer for \a patch_fp */
+} batch_state_t;
+
+
+/** \brief  Result of an image found by a recursive scan
+ *
+ * Only what's needed to report the image in text form and update the cache,
+ * so memory usage per image stays small on large trees.
+ */
+typedef struct batch_result_s {
+    char *          path;       /**< path to image */
+    const struct batch_scan_s *scan;    /**< scan the image was found by */
+    int             fixes;      /**< number of fixes required, -1 on error */
+    int             error;      /**< `t64_errno` on error */
+    int             sys_errno;  /**< C library `errno` on I/O error */
+    bool            cached;     /**< result was taken from the cache */
+    bool            have_stat;  /**< \a size and \a mtime are valid */
+    size_t          size;       /**< size of image before verifying */
+    int64_t         mtime;      /**< modification time before verifying */
+} batch_result_t;
+
+
+/** \brief  Images found by a recursive scan
+ *
+ * Results are added by the scan callback from the worker threads. Unless the
+ * images are verified after the scan (\a deferred), a job verifying the image
+ * is submitted to the pool right away, while the tree is still being read.
+ */
+typedef struct batch_scan_s {
+    pthread_mutex_t lock;   /**< lock for \a results and \a used */
+    batch_result_t **results;   /**< results, in the order they were found */
+    size_t          size;   /**< number of slots in \a results */
+    size_t          used;   /**< number of results in \a results */
+    bool            deferred;   /**< verify the images after sorting */
+    pool_t *        pool;   /**< pool to submit the jobs to */
+    t64_sync_t      sync;   /**< durability policy for `--in-place` */
+    const batch_state_t *state; /**< batch state */
+} batch_scan_t;
+
+
+/** \brief  Initialize batch \a job
+ *
+ * \param[out]  job     batch job
+ * \param[in]   input   image to verify
+ * \param[in]   sync    durability policy for `--in-place`
+ * \param[in]   state   batch state (cache and arenas)
+ */
+static void batch_job_init(batch_job_t *job,
+                           const batch_input_t *input,
+                           t64_sync_t sync,
+                           const batch_state_t *state)
+{
+    job->path = input->path;
+    job->archive = input->archive;
+    job->member = input->member;
+    job->quiet = true;
+    job->check = check;
+    job->in_place = in_place;
+    job->sync = sync;
+    job->fixes = 0;
+    job->error = T64_ERR_NONE;
+    job->sys_errno = 0;
+    job->format = report ? report_format : REPORT_TEXT;
+    job->cache = state->cache;
+    job->cached = false;
+    job->have_stat = false;
+    job->arenas = state->arenas;
+    job->prefetched = false;
+    job->head = NULL;
+    job->head_len = 0;
+    job->head_size = 0;
+    job->dupes = dupes;
+    job->patching = patch_path != NULL;
+    job->keep = dupes || index_path != NULL;
+    job->records = NULL;
+    job->nrecords = 0;
+}
+
+
+/** \brief  Start reporting batch results
+ *
+ * \param[out]  state   batch state
+ * \param[in]   pool    thread pool, an arena is created for each worker
+ *
+ * \return  false if the cache file couldn't be read
+ */
+static bool batch_begin(batch_state_t *state, const pool_t *pool)
+{
+    int i;
+
+    state->cache = NULL;
+    state->count = 0;
+    state->cached = 0;
+    state->ok = 0;
+    state->faulty = 0;
+    state->failed = 0;
+    state->files = NULL;
+    state->files_used = 0;
+    state->files_size = 0;
+    state->paths = NULL;
+    state->paths_used = 0;
+    state->paths_size = 0;
+    state->catalog = NULL;
+    state->patch_fp = NULL;
+
+    if (patch_path != NULL) {
+        errno = 0;
+        if (base_is_stdio(patch_path)) {
+            state->patch_fp = stdout;
+            base_set_binary(stdout);
+        } else {
+            state->patch_fp = fopen(patch_path, "wb");
+            if (state->patch_fp == NULL) {
+                t64_errno = T64_ERR_IO;
+                fprintf(stderr,
+                        "t64fix: error: failed to write patch file '%s'.\n",
+                        patch_path);
+                print_error();
+                return false;
+            }
+        }
+        outbuf_init(&(state->patch), state->patch_fp);
+    }
+    if (cache_path != NULL) {
+        state->cache = cache_load(cache_path);
+        if (state->cache == NULL) {
+            fprintf(stderr, "t64fix: error: failed to read cache file '%s'.\n",
+                    cache_path);
+            print_error();
+            if (state->patch_fp != NULL) {
+                outbuf_free(&(state->patch));
+                if (state->patch_fp != stdout) {
+                    fclose(state->patch_fp);
+                }
+            }
+            return false;
+        }
+    }
+    state->workers = pool_workers(pool);
+    state->arenas = base_malloc(sizeof *(state->arenas)
+                                * (size_t)state->workers);
+    for (i = 0; i < state->workers; i++) {
+        state->arenas[i] = arena_new(0);
+    }
+    /* with a cache most images aren't opened at all, a scan produces its
+     * paths on the workers and --dupes and reports need all data, so only
+     * read ahead the directories of plain lists of images */
+    state->aio = NULL;
+    if (io_depth > 0 && state->cache == NULL && !recursive && !dupes
+            && !report) {
+        state->aio = aio_new((unsigned int)io_depth);
+    }
+    if (index_path != NULL) {
+        state->catalog = catalog_builder_new();
+    }
+    if (report) {
+        outbuf_init(&(state->out), stdout);
+        report_begin(&(state->out), report_format);
+    }
+    return true;
+}
+
+
+/** \brief  Add the hashed files of \a job to \a state
+ *
+ * Empty files are left out, they're all the same.
+ *
+ * \param[in,out]   state   batch state
+ * \param[in]       job     finished batch job
+ */
+static void batch_add_files(batch_state_t *state, const batch_job_t *job)
+{
+    char *path = NULL;
+    int i;
+
+    for (i = 0; i < job->nrecords; i++) {
+        const t64_record_t *record = job->records + i;
+        batch_file_t *file;
+
+        if (!record->hashed || record->real_end_addr == record->start_addr) {
+            continue;
+        }
+        if (path == NULL) {
+            if (state->paths_used == state->paths_size) {
+                state->paths_size = state->paths_size * 2 + 64;
+                state->paths = base_realloc(state->paths,
+                        sizeof *(state->paths) * state->paths_size);
+            }
+            path = base_strdup(job->path);
+            state->paths[state->paths_used++] = path;
+        }
+        if (state->files_used == state->files_size) {
+            state->files_size = state->files_size * 2 + 256;
+            state->files = base_realloc(state->files,
+                    sizeof *(state->files) * state->files_size);
+        }
+        file = state->files + state->files_used;
+        file->hash = record->hash;
+        file->size = (size_t)(record->real_end_addr - record->start_addr);
+        file->seq = state->files_used;
+        file->copy.path = path;
+        file->copy.index = record->index;
+        memcpy(file->copy.filename, record->filename, T64_REC_FILENAME_LEN);
+        state->files_used++;
+    }
+}
+
+
+/** \brief  Compare hashed files on hash, size and order for qsort()
+ *
+ * \param[in]   p1  first file
+ * \param[in]   p2  second file
+ *
+ * \return  <0, 0 or >0
+ */
+static int batch_file_cmp(const void *p1, const void *p2)
+{
+    const batch_file_t *file1 = p1;
+    const batch_file_t *file2 = p2;
+
+    if (file1->hash != file2->hash) {
+        return file1->hash < file2->hash ? -1 : 1;
+    }
+    if (file1->size != file2->size) {
+        return file1->size < file2->size ? -1 : 1;
+    }
+    return file1->seq < file2->seq ? -1 : (file1->seq > file2->seq);
+}
+
+
+/** \brief  Report groups of files with identical data
+ *
+ * Groups are reported in hash order, the copies in each group in the order
+ * their images were reported.
+ *
+ * \param[in,out]   state   batch state
+ * \param[in,out]   out     writer
+ *
+ * \return  number of files that are a copy of an earlier file
+ */
+static size_t batch_report_duplicates(batch_state_t *state, outbuf_t *out)
+{
+    report_copy_t *copies;
+    size_t duplicates = 0;
+    size_t i;
+    size_t j;
+
+    qsort(state->files, state->files_used, sizeof *(state->files),
+          batch_file_cmp);
+    copies = base_malloc(sizeof *copies * (state->files_used + 1));
+    for (i = 0; i < state->files_used; i = j) {
+        const batch_file_t *first = state->files + i;
+
+        for (j = i + 1; j < state->files_used; j++) {
+            if (state->files[j].hash != first->hash
+                    || state->files[j].size != first->size) {
+                break;
+            }
+        }
+        if (j - i > 1) {
+            size_t k;
+
+            for (k = i; k < j; k++) {
+                copies[k - i] = state->files[k].copy;
+            }
+            if (out != NULL) {
+                report_duplicate(out, report ? report_format : REPORT_TEXT,
+                                 first->hash, first->size, copies, j - i);
+            }
+            duplicates += j - i - 1;
+        }
+    }
+    base_free(copies);
+    return duplicates;
+}
+
+
+/** \brief  Report result of finished batch \a job
+ *
+ * Updates the counters, the cache, the duplicates and the catalog and outputs
+ * the result or report of \a job. Must be called in the order the results should be reported in.
+ *
+ * \param[in,out]   state   batch state
+ * \param[in,out]   job     finished batch job (report is reset)
+ */
+static void batch_job_report(batch_state_t *state, batch_job_t *job)
+{
+    state->count++;
+    if (job->cached) {
+        state->cached++;
+    } else if (state->cache != NULL && job->have_stat && job->fixes >= 0
+            && !(job->in_place && job->fixes > 0)) {
+        cache_store(state->cache, job->path, job->size, job->mtime,
+                    job->fixes);
+    }
+    if (job->fixes < 0) {
+        state->failed++;
+    } else if (job->fixes > 0) {
+        state->faulty++;
+    } else {
+        state->ok++;
+    }
+    if (job->records != NULL) {
+        if (dupes) {
+            batch_add_files(state, job);
+        }
+        if (state->catalog != NULL) {
+            catalog_builder_add(state->catalog, job->path, job->tapename,
+                                job->records, job->nrecords);
+        }
+        base_free(job->records);
+        job->records = NULL;
+        job->nrecords = 0;
+    }
+    if (state->patch_fp != NULL && job->patch.used > 0) {
+        /* patches are framed by a line with their size and the image path */
+        outbuf_printf(&(state->patch), "%zu %s\n", job->patch.used,
+                      job->path);
+        outbuf_append(&(state->patch), &(job->patch));
+        outbuf_reset(&(job->patch));
+    }
+    if (report) {
+        outbuf_append(&(state->out), &(job->report));
+        outbuf_reset(&(job->report));
+    } else if (!quiet) {
+        batch_print_result(job);
+    }
+}
+
+
+/** \brief  Finish reporting batch results
+ *
+ * Flushes the report or prints the summary and saves the cache.
+ *
+ * \param[in,out]   state   batch state
+ *
+ * \return  true if all images were OK (or fixed with `--in-place`)
+ */
+static bool batch_end(batch_state_t *state)
+{
+    size_t duplicates = 0;
+    size_t n;
+    int i;
+
+    for (i = 0; i < state->workers; i++) {
+        arena_free(state->arenas[i]);
+    }
+    base_free(state->arenas);
+    if (state->aio != NULL) {
+        aio_free(state->aio);
+    }
+
+    if (dupes) {
+        if (report) {
+            duplicates = batch_report_duplicates(state, &(state->out));
+        } else if (!quiet) {
+            outbuf_t out;
+
+            outbuf_init(&out, stdout);
+            duplicates = batch_report_duplicates(state, &out);
+            if (!outbuf_flush(&out)) {
+                print_error();
+                state->failed++;
+            }
+            outbuf_free(&out);
+        }
+        for (n = 0; n < state->paths_used; n++) {
+            base_free(state->paths[n]);
+        }
+        base_free(state->paths);
+        base_free(state->files);
+    }
+    if (state->catalog != NULL) {
+        if (!catalog_builder_write(state->catalog, index_path)) {
+            fprintf(stderr, "t64fix: error: failed to write index file '%s'.\n",
+                    index_path);
+            print_error();
+            state->failed++;
+        }
+        catalog_builder_free(state->catalog);
+    }
+    if (state->patch_fp != NULL) {
+        bool ok = outbuf_flush(&(state->patch));
+
+        outbuf_free(&(state->patch));
+        if (state->patch_fp != stdout && fclose(state->patch_fp) != 0) {
+            t64_errno = T64_ERR_IO;
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "t64fix: error: failed to write patch file '%s'.\n",
+                    patch_path);
+            print_error();
+            state->failed++;
+        }
+    }
+
+    if (report) {
+        if (!outbuf_flush(&(state->out))) {
+            print_error();
+            state->failed++;
+        }
+        outbuf_free(&(state->out));
+    } else if (!quiet) {
+        printf("t64fix: checked %zu images: %zu OK, %zu %s, %zu errors",
+               state->count, state->ok, state->faulty,
+               in_place ? "fixed" : "faulty", state->failed);
+        if (state->cache != NULL) {
+            printf(", %zu cached", state->cached);
+        }
+        if (dupes) {
+            printf(", %zu duplicate files", duplicates);
+        }
+        putchar('\n');
+    }
+
+    if (state->cache != NULL) {
+        if (!cache_save(state->cache)) {
+            fprintf(stderr, "t64fix: error: failed to write cache file '%s'.\n",
+                    cache_path);
+            print_error();
+            state->failed++;
+        }
+        cache_free(state->cache);
+    }
+
+    if (in_place) {
+        return state->failed == 0;
+    }
+    return state->faulty == 0 && state->failed == 0;
+}
+
+
+/** \brief  Jobs of a chunk whose images are being read ahead
+ */
+typedef struct batch_prefetch_s {
+    pool_t *        pool;   /**< pool to submit the jobs to */
+    aio_req_t *     reqs;   /**< read requests */
+    batch_job_t **  jobs;   /**< job of each element of \a reqs */
+} batch_prefetch_t;
+
+
+/** \brief  Submit job whose image head has been read (aio callback)
+ *
+ * Jobs whose read failed are submitted as well, their worker opens the image
+ * normally, which reports the error if there really is one.
+ *
+ * \param[in,out]   arg     prefetch state (`batch_prefetch_t`)
+ * \param[in]       index   index of the request
+ */
+static void batch_prefetch_done(void *arg, size_t index)
+{
+    batch_prefetch_t *prefetch = arg;
+    const aio_req_t *req = prefetch->reqs + index;
+    batch_job_t *job = prefetch->jobs[index];
+
+    if (req->error == 0) {
+        job->prefetched = true;
+        job->head = req->buffer;
+        job->head_len = req->len;
+        job->head_size = req->size;
+    }
+    pool_submit(prefetch->pool, batch_verify_job, job);
+}
+
+
+/** \brief  Submit the \a count jobs in \a chunk, reading ahead if possible
+ *
+ * With an aio context in \a state the heads of the images are read
+ * asynchronously and each job is submitted once its read has completed, so
+ * the workers don't have to wait for the storage.
+ *
+ * \param[in,out]   state       batch state
+ * \param[in,out]   prefetch    prefetch state (\a reqs and \a jobs have room
+ *                              for \a count elements)
+ * \param[in,out]   chunk       jobs
+ * \param[in]       count       number of elements in \a chunk
+ * \param[in]       buffer      buffer of \a count * AIO_HEAD_SIZE bytes
+ */
+static void batch_submit_chunk(batch_state_t *state,
+                               batch_prefetch_t *prefetch,
+                               batch_job_t *chunk,
+                               size_t count,
+                               uint8_t *buffer)
+{
+    size_t used = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        batch_job_t *job = chunk + i;
+
+        if (state->aio == NULL || job->archive != NULL
+                || base_is_stdio(job->path)) {
+            pool_submit(prefetch->pool, batch_verify_job, job);
+        } else {
+            prefetch->reqs[used].path = job->path;
+            prefetch->reqs[used].buffer = buffer + used * AIO_HEAD_SIZE;
+            prefetch->jobs[used] = job;
+            used++;
+        }
+    }
+    if (used > 0) {
+        aio_read_heads(state->aio, prefetch->reqs, used, batch_prefetch_done,
+                       prefetch);
+    }
+}
+
+
+/** \brief  Verify \a inputs in chunks, reporting in the order given
+ *
+ * \param[in,out]   state   batch state
+ * \param[in,out]   pool    thread pool
+ * \param[in]       inputs  images to verify
+ * \param[in]       count   number of elements in \a inputs
+ * \param[in]       sync    durability policy for `--in-place`
+ */
+static void batch_run_inputs(batch_state_t *state,
+                             pool_t *pool,
+                             const batch_input_t *inputs,
+                             size_t count,
+                             t64_sync_t sync)
+{
+    batch_job_t *chunk;
+    batch_prefetch_t prefetch;
+    uint8_t *buffer = NULL;
+    size_t chunk_used;
+    size_t done;
+
+    chunk_used = count < BATCH_CHUNK_SIZE ? count : BATCH_CHUNK_SIZE;
+    chunk = base_malloc(sizeof *chunk * chunk_used);
+    prefetch.pool = pool;
+    prefetch.reqs = NULL;
+    prefetch.jobs = NULL;
+    if (state->aio != NULL) {
+        prefetch.reqs = base_malloc(sizeof *(prefetch.reqs) * chunk_used);
+        prefetch.jobs = base_malloc(sizeof *(prefetch.jobs) * chunk_used);
+        buffer = base_malloc(chunk_used * AIO_HEAD_SIZE);
+    }
+    if (report) {
+        for (done = 0; done < chunk_used; done++) {
+            outbuf_init(&(chunk[done].report), NULL);
+        }
+    }
+    if (patch_path != NULL) {
+        for (done = 0; done < chunk_used; done++) {
+            outbuf_init(&(chunk[done].patch), NULL);
+        }
+    }
+
+    for (done = 0; done < count; ) {
+        size_t n = count - done;
+        size_t i;
+
+        if (n > BATCH_CHUNK_SIZE) {
+            n = BATCH_CHUNK_SIZE;
+        }
+        for (i = 0; i < n; i++) {
+            batch_job_init(chunk + i, inputs + done + i, sync, state);
+        }
+        batch_submit_chunk(state, &prefetch, chunk, n, buffer);
+        pool_wait(pool);
+
+        /* report results in order */
+        for (i = 0; i < n; i++) {
+            batch_job_report(state, chunk + i);
+        }
+        done += n;
+    }
+
+    if (report) {
+        for (done = 0; done < chunk_used; done++) {
+            outbuf_free(&(chunk[done].report));
+        }
+    }
+    if (patch_path != NULL) {
+        for (done = 0; done < chunk_used; done++) {
+            outbuf_free(&(chunk[done].patch));
+        }
+    }
+    base_free(chunk);
+    base_free(prefetch.reqs);
+    base_free(prefetch.jobs);
+    base_free(buffer);
+}
+
+
+/** \brief  Verify image found by a recursive scan (pool job)
+ *
+ * Verifies the image with a job on the stack and keeps only its result.
+ *
+ * \param[in,out]   arg     result of the image (`batch_result_t`)
+ * \param[in]       worker  worker index
+ */
+static void batch_scan_job(void *arg, int worker)
+{
+    batch_result_t *result = arg;
+    batch_job_t job;
+    batch_input_t input;
+
+    input.path = result->path;
+    input.archive = NULL;
+    input.member = -1;
+    batch_job_init(&job, &input, result->scan->sync, result->scan->state);
+    batch_verify_job(&job, worker);
+
+    result->fixes = job.fixes;
+    result->error = job.error;
+    result->sys_errno = job.sys_errno;
+    result->cached = job.cached;
+    result->have_stat = job.have_stat;
+    result->size = job.size;
+    result->mtime = job.mtime;
+}
+
+
+/** \brief  Handle image found by scan_tree()
+ *
+ * Adds a result for the image and, unless verifying is deferred, submits a
+ * job verifying the image to the pool.
+ *
+ * \param[in,out]   arg     scan state (`batch_scan_t`)
+ * \param[in]       path    path of image (ownership is transferred)
+ */
+static void batch_scan_found(void *arg, char *path)
+{
+    batch_scan_t *scan = arg;
+    batch_result_t *result = base_malloc(sizeof *result);
+
+    result->path = path;
+    result->scan = scan;
+
+    pthread_mutex_lock(&scan->lock);
+    if (scan->used == scan->size) {
+        scan->size *= 2;
+        scan->results = base_realloc(scan->results,
+                                     sizeof *(scan->results) * scan->size);
+    }
+    scan->results[scan->used++] = result;
+    pthread_mutex_unlock(&scan->lock);
+
+    if (!scan->deferred) {
+        pool_submit(scan->pool, batch_scan_job, result);
+    }
+}
+
+
+/** \brief  Compare paths of two scan results for qsort()
+ *
+ * \param[in]   p1  pointer to first result pointer
+ * \param[in]   p2  pointer to second result pointer
+ *
+ * \return  <0, 0 or >0
+ */
+static int batch_result_cmp(const void *p1, const void *p2)
+{
+    const batch_result_t *result1 = *(const batch_result_t * const *)p1;
+    const batch_result_t *result2 = *(const batch_result_t * const *)p2;
+
+    return strcmp(result1->path, result2->path);
+}
+
+
+/** \brief  Verify all images in the directory trees \a roots
+ *
+ * Directories are read on the pool and images are verified as soon as they're
+ * found. Results are sorted on path (byte order) before reporting, so the
+ * output doesn't depend on the order of the directory entries or the
+ * scheduling of the workers.
+ *
+ * Only the paths and results are kept until the scan is done. Reports,
+ * patches and the files for `--dupes` and `--index` would take memory in
+ * proportion to the tree, so with those the images are verified after the
+ * paths have been sorted instead, in chunks like a list of images.
+ *
+ * \param[in,out]   state   batch state
+ * \param[in,out]   pool    thread pool
+ * \param[in]       roots   directories to scan
+ * \param[in]       count   number of elements in \a roots
+ * \param[in]       sync    durability policy for `--in-place`
+ */
+static void batch_run_scan(batch_state_t *state,
+                           pool_t *pool,
+                           const char **roots,
+                           size_t count,
+                           t64_sync_t sync)
+{
+    batch_scan_t scan;
+    size_t i;
+
+    pthread_mutex_init(&scan.lock, NULL);
+    scan.size = 256;
+    scan.used = 0;
+    scan.results = base_malloc(sizeof *(scan.results) * scan.size);
+    scan.deferred = report || patch_path != NULL || dupes
+        || index_path != NULL;
+    scan.pool = pool;
+    scan.sync = sync;
+    scan.state = state;
+
+    state->failed += scan_tree(pool, roots, count, ".t64", batch_scan_found,
+                               &scan);
+
+    qsort(scan.results, scan.used, sizeof *(scan.results), batch_result_cmp);
+    if (scan.deferred && scan.used > 0) {
+        batch_input_t *inputs = base_malloc(sizeof *inputs * (scan.used + 1));
+
+        for (i = 0; i < scan.used; i++) {
+            inputs[i].path = scan.results[i]->path;
+            inputs[i].archive = NULL;
+            inputs[i].member = -1;
+        }
+        batch_run_inputs(state, pool, inputs, scan.used, sync);
+        base_free(inputs);
+    } else if (!scan.deferred) {
+        for (i = 0; i < scan.used; i++) {
+            const batch_result_t *result = scan.results[i];
+            batch_job_t job;
+            batch_input_t input;
+
+            input.path = result->path;
+            input.archive = NULL;
+            input.member = -1;
+            batch_job_init(&job, &input, sync, state);
+            job.fixes = result->fixes;
+            job.error = result->error;
+            job.sys_errno = result->sys_errno;
+            job.cached = result->cached;
+            job.have_stat = result->have_stat;
+            job.size = result->size;
+            job.mtime = result->mtime;
+            batch_job_report(state, &job);
+        }
+    }
+    for (i = 0; i < scan.used; i++) {
+        base_free(scan.results[i]->path);
+        base_free(scan.results[i]);
+    }
+    base_free(scan.results);
+    pthread_mutex_destroy(&scan.lock);
+}
+
+
+/** \brief  Verify multiple images using a thread pool
+ *
+ * Prints one result line per image on stdout, in the order the images were
+ * given, followed by a summary. With `--format` a report of each image is
+ * generated by the workers into their job's memory writer, which are then
+ * appended in order to a single buffered writer for stdout.
+ *
+ * With `--recursive` the arguments are directories which are scanned for .t64
+ * images, the results are reported sorted on path. Directories that can't be
+ * read count as errors.
+ *
+ * With `--cache` images whose path, size and modification time match the
+ * cache aren't opened at all, their cached result is reported instead. Results
+ * of the other images are stored in the cache, except for images that had
+ * fixes written into them, those get verified again on the next run.
+ *
+ * With `--in-place` the fixes are written back into the images and faulty
+ * images that were fixed succesfully count as OK for the exit status.
+ *
+ * \param[in]   args    list of t64 files (or directories)
+ * \param[in]   nargs   number of elements in \a args
+ * \param[in]   sync    durability policy for `--in-place`
+ *
+ * \return  true if all images were OK
+ */
+static bool cmd_batch(const char **args, int nargs, t64_sync_t sync)
+{
+    const char **list = NULL;
+    const char **paths;
+    char *list_buffer = NULL;
+    size_t list_count = 0;
+    size_t count;
+    batch_state_t state;
+    pool_t *pool;
+    bool result;
+
+    if (batch_list != NULL) {
+        list = read_batch_list(batch_list, &list_buffer, &list_count);
+        if (list == NULL) {
+            fprintf(stderr, "t64fix: error: failed to read list file '%s'.\n",
+                    batch_list);
+            print_error();
+            return false;
+        }
+    }
+
+    /* combine command line arguments and list file entries */
+    count = (size_t)nargs + list_count;
+    if (count == 0) {
+        fprintf(stderr, "t64fix: error: no input file(s) given.\n");
+        base_free(list);
+        base_free(list_buffer);
+        return false;
+    }
+    pool = pool_new((int)jobs);
+    if (!batch_begin(&state, pool)) {
+        pool_free(pool);
+        base_free(list);
+        base_free(list_buffer);
+        return false;
+    }
+    paths = base_malloc(sizeof *paths * count);
+    if (nargs > 0) {
+        memcpy(paths, args, sizeof *paths * (size_t)nargs);
+    }
+    if (list_count > 0) {
+        memcpy(paths + nargs, list, sizeof *paths * list_count);
+    }
+
+    if (recursive) {
+        batch_run_scan(&state, pool, paths, count, sync);
+    } else {
+        batch_input_t *inputs = batch_inputs_new(paths, &count);
+
+        batch_run_inputs(&state, pool, inputs, count, sync);
+        batch_inputs_free(inputs, count);
+    }
+    result = batch_end(&state);
+
+    pool_free(pool);
+    base_free(paths);
+    base_free(list);
+    base_free(list_buffer);
+    return result;
+}
+
+
+
+/** \brief  Report record found by cmd_query() (catalog callback)
+ *
+ * \param[in,out]   arg     writer for stdout, `NULL` with `--quiet`
+ * \param[in]       entry   record
+ */
+static void query_entry(void *arg, const catalog_entry_t *entry)
+{
+    if (arg != NULL) {
+        report_catalog_entry(arg, report ? report_format : REPORT_TEXT, entry);
+    }
+}
+
+
+/** \brief  Search the catalog of `--query` for records matching \a args
+ *
+ * Each argument is a search term, see catalog_parse_term(), records have to
+ * match all of them. Matching records are listed on stdout, or reported in
+ * the `--format` selected, the images aren't opened.
+ *
+ * \param[in]   args    search terms
+ * \param[in]   nargs   number of elements in \a args
+ *
+ * \return  true if any record matched
+ */
+static bool cmd_query(const char **args, int nargs)
+{
+    catalog_term_t *terms;
+    catalog_t *catalog;
+    outbuf_t out;
+    size_t matches;
+    int i;
+
+    terms = base_malloc(sizeof *terms * ((size_t)nargs + 1));
+    for (i = 0; i < nargs; i++) {
+        if (!catalog_parse_term(args[i], terms + i)) {
+            fprintf(stderr,
+                    "t64fix: error: invalid search term '%s', expected "
+                    "name=, tape=, start=, end= or hash=<value>.\n", args[i]);
+            base_free(terms);
+            return false;
+        }
+    }
+    catalog = catalog_open(query_path);
+    if (catalog == NULL) {
+        fprintf(stderr, "t64fix: error: failed to read index file '%s'.\n",
+                query_path);
+        print_error();
+        base_free(terms);
+        return false;
+    }
+
+    outbuf_init(&out, stdout);
+    if (report) {
+        report_begin(&out, report_format);
+    }
+    matches = catalog_query(catalog, terms, (size_t)nargs,
+                            query_entry, quiet && !report ? NULL : &out);
+    if (!outbuf_flush(&out)) {
+        print_error();
+        matches = 0;
+    }
+    outbuf_free(&out);
+    catalog_close(catalog);
+    base_free(terms);
+    return matches > 0;
+}
+
+
+/** \brief  Program driver
+ *
+ * \param[in]   argc    argument count
+ * \param[in]   argv    argument vector
+ *
+ * \return  EXIT_SUCCESS or EXIT_FAILURE
+ */
+int main(int argc, char *argv[])
+{
+    const char **args;
+    int result;     /* optparse result */
+    bool status;    /* command status */
+    t64_sync_t sync;
+    size_t inflate_bytes;
+
+    optparse_init(options, "t64fix", VERSION);
+    optparse_set_prologue(help_prologue);
+
+    if (argc < 2) {
+        /* display help and exit */
+        optparse_help();
+        optparse_exit();
+        return EXIT_FAILURE;
     }
 
     /* parse command line options */
@@ -296,32 +2110,191 @@ int main(int argc, char *argv[])
         /* --help or --version */
         optparse_exit();
         return EXIT_SUCCESS;
-    } else if (result == 0) {
+    } else if (result == 0 && batch_list == NULL && daemon_socket == NULL
+            && query_path == NULL) {
         fprintf(stderr, "t64fix: no input or output file(s) given, aborting\n");
         optparse_exit();
         return EXIT_FAILURE;
     }
 
+    if (stats) {
+        stats_enable();
+    }
+    if (inflate_limit < 0) {
+        fprintf(stderr,
+                "t64fix: error: invalid argument %ld for `--inflate-limit`.\n",
+                inflate_limit);
+        optparse_exit();
+        return EXIT_FAILURE;
+    }
+    inflate_bytes = inflate_limit > (long)(ARCHIVE_LIMIT_MAX >> 20)
+        ? ARCHIVE_LIMIT_MAX : (size_t)inflate_limit << 20;
+    archive_set_limit(inflate_bytes);
+
     /* get list of non-option command line args */
     args = optparse_args();
 
-    base_debug("args[0] = '%s'\n", args[0]);
+    if (result > 0) {
+        base_debug("args[0] = '%s'\n", args[0]);
+    }
+
+    if (!get_sync_mode(&sync)) {
+        optparse_exit();
+        return EXIT_FAILURE;
+    }
+    if (!report_get_format(format_name, &report_format)) {
+        fprintf(stderr,
+                "t64fix: error: invalid argument '%s' for `--format`, expected "
+                "'text', 'ndjson' or 'csv'.\n", format_name);
+        optparse_exit();
+        return EXIT_FAILURE;
+    }
+    if (base_is_stdio(outfile) || base_is_stdio(create_file)
+            || base_is_stdio(d64_file) || base_is_stdio(patch_path)) {
+        /* stdout is used for the data, keep it clean */
+        if (report_format != REPORT_TEXT) {
+            fprintf(stderr,
+                    "t64fix: error: cannot write a report and data to "
+                    "stdout.\n");
+            optparse_exit();
+            return EXIT_FAILURE;
+        }
+        quiet = true;
+    }
+    if (report_format != REPORT_TEXT && !quiet) {
+        /* the report replaces the normal output */
+        report = true;
+        quiet = true;
+    }
+    if (in_place && outfile != NULL) {
+        fprintf(stderr,
+                "t64fix: error: `--in-place` and `--output` are mutually "
+                "exclusive.\n");
+        optparse_exit();
+        return EXIT_FAILURE;
+    }
+
+    if (check && (report || outfile != NULL || in_place || create_file != NULL
+                || extract >= 0 || extract_all || d64_file != NULL
+                || cache_path != NULL || dupes || index_path != NULL
+                || daemon_socket != NULL || query_path != NULL
+                || patch_path != NULL || apply_path != NULL || compact)) {
+        fprintf(stderr,
+                "t64fix: error: `--check` only checks images, without "
+                "reports or other commands.\n");
+        optparse_exit();
+        return EXIT_FAILURE;
+    }
+
+    if (compact && ((outfile == NULL && !in_place) || batch
+                || batch_list != NULL || recursive || create_file != NULL
+                || extract >= 0 || extract_all || d64_file != NULL
+                || daemon_socket != NULL || query_path != NULL
+                || patch_path != NULL || apply_path != NULL)) {
+        fprintf(stderr,
+                "t64fix: error: `--compact` only rewrites a single image with "
+                "`--output` or `--in-place`.\n");
+        optparse_exit();
+        return EXIT_FAILURE;
+    }
 
     /* handle commands: */
-    if (create_file != NULL) {
+    if (daemon_socket != NULL) {
+        /* --daemon <socket> */
+        if (result > 0 || batch || batch_list != NULL || recursive
+                || create_file != NULL || extract >= 0 || extract_all
+                || outfile != NULL || d64_file != NULL || in_place
+                || cache_path != NULL || dupes || index_path != NULL
+                || query_path != NULL || patch_path != NULL
+                || apply_path != NULL) {
+            fprintf(stderr,
+                    "t64fix: error: `--daemon` doesn't take any images or "
+                    "other commands.\n");
+            status = false;
+        } else {
+            status = server_run(daemon_socket, (int)jobs, inflate_bytes);
+        }
+    } else if (query_path != NULL) {
+        /* --query <index> [<key>=<value>...] */
+        if (batch || batch_list != NULL || recursive || create_file != NULL
+                || extract >= 0 || extract_all || outfile != NULL
+                || d64_file != NULL || in_place || cache_path != NULL
+                || dupes || index_path != NULL || patch_path != NULL
+                || apply_path != NULL) {
+            fprintf(stderr,
+                    "t64fix: error: `--query` only takes search terms.\n");
+            status = false;
+        } else {
+            status = cmd_query(args, result);
+        }
+    } else if (batch || batch_list != NULL || recursive) {
+        /* --batch <t64-files>, --list <file> and/or --recursive <dirs> */
+        if (create_file != NULL || extract >= 0 || extract_all
+                || outfile != NULL || d64_file != NULL || apply_path != NULL) {
+            fprintf(stderr,
+                    "t64fix: error: batch mode only supports verifying and "
+                    "fixing in place.\n");
+            status = false;
+        } else {
+            status = cmd_batch(args, result, sync);
+        }
+    } else if (cache_path != NULL) {
+        fprintf(stderr,
+                "t64fix: error: `--cache` is only supported in batch mode.\n");
+        status = false;
+    } else if (dupes) {
+        fprintf(stderr,
+                "t64fix: error: `--dupes` is only supported in batch mode.\n");
+        status = false;
+    } else if (index_path != NULL) {
+        fprintf(stderr,
+                "t64fix: error: `--index` is only supported in batch mode.\n");
+        status = false;
+    } else if (apply_path != NULL) {
+        /* --apply <patch> <image> -o <patched-image> */
+        if (create_file != NULL || extract >= 0 || extract_all
+                || d64_file != NULL || in_place || patch_path != NULL) {
+            fprintf(stderr,
+                    "t64fix: error: `--apply` only writes the patched image "
+                    "to `--output`.\n");
+            status = false;
+        } else {
+            status = cmd_apply(args[0]);
+        }
+    } else if (patch_path != NULL
+            && (create_file != NULL || extract >= 0 || extract_all
+                || d64_file != NULL)) {
+        fprintf(stderr,
+                "t64fix: error: `--patch` is only supported when verifying "
+                "or fixing in place.\n");
+        status = false;
+    } else if (create_file != NULL) {
         /* --create <outfile> <prg-files> */
         status = cmd_create(args, result);
     } else if (extract >= 0) {
         /* --extract <index> */
         status = cmd_extract_indexed(args[0]);
+    } else if (d64_file != NULL) {
+        /* --to-d64 <d64-file> */
+        status = cmd_to_d64(args[0]);
     } else if (extract_all) {
         /* --extract-all */
         status = cmd_extract_all(args[0]);
+    } else if (in_place) {
+        /* --in-place */
+        status = cmd_fix_in_place(args[0], sync);
+    } else if (check) {
+        /* --check */
+        status = cmd_check(args[0]);
     } else {
         /* assume verify */
         status = cmd_verify(args[0]);
     }
 
+    if (stats) {
+        stats_print(stderr);
+    }
+
     /* clean up */
     optparse_exit();
 
@@ -13,9 +13,9 @@
  * The bool option will set its result to 1 when encountered, so the user is
  * expected to set the result to 0 before calling the parser.
  *
- * Combining short options isn't supported (yet), neither is the
- * `--option=VALUE` syntax (yet), all options that need an argument expect it
- * to be in the next argv element.
+ * Combining short options isn't supported (yet). Options that need an argument
+ * expect it to be in the next argv element, long options also accept the
+ * `--option=VALUE` syntax. A single `-` is a normal argument.
  *
  * Exit codes of optparse_exec() are a bit funky:
  * - On succesful completion it returns the number of command line arguments not
@@ -205,7 +205,8 @@ static const option_decl_t *find_option(int name_short, const char *name_long)
 
     while (opt->name_short != 0 || opt->name_long != NULL) {
         if ((name_short != 0 && opt->name_short == name_short) ||
-                (name_long != NULL && strcmp(opt->name_long, name_long) == 0)) {
+                (name_long != NULL && opt->name_long != NULL
+                 && strcmp(opt->name_long, name_long) == 0)) {
             return opt;
         }
         opt++;
@@ -411,8 +412,8 @@ int optparse_exec(int argc, char *argv[])
         const char *arg = argv[i];
         int delta;
 
-        if (arg[0] != '-') {
-            /* not an option */
+        if (arg[0] != '-' || arg[1] == '\0') {
+            /* not an option, a single '-' usually means stdin/stdout */
 #ifdef OPTPARSE_DEBUG
             printf("%s:%d: found argument: '%s'\n", __FILE__, __LINE__, arg);
 #endif
@@ -423,9 +424,26 @@ int optparse_exec(int argc, char *argv[])
             printf("%s:%d: found possible option: '%s'\n",
                     __FILE__, __LINE__, arg);
 #endif
+            const char *value = NULL;
+
             if (arg[1] == '-') {
-                /* long option */
-                opt = find_option(0, arg + 2);
+                /* long option, possibly with argument: --name=value */
+                const char *eq = strchr(arg + 2, '=');
+
+                if (eq != NULL) {
+                    char name[64];
+                    size_t len = (size_t)(eq - (arg + 2));
+
+                    if (len >= sizeof name) {
+                        len = sizeof name - 1;
+                    }
+                    memcpy(name, arg + 2, len);
+                    name[len] = '\0';
+                    opt = find_option(0, name);
+                    value = eq + 1;
+                } else {
+                    opt = find_option(0, arg + 2);
+                }
             } else {
                 opt = find_option(arg[1], NULL);
             }
@@ -435,6 +453,18 @@ int optparse_exec(int argc, char *argv[])
                 /* don't just complain, do something (thanks iAN) */
                 return OPT_EXIT_ERROR;
             }
+            if (value != NULL) {
+                if (opt->type == OPT_BOOL) {
+                    fprintf(stderr,
+                            "%s: Error: option '--%s' doesn't take an "
+                            "argument\n", prg_name, opt->name_long);
+                    return OPT_EXIT_ERROR;
+                }
+                if (handle_option(opt, value) < 0) {
+                    return OPT_EXIT_ERROR;
+                }
+                continue;
+            }
             delta = handle_option(opt, argv[i + 1]);
             if (delta < 0) {
                 return OPT_EXIT_ERROR;
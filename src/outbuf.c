@@ -0,0 +1,228 @@
+/** \file   outbuf.c
+ * \brief   Buffered output writer
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Collects small writes (single characters, short formatted strings) in a
+ * buffer so output consisting of many small pieces results in few large
+ * writes. Memory writers can be used by worker threads to generate output that
+ * is later appended to a stream writer in a fixed order.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "base.h"
+
+#include "outbuf.h"
+
+
+/** \brief  Initial size of the buffer of a memory writer
+ */
+#define OUTBUF_MEMORY_SIZE  256
+
+
+/** \brief  Initialize writer \a buf
+ *
+ * \param[out]  buf writer
+ * \param[in]   fp  output stream, or `NULL` to collect output in memory
+ */
+void outbuf_init(outbuf_t *buf, FILE *fp)
+{
+    buf->fp = fp;
+    buf->size = fp != NULL ? OUTBUF_STREAM_SIZE : OUTBUF_MEMORY_SIZE;
+    buf->data = base_malloc(buf->size);
+    buf->used = 0;
+    buf->error = false;
+}
+
+
+/** \brief  Free memory used by \a buf
+ *
+ * Doesn't flush the buffer, use outbuf_flush() for that.
+ *
+ * \param[in,out]   buf writer
+ */
+void outbuf_free(outbuf_t *buf)
+{
+    base_free(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->used = 0;
+}
+
+
+/** \brief  Discard contents of \a buf, keeping the buffer for reuse
+ *
+ * \param[in,out]   buf writer
+ */
+void outbuf_reset(outbuf_t *buf)
+{
+    buf->used = 0;
+}
+
+
+/** \brief  Make room for at least \a size bytes in \a buf
+ *
+ * Stream writers are flushed first, memory writers (and stream writers that
+ * need more than their buffer size) get their buffer enlarged.
+ *
+ * \param[in,out]   buf     writer
+ * \param[in]       size    number of bytes required
+ */
+static void outbuf_reserve(outbuf_t *buf, size_t size)
+{
+    if (buf->size - buf->used >= size) {
+        return;
+    }
+    if (buf->fp != NULL) {
+        outbuf_flush(buf);
+        if (buf->size >= size) {
+            return;
+        }
+    }
+    while (buf->size - buf->used < size) {
+        buf->size *= 2;
+    }
+    buf->data = base_realloc(buf->data, buf->size);
+}
+
+
+/** \brief  Write \a size bytes of \a data to \a buf
+ *
+ * \param[in,out]   buf     writer
+ * \param[in]       data    data to write
+ * \param[in]       size    size of \a data
+ */
+void outbuf_write(outbuf_t *buf, const void *data, size_t size)
+{
+    if (buf->fp != NULL && size >= buf->size) {
+        /* no point in copying large blocks */
+        outbuf_flush(buf);
+        if (!buf->error && fwrite(data, 1, size, buf->fp) != size) {
+            buf->error = true;
+        }
+        return;
+    }
+    outbuf_reserve(buf, size);
+    memcpy(buf->data + buf->used, data, size);
+    buf->used += size;
+}
+
+
+/** \brief  Write character \a c to \a buf
+ *
+ * \param[in,out]   buf writer
+ * \param[in]       c   character
+ */
+void outbuf_putc(outbuf_t *buf, int c)
+{
+    if (buf->used == buf->size) {
+        outbuf_reserve(buf, 1);
+    }
+    buf->data[buf->used++] = (char)c;
+}
+
+
+/** \brief  Write string \a s to \a buf
+ *
+ * \param[in,out]   buf writer
+ * \param[in]       s   string
+ */
+void outbuf_puts(outbuf_t *buf, const char *s)
+{
+    outbuf_write(buf, s, strlen(s));
+}
+
+
+/** \brief  Write formatted string to \a buf
+ *
+ * \param[in,out]   buf writer
+ * \param[in]       fmt format string
+ * \param[in]       ... format arguments
+ */
+void outbuf_printf(outbuf_t *buf, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf->data + buf->used, buf->size - buf->used, fmt, args);
+    va_end(args);
+    if (len < 0) {
+        buf->error = true;
+        return;
+    }
+    if ((size_t)len >= buf->size - buf->used) {
+        /* didn't fit, make room and try again */
+        outbuf_reserve(buf, (size_t)len + 1);
+        va_start(args, fmt);
+        vsnprintf(buf->data + buf->used, buf->size - buf->used, fmt, args);
+        va_end(args);
+    }
+    buf->used += (size_t)len;
+}
+
+
+/** \brief  Append contents of writer \a src to \a buf
+ *
+ * \param[in,out]   buf writer
+ * \param[in]       src memory writer
+ */
+void outbuf_append(outbuf_t *buf, const outbuf_t *src)
+{
+    outbuf_write(buf, src->data, src->used);
+}
+
+
+/** \brief  Write contents of stream writer \a buf to its stream
+ *
+ * Does nothing for memory writers.
+ *
+ * \param[in,out]   buf writer
+ *
+ * \return  false if an I/O error occurred at any point
+ * \throw   T64_ERR_IO
+ */
+bool outbuf_flush(outbuf_t *buf)
+{
+    if (buf->fp == NULL) {
+        return true;
+    }
+    if (buf->used > 0 && !buf->error) {
+        if (fwrite(buf->data, 1, buf->used, buf->fp) != buf->used) {
+            buf->error = true;
+        }
+    }
+    buf->used = 0;
+    if (!buf->error && fflush(buf->fp) != 0) {
+        buf->error = true;
+    }
+    if (buf->error) {
+        t64_errno = T64_ERR_IO;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,67 @@
+/** \file   outbuf.h
+ * \brief   Buffered output writer - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_OUTBUF_H
+#define HAVE_OUTBUF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+
+/** \brief  Size of the buffer of a stream writer
+ */
+#define OUTBUF_STREAM_SIZE  0x10000
+
+
+/** \brief  Buffered output writer
+ *
+ * A writer either writes to a stream, in which case its buffer is written out
+ * whenever it's full, or it collects all output in memory (\a fp is `NULL`).
+ */
+typedef struct outbuf_s {
+    FILE *  fp;     /**< output stream, `NULL` for a memory writer */
+    char *  data;   /**< buffer */
+    size_t  size;   /**< size of \a data */
+    size_t  used;   /**< number of bytes used in \a data */
+    bool    error;  /**< an I/O error occurred */
+} outbuf_t;
+
+
+void outbuf_init(outbuf_t *buf, FILE *fp);
+void outbuf_free(outbuf_t *buf);
+void outbuf_reset(outbuf_t *buf);
+void outbuf_write(outbuf_t *buf, const void *data, size_t size);
+void outbuf_putc(outbuf_t *buf, int c);
+void outbuf_puts(outbuf_t *buf, const char *s);
+void outbuf_printf(outbuf_t *buf, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+void outbuf_append(outbuf_t *buf, const outbuf_t *src);
+bool outbuf_flush(outbuf_t *buf);
+
+#endif
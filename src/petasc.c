@@ -35,7 +35,6 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
-#include <ctype.h>
 
 #include "cbmdos.h"
 
@@ -90,7 +89,7 @@ static const uint8_t pet_to_asc_table[256] = {
     /* $c0-$df: invert case */
     0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b,
     0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
-    0x58, 0x59, 0x5a, 0xdb, 0xdd, 0xde, 0xdf,
+    0x58, 0x59, 0x5a, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
 
    /* $e0-$ff: copy of PETSCII $a0-$bf */
     0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab,
@@ -155,6 +154,133 @@ static const uint8_t asc_to_pet_table[256] = {
 
 
 
+/** \brief  PETSCII to printable 7-bit ASCII translation table
+ *
+ * Same as pet_to_asc_table, except that codes translating to values above $7f
+ * are replaced with '_'. Used by pet_to_asc_str() and pet_to_asc_names().
+ */
+static const uint8_t pet_to_asc7_table[256] = {
+    /* $00-$0f */
+    0x00, 0x01, 0x02, 0x1b, 0x04, 0x05, 0x06, 0x07,
+    0x14, 0x15, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    /* $10-$1f */
+    0x10, 0x11, 0x12, 0x13, 0x08, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    /* $20-$2f */
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
+    0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    /* $30-$3f */
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    /* $40-$4f */
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    /* $50-$5f */
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+    0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+    /* $60-$6f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $70-$7f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $80-$8f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x0d, 0x5f, 0x5f,
+    /* $90-$9f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $a0-$af */
+    0x20, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $b0-$bf */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $c0-$cf */
+    0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+    /* $d0-$df */
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+    0x58, 0x59, 0x5a, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $e0-$ef */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $f0-$ff */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+};
+
+
+/** \brief  Replace character illegal in Windows file names with '_'
+ *
+ * \param[in]   ch  ASCII code
+ */
+#ifdef _WIN32
+# define PET_HOST_WIN(ch)   0x5f
+#else
+# define PET_HOST_WIN(ch)   (ch)
+#endif
+
+/** \brief  PETSCII to host file name character translation table
+ *
+ * Precomputed version of `isprint(pet_to_asc(pet)) && is_host_allowed_char()`:
+ * unprintable codes and characters that are illegal in host file names (see
+ * host_illegal_chars) are replaced with '_'.
+ */
+static const uint8_t pet_to_host_table[256] = {
+    /* $00-$0f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $10-$1f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $20-$2f */
+    0x20, 0x21, PET_HOST_WIN(0x22), 0x23, 0x24, PET_HOST_WIN(0x25), 0x26, 0x27,
+    0x28, 0x29, PET_HOST_WIN(0x2a), 0x2b, 0x2c, 0x2d, 0x2e, 0x5f,
+    /* $30-$3f */
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, PET_HOST_WIN(0x3a), 0x3b, PET_HOST_WIN(0x3c), 0x3d, PET_HOST_WIN(0x3e), PET_HOST_WIN(0x3f),
+    /* $40-$4f */
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    /* $50-$5f */
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+    0x78, 0x79, 0x7a, 0x5b, PET_HOST_WIN(0x5c), 0x5d, 0x5e, 0x5f,
+    /* $60-$6f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $70-$7f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $80-$8f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $90-$9f */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $a0-$af */
+    0x20, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $b0-$bf */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $c0-$cf */
+    0x60, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+    /* $d0-$df */
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+    0x58, 0x59, 0x5a, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $e0-$ef */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    /* $f0-$ff */
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+    0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+};
+
+#undef PET_HOST_WIN
+
+
 /** \brief  Illegal characters in file names and paths
  *
  * A string containing characters that are illegal in a host path.
@@ -234,12 +360,64 @@ void pet_to_asc_str(char *asc, const uint8_t *pet, size_t n)
 {
     size_t i = 0;
     while (i < n && pet[i] != '\0') {
-        int b = pet_to_asc(pet[i]);
-        asc[i] = b < 0x80 ? (char)b : '_';
+        asc[i] = (char)pet_to_asc7_table[pet[i]];
         i++;
     }
     asc[i] = '\0';
+}
+
+
+/** \brief  Translate \a count PETSCII names to ASCII in one go
+ *
+ * Translates names of \a len bytes located every \a src_stride bytes in \a src,
+ * storing the results every \a dest_stride bytes in \a dest. This allows
+ * converting all filenames of a T64 directory (an array of t64_record_t) or of
+ * a D64 directory block in a single call.
+ *
+ * Each name is translated like pet_to_asc_str() (\a mode is PET_CONV_ASCII) or
+ * like pet_filename_to_host() (\a mode is PET_CONV_HOST), stopping at the first
+ * 0x0 in the PETSCII name. Trailing spaces (both $20 and $a0) are removed.
+ *
+ * The inner loop is a plain table lookup over all \a len bytes without any
+ * branches, the terminator is determined afterwards.
+ *
+ * \param[out]  dest        target strings, \a dest_stride must be at least
+ *                          \a len + 1
+ * \param[in]   dest_stride distance between strings in \a dest
+ * \param[in]   src         PETSCII names
+ * \param[in]   src_stride  distance between names in \a src
+ * \param[in]   len         length of each name in \a src
+ * \param[in]   count       number of names
+ * \param[in]   mode        conversion mode
+ */
+void pet_to_asc_names(char *dest, size_t dest_stride,
+                      const uint8_t *src, size_t src_stride,
+                      size_t len, size_t count,
+                      pet_conv_t mode)
+{
+    const uint8_t *table;
+    size_t n;
+
+    table = mode == PET_CONV_HOST ? pet_to_host_table : pet_to_asc7_table;
+
+    for (n = 0; n < count; n++) {
+        const uint8_t *pet = src + n * src_stride;
+        char *asc = dest + n * dest_stride;
+        const uint8_t *nul;
+        size_t end;
+        size_t i;
 
+        for (i = 0; i < len; i++) {
+            asc[i] = (char)table[pet[i]];
+        }
+
+        nul = memchr(pet, 0x00, len);
+        end = nul != NULL ? (size_t)(nul - pet) : len;
+        while (end > 0 && asc[end - 1] == 0x20) {
+            end--;
+        }
+        asc[end] = '\0';
+    }
 }
 
 
@@ -298,9 +476,7 @@ void pet_filename_to_host(char *asc, const uint8_t *pet, const char *ext)
         /* copy filename without padding */
         int i;
         for (i = 0; i < trail - lead; i++) {
-            int b = pet_to_asc(pet[lead + i]);
-            asc[i] = isprint(b) && is_host_allowed_char(b)
-                ? (char)b : '_';
+            asc[i] = (char)pet_to_host_table[pet[lead + i]];
         }
         /* terminate string */
         asc[trail - lead] = '\0';
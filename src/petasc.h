@@ -28,11 +28,24 @@
 #include <stdint.h>
 
 
+/** \brief  Conversion modes for pet_to_asc_names()
+ */
+typedef enum pet_conv_e {
+    PET_CONV_ASCII, /**< 7-bit ASCII, like pet_to_asc_str() */
+    PET_CONV_HOST   /**< characters allowed in host file names, replacing
+                         unprintable and illegal characters with '_' */
+} pet_conv_t;
+
+
 uint8_t pet_to_asc(uint8_t pet);
 uint8_t asc_to_pet(uint8_t asc);
 bool    is_host_allowed_char(int ch);
 void    pet_to_asc_str(char *asc, const uint8_t *pet, size_t n);
 void    asc_to_pet_str(uint8_t *pet, const char *asc, size_t n);
+void    pet_to_asc_names(char *dest, size_t dest_stride,
+                         const uint8_t *src, size_t src_stride,
+                         size_t len, size_t count,
+                         pet_conv_t mode);
 void    pet_filename_to_host(char *asc, const uint8_t *pet, const char *ext);
 int     write_petscii_digits(uint8_t *pet, int value, size_t len);
 
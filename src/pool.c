@@ -0,0 +1,345 @@
+/** \file   pool.c
+ * \brief   Fixed-size worker thread pool
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * A simple thread pool with a FIFO job queue. Jobs are submitted with
+ * pool_submit() and pool_wait() blocks until all submitted jobs have finished.
+ * The pool doesn't store any results: jobs are expected to write their results
+ * into the object passed to pool_submit(), which allows the caller to report
+ * results in a stable order regardless of the order in which jobs finish.
+ *
+ * A pool with a single worker doesn't create any threads at all, jobs are run
+ * directly from pool_submit(). This keeps the default (non-batch) code paths
+ * free of any threading overhead.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _WIN32
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
+
+#include "base.h"
+
+#include "pool.h"
+
+
+/** \brief  Initial size of the job queue
+ *
+ * The queue gets doubled in size whenever it's full.
+ */
+#define POOL_QUEUE_INIT 64
+
+
+/** \brief  Queued job
+ */
+typedef struct pool_job_s {
+    pool_func_t func;   /**< function to call */
+    void *      arg;    /**< argument for \a func */
+} pool_job_t;
+
+
+/** \brief  Worker argument
+ */
+typedef struct pool_worker_s {
+    pool_t *    pool;   /**< pool the worker belongs to */
+    int         index;  /**< index of the worker */
+} pool_worker_t;
+
+
+/** \brief  Thread pool
+ */
+struct pool_s {
+    pthread_mutex_t lock;           /**< lock for all members below */
+    pthread_cond_t  job_ready;      /**< signalled when a job is queued */
+    pthread_cond_t  jobs_done;      /**< signalled when the pool is idle */
+    pthread_t *     threads;        /**< worker threads */
+    pool_worker_t * workers;        /**< worker arguments */
+    int             worker_count;   /**< number of workers */
+    pool_job_t *    queue;          /**< job queue (ring buffer) */
+    size_t          queue_size;     /**< number of slots in \a queue */
+    size_t          queue_head;     /**< index of next job to run */
+    size_t          queue_used;     /**< number of jobs in \a queue */
+    size_t          pending;        /**< number of queued or running jobs */
+    bool            stop;           /**< workers should exit */
+};
+
+
+/** \brief  Get number of online processors
+ *
+ * \return  number of processors, at least 1
+ */
+int pool_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) {
+        return 1;
+    } else if (n > POOL_WORKERS_MAX) {
+        return POOL_WORKERS_MAX;
+    }
+    return (int)n;
+#endif
+}
+
+
+/** \brief  Pop job from the queue of \a pool
+ *
+ * \param[in,out]   pool    thread pool
+ *
+ * \return  job
+ *
+ * \note    Expects the queue to be locked and non-empty
+ */
+static pool_job_t pool_queue_pop(pool_t *pool)
+{
+    pool_job_t job = pool->queue[pool->queue_head];
+
+    pool->queue_head = (pool->queue_head + 1) % pool->queue_size;
+    pool->queue_used--;
+    return job;
+}
+
+
+/** \brief  Push job on the queue of \a pool
+ *
+ * \param[in,out]   pool    thread pool
+ * \param[in]       func    job function
+ * \param[in]       arg     argument for \a func
+ *
+ * \note    Expects the queue to be locked
+ */
+static void pool_queue_push(pool_t *pool, pool_func_t func, void *arg)
+{
+    size_t tail;
+
+    if (pool->queue_used == pool->queue_size) {
+        /* resize queue, unwrapping the ring buffer while doing so */
+        size_t size = pool->queue_size * 2;
+        pool_job_t *queue = base_malloc(sizeof *queue * size);
+        size_t i;
+
+        for (i = 0; i < pool->queue_used; i++) {
+            queue[i] = pool->queue[(pool->queue_head + i) % pool->queue_size];
+        }
+        base_free(pool->queue);
+        pool->queue = queue;
+        pool->queue_size = size;
+        pool->queue_head = 0;
+    }
+    tail = (pool->queue_head + pool->queue_used) % pool->queue_size;
+    pool->queue[tail].func = func;
+    pool->queue[tail].arg = arg;
+    pool->queue_used++;
+}
+
+
+/** \brief  Worker thread main loop
+ *
+ * \param[in]   arg worker argument (`pool_worker_t`)
+ *
+ * \return  NULL
+ */
+static void *pool_worker_main(void *arg)
+{
+    pool_worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        pool_job_t job;
+
+        while (pool->queue_used == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        }
+        if (pool->queue_used == 0) {
+            /* stop requested and nothing left to do */
+            break;
+        }
+        job = pool_queue_pop(pool);
+        pthread_mutex_unlock(&pool->lock);
+
+        job.func(job.arg, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->jobs_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+/** \brief  Create new thread pool
+ *
+ * \param[in]   workers number of worker threads, use 0 or less to get one
+ *                      worker per processor
+ *
+ * \return  new thread pool, free with pool_free()
+ */
+pool_t *pool_new(int workers)
+{
+    pool_t *pool = base_malloc(sizeof *pool);
+    int i;
+
+    if (workers < 1) {
+        workers = pool_cpu_count();
+    } else if (workers > POOL_WORKERS_MAX) {
+        workers = POOL_WORKERS_MAX;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->jobs_done, NULL);
+    pool->worker_count = workers;
+    pool->queue = base_malloc(sizeof *(pool->queue) * POOL_QUEUE_INIT);
+    pool->queue_size = POOL_QUEUE_INIT;
+    pool->queue_head = 0;
+    pool->queue_used = 0;
+    pool->pending = 0;
+    pool->stop = false;
+    pool->threads = NULL;
+    pool->workers = NULL;
+
+    if (workers == 1) {
+        /* jobs are run directly by pool_submit() */
+        return pool;
+    }
+
+    pool->threads = base_malloc(sizeof *(pool->threads) * (size_t)workers);
+    pool->workers = base_malloc(sizeof *(pool->workers) * (size_t)workers);
+    for (i = 0; i < workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker_main,
+                    &pool->workers[i]) != 0) {
+            /* continue with the threads we've got */
+            fprintf(stderr,
+                    "t64fix: warning: failed to create worker thread %d, "
+                    "continuing with %d worker(s)\n", i, i > 0 ? i : 1);
+            break;
+        }
+    }
+    if (i == 0) {
+        base_free(pool->threads);
+        base_free(pool->workers);
+        pool->threads = NULL;
+        pool->workers = NULL;
+        i = 1;
+    }
+    pool->worker_count = i;
+    return pool;
+}
+
+
+/** \brief  Get number of workers of \a pool
+ *
+ * \param[in]   pool    thread pool
+ *
+ * \return  number of workers
+ */
+int pool_workers(const pool_t *pool)
+{
+    return pool->worker_count;
+}
+
+
+/** \brief  Submit job to \a pool
+ *
+ * \param[in,out]   pool    thread pool
+ * \param[in]       func    job function
+ * \param[in]       arg     argument for \a func
+ */
+void pool_submit(pool_t *pool, pool_func_t func, void *arg)
+{
+    if (pool->threads == NULL) {
+        func(arg, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool_queue_push(pool, func, arg);
+    pool->pending++;
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/** \brief  Wait for all jobs submitted to \a pool to finish
+ *
+ * \param[in,out]   pool    thread pool
+ */
+void pool_wait(pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->jobs_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/** \brief  Free \a pool
+ *
+ * Finishes any queued jobs, stops the worker threads and frees all memory used
+ * by \a pool.
+ *
+ * \param[in,out]   pool    thread pool
+ */
+void pool_free(pool_t *pool)
+{
+    if (pool->threads != NULL) {
+        int i;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->job_ready);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < pool->worker_count; i++) {
+            pthread_join(pool->threads[i], NULL);
+        }
+        base_free(pool->threads);
+        base_free(pool->workers);
+    }
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->jobs_done);
+    pthread_mutex_destroy(&pool->lock);
+    base_free(pool->queue);
+    base_free(pool);
+}
@@ -0,0 +1,57 @@
+/** \file   pool.h
+ * \brief   Fixed-size worker thread pool - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_POOL_H
+#define HAVE_POOL_H
+
+#include <stdlib.h>
+
+
+/** \brief  Maximum number of worker threads in a pool
+ */
+#define POOL_WORKERS_MAX    256
+
+
+/** \brief  Job function
+ *
+ * \param[in]   arg     argument passed to pool_submit()
+ * \param[in]   worker  index of the worker running the job (0 to workers-1)
+ */
+typedef void (*pool_func_t)(void *arg, int worker);
+
+
+/** \brief  Opaque thread pool type
+ */
+typedef struct pool_s pool_t;
+
+
+int     pool_cpu_count(void);
+pool_t *pool_new(int workers);
+int     pool_workers(const pool_t *pool);
+void    pool_submit(pool_t *pool, pool_func_t func, void *arg);
+void    pool_wait(pool_t *pool);
+void    pool_free(pool_t *pool);
+
+#endif
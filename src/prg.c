@@ -33,92 +33,944 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include "base.h"
+#include "cbmdos.h"
+#include "d64.h"
+#include "outbuf.h"
 #include "petasc.h"
+#include "pool.h"
+#include "stats.h"
 #include "t64types.h"
 
 #include "prg.h"
 
 
+/** \brief  Size of buffer for host file names
+ *
+ * Filename (16), suffix to make the name unique ('_' and up to five digits),
+ * ".prg" and the terminating nul character.
+ */
+#define PRG_NAME_SIZE   (T64_REC_FILENAME_LEN + 6 + 4 + 1)
+
+
+/** \brief  Size of a tar block
+ */
+#define PRG_TAR_BLOCK   512
+
+/** \brief  Offset in tar header of the file name
+ */
+#define PRG_TAR_NAME    0
+
+/** \brief  Offset in tar header of the file mode (octal)
+ */
+#define PRG_TAR_MODE    100
+
+/** \brief  Offset in tar header of the owner's user ID (octal)
+ */
+#define PRG_TAR_UID     108
+
+/** \brief  Offset in tar header of the owner's group ID (octal)
+ */
+#define PRG_TAR_GID     116
+
+/** \brief  Offset in tar header of the file size (octal)
+ */
+#define PRG_TAR_SIZE    124
+
+/** \brief  Offset in tar header of the modification time (octal)
+ */
+#define PRG_TAR_MTIME   136
+
+/** \brief  Offset in tar header of the header checksum (octal)
+ */
+#define PRG_TAR_CHKSUM  148
+
+/** \brief  Offset in tar header of the entry type
+ */
+#define PRG_TAR_TYPE    156
+
+/** \brief  Offset in tar header of the ustar magic and version
+ */
+#define PRG_TAR_MAGIC   257
+
+
+/** \brief  Size of a cpio (newc) header, excluding the file name
+ */
+#define PRG_CPIO_HEADER 110
+
+/** \brief  Number of hexadecimal fields in a cpio (newc) header
+ */
+#define PRG_CPIO_FIELDS 13
+
+/** \brief  File name of the last entry of a cpio archive
+ */
+#define PRG_CPIO_TRAILER    "TRAILER!!!"
+
+
+/** \brief  Archive format writer
+ *
+ * Used by prg_extract_archive() to write the entries, so adding a format only
+ * requires a writer for a single entry and one for the end of the archive.
+ */
+typedef struct prg_sink_s {
+    /** \brief  Write an entry for a PRG file
+     *
+     * \param[in,out]   out     writer
+     * \param[in]       index   index of the entry in the archive
+     * \param[in]       name    file name
+     * \param[in]       addr    load address of the file, little endian
+     * \param[in]       data    file data, excluding the load address
+     * \param[in]       size    size of \a data
+     *
+     * \return  number of bytes written
+     */
+    size_t (*entry)(outbuf_t *out,
+                    size_t index,
+                    const char *name,
+                    const uint8_t *addr,
+                    const uint8_t *data,
+                    size_t size);
+
+    /** \brief  Write the end of the archive
+     *
+     * \param[in,out]   out writer
+     *
+     * \return  number of bytes written
+     */
+    size_t (*finish)(outbuf_t *out);
+} prg_sink_t;
+
+
+/** \brief  Extraction job
+ */
+typedef struct prg_job_s {
+    const t64_image_t * image;              /**< image to extract from */
+    int                 index;              /**< record index */
+    char                name[PRG_NAME_SIZE];/**< host file name */
+    bool                ok;                 /**< file written succesfully */
+    int                 error;              /**< t64_errno on failure */
+    int                 sys_errno;          /**< errno on failure */
+} prg_job_t;
+
+
+/** \brief  Determine if \a record is a memory snapshot
+ *
+ * \param[in]   record  t64 record
+ *
+ * \return  bool
+ */
+static bool is_snapshot(const t64_record_t *record)
+{
+    return record->c64s_ftype > 1 || record->c1541_ftype == 0x00;
+}
+
+
+/** \brief  Generate host file name for \a record, excluding extension
+ *
+ * Converts the filename from PETSCII, replaces characters that are illegal in
+ * host file names and removes the padding.
+ *
+ * \param[out]  name    name buffer, at least T64_REC_FILENAME_LEN + 1 bytes
+ * \param[in]   record  t64 record
+ */
+static void prg_name(char *name, const t64_record_t *record)
+{
+    pet_to_asc_names(name, T64_REC_FILENAME_LEN + 1,
+                     record->filename, T64_REC_FILENAME_LEN,
+                     T64_REC_FILENAME_LEN, 1, PET_CONV_HOST);
+}
+
+
+/** \brief  Get a pointer to the data of \a record, checking bounds
+ *
+ * \param[in]   image   t64 image
+ * \param[in]   record  record in \a image
+ * \param[out]  size    size of the data of \a record
+ *
+ * \return  pointer into the data of \a image or `NULL` when the record's data
+ *          isn't inside the image
+ * \throw   T64_ERR_T64_INVALID
+ */
+static const uint8_t *prg_data(const t64_image_t *image,
+                               const t64_record_t *record,
+                               size_t *size)
+{
+    *size = (size_t)(record->real_end_addr - record->start_addr);
+    if (record->offset > image->size || *size > image->size - record->offset) {
+        t64_errno = T64_ERR_T64_INVALID;
+        return NULL;
+    }
+    return image->data + record->offset;
+}
+
+
 /** \brief  Extract prg file at \a index from \a image
  *
  * \param[in]   image   t64 image
  * \param[in]   index   index in \a image of file to extract
+ * \param[in]   path    path of the prg file, "-" for stdout, `NULL` to use
+ *                      the file name of the record
  * \param[in]   quiet   don't output anything to stdout/stderr
  *
  * \return  bool
  */
-bool prg_extract(const t64_image_t *image, int index, int quiet)
+bool prg_extract(const t64_image_t *image,
+                 int index,
+                 const char *path,
+                 int quiet)
 {
     t64_record_t *record;
-    char name[T64_REC_FILENAME_LEN + 5];    /* +4 for '.prg', + 1 for 0 */
-    int i;
+    char name[PRG_NAME_SIZE];
+    const uint8_t *data;
+    size_t size;
 
     if (index < 0 || index >= image->rec_used) {
         t64_errno = T64_ERR_INDEX;
         return false;
     }
+    if (image->partial) {
+        t64_errno = T64_ERR_PARTIAL;
+        return false;
+    }
 
     record = image->records + index;
 
     /* check for memory snapshot */
-    if (record->c64s_ftype > 1 || record->c1541_ftype == 0x00) {
+    if (is_snapshot(record)) {
         if (!quiet) {
             fprintf(stderr, "t64fix: skipping memory snapshot\n");
         }
         return true;
     }
-    /* convert filename from PETSCII, replace '/' */
-    pet_to_asc_str(name, record->filename, T64_REC_FILENAME_LEN);
-    for (i = 0; i < T64_REC_FILENAME_LEN; i++) {
-        if (name[i] == '/') {
-            name[i] = '_';
-        }
+    /* make sure the data is actually inside the image */
+    data = prg_data(image, record, &size);
+    if (data == NULL) {
+        return false;
     }
-    /* remove padding */
-    i--;
-    while (i >= 0 && name[i] == 0x20) {
-        name[i--] = '\0';
+
+    if (path == NULL) {
+        prg_name(name, record);
+        strcat(name, ".prg");
+        path = name;
     }
-    strcpy(name + i + 1, ".prg");
     if (!quiet) {
-        printf("t64fix: writing prg file '%s'\n", name);
+        printf("t64fix: writing prg file '%s'\n", path);
     }
 
-    return fwrite_prg(name, image->data + record->offset,
-            (size_t)(record->real_end_addr - record->start_addr),
-            record->start_addr);
+    return fwrite_prg(path, data, size, record->start_addr);
+}
+
+
+/** \brief  Extract prg file at \a index from \a image into memory writer \a out
+ *
+ * Appends the load address and the data of the file to \a out. Nothing is
+ * appended for memory snapshots, like prg_extract() skips them.
+ *
+ * \param[in]       image   t64 image
+ * \param[in]       index   index in \a image of file to extract
+ * \param[in,out]   out     writer
+ *
+ * \return  bool
+ * \throw   T64_ERR_INDEX
+ * \throw   T64_ERR_PARTIAL
+ * \throw   T64_ERR_T64_INVALID
+ */
+bool prg_extract_mem(const t64_image_t *image, int index, outbuf_t *out)
+{
+    const t64_record_t *record;
+    const uint8_t *data;
+    size_t size;
+
+    if (index < 0 || index >= image->rec_used) {
+        t64_errno = T64_ERR_INDEX;
+        return false;
+    }
+    if (image->partial) {
+        t64_errno = T64_ERR_PARTIAL;
+        return false;
+    }
+
+    record = image->records + index;
+    if (is_snapshot(record)) {
+        return true;
+    }
+    data = prg_data(image, record, &size);
+    if (data == NULL) {
+        return false;
+    }
+    outbuf_putc(out, record->start_addr & 0xff);
+    outbuf_putc(out, (record->start_addr >> 8) & 0xff);
+    outbuf_write(out, data, size);
+    return true;
+}
+
+
+/** \brief  Compare host file names, ignoring case
+ *
+ * Names differing only in case are treated as equal, they would clobber each
+ * other on case-insensitive file systems.
+ *
+ * \param[in]   s1  name
+ * \param[in]   s2  name
+ *
+ * \return  <0, 0 or >0
+ */
+static int prg_name_cmp(const char *s1, const char *s2)
+{
+    while (*s1 != '\0' && tolower((unsigned char)*s1) == tolower((unsigned char)*s2)) {
+        s1++;
+        s2++;
+    }
+    return tolower((unsigned char)*s1) - tolower((unsigned char)*s2);
+}
+
+
+/** \brief  qsort(3) callback: sort jobs on name, then on record index
+ *
+ * \param[in]   p1  job pointer
+ * \param[in]   p2  job pointer
+ *
+ * \return  <0, 0 or >0
+ */
+static int compar_job_name(const void *p1, const void *p2)
+{
+    const prg_job_t *j1 = *(const prg_job_t * const *)p1;
+    const prg_job_t *j2 = *(const prg_job_t * const *)p2;
+    int result = prg_name_cmp(j1->name, j2->name);
+
+    if (result == 0) {
+        result = j1->index - j2->index;
+    }
+    return result;
+}
+
+
+/** \brief  Make the host file names of \a jobs unique
+ *
+ * The first file (in record order) of a set of files with the same name keeps
+ * its name, the others get the record index appended. Should that still result
+ * in a collision (a tape containing both "foo" twice and "foo_1" for example),
+ * the extraction is refused before any file is written.
+ *
+ * \param[in,out]   jobs    extraction jobs
+ * \param[in]       count   number of elements in \a jobs
+ * \param[in]       quiet   don't output anything on stdout
+ *
+ * \return  false on remaining collisions
+ * \throw   T64_ERR_T64_INVALID
+ */
+static bool prg_unique_names(prg_job_t *jobs, size_t count, int quiet)
+{
+    prg_job_t **sorted;
+    bool result = true;
+    size_t i;
+
+    if (count < 2) {
+        return true;
+    }
+
+    sorted = base_malloc(sizeof *sorted * count);
+    for (i = 0; i < count; i++) {
+        sorted[i] = jobs + i;
+    }
+    qsort(sorted, count, sizeof *sorted, compar_job_name);
+    for (i = count - 1; i > 0; i--) {
+        if (prg_name_cmp(sorted[i - 1]->name, sorted[i]->name) == 0) {
+            size_t len = strlen(sorted[i]->name);
+
+            snprintf(sorted[i]->name + len, PRG_NAME_SIZE - len, "_%d",
+                    sorted[i]->index);
+            if (!quiet) {
+                printf("t64fix: file %d: duplicate name, using '%s.prg'\n",
+                        sorted[i]->index, sorted[i]->name);
+            }
+        }
+    }
+
+    /* check the renamed files didn't collide with others */
+    qsort(sorted, count, sizeof *sorted, compar_job_name);
+    for (i = 1; i < count; i++) {
+        if (prg_name_cmp(sorted[i - 1]->name, sorted[i]->name) == 0) {
+            if (!quiet) {
+                fprintf(stderr,
+                        "t64fix: files %d and %d would both be written as "
+                        "'%s.prg'\n",
+                        sorted[i - 1]->index, sorted[i]->index,
+                        sorted[i]->name);
+            }
+            t64_errno = T64_ERR_T64_INVALID;
+            result = false;
+            break;
+        }
+    }
+    base_free(sorted);
+    return result;
+}
+
+
+/** \brief  Pool worker: write prg file of a job
+ *
+ * \param[in,out]   arg     job (`prg_job_t`)
+ * \param[in]       worker  worker index (unused)
+ */
+static void prg_write_job(void *arg, int worker)
+{
+    prg_job_t *job = arg;
+    const t64_record_t *record = job->image->records + job->index;
+    const uint8_t *data;
+    size_t size;
+
+    (void)worker;
+
+    errno = 0;
+    data = prg_data(job->image, record, &size);
+    job->ok = data != NULL
+        && fwrite_prg(job->name, data, size, record->start_addr);
+    if (!job->ok) {
+        job->error = t64_errno;
+        job->sys_errno = errno;
+    }
+}
+
+
+/** \brief  Create extraction jobs for all files in \a image
+ *
+ * Memory snapshots are skipped, the names of the jobs are made unique and get
+ * the ".prg" extension.
+ *
+ * \param[in]   image   t64 image
+ * \param[out]  count   number of jobs
+ * \param[in]   quiet   don't output anything to stdout/stderr
+ *
+ * \return  jobs (free with base_free()) or `NULL` on error
+ * \throw   T64_ERR_PARTIAL
+ * \throw   T64_ERR_T64_INVALID
+ */
+static prg_job_t *prg_jobs_new(const t64_image_t *image,
+                               size_t *count,
+                               int quiet)
+{
+    const size_t name_size = T64_REC_FILENAME_LEN + 1;
+    prg_job_t *jobs;
+    char *names;
+    size_t i;
+    int r;
+
+    *count = 0;
+    if (image->partial) {
+        t64_errno = T64_ERR_PARTIAL;
+        return NULL;
+    }
+
+    /* translate all filenames in one go */
+    names = base_malloc(name_size * ((size_t)image->rec_used + 1));
+    if (image->rec_used > 0) {
+        pet_to_asc_names(names, name_size,
+                         image->records[0].filename, sizeof *(image->records),
+                         T64_REC_FILENAME_LEN, (size_t)image->rec_used,
+                         PET_CONV_HOST);
+    }
+
+    jobs = base_malloc(sizeof *jobs * ((size_t)image->rec_used + 1));
+    for (r = 0; r < image->rec_used; r++) {
+        const t64_record_t *record = image->records + r;
+
+        if (is_snapshot(record)) {
+            if (!quiet) {
+                printf("t64fix: skipping file %d: memory snapshot\n", r);
+            }
+        } else {
+            prg_job_t *job = jobs + (*count)++;
+
+            job->image = image;
+            job->index = r;
+            job->ok = false;
+            job->error = 0;
+            job->sys_errno = 0;
+            strcpy(job->name, names + (size_t)r * name_size);
+        }
+    }
+    base_free(names);
+    if (!prg_unique_names(jobs, *count, quiet)) {
+        base_free(jobs);
+        return NULL;
+    }
+    for (i = 0; i < *count; i++) {
+        strcat(jobs[i].name, ".prg");
+    }
+    return jobs;
 }
 
 
 /** \brief  Extract all files
+ *
+ * The output names of all files are determined before anything gets written,
+ * duplicate names get the record index appended. The files are then written
+ * concurrently on a thread pool, each with a single vectored write directly
+ * from the image data.
  *
  * \param[in]   image   t64 image
+ * \param[in]   workers number of worker threads (0 for one per processor)
  * \param[in]   quiet   don't output information on stdout/stderr
  *
  * \return  bool
  */
-bool prg_extract_all(const t64_image_t *image, int quiet)
+bool prg_extract_all(const t64_image_t *image, int workers, int quiet)
 {
+    prg_job_t *jobs;
+    pool_t *pool;
+    size_t count;
+    bool result = true;
     int i;
-    int skipped = 0;
 
-    for (i = 0; i < image->rec_used; i++) {
-        t64_record_t *record = image->records + i;
-        if (record->c64s_ftype > 1 || record->c1541_ftype == 0x00) {
+    jobs = prg_jobs_new(image, &count, quiet);
+    if (jobs == NULL) {
+        return false;
+    }
+
+    pool = pool_new(workers);
+    for (i = 0; i < (int)count; i++) {
+        pool_submit(pool, prg_write_job, jobs + i);
+    }
+    pool_wait(pool);
+    pool_free(pool);
+
+    /* report in record order */
+    for (i = 0; i < (int)count; i++) {
+        if (jobs[i].ok) {
+            if (!quiet) {
+                printf("t64fix: writing prg file '%s'\n", jobs[i].name);
+            }
+        } else if (result) {
+            /* keep the error of the first failed file for the caller */
+            t64_errno = jobs[i].error;
+            errno = jobs[i].sys_errno;
+            result = false;
+        }
+    }
+    if (result && !quiet) {
+        printf("t64fix: extracted %d files\n", (int)count);
+    }
+    base_free(jobs);
+    return result;
+}
+
+
+/** \brief  Write octal number \a value into tar header field
+ *
+ * \param[out]  field   header field
+ * \param[in]   len     size of \a field, including the terminating nul
+ * \param[in]   value   value
+ */
+static void prg_tar_octal(char *field, size_t len, unsigned long value)
+{
+    size_t i = len - 1;
+
+    field[i] = '\0';
+    while (i > 0) {
+        field[--i] = (char)('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+
+/** \brief  Generate tar (ustar) header for a regular file
+ *
+ * The modification time is set to 0 so extracting the same image twice gives
+ * identical archives.
+ *
+ * \param[out]  header  header block
+ * \param[in]   name    file name (less than 100 characters)
+ * \param[in]   size    size of the file
+ */
+static void prg_tar_header(char *header, const char *name, size_t size)
+{
+    unsigned long sum = 0;
+    size_t i;
+
+    memset(header, 0, PRG_TAR_BLOCK);
+    memcpy(header + PRG_TAR_NAME, name, strlen(name));
+    prg_tar_octal(header + PRG_TAR_MODE, 8, 0644);
+    prg_tar_octal(header + PRG_TAR_UID, 8, 0);
+    prg_tar_octal(header + PRG_TAR_GID, 8, 0);
+    prg_tar_octal(header + PRG_TAR_SIZE, 12, (unsigned long)size);
+    prg_tar_octal(header + PRG_TAR_MTIME, 12, 0);
+    header[PRG_TAR_TYPE] = '0';
+    memcpy(header + PRG_TAR_MAGIC, "ustar\0" "00", 8);
+
+    /* the checksum is calculated with the checksum field set to spaces */
+    memset(header + PRG_TAR_CHKSUM, ' ', 8);
+    for (i = 0; i < PRG_TAR_BLOCK; i++) {
+        sum += (unsigned char)header[i];
+    }
+    prg_tar_octal(header + PRG_TAR_CHKSUM, 7, sum);
+}
+
+
+/** \brief  Write tar entry for a PRG file
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       index   index of the entry (unused)
+ * \param[in]       name    file name
+ * \param[in]       addr    load address of the file, little endian
+ * \param[in]       data    file data, excluding the load address
+ * \param[in]       size    size of \a data
+ *
+ * \return  number of bytes written
+ */
+static size_t prg_tar_entry(outbuf_t *out,
+                            size_t index,
+                            const char *name,
+                            const uint8_t *addr,
+                            const uint8_t *data,
+                            size_t size)
+{
+    static const char zeros[PRG_TAR_BLOCK];
+    char header[PRG_TAR_BLOCK];
+    size_t pad = (PRG_TAR_BLOCK - (size + 2) % PRG_TAR_BLOCK) % PRG_TAR_BLOCK;
+
+    (void)index;
+
+    prg_tar_header(header, name, size + 2);
+    outbuf_write(out, header, PRG_TAR_BLOCK);
+    outbuf_write(out, addr, 2);
+    outbuf_write(out, data, size);
+    outbuf_write(out, zeros, pad);
+    return PRG_TAR_BLOCK + size + 2 + pad;
+}
+
+
+/** \brief  Write end of tar archive: two zero blocks
+ *
+ * \param[in,out]   out writer
+ *
+ * \return  number of bytes written
+ */
+static size_t prg_tar_finish(outbuf_t *out)
+{
+    static const char zeros[PRG_TAR_BLOCK * 2];
+
+    outbuf_write(out, zeros, sizeof zeros);
+    return sizeof zeros;
+}
+
+
+/** \brief  Write cpio (newc) header and file name
+ *
+ * The newc header is "070701" followed by thirteen 8-digit hexadecimal
+ * fields, the name (including its nul) is padded to a multiple of four bytes
+ * together with the header. Like tar entries, the modification time is 0 and
+ * the file is owned by root.
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       ino     inode number
+ * \param[in]       mode    file mode and type
+ * \param[in]       name    file name
+ * \param[in]       size    size of the file
+ *
+ * \return  number of bytes written
+ */
+static size_t prg_cpio_header(outbuf_t *out,
+                              unsigned long ino,
+                              unsigned long mode,
+                              const char *name,
+                              size_t size)
+{
+    static const char zeros[4];
+    static const char digits[] = "0123456789ABCDEF";
+    char header[PRG_CPIO_HEADER];
+    size_t namesize = strlen(name) + 1;
+    size_t pad = (4 - (PRG_CPIO_HEADER + namesize) % 4) % 4;
+    unsigned long fields[PRG_CPIO_FIELDS];
+    size_t f;
+    int i;
+
+    memset(fields, 0, sizeof fields);
+    fields[0] = ino;
+    fields[1] = mode;
+    fields[4] = 1;    /* nlink */
+    fields[6] = (unsigned long)size;
+    fields[11] = (unsigned long)namesize;
+
+    memcpy(header, "070701", 6);
+    for (f = 0; f < PRG_CPIO_FIELDS; f++) {
+        for (i = 7; i >= 0; i--) {
+            header[6 + f * 8 + (size_t)i] = digits[fields[f] & 0xf];
+            fields[f] >>= 4;
+        }
+    }
+    outbuf_write(out, header, PRG_CPIO_HEADER);
+    outbuf_write(out, name, namesize);
+    outbuf_write(out, zeros, pad);
+    return PRG_CPIO_HEADER + namesize + pad;
+}
+
+
+/** \brief  Write cpio (newc) entry for a PRG file
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       index   index of the entry, used for the inode number
+ * \param[in]       name    file name
+ * \param[in]       addr    load address of the file, little endian
+ * \param[in]       data    file data, excluding the load address
+ * \param[in]       size    size of \a data
+ *
+ * \return  number of bytes written
+ */
+static size_t prg_cpio_entry(outbuf_t *out,
+                             size_t index,
+                             const char *name,
+                             const uint8_t *addr,
+                             const uint8_t *data,
+                             size_t size)
+{
+    static const char zeros[4];
+    size_t pad = (4 - (size + 2) % 4) % 4;
+    size_t total;
+
+    /* regular file, 0644 */
+    total = prg_cpio_header(out, (unsigned long)index + 1, 0100644, name,
+                            size + 2);
+    outbuf_write(out, addr, 2);
+    outbuf_write(out, data, size);
+    outbuf_write(out, zeros, pad);
+    return total + size + 2 + pad;
+}
+
+
+/** \brief  Write end of cpio archive: the trailer entry
+ *
+ * \param[in,out]   out writer
+ *
+ * \return  number of bytes written
+ */
+static size_t prg_cpio_finish(outbuf_t *out)
+{
+    return prg_cpio_header(out, 0, 0, PRG_CPIO_TRAILER, 0);
+}
+
+
+/** \brief  Archive writers, indexed by prg_archive_t
+ */
+static const prg_sink_t prg_sinks[] = {
+    { prg_tar_entry,    prg_tar_finish },   /* PRG_ARCHIVE_TAR */
+    { prg_cpio_entry,   prg_cpio_finish }   /* PRG_ARCHIVE_CPIO */
+};
+
+
+/** \brief  Extract all files from \a image into an archive
+ *
+ * The archive is written sequentially, streaming the data of the files from
+ * the image data, so \a path can be a pipe or "-" for stdout. Files get the
+ * same names as with prg_extract_all().
+ *
+ * \param[in]   image   t64 image
+ * \param[in]   path    path of the archive, "-" for stdout
+ * \param[in]   format  archive format
+ * \param[in]   quiet   don't output anything to stdout/stderr
+ *
+ * \return  bool
+ * \throw   T64_ERR_PARTIAL
+ * \throw   T64_ERR_T64_INVALID
+ * \throw   T64_ERR_IO
+ */
+bool prg_extract_archive(const t64_image_t *image,
+                         const char *path,
+                         prg_archive_t format,
+                         int quiet)
+{
+    const prg_sink_t *sink = prg_sinks + format;
+    prg_job_t *jobs;
+    outbuf_t out;
+    size_t count;
+    size_t total = 0;
+    size_t i;
+    bool result = true;
+    FILE *fp;
+    STATS_START(t_write);
+
+    jobs = prg_jobs_new(image, &count, quiet);
+    if (jobs == NULL) {
+        return false;
+    }
+
+    errno = 0;
+    if (base_is_stdio(path)) {
+        fp = stdout;
+        base_set_binary(fp);
+    } else {
+        fp = fopen(path, "wb");
+        if (fp == NULL) {
+            t64_errno = T64_ERR_IO;
+            base_free(jobs);
+            return false;
+        }
+    }
+
+    outbuf_init(&out, fp);
+    for (i = 0; i < count && result; i++) {
+        const t64_record_t *record = image->records + jobs[i].index;
+        const uint8_t *data;
+        uint8_t addr[2];
+        size_t size;
+
+        data = prg_data(image, record, &size);
+        if (data == NULL) {
+            result = false;
+            break;
+        }
+        if (!quiet) {
+            printf("t64fix: adding prg file '%s'\n", jobs[i].name);
+        }
+        set_uint16(addr, record->start_addr);
+        total += sink->entry(&out, i, jobs[i].name, addr, data, size);
+    }
+    if (result) {
+        total += sink->finish(&out);
+        result = outbuf_flush(&out);
+    }
+    outbuf_free(&out);
+
+    if (fp != stdout) {
+        if (fclose(fp) != 0 && result) {
+            t64_errno = T64_ERR_IO;
+            result = false;
+        }
+        if (!result) {
+            remove(path);
+        }
+    }
+    STATS_STOP(STATS_PHASE_WRITE, t_write);
+    if (result) {
+        STATS_ADD(STATS_BYTES_WRITTEN, total);
+        STATS_ADD(STATS_FILES_WRITTEN, 1);
+        if (!quiet) {
+            printf("t64fix: extracted %d files into '%s'\n", (int)count, path);
+        }
+    }
+    base_free(jobs);
+    return result;
+}
+
+
+/** \brief  Extract all files from \a image into a tar archive
+ *
+ * \param[in]   image   t64 image
+ * \param[in]   path    path of the archive, "-" for stdout
+ * \param[in]   quiet   don't output anything to stdout/stderr
+ *
+ * \return  bool
+ * \throw   T64_ERR_PARTIAL
+ * \throw   T64_ERR_T64_INVALID
+ * \throw   T64_ERR_IO
+ */
+bool prg_extract_tar(const t64_image_t *image, const char *path, int quiet)
+{
+    return prg_extract_archive(image, path, PRG_ARCHIVE_TAR, quiet);
+}
+
+
+/** \brief  Convert PETSCII name padded with spaces to D64 format
+ *
+ * \param[out]  dest    D64 name, padded with $a0
+ * \param[in]   src     name padded with spaces
+ * \param[in]   len     length of \a src
+ */
+static void prg_d64_name(uint8_t *dest, const uint8_t *src, size_t len)
+{
+    size_t i;
+
+    if (len > CBMDOS_FILENAME_MAX) {
+        len = CBMDOS_FILENAME_MAX;
+    }
+    memset(dest, 0xa0, CBMDOS_FILENAME_MAX);
+    memcpy(dest, src, len);
+    for (i = len; i > 0 && (dest[i - 1] == 0x20 || dest[i - 1] == 0x00); i--) {
+        dest[i - 1] = 0xa0;
+    }
+}
+
+
+/** \brief  Convert all files in \a image to a new D64 image
+ *
+ * The files are written in record order with the interleave of the 1541, the
+ * tape name is used as disk name. Memory snapshots are skipped.
+ *
+ * \param[in]   image   t64 image
+ * \param[in]   path    path of the D64 image, "-" for stdout
+ * \param[in]   quiet   don't output anything to stdout/stderr
+ *
+ * \return  bool
+ * \throw   T64_ERR_PARTIAL
+ * \throw   T64_ERR_T64_INVALID
+ * \throw   T64_ERR_D64_FULL
+ * \throw   T64_ERR_IO
+ */
+bool prg_extract_d64(const t64_image_t *image, const char *path, int quiet)
+{
+    d64_t d64;
+    uint8_t name[CBMDOS_FILENAME_MAX];
+    bool result = true;
+    int count = 0;
+    int i;
+
+    if (image->partial) {
+        t64_errno = T64_ERR_PARTIAL;
+        return false;
+    }
+
+    d64_new(&d64);
+    prg_d64_name(name, image->tapename, T64_HDR_NAME_LEN);
+    memcpy(d64.data + D64_BAM_OFFSET + D64_BAM_DISKNAME, name,
+           D64_DISKNAME_MAXLEN);
+
+    for (i = 0; i < image->rec_used && result; i++) {
+        const t64_record_t *record = image->records + i;
+        const uint8_t *data;
+        uint8_t filetype;
+        size_t size;
+
+        if (is_snapshot(record)) {
             if (!quiet) {
                 printf("t64fix: skipping file %d: memory snapshot\n", i);
             }
-            skipped++;
-        } else {
-            if (!prg_extract(image, i, quiet)) {
-                return false;
+            continue;
+        }
+        data = prg_data(image, record, &size);
+        if (data == NULL) {
+            result = false;
+            break;
+        }
+        /* keep SEQ/PRG/USR from the record, anything else becomes PRG */
+        filetype = record->c1541_ftype;
+        if ((filetype & CBMDOS_FILETYPE_MASK) < CBMDOS_FILETYPE_SEQ
+                || (filetype & CBMDOS_FILETYPE_MASK) > CBMDOS_FILETYPE_USR) {
+            filetype = CBMDOS_FILETYPE_PRG;
+        }
+        filetype = (uint8_t)((filetype & CBMDOS_FILETYPE_MASK)
+                | CBMDOS_CLOSED_MASK);
+
+        prg_d64_name(name, record->filename, T64_REC_FILENAME_LEN);
+        if (!d64_file_write_prg(&d64, name, filetype, record->start_addr,
+                    data, size)) {
+            if (!quiet) {
+                printf("t64fix: no room on disk for file %d\n", i);
             }
+            result = false;
+            break;
         }
+        count++;
     }
-    if (!quiet) {
-        printf("t64fix: extracted %d files\n", image->rec_used - skipped);
+
+    if (result) {
+        result = d64_write(&d64, path);
+        if (result && !quiet) {
+            printf("t64fix: wrote %d files to '%s', %d blocks free\n",
+                    count, path, d64_blocks_free(&d64));
+        }
     }
-    return true;
+    d64_free(&d64);
+    return result;
 }
@@ -28,9 +28,28 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef HAVE_PRG_H
 #define HAVE_PRG_H
 
+#include "outbuf.h"
 #include "t64.h"
 
-bool prg_extract(const t64_image_t *image, int index, int quiet);
-bool prg_extract_all(const t64_image_t *image, int quiet);
+/** \brief  Archive formats for prg_extract_archive()
+ */
+typedef enum prg_archive_e {
+    PRG_ARCHIVE_TAR,    /**< POSIX ustar */
+    PRG_ARCHIVE_CPIO    /**< SVR4 cpio without checksums (newc) */
+} prg_archive_t;
+
+
+bool prg_extract(const t64_image_t *image,
+                 int index,
+                 const char *path,
+                 int quiet);
+bool prg_extract_mem(const t64_image_t *image, int index, outbuf_t *out);
+bool prg_extract_all(const t64_image_t *image, int workers, int quiet);
+bool prg_extract_tar(const t64_image_t *image, const char *path, int quiet);
+bool prg_extract_archive(const t64_image_t *image,
+                         const char *path,
+                         prg_archive_t format,
+                         int quiet);
+bool prg_extract_d64(const t64_image_t *image, const char *path, int quiet);
 
 #endif
@@ -0,0 +1,542 @@
+/** \file   report.c
+ * \brief   Machine-readable verification reports
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Generates NDJSON or CSV reports of verified images into a buffered writer.
+ *
+ * NDJSON: one object per image on a single line, containing the header fields,
+ * the fix count and reasons and an array with all records.
+ *
+ * CSV: a header row followed by one "image" row per image and one "record" row
+ * per record, columns that don't apply to a row are left empty. Multiple fix
+ * reasons in a single field are separated with '|'.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "base.h"
+#include "outbuf.h"
+#include "petasc.h"
+#include "stats.h"
+#include "t64types.h"
+
+#include "report.h"
+
+
+/** \brief  Names of the fix reasons, in `t64_fix_t` bit order
+ */
+static const char *fix_names[T64_FIX_COUNT] = {
+    "magic", "rec_max", "rec_used", "rec_range", "filetype", "end_addr"
+};
+
+/** \brief  Record status names, indexed by `t64_status_t`
+ */
+static const char *status_names[] = { "ok", "fixed", "skipped" };
+
+/** \brief  CSV header row
+ */
+static const char csv_header[] =
+    "kind,path,status,fixes,fix_reasons,error,magic,version,tapename,"
+    "rec_max,rec_used,index,filename,c64s_type,c1541_type,start_addr,"
+    "end_addr,real_end_addr,offset,hash\n";
+
+
+/** \brief  Get report format from its \a name
+ *
+ * \param[in]   name    format name ("text", "ndjson" or "csv")
+ * \param[out]  format  report format
+ *
+ * \return  false if \a name is not a valid format
+ */
+bool report_get_format(const char *name, report_format_t *format)
+{
+    if (name == NULL || strcmp(name, "text") == 0) {
+        *format = REPORT_TEXT;
+    } else if (strcmp(name, "ndjson") == 0) {
+        *format = REPORT_NDJSON;
+    } else if (strcmp(name, "csv") == 0) {
+        *format = REPORT_CSV;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief  Convert PETSCII name to ASCII, removing padding
+ *
+ * \param[out]  dest    destination, at least \a len + 1 bytes
+ * \param[in]   name    PETSCII name
+ * \param[in]   len     maximum length of \a name
+ */
+static void ascii_name(char *dest, const uint8_t *name, size_t len)
+{
+    pet_to_asc_str(dest, name, len);
+    len = strlen(dest);
+    while (len > 0 && dest[len - 1] == 0x20) {
+        dest[--len] = '\0';
+    }
+}
+
+
+/** \brief  Write JSON string \a s, quoted and escaped
+ *
+ * \param[in,out]   out writer
+ * \param[in]       s   string
+ */
+static void json_string(outbuf_t *out, const char *s)
+{
+    outbuf_putc(out, '"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+
+        if (c == '"' || c == '\\') {
+            outbuf_putc(out, '\\');
+            outbuf_putc(out, c);
+        } else if (c < 0x20) {
+            outbuf_printf(out, "\\u%04x", c);
+        } else {
+            outbuf_putc(out, c);
+        }
+    }
+    outbuf_putc(out, '"');
+}
+
+
+/** \brief  Write CSV field \a s, quoting it when required
+ *
+ * \param[in,out]   out writer
+ * \param[in]       s   string
+ */
+static void csv_string(outbuf_t *out, const char *s)
+{
+    if (strpbrk(s, ",\"\r\n") == NULL && s[0] != ' ') {
+        outbuf_puts(out, s);
+        return;
+    }
+    outbuf_putc(out, '"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"') {
+            outbuf_putc(out, '"');
+        }
+        outbuf_putc(out, *s);
+    }
+    outbuf_putc(out, '"');
+}
+
+
+/** \brief  Write fix reasons in \a flags
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       format  report format
+ * \param[in]       flags   `t64_fix_t` flags
+ */
+static void fix_reasons(outbuf_t *out, report_format_t format, unsigned int flags)
+{
+    bool first = true;
+    int i;
+
+    if (format == REPORT_NDJSON) {
+        outbuf_putc(out, '[');
+    }
+    for (i = 0; i < T64_FIX_COUNT; i++) {
+        if (flags & (1u << i)) {
+            if (!first) {
+                outbuf_putc(out, format == REPORT_NDJSON ? ',' : '|');
+            }
+            if (format == REPORT_NDJSON) {
+                json_string(out, fix_names[i]);
+            } else {
+                outbuf_puts(out, fix_names[i]);
+            }
+            first = false;
+        }
+    }
+    if (format == REPORT_NDJSON) {
+        outbuf_putc(out, ']');
+    }
+}
+
+
+/** \brief  Start report
+ *
+ * Writes the CSV header row, doesn't do anything for other formats.
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       format  report format
+ */
+void report_begin(outbuf_t *out, report_format_t format)
+{
+    if (format == REPORT_CSV) {
+        outbuf_write(out, csv_header, sizeof csv_header - 1);
+    }
+}
+
+
+/** \brief  Write NDJSON report of \a image
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       path    path of image
+ * \param[in]       image   verified t64 image
+ * \param[in]       status  image status
+ */
+static void report_image_ndjson(outbuf_t *out,
+                                const char *path,
+                                const t64_image_t *image,
+                                const char *status)
+{
+    char name[T64_HDR_NAME_LEN + 1];
+    char magic[T64_HDR_MAGIC_LEN + 1];
+    int i;
+
+    memcpy(magic, image->magic, T64_HDR_MAGIC_LEN);
+    magic[T64_HDR_MAGIC_LEN] = '\0';
+    ascii_name(name, image->tapename, T64_HDR_NAME_LEN);
+
+    outbuf_puts(out, "{\"path\":");
+    json_string(out, path);
+    outbuf_printf(out, ",\"status\":\"%s\",\"fixes\":%d,\"fix_reasons\":",
+                  status, image->fixes);
+    fix_reasons(out, REPORT_NDJSON, image->fix_flags);
+    outbuf_puts(out, ",\"magic\":");
+    json_string(out, magic);
+    outbuf_printf(out, ",\"version\":%u,\"tapename\":", image->version);
+    json_string(out, name);
+    outbuf_printf(out, ",\"rec_max\":%u,\"rec_used\":%u,\"records\":[",
+                  image->rec_max, image->rec_used);
+
+    for (i = 0; i < image->rec_used; i++) {
+        const t64_record_t *record = image->records + i;
+        char filename[T64_REC_FILENAME_LEN + 1];
+
+        ascii_name(filename, record->filename, T64_REC_FILENAME_LEN);
+        if (i > 0) {
+            outbuf_putc(out, ',');
+        }
+        outbuf_printf(out, "{\"index\":%d,\"filename\":", record->index);
+        json_string(out, filename);
+        outbuf_printf(out,
+                      ",\"c64s_type\":%u,\"c1541_type\":%u,\"start_addr\":%u,"
+                      "\"end_addr\":%u,\"real_end_addr\":%u,\"offset\":%lu,"
+                      "\"status\":\"%s\",\"fix_reasons\":",
+                      record->c64s_ftype, record->c1541_ftype,
+                      record->start_addr, record->end_addr,
+                      record->real_end_addr, (unsigned long)record->offset,
+                      status_names[record->status]);
+        fix_reasons(out, REPORT_NDJSON, record->fix_flags);
+        if (record->hashed) {
+            outbuf_printf(out, ",\"hash\":\"%016" PRIx64 "\"", record->hash);
+        }
+        outbuf_putc(out, '}');
+    }
+    outbuf_puts(out, "]}\n");
+}
+
+
+/** \brief  Write CSV report of \a image
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       path    path of image
+ * \param[in]       image   verified t64 image
+ * \param[in]       status  image status
+ */
+static void report_image_csv(outbuf_t *out,
+                             const char *path,
+                             const t64_image_t *image,
+                             const char *status)
+{
+    char name[T64_HDR_NAME_LEN + 1];
+    char magic[T64_HDR_MAGIC_LEN + 1];
+    int i;
+
+    memcpy(magic, image->magic, T64_HDR_MAGIC_LEN);
+    magic[T64_HDR_MAGIC_LEN] = '\0';
+    ascii_name(name, image->tapename, T64_HDR_NAME_LEN);
+
+    outbuf_puts(out, "image,");
+    csv_string(out, path);
+    outbuf_printf(out, ",%s,%d,", status, image->fixes);
+    fix_reasons(out, REPORT_CSV, image->fix_flags);
+    outbuf_puts(out, ",,");
+    csv_string(out, magic);
+    outbuf_printf(out, ",%u,", image->version);
+    csv_string(out, name);
+    outbuf_printf(out, ",%u,%u,,,,,,,,,\n", image->rec_max, image->rec_used);
+
+    for (i = 0; i < image->rec_used; i++) {
+        const t64_record_t *record = image->records + i;
+        char filename[T64_REC_FILENAME_LEN + 1];
+
+        ascii_name(filename, record->filename, T64_REC_FILENAME_LEN);
+        outbuf_puts(out, "record,");
+        csv_string(out, path);
+        outbuf_printf(out, ",%s,,", status_names[record->status]);
+        fix_reasons(out, REPORT_CSV, record->fix_flags);
+        outbuf_printf(out, ",,,,,,,%d,", record->index);
+        csv_string(out, filename);
+        outbuf_printf(out, ",%u,%u,%u,%u,%u,%lu,",
+                      record->c64s_ftype, record->c1541_ftype,
+                      record->start_addr, record->end_addr,
+                      record->real_end_addr, (unsigned long)record->offset);
+        if (record->hashed) {
+            outbuf_printf(out, "%016" PRIx64, record->hash);
+        }
+        outbuf_putc(out, '\n');
+    }
+}
+
+
+/** \brief  Write report of verified \a image
+ *
+ * The image status is "ok" if no fixes were required, "fixed" if \a fixed is
+ * true and "faulty" otherwise.
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       format  report format (NDJSON or CSV)
+ * \param[in]       path    path of image
+ * \param[in]       image   verified t64 image
+ * \param[in]       fixed   fixes have been written back to the image
+ */
+void report_image(outbuf_t *out,
+                  report_format_t format,
+                  const char *path,
+                  const t64_image_t *image,
+                  bool fixed)
+{
+    const char *status;
+    STATS_START(t_output);
+
+    if (image->fixes == 0) {
+        status = "ok";
+    } else {
+        status = fixed ? "fixed" : "faulty";
+    }
+
+    if (format == REPORT_NDJSON) {
+        report_image_ndjson(out, path, image, status);
+    } else if (format == REPORT_CSV) {
+        report_image_csv(out, path, image, status);
+    }
+    STATS_STOP(STATS_PHASE_OUTPUT, t_output);
+}
+
+
+/** \brief  Write report of an image that couldn't be processed
+ *
+ * \param[in,out]   out         writer
+ * \param[in]       format      report format (NDJSON or CSV)
+ * \param[in]       path        path of image
+ * \param[in]       error       t64 error code
+ * \param[in]       sys_errno   C library errno, used for `T64_ERR_IO`
+ */
+void report_error(outbuf_t *out,
+                  report_format_t format,
+                  const char *path,
+                  int error,
+                  int sys_errno)
+{
+    char msg[256];
+
+    if (error == T64_ERR_IO) {
+        snprintf(msg, sizeof msg, "%s (%s)",
+                 t64_strerror(error), strerror(sys_errno));
+    } else {
+        snprintf(msg, sizeof msg, "%s", t64_strerror(error));
+    }
+
+    if (format == REPORT_NDJSON) {
+        outbuf_puts(out, "{\"path\":");
+        json_string(out, path);
+        outbuf_puts(out, ",\"status\":\"error\",\"error\":");
+        json_string(out, msg);
+        outbuf_puts(out, "}\n");
+    } else if (format == REPORT_CSV) {
+        outbuf_puts(out, "image,");
+        csv_string(out, path);
+        outbuf_puts(out, ",error,,,");
+        csv_string(out, msg);
+        outbuf_puts(out, ",,,,,,,,,,,,,,\n");
+    }
+}
+
+
+/** \brief  Write report of an image whose result was taken from the cache
+ *
+ * Only the status and fix count are known for cached images, the NDJSON object
+ * gets a `"cached":true` member, in CSV the other columns are left empty.
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       format  report format (NDJSON or CSV)
+ * \param[in]       path    path of image
+ * \param[in]       fixes   number of fixes the image requires
+ */
+void report_cached(outbuf_t *out,
+                   report_format_t format,
+                   const char *path,
+                   int fixes)
+{
+    const char *status = fixes == 0 ? "ok" : "faulty";
+
+    if (format == REPORT_NDJSON) {
+        outbuf_puts(out, "{\"path\":");
+        json_string(out, path);
+        outbuf_printf(out, ",\"status\":\"%s\",\"fixes\":%d,\"cached\":true}\n",
+                      status, fixes);
+    } else if (format == REPORT_CSV) {
+        outbuf_puts(out, "image,");
+        csv_string(out, path);
+        outbuf_printf(out, ",%s,%d,,,,,,,,,,,,,,,,\n", status, fixes);
+    }
+}
+
+
+/** \brief  Write report of a group of files with identical data
+ *
+ * In text format the group is written as a line with the hash, size and number
+ * of copies followed by an indented line per copy. NDJSON gets an object with
+ * a `"duplicate"` member holding the hash, CSV a `duplicate` row per copy.
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       format  report format
+ * \param[in]       hash    hash64() of the data
+ * \param[in]       size    size of the data
+ * \param[in]       copies  files with this data
+ * \param[in]       count   number of elements in \a copies
+ */
+void report_duplicate(outbuf_t *out,
+                      report_format_t format,
+                      uint64_t hash,
+                      size_t size,
+                      const report_copy_t *copies,
+                      size_t count)
+{
+    char filename[T64_REC_FILENAME_LEN + 1];
+    size_t i;
+
+    switch (format) {
+        case REPORT_TEXT:
+            outbuf_printf(out, "duplicate %016" PRIx64 " (%zu bytes, %zu "
+                          "copies):\n", hash, size, count);
+            for (i = 0; i < count; i++) {
+                ascii_name(filename, copies[i].filename, T64_REC_FILENAME_LEN);
+                outbuf_printf(out, "    %s: %d: \"%s\"\n",
+                              copies[i].path, copies[i].index, filename);
+            }
+            break;
+        case REPORT_NDJSON:
+            outbuf_printf(out, "{\"duplicate\":\"%016" PRIx64 "\",\"size\":%zu,"
+                          "\"copies\":[", hash, size);
+            for (i = 0; i < count; i++) {
+                ascii_name(filename, copies[i].filename, T64_REC_FILENAME_LEN);
+                outbuf_puts(out, i > 0 ? ",{\"path\":" : "{\"path\":");
+                json_string(out, copies[i].path);
+                outbuf_printf(out, ",\"index\":%d,\"filename\":",
+                              copies[i].index);
+                json_string(out, filename);
+                outbuf_putc(out, '}');
+            }
+            outbuf_puts(out, "]}\n");
+            break;
+        case REPORT_CSV:
+            for (i = 0; i < count; i++) {
+                ascii_name(filename, copies[i].filename, T64_REC_FILENAME_LEN);
+                outbuf_puts(out, "duplicate,");
+                csv_string(out, copies[i].path);
+                outbuf_printf(out, ",,,,,,,,,,%d,", copies[i].index);
+                csv_string(out, filename);
+                outbuf_printf(out, ",,,,,,,%016" PRIx64 "\n", hash);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+
+/** \brief  Write record \a entry found in a catalog
+ *
+ * In text format a line with the path, index, filename and addresses, NDJSON
+ * gets an object per record and CSV an `entry` row per record.
+ *
+ * \param[in,out]   out     writer
+ * \param[in]       format  report format
+ * \param[in]       entry   record
+ */
+void report_catalog_entry(outbuf_t *out,
+                          report_format_t format,
+                          const catalog_entry_t *entry)
+{
+    switch (format) {
+        case REPORT_TEXT:
+            outbuf_printf(out, "%s: %d: \"%s\" $%04x-$%04x",
+                          entry->path, entry->index, entry->filename,
+                          entry->start_addr, entry->real_end_addr);
+            if (entry->hashed) {
+                outbuf_printf(out, " %016" PRIx64, entry->hash);
+            }
+            outbuf_putc(out, '\n');
+            break;
+        case REPORT_NDJSON:
+            outbuf_puts(out, "{\"path\":");
+            json_string(out, entry->path);
+            outbuf_puts(out, ",\"tapename\":");
+            json_string(out, entry->tapename);
+            outbuf_printf(out, ",\"index\":%d,\"filename\":", entry->index);
+            json_string(out, entry->filename);
+            outbuf_printf(out,
+                          ",\"c64s_type\":%u,\"c1541_type\":%u,\"start_addr\":%u,"
+                          "\"end_addr\":%u,\"real_end_addr\":%u,\"offset\":%lu,"
+                          "\"status\":\"%s\"",
+                          entry->c64s_ftype, entry->c1541_ftype,
+                          entry->start_addr, entry->end_addr,
+                          entry->real_end_addr, (unsigned long)entry->offset,
+                          status_names[entry->status]);
+            if (entry->hashed) {
+                outbuf_printf(out, ",\"hash\":\"%016" PRIx64 "\"", entry->hash);
+            }
+            outbuf_puts(out, "}\n");
+            break;
+        case REPORT_CSV:
+            outbuf_puts(out, "entry,");
+            csv_string(out, entry->path);
+            outbuf_printf(out, ",%s,,,,,,", status_names[entry->status]);
+            csv_string(out, entry->tapename);
+            outbuf_printf(out, ",,,%d,", entry->index);
+            csv_string(out, entry->filename);
+            outbuf_printf(out, ",%u,%u,%u,%u,%u,%lu,",
+                          entry->c64s_ftype, entry->c1541_ftype,
+                          entry->start_addr, entry->end_addr,
+                          entry->real_end_addr, (unsigned long)entry->offset);
+            if (entry->hashed) {
+                outbuf_printf(out, "%016" PRIx64, entry->hash);
+            }
+            outbuf_putc(out, '\n');
+            break;
+        default:
+            break;
+    }
+}
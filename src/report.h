@@ -0,0 +1,81 @@
+/** \file   report.h
+ * \brief   Machine-readable verification reports - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_REPORT_H
+#define HAVE_REPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "catalog.h"
+#include "outbuf.h"
+#include "t64types.h"
+
+
+/** \brief  Report formats
+ */
+typedef enum {
+    REPORT_TEXT,    /**< human-readable text (t64_dump() and friends) */
+    REPORT_NDJSON,  /**< one JSON object per image, per line */
+    REPORT_CSV      /**< one row per image plus one row per record */
+} report_format_t;
+
+
+/** \brief  Copy of a file in a group of identical files
+ */
+typedef struct report_copy_s {
+    const char *    path;       /**< path of image */
+    int             index;      /**< index of record in image */
+    uint8_t         filename[T64_REC_FILENAME_LEN]; /**< PETSCII filename */
+} report_copy_t;
+
+
+bool report_get_format(const char *name, report_format_t *format);
+void report_begin(outbuf_t *out, report_format_t format);
+void report_image(outbuf_t *out,
+                  report_format_t format,
+                  const char *path,
+                  const t64_image_t *image,
+                  bool fixed);
+void report_error(outbuf_t *out,
+                  report_format_t format,
+                  const char *path,
+                  int error,
+                  int sys_errno);
+void report_cached(outbuf_t *out,
+                   report_format_t format,
+                   const char *path,
+                   int fixes);
+void report_duplicate(outbuf_t *out,
+                      report_format_t format,
+                      uint64_t hash,
+                      size_t size,
+                      const report_copy_t *copies,
+                      size_t count);
+void report_catalog_entry(outbuf_t *out,
+                          report_format_t format,
+                          const catalog_entry_t *entry);
+
+#endif
@@ -0,0 +1,366 @@
+/** \file   scan.c
+ * \brief   Recursive directory scan
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Walks directory trees on a thread pool: each directory is read by a pool job
+ * which submits a new job for each subdirectory and passes the files with a
+ * matching extension to a callback. The callback can submit jobs of its own to
+ * the same pool, so work on files found early overlaps with reading the rest
+ * of the tree.
+ *
+ * Like `find -type f`, symbolic links are not followed and only regular files
+ * are passed to the callback. The order in which files are found depends on
+ * the scheduling of the workers, callers that need a stable order will have
+ * to sort the results.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _WIN32
+# define _POSIX_C_SOURCE 200809L
+# define _DEFAULT_SOURCE    /* d_type and DT_* on glibc */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <dirent.h>
+# include <fcntl.h>
+#endif
+
+#include "base.h"
+#include "pool.h"
+
+#include "scan.h"
+
+
+/** \brief  Path separator used when joining paths
+ */
+#ifdef _WIN32
+# define SCAN_SEPARATOR '\\'
+#else
+# define SCAN_SEPARATOR '/'
+#endif
+
+
+/** \brief  State of a scan, shared by all directory jobs
+ */
+typedef struct scan_state_s {
+    pool_t *        pool;       /**< pool running the directory jobs */
+    const char *    ext;        /**< extension of files to report */
+    size_t          ext_len;    /**< length of \a ext */
+    scan_func_t     func;       /**< callback for files found */
+    void *          arg;        /**< argument for \a func */
+    pthread_mutex_t lock;       /**< lock for \a errors and stderr */
+    size_t          errors;     /**< number of directories that couldn't be
+                                     read */
+} scan_state_t;
+
+
+/** \brief  Directory job
+ */
+typedef struct scan_dir_s {
+    scan_state_t *  scan;       /**< scan state */
+    char *          path;       /**< path of the directory */
+} scan_dir_t;
+
+
+static void scan_dir_job(void *arg, int worker);
+
+
+/** \brief  Check if \a name ends in the extension of \a scan, ignoring case
+ *
+ * \param[in]   scan    scan state
+ * \param[in]   name    file name
+ *
+ * \return  bool
+ */
+static bool scan_match(const scan_state_t *scan, const char *name)
+{
+    size_t len = strlen(name);
+    size_t i;
+
+    if (len <= scan->ext_len) {
+        return false;
+    }
+    name += len - scan->ext_len;
+    for (i = 0; i < scan->ext_len; i++) {
+        if (tolower((unsigned char)name[i])
+                != tolower((unsigned char)scan->ext[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/** \brief  Join \a dir and \a name into a new path
+ *
+ * \param[in]   dir     directory
+ * \param[in]   name    name of entry in \a dir
+ *
+ * \return  path, free with base_free()
+ */
+static char *scan_join(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    char *path = base_malloc(dlen + 1 + nlen + 1);
+
+    memcpy(path, dir, dlen);
+    if (dlen > 0 && dir[dlen - 1] != '/' && dir[dlen - 1] != SCAN_SEPARATOR) {
+        path[dlen++] = SCAN_SEPARATOR;
+    }
+    memcpy(path + dlen, name, nlen + 1);
+    return path;
+}
+
+
+/** \brief  Submit a job reading directory \a path
+ *
+ * \param[in,out]   scan    scan state
+ * \param[in]       path    path of directory (ownership is transferred)
+ */
+static void scan_submit_dir(scan_state_t *scan, char *path)
+{
+    scan_dir_t *dir = base_malloc(sizeof *dir);
+
+    dir->scan = scan;
+    dir->path = path;
+    pool_submit(scan->pool, scan_dir_job, dir);
+}
+
+
+/** \brief  Handle entry \a name of directory \a dir
+ *
+ * \param[in,out]   scan    scan state
+ * \param[in]       dir     path of directory
+ * \param[in]       name    name of entry
+ * \param[in]       is_dir  entry is a directory
+ */
+static void scan_entry(scan_state_t *scan,
+                       const char *dir,
+                       const char *name,
+                       bool is_dir)
+{
+    if (is_dir) {
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            scan_submit_dir(scan, scan_join(dir, name));
+        }
+    } else if (scan_match(scan, name)) {
+        scan->func(scan->arg, scan_join(dir, name));
+    }
+}
+
+
+/** \brief  Report failure to read directory \a path
+ *
+ * \param[in,out]   scan    scan state
+ * \param[in]       path    path of directory
+ */
+static void scan_error(scan_state_t *scan, const char *path)
+{
+    int err = errno;
+
+    pthread_mutex_lock(&scan->lock);
+    scan->errors++;
+    fprintf(stderr, "t64fix: warning: failed to read directory '%s': %s\n",
+            path, strerror(err));
+    pthread_mutex_unlock(&scan->lock);
+}
+
+
+#ifdef _WIN32
+
+/** \brief  Read directory (pool job)
+ *
+ * \param[in,out]   arg     directory job (freed)
+ * \param[in]       worker  worker index (unused)
+ */
+static void scan_dir_job(void *arg, int worker)
+{
+    scan_dir_t *dir = arg;
+    WIN32_FIND_DATAA entry;
+    HANDLE handle;
+    char *pattern;
+
+    (void)worker;
+
+    pattern = scan_join(dir->path, "*");
+    handle = FindFirstFileA(pattern, &entry);
+    base_free(pattern);
+    if (handle == INVALID_HANDLE_VALUE) {
+        errno = EACCES;
+        scan_error(dir->scan, dir->path);
+    } else {
+        do {
+            if (entry.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+                /* don't follow symbolic links and junctions */
+                continue;
+            }
+            scan_entry(dir->scan, dir->path, entry.cFileName,
+                       (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+        } while (FindNextFileA(handle, &entry));
+        FindClose(handle);
+    }
+    base_free(dir->path);
+    base_free(dir);
+}
+
+#else
+
+/** \brief  Read directory (pool job)
+ *
+ * Uses the entry type returned by readdir() when available, so no stat() call
+ * is required for most entries.
+ *
+ * \param[in,out]   arg     directory job (freed)
+ * \param[in]       worker  worker index (unused)
+ */
+static void scan_dir_job(void *arg, int worker)
+{
+    scan_dir_t *dir = arg;
+    DIR *dp;
+    struct dirent *entry;
+
+    (void)worker;
+
+    dp = opendir(dir->path);
+    if (dp == NULL) {
+        scan_error(dir->scan, dir->path);
+    } else {
+        errno = 0;
+        while ((entry = readdir(dp)) != NULL) {
+            bool is_dir;
+            bool is_reg;
+#ifdef DT_DIR
+            if (entry->d_type != DT_UNKNOWN) {
+                is_dir = entry->d_type == DT_DIR;
+                is_reg = entry->d_type == DT_REG;
+            } else
+#endif
+            {
+                struct stat st;
+
+                if (fstatat(dirfd(dp), entry->d_name, &st,
+                            AT_SYMLINK_NOFOLLOW) != 0) {
+                    errno = 0;
+                    continue;
+                }
+                is_dir = S_ISDIR(st.st_mode);
+                is_reg = S_ISREG(st.st_mode);
+            }
+            if (is_dir || is_reg) {
+                scan_entry(dir->scan, dir->path, entry->d_name, is_dir);
+            }
+            errno = 0;
+        }
+        if (errno != 0) {
+            scan_error(dir->scan, dir->path);
+        }
+        closedir(dp);
+    }
+    base_free(dir->path);
+    base_free(dir);
+}
+
+#endif
+
+
+/** \brief  Check if \a path is a directory
+ *
+ * \param[in]   path    path
+ *
+ * \return  bool
+ */
+static bool scan_is_dir(const char *path)
+{
+#ifdef _WIN32
+    DWORD attr = GetFileAttributesA(path);
+
+    return attr != INVALID_FILE_ATTRIBUTES
+        && (attr & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+
+/** \brief  Scan directory trees for files with extension \a ext
+ *
+ * Calls \a func for each regular file in \a roots and their subdirectories
+ * whose name ends in \a ext (ignoring case). Roots that aren't directories are
+ * passed to \a func as-is, regardless of their extension, so errors opening
+ * them are reported by the caller.
+ *
+ * Returns when all directory jobs and any jobs submitted to \a pool by \a func
+ * have finished.
+ *
+ * \param[in,out]   pool    thread pool
+ * \param[in]       roots   paths to scan
+ * \param[in]       count   number of elements in \a roots
+ * \param[in]       ext     extension, including the dot (".t64")
+ * \param[in]       func    function to call for each file found
+ * \param[in]       arg     argument for \a func
+ *
+ * \return  number of directories that couldn't be read
+ */
+size_t scan_tree(pool_t *pool,
+                 const char **roots,
+                 size_t count,
+                 const char *ext,
+                 scan_func_t func,
+                 void *arg)
+{
+    scan_state_t scan;
+    size_t i;
+
+    scan.pool = pool;
+    scan.ext = ext;
+    scan.ext_len = strlen(ext);
+    scan.func = func;
+    scan.arg = arg;
+    scan.errors = 0;
+    pthread_mutex_init(&scan.lock, NULL);
+
+    for (i = 0; i < count; i++) {
+        if (scan_is_dir(roots[i])) {
+            scan_submit_dir(&scan, base_strdup(roots[i]));
+        } else {
+            func(arg, base_strdup(roots[i]));
+        }
+    }
+    pool_wait(pool);
+
+    pthread_mutex_destroy(&scan.lock);
+    return scan.errors;
+}
@@ -0,0 +1,52 @@
+/** \file   scan.h
+ * \brief   Recursive directory scan - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_SCAN_H
+#define HAVE_SCAN_H
+
+#include <stdlib.h>
+
+#include "pool.h"
+
+
+/** \brief  Function called for each file found by scan_tree()
+ *
+ * Called from the worker thread that read the directory containing the file.
+ *
+ * \param[in]   arg     argument passed to scan_tree()
+ * \param[in]   path    path of the file, owned by the callee (free with
+ *                      base_free())
+ */
+typedef void (*scan_func_t)(void *arg, char *path);
+
+
+size_t scan_tree(pool_t *pool,
+                 const char **roots,
+                 size_t count,
+                 const char *ext,
+                 scan_func_t func,
+                 void *arg);
+
+#endif
@@ -0,0 +1,732 @@
+/** \file   server.c
+ * \brief   Daemon mode: serve requests over a Unix domain socket
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Keeps a worker pool running and handles requests on images sent over a
+ * local socket, so a client doesn't pay for starting a process per image.
+ * Each connection is handled by a pool worker and can send any number of
+ * requests, one after the other. A request is a text line followed by the
+ * image data:
+ *
+ * ```
+ * verify <size>\n<size bytes>
+ * fix <size>\n<size bytes>
+ * list <size>\n<size bytes>
+ * extract <index> <size>\n<size bytes>
+ * ```
+ *
+ * The response is a text line with the status and two sizes, followed by an
+ * NDJSON report (as written by `--format=ndjson`, with a path of "-") and
+ * the data:
+ *
+ * ```
+ * <ok|error> <report size> <data size>\n<report><data>
+ * ```
+ *
+ * `verify` verifies the image, `fix` also returns the fixed image as data,
+ * `list` reports the directory as stored (only the header gets checked) and
+ * `extract` returns the PRG file (load address and data) of the record at
+ * <index>, which is empty for memory snapshots. A malformed request gets an
+ * error response, after which the connection is closed.
+ *
+ * A connection is closed when a request (the line and the image) doesn't
+ * arrive within SERVER_TIMEOUT_MS, counting from the response to the previous
+ * request, or when sending a response stalls as long, so idle or slow clients
+ * can't keep the workers from serving others. Images may be gzip or zip
+ * compressed, decompressed images larger than the limit passed to server_run()
+ * are rejected.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _WIN32
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+# include <signal.h>
+# include <pthread.h>
+# include <poll.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/time.h>
+# include <sys/uio.h>
+# include <sys/un.h>
+#endif
+
+#include "archive.h"
+#include "base.h"
+#include "outbuf.h"
+#include "pool.h"
+#include "prg.h"
+#include "report.h"
+#include "t64.h"
+
+#include "server.h"
+
+
+#ifndef _WIN32
+
+/** \brief  Maximum length of a request line, including the newline
+ */
+#define SERVER_LINE_MAX     64
+
+/** \brief  Size of the receive buffer of a connection
+ */
+#define SERVER_BUFFER_SIZE  4096
+
+/** \brief  Timeout in milliseconds between checks for a stop request
+ */
+#define SERVER_POLL_MS      250
+
+/** \brief  Backlog of the listening socket
+ */
+#define SERVER_BACKLOG      64
+
+/** \brief  Time in milliseconds a client gets to send a request
+ *
+ * Also the timeout for sending a response.
+ */
+#define SERVER_TIMEOUT_MS   30000
+
+
+/** \brief  Request commands
+ */
+typedef enum server_cmd_e {
+    SERVER_CMD_VERIFY,  /**< verify image */
+    SERVER_CMD_FIX,     /**< verify image and return the fixed image */
+    SERVER_CMD_LIST,    /**< report directory without verifying */
+    SERVER_CMD_EXTRACT  /**< verify image and return a PRG file */
+} server_cmd_t;
+
+
+/** \brief  Client connection
+ */
+typedef struct server_conn_s {
+    int         fd;                         /**< socket */
+    uint8_t     buffer[SERVER_BUFFER_SIZE]; /**< receive buffer */
+    size_t      pos;                        /**< read position in \a buffer */
+    size_t      len;                        /**< bytes in \a buffer */
+    uint8_t *   payload;                    /**< image data of request, reused
+                                                 for the next request */
+    size_t      payload_size;               /**< size of \a payload */
+    outbuf_t    report;                     /**< report of request */
+    outbuf_t    data;                       /**< PRG data of `extract` */
+    uint64_t    deadline;                   /**< base_clock_ns() by which the
+                                                 current request must have
+                                                 arrived */
+} server_conn_t;
+
+
+/** \brief  Set by SIGINT or SIGTERM to stop the server
+ *
+ * Only checked by the thread accepting connections, which passes it on to the
+ * connections through \a server_closing.
+ */
+static volatile sig_atomic_t server_stop = 0;
+
+/** \brief  Lock for \a server_closing
+ */
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** \brief  Connections should be closed
+ */
+static bool server_closing = false;
+
+
+/** \brief  Signal handler for SIGINT and SIGTERM
+ *
+ * \param[in]   sig signal number (unused)
+ */
+static void server_signal(int sig)
+{
+    (void)sig;
+    server_stop = 1;
+}
+
+
+/** \brief  Check if the server is stopping
+ *
+ * \param[in]   conn    called for a connection (from a worker thread)
+ *
+ * \return  bool
+ */
+static bool server_stopping(bool conn)
+{
+    bool closing;
+
+    if (!conn) {
+        return server_stop != 0;
+    }
+    pthread_mutex_lock(&server_lock);
+    closing = server_closing;
+    pthread_mutex_unlock(&server_lock);
+    return closing;
+}
+
+
+/** \brief  Wait until \a fd is readable
+ *
+ * \param[in]   fd          socket
+ * \param[in]   conn        \a fd is a connection (called from a worker thread)
+ * \param[in]   deadline    base_clock_ns() at which to give up, 0 for none
+ *
+ * \return  false if the server is stopping, on timeout or on error
+ */
+static bool server_wait(int fd, bool conn, uint64_t deadline)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!server_stopping(conn)) {
+        int timeout = SERVER_POLL_MS;
+        int result;
+
+        if (deadline > 0) {
+            uint64_t now = base_clock_ns();
+
+            if (now >= deadline) {
+                return false;
+            }
+            if (deadline - now < (uint64_t)SERVER_POLL_MS * 1000000U) {
+                timeout = (int)((deadline - now) / 1000000U) + 1;
+            }
+        }
+        result = poll(&pfd, 1, timeout);
+
+        if (result > 0) {
+            return true;
+        } else if (result < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return false;
+}
+
+
+/** \brief  Receive at most \a size bytes from \a conn into \a dest
+ *
+ * \param[in,out]   conn    connection
+ * \param[out]      dest    destination
+ * \param[in]       size    size of \a dest
+ *
+ * \return  number of bytes received, 0 on end-of-file, error, timeout or stop
+ *          request
+ */
+static size_t server_recv(server_conn_t *conn, uint8_t *dest, size_t size)
+{
+    while (server_wait(conn->fd, true, conn->deadline)) {
+        ssize_t result = recv(conn->fd, dest, size, 0);
+
+        if (result > 0) {
+            return (size_t)result;
+        } else if (result == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    return 0;
+}
+
+
+/** \brief  Read request line from \a conn
+ *
+ * \param[in,out]   conn    connection
+ * \param[out]      line    line, without newline, nul-terminated
+ * \param[in]       size    size of \a line
+ *
+ * \return  1 on success, 0 on error or end-of-file, -1 if the line is too long
+ */
+static int server_read_line(server_conn_t *conn, char *line, size_t size)
+{
+    size_t used = 0;
+
+    while (true) {
+        if (conn->pos == conn->len) {
+            conn->pos = 0;
+            conn->len = server_recv(conn, conn->buffer, sizeof conn->buffer);
+            if (conn->len == 0) {
+                return 0;
+            }
+        }
+        if (conn->buffer[conn->pos] == '\n') {
+            conn->pos++;
+            line[used] = '\0';
+            return 1;
+        }
+        if (used == size - 1) {
+            return -1;
+        }
+        line[used++] = (char)conn->buffer[conn->pos++];
+    }
+}
+
+
+/** \brief  Read \a size bytes of request data from \a conn into \a dest
+ *
+ * Copies what's left in the receive buffer first, the rest is received
+ * directly into \a dest.
+ *
+ * \param[in,out]   conn    connection
+ * \param[out]      dest    destination
+ * \param[in]       size    number of bytes to read
+ *
+ * \return  false on error or end-of-file
+ */
+static bool server_read(server_conn_t *conn, uint8_t *dest, size_t size)
+{
+    size_t avail = conn->len - conn->pos;
+
+    if (avail > size) {
+        avail = size;
+    }
+    if (avail > 0) {
+        memcpy(dest, conn->buffer + conn->pos, avail);
+        conn->pos += avail;
+        dest += avail;
+        size -= avail;
+    }
+
+    while (size > 0) {
+        size_t n = server_recv(conn, dest, size);
+
+        if (n == 0) {
+            return false;
+        }
+        dest += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+/** \brief  Send \a count buffers in \a iov to \a fd
+ *
+ * \param[in]       fd      socket
+ * \param[in,out]   iov     buffers (modified)
+ * \param[in]       count   number of elements in \a iov
+ *
+ * \return  false on error
+ */
+static bool server_send(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t result = writev(fd, iov, count);
+        size_t written;
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written = (size_t)result;
+        while (count > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+
+/** \brief  Send response
+ *
+ * \param[in,out]   conn    connection, with the report in conn->report
+ * \param[in]       ok      request succeeded
+ * \param[in]       data    data of response
+ * \param[in]       size    size of \a data
+ *
+ * \return  false on error
+ */
+static bool server_respond(server_conn_t *conn,
+                           bool ok,
+                           const uint8_t *data,
+                           size_t size)
+{
+    char status[64];
+    struct iovec iov[3];
+    int len;
+
+    len = snprintf(status, sizeof status, "%s %zu %zu\n",
+                   ok ? "ok" : "error", conn->report.used, size);
+    iov[0].iov_base = status;
+    iov[0].iov_len = (size_t)len;
+    iov[1].iov_base = conn->report.data;
+    iov[1].iov_len = conn->report.used;
+    /* cast away const without upsetting -Wcast-qual, writev() doesn't write */
+    iov[2].iov_base = (uint8_t *)(uintptr_t)data;
+    iov[2].iov_len = size;
+    return server_send(conn->fd, iov, size > 0 ? 3 : 2);
+}
+
+
+/** \brief  Parse size \a s
+ *
+ * \param[in]   s       decimal number
+ * \param[out]  value   value of \a s
+ *
+ * \return  false if \a s isn't a number or out of range
+ */
+static bool server_parse_size(const char *s, size_t *value)
+{
+    size_t v = 0;
+
+    if (*s == '\0') {
+        return false;
+    }
+    while (*s != '\0') {
+        if (*s < '0' || *s > '9') {
+            return false;
+        }
+        v = v * 10 + (size_t)(*s - '0');
+        if (v > SERVER_PAYLOAD_MAX) {
+            return false;
+        }
+        s++;
+    }
+    *value = v;
+    return true;
+}
+
+
+/** \brief  Parse request \a line
+ *
+ * \param[in,out]   line    request line (modified)
+ * \param[out]      cmd     command
+ * \param[out]      index   record index for `extract`
+ * \param[out]      size    size of the image data following the line
+ *
+ * \return  false if \a line isn't a valid request
+ */
+static bool server_parse(char *line,
+                         server_cmd_t *cmd,
+                         int *index,
+                         size_t *size)
+{
+    char *args[3];
+    int argc = 0;
+    char *p = line;
+    size_t value;
+
+    while (*p != '\0') {
+        if (argc == 3) {
+            return false;
+        }
+        args[argc++] = p;
+        while (*p != '\0' && *p != ' ') {
+            p++;
+        }
+        if (*p == ' ') {
+            *p++ = '\0';
+        }
+    }
+    if (argc < 2) {
+        return false;
+    }
+
+    if (strcmp(args[0], "verify") == 0) {
+        *cmd = SERVER_CMD_VERIFY;
+    } else if (strcmp(args[0], "fix") == 0) {
+        *cmd = SERVER_CMD_FIX;
+    } else if (strcmp(args[0], "list") == 0) {
+        *cmd = SERVER_CMD_LIST;
+    } else if (strcmp(args[0], "extract") == 0) {
+        *cmd = SERVER_CMD_EXTRACT;
+    } else {
+        return false;
+    }
+    if ((*cmd == SERVER_CMD_EXTRACT) != (argc == 3)) {
+        return false;
+    }
+    if (argc == 3) {
+        if (!server_parse_size(args[1], &value) || value > INT16_MAX) {
+            return false;
+        }
+        *index = (int)value;
+    }
+    return server_parse_size(args[argc - 1], size);
+}
+
+
+/** \brief  Handle request on the image in the payload of \a conn
+ *
+ * \param[in,out]   conn    connection
+ * \param[in]       cmd     command
+ * \param[in]       index   record index for `extract`
+ * \param[in]       size    size of the image data
+ *
+ * \return  false if sending the response failed
+ */
+static bool server_handle(server_conn_t *conn,
+                          server_cmd_t cmd,
+                          int index,
+                          size_t size)
+{
+    t64_image_t *image;
+    const uint8_t *data = NULL;
+    size_t data_size = 0;
+    bool ok = true;
+    bool result;
+
+    t64_errno = T64_ERR_NONE;
+    errno = 0;
+
+    image = t64_open_mem(conn->payload, size, 1);
+    if (image == NULL) {
+        ok = false;
+    } else if (cmd != SERVER_CMD_LIST && t64_verify(image, 1) < 0) {
+        ok = false;
+    } else if (cmd == SERVER_CMD_FIX) {
+        ok = t64_apply_fixes(image);
+        data = image->data;
+        data_size = image->size;
+    } else if (cmd == SERVER_CMD_EXTRACT) {
+        ok = prg_extract_mem(image, index, &(conn->data));
+        data = (const uint8_t *)conn->data.data;
+        data_size = conn->data.used;
+    }
+
+    if (ok) {
+        report_image(&(conn->report), REPORT_NDJSON, "-", image,
+                     cmd == SERVER_CMD_FIX && image->fixes > 0);
+    } else {
+        report_error(&(conn->report), REPORT_NDJSON, "-", t64_errno, errno);
+        data_size = 0;
+    }
+    result = server_respond(conn, ok, data, data_size);
+
+    if (image != NULL) {
+        t64_free(image);
+    }
+    outbuf_reset(&(conn->report));
+    outbuf_reset(&(conn->data));
+    return result;
+}
+
+
+/** \brief  Handle requests of a connection (pool job)
+ *
+ * \param[in,out]   arg     connection (freed)
+ * \param[in]       worker  worker index (unused)
+ */
+static void server_conn_job(void *arg, int worker)
+{
+    server_conn_t *conn = arg;
+    char line[SERVER_LINE_MAX];
+    int status;
+
+    (void)worker;
+
+    while (true) {
+        server_cmd_t cmd;
+        int index = 0;
+        size_t size;
+
+        conn->deadline = base_clock_ns()
+            + (uint64_t)SERVER_TIMEOUT_MS * 1000000U;
+        status = server_read_line(conn, line, sizeof line);
+        if (status == 0) {
+            break;
+        }
+
+        if (status < 0 || !server_parse(line, &cmd, &index, &size)) {
+            /* can't find the next request after a bad one */
+            report_error(&(conn->report), REPORT_NDJSON, "-", T64_ERR_REQUEST,
+                         0);
+            server_respond(conn, false, NULL, 0);
+            break;
+        }
+        if (size > conn->payload_size) {
+            conn->payload = base_realloc(conn->payload, size);
+            conn->payload_size = size;
+        }
+        if (!server_read(conn, conn->payload, size)
+                || !server_handle(conn, cmd, index, size)) {
+            break;
+        }
+    }
+
+    close(conn->fd);
+    outbuf_free(&(conn->report));
+    outbuf_free(&(conn->data));
+    base_free(conn->payload);
+    base_free(conn);
+}
+
+
+/** \brief  Check if the socket at \a addr is left over from a previous run
+ *
+ * \param[in]   addr    socket address
+ *
+ * \return  true if nobody is listening on \a addr
+ */
+static bool server_is_stale(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool stale;
+
+    if (fd < 0) {
+        return false;
+    }
+    stale = connect(fd, (const struct sockaddr *)addr, sizeof *addr) != 0
+        && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+#endif
+
+
+/** \brief  Serve requests on Unix domain socket \a path
+ *
+ * Runs until interrupted by SIGINT or SIGTERM, after which the open
+ * connections are finished, the socket is removed and the function returns.
+ * Each open connection takes up a worker, so \a workers is also the number of
+ * connections served concurrently; connections are closed when a request
+ * doesn't arrive within SERVER_TIMEOUT_MS.
+ *
+ * Sets the limit of archive_set_limit() to \a inflate_limit.
+ *
+ * \param[in]   path            path of the socket
+ * \param[in]   workers         number of worker threads, 0 or less for one
+ *                              per processor
+ * \param[in]   inflate_limit   maximum size of a decompressed image, 0 for
+ *                              SERVER_INFLATE_MAX
+ *
+ * \return  false if the server couldn't be started
+ */
+bool server_run(const char *path, int workers, size_t inflate_limit)
+{
+#ifdef _WIN32
+    (void)path;
+    (void)workers;
+    (void)inflate_limit;
+    fprintf(stderr, "t64fix: error: daemon mode isn't supported on Windows.\n");
+    return false;
+#else
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct timeval timeout;
+    pool_t *pool;
+    int fd;
+    bool result = true;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "t64fix: error: socket path '%s' is too long.\n", path);
+        return false;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "t64fix: error: failed to create socket: %s.\n",
+                strerror(errno));
+        return false;
+    }
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof addr) != 0
+            && !(errno == EADDRINUSE && server_is_stale(&addr)
+                && unlink(path) == 0
+                && bind(fd, (const struct sockaddr *)&addr, sizeof addr) == 0)) {
+        fprintf(stderr, "t64fix: error: failed to bind socket '%s': %s.\n",
+                path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (listen(fd, SERVER_BACKLOG) != 0
+            || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+        fprintf(stderr, "t64fix: error: failed to listen on socket '%s': %s.\n",
+                path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    /* no SA_RESTART: let poll() return on a stop request */
+    memset(&sa, 0, sizeof sa);
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = server_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    /* a client going away shouldn't take the server with it */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    /* a compressed request mustn't inflate into more than the daemon can
+     * take, set before the workers open any images */
+    archive_set_limit(inflate_limit > 0 ? inflate_limit : SERVER_INFLATE_MAX);
+    timeout.tv_sec = SERVER_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (SERVER_TIMEOUT_MS % 1000) * 1000;
+
+    pool = pool_new(workers);
+    while (server_wait(fd, false, 0)) {
+        server_conn_t *conn;
+        int conn_fd = accept(fd, NULL, NULL);
+
+        if (conn_fd < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK
+                    || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "t64fix: error: failed to accept connection: "
+                    "%s.\n", strerror(errno));
+            result = false;
+            break;
+        }
+        /* don't let a client that stops reading hold on to a worker */
+        setsockopt(conn_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+        conn = base_malloc(sizeof *conn);
+        conn->fd = conn_fd;
+        conn->pos = 0;
+        conn->len = 0;
+        conn->payload = NULL;
+        conn->payload_size = 0;
+        conn->deadline = 0;
+        outbuf_init(&(conn->report), NULL);
+        outbuf_init(&(conn->data), NULL);
+        pool_submit(pool, server_conn_job, conn);
+    }
+
+    close(fd);
+    unlink(path);
+
+    pthread_mutex_lock(&server_lock);
+    server_closing = true;
+    pthread_mutex_unlock(&server_lock);
+    pool_free(pool);
+    return result;
+#endif
+}
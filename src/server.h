@@ -0,0 +1,44 @@
+/** \file   server.h
+ * \brief   Daemon mode: serve requests over a Unix domain socket - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_SERVER_H
+#define HAVE_SERVER_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+
+/** \brief  Maximum size of the image sent with a request
+ */
+#define SERVER_PAYLOAD_MAX  (64UL<<20)
+
+/** \brief  Default maximum size of a decompressed image sent with a request
+ */
+#define SERVER_INFLATE_MAX  (64UL<<20)
+
+
+bool server_run(const char *path, int workers, size_t inflate_limit);
+
+#endif
@@ -0,0 +1,176 @@
+/** \file   stats.c
+ * \brief   Instrumentation: phase timers and counters
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ *
+ * Collects counters and accumulated phase times when enabled with `--stats`.
+ * Counters are updated atomically so worker threads can use them, the phase
+ * times of concurrent workers add up, so in batch mode they can exceed the
+ * wall clock time of the run.
+ *
+ * When disabled the macros in stats.h reduce to a test of `stats_enabled`.
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "base.h"
+#include "t64types.h"
+
+#include "stats.h"
+
+
+/** \brief  Statistics are being collected
+ */
+bool stats_enabled = false;
+
+/** \brief  Counter values
+ */
+static uint64_t counters[STATS_COUNTER_COUNT];
+
+/** \brief  Accumulated phase times in nanoseconds
+ */
+static uint64_t phase_times[STATS_PHASE_COUNT];
+
+/** \brief  Start time of the run
+ */
+static uint64_t start_time;
+
+
+/** \brief  Counter names for stats_print()
+ */
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+    "bytes read",
+    "bytes written",
+    "files written",
+    "images verified",
+    "records verified",
+    "fixes: magic",
+    "fixes: rec_max",
+    "fixes: rec_used",
+    "fixes: rec_range",
+    "fixes: filetype",
+    "fixes: end_addr",
+    "allocations",
+    "bytes allocated"
+};
+
+/** \brief  Phase names for stats_print()
+ */
+static const char *phase_names[STATS_PHASE_COUNT] = {
+    "read", "parse", "verify", "output", "write"
+};
+
+
+/** \brief  Atomically add \a n to \a *p
+ *
+ * \param[in,out]   p   value
+ * \param[in]       n   amount to add
+ */
+static void atomic_add(uint64_t *p, uint64_t n)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+#else
+    *p += n;    /* not thread-safe, but only used for statistics */
+#endif
+}
+
+
+/** \brief  Enable collecting statistics
+ */
+void stats_enable(void)
+{
+    stats_enabled = true;
+    start_time = base_clock_ns();
+}
+
+
+/** \brief  Add \a n to \a counter
+ *
+ * \param[in]   counter counter
+ * \param[in]   n       amount to add
+ */
+void stats_add(stats_counter_t counter, uint64_t n)
+{
+    atomic_add(&counters[counter], n);
+}
+
+
+/** \brief  Get clock value for STATS_START()
+ *
+ * \return  nanoseconds
+ */
+uint64_t stats_clock(void)
+{
+    return base_clock_ns();
+}
+
+
+/** \brief  Add the time since \a start to \a phase
+ *
+ * \param[in]   phase   phase
+ * \param[in]   start   start time obtained with stats_clock()
+ */
+void stats_time(stats_phase_t phase, uint64_t start)
+{
+    atomic_add(&phase_times[phase], base_clock_ns() - start);
+}
+
+
+/** \brief  Count the fixes in `t64_fix_t` \a flags
+ *
+ * \param[in]   flags   fix reasons
+ */
+void stats_tally_fixes(unsigned int flags)
+{
+    int i;
+
+    for (i = 0; i < T64_FIX_COUNT; i++) {
+        if (flags & (1u << i)) {
+            atomic_add(&counters[STATS_FIX_MAGIC + i], 1);
+        }
+    }
+}
+
+
+/** \brief  Print summary of the statistics on \a fp
+ *
+ * \param[in]   fp  output stream
+ */
+void stats_print(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "t64fix: stats: total time %.3f ms\n",
+            (double)(base_clock_ns() - start_time) / 1e6);
+    for (i = 0; i < STATS_PHASE_COUNT; i++) {
+        fprintf(fp, "t64fix: stats: %-17s %12.3f ms\n",
+                phase_names[i], (double)phase_times[i] / 1e6);
+    }
+    for (i = 0; i < STATS_COUNTER_COUNT; i++) {
+        fprintf(fp, "t64fix: stats: %-17s %12" PRIu64 "\n",
+                counter_names[i], counters[i]);
+    }
+}
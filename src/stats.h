@@ -0,0 +1,112 @@
+/** \file   stats.h
+ * \brief   Instrumentation: phase timers and counters - header
+ *
+ * \author  Bas Wassink <b.wassink@ziggo.nl>
+ */
+
+/*
+t64fix - a small tool to correct T64 tape image files
+Copyright (C) 2016-2021  Bas Wassink <b.wassink@ziggo.nl>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef HAVE_STATS_H
+#define HAVE_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/** \brief  Counters
+ */
+typedef enum {
+    STATS_BYTES_READ,       /**< bytes read (or mapped) from files */
+    STATS_BYTES_WRITTEN,    /**< bytes written to files */
+    STATS_FILES_WRITTEN,    /**< number of files written */
+    STATS_IMAGES,           /**< images verified */
+    STATS_RECORDS,          /**< records verified */
+    STATS_FIX_MAGIC,        /**< fixes of the header magic */
+    STATS_FIX_REC_MAX,      /**< fixes of the maximum record count */
+    STATS_FIX_REC_USED,     /**< fixes of the used record count */
+    STATS_FIX_REC_RANGE,    /**< fixes of used > maximum record count */
+    STATS_FIX_FILETYPE,     /**< fixes of C1541 file types */
+    STATS_FIX_END_ADDR,     /**< fixes of end addresses */
+    STATS_ALLOCS,           /**< calls of base_malloc() and friends */
+    STATS_ALLOC_BYTES,      /**< bytes requested from base_malloc() etc */
+
+    STATS_COUNTER_COUNT     /**< number of counters */
+} stats_counter_t;
+
+
+/** \brief  Timed phases
+ */
+typedef enum {
+    STATS_PHASE_READ,       /**< reading/mapping files */
+    STATS_PHASE_PARSE,      /**< parsing header and directory */
+    STATS_PHASE_VERIFY,     /**< t64_verify() */
+    STATS_PHASE_OUTPUT,     /**< dumps and reports */
+    STATS_PHASE_WRITE,      /**< writing images and prg files */
+
+    STATS_PHASE_COUNT       /**< number of phases */
+} stats_phase_t;
+
+
+/** \brief  Statistics are being collected
+ *
+ * Only read this through the macros below, which don't do anything else when
+ * this is false.
+ */
+extern bool stats_enabled;
+
+
+/** \brief  Add \a n to counter \a c
+ */
+#define STATS_ADD(c, n) \
+    do { \
+        if (stats_enabled) { \
+            stats_add((c), (uint64_t)(n)); \
+        } \
+    } while (0)
+
+/** \brief  Declare variable \a var and store the start time of a phase in it
+ */
+#define STATS_START(var) \
+    uint64_t var = stats_enabled ? stats_clock() : 0
+
+/** \brief  Store the start time of a phase in \a var declared with STATS_START()
+ */
+#define STATS_RESTART(var) \
+    var = stats_enabled ? stats_clock() : 0
+
+/** \brief  Add time since \a var (see STATS_START()) to phase \a p
+ */
+#define STATS_STOP(p, var) \
+    do { \
+        if (stats_enabled) { \
+            stats_time((p), (var)); \
+        } \
+    } while (0)
+
+
+void        stats_enable(void);
+void        stats_add(stats_counter_t counter, uint64_t n);
+uint64_t    stats_clock(void);
+void        stats_time(stats_phase_t phase, uint64_t start);
+void        stats_tally_fixes(unsigned int flags);
+void        stats_print(FILE *fp);
+
+#endif
@@ -33,9 +33,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 #include <errno.h>
 
+#include "arena.h"
+#include "archive.h"
 #include "base.h"
 #include "cbmdos.h"
+#include "hash.h"
+#include "ips.h"
+#include "outbuf.h"
 #include "petasc.h"
+#include "pool.h"
+#include "stats.h"
 
 #include "t64.h"
 
@@ -71,6 +78,22 @@ static const char *magic_strings[] = {
 static const char *status_strings[] = {  "OK", "fixed", "skipped" };
 
 
+/** \brief  Header fields written by t64_write_header()
+ *
+ * Used to only write back the fields that actually changed.
+ */
+static const struct {
+    size_t offset;  /**< offset in header */
+    size_t size;    /**< size of field */
+} header_fields[] = {
+    { T64_HDR_MAGIC, T64_HDR_MAGIC_LEN },
+    { T64_HDR_VERSION, 2 },
+    { T64_HDR_REC_MAX, 2 },
+    { T64_HDR_REC_USED, 2 },
+    { T64_HDR_NAME, T64_HDR_NAME_LEN }
+};
+
+
 /* }}} */
 
 
@@ -103,40 +126,23 @@ static int t64_check_magic(const t64_image_t *image)
 }
 
 
-/** \brief  Parse header to determine if it is a t64 image, apply some fixes
+/** \brief  Fix the record counters of \a image
  *
- * This function checks the header's magic against known magic strings. If no
- * magic was found, 0 (false) is returned, otherwise, some header fixes are
- * applied and 1 (true) is returned
+ * A maximum or used count of 0 is set to 1, which is required for the other
+ * fixes to work, and a used count larger than the maximum is clamped.
  *
- * \return  boolean
+ * \param[in,out]   image   t64 image
+ * \param[in]       quiet   don't output anything on stdout
  */
-static bool t64_parse_header(t64_image_t *image, int quiet)
+static void t64_fix_counts(t64_image_t *image, int quiet)
 {
-    int result = t64_check_magic(image);
-    if (result < 0) {
-        if (!quiet) {
-            printf("t64fix: fatal: couldn't find magic bytes, aborting\n");
-        }
-        return false;
-    } else {
-        if (result > 0) {
-            if (!quiet) {
-                printf("t64fix: warning: fixing header magic bytes\n");
-            }
-            image->fixes++;
-        }
-        strcpy((char *)(image->magic), magic_strings[result]);
-    }
-    /* get file record max and used counters */
-    image->rec_max = get_uint16(image->data + T64_HDR_REC_MAX);
-    image->rec_used = get_uint16(image->data + T64_HDR_REC_USED);
     if (image->rec_max == 0) {
         if (!quiet) {
             printf("t64fix: warning: maximum records count reported as "
                 "0, adjusting to 1\n");
         }
         image->rec_max = 1;
+        image->fix_flags |= T64_FIX_REC_MAX;
         image->fixes++;
     }
     if (image->rec_used == 0) {
@@ -144,11 +150,10 @@ static bool t64_parse_header(t64_image_t *image, int quiet)
             printf("t64fix: warning: current records count reported as "
                 "0, adjusting to 1\n");
         }
-        /* this fix is required for the other fixes to work */
         image->rec_used = 1;
+        image->fix_flags |= T64_FIX_REC_USED;
         image->fixes++;
     }
-
     if (image->rec_used > image->rec_max) {
         if (!quiet) {
             printf("t64fix: warning: header reports more used records than "
@@ -156,8 +161,42 @@ static bool t64_parse_header(t64_image_t *image, int quiet)
                     (int)(image->rec_used), (int)(image->rec_max));
         }
         image->rec_used = image->rec_max;
+        image->fix_flags |= T64_FIX_REC_RANGE;
         image->fixes++;
     }
+}
+
+
+/** \brief  Parse header to determine if it is a t64 image, apply some fixes
+ *
+ * This function checks the header's magic against known magic strings. If no
+ * magic was found, 0 (false) is returned, otherwise, some header fixes are
+ * applied and 1 (true) is returned
+ *
+ * \return  boolean
+ */
+static bool t64_parse_header(t64_image_t *image, int quiet)
+{
+    int result = t64_check_magic(image);
+    if (result < 0) {
+        if (!quiet) {
+            printf("t64fix: fatal: couldn't find magic bytes, aborting\n");
+        }
+        return false;
+    } else {
+        if (result > 0) {
+            if (!quiet) {
+                printf("t64fix: warning: fixing header magic bytes\n");
+            }
+            image->fix_flags |= T64_FIX_MAGIC;
+            image->fixes++;
+        }
+        strcpy((char *)(image->magic), magic_strings[result]);
+    }
+    /* get file record max and used counters */
+    image->rec_max = get_uint16(image->data + T64_HDR_REC_MAX);
+    image->rec_used = get_uint16(image->data + T64_HDR_REC_USED);
+    t64_fix_counts(image, quiet);
 
     /* copy tape name: warning: not 0-terminated */
     memcpy(image->tapename, image->data + T64_HDR_NAME, T64_HDR_NAME_LEN);
@@ -168,24 +207,25 @@ static bool t64_parse_header(t64_image_t *image, int quiet)
 }
 
 
-/** \brief  Write correct header data in \a image
+/** \brief  Write correct header data of \a image into \a dest
  *
  * \param[in]   image   t64 image
+ * \param[out]  dest    destination of header data
  */
-static void t64_write_header(t64_image_t *image)
+static void t64_write_header(const t64_image_t *image, uint8_t *dest)
 {
     /* write the correct magic */
-    memcpy(image->data + T64_HDR_MAGIC, c64s_magic, T64_HDR_MAGIC_LEN);
+    memcpy(dest + T64_HDR_MAGIC, c64s_magic, T64_HDR_MAGIC_LEN);
 
     /* write tape name */
-    memcpy(image->data + T64_HDR_NAME, image->tapename, T64_HDR_NAME_LEN);
+    memcpy(dest + T64_HDR_NAME, image->tapename, T64_HDR_NAME_LEN);
 
     /* write version */
-    set_uint16(image->data + T64_HDR_VERSION, 0x101);
+    set_uint16(dest + T64_HDR_VERSION, 0x101);
 
     /* write number of available file records and number of used records */
-    set_uint16(image->data + T64_HDR_REC_MAX, image->rec_max);
-    set_uint16(image->data + T64_HDR_REC_USED, image->rec_used);
+    set_uint16(dest + T64_HDR_REC_MAX, image->rec_max);
+    set_uint16(dest + T64_HDR_REC_USED, image->rec_used);
 }
 
 /* }}} */
@@ -193,47 +233,105 @@ static void t64_write_header(t64_image_t *image)
 
 /* {{{ T64 file record handling */
 
-/** \brief  Comparison function for qsort() call to sort records on data offset
-  *
-  * \param[in]  p1  pointer to record 1
-  * \param[in]  p2  pointer to record 2
-  *
-  * \return -1 if r1<r2, 0 if r1==r2, 1 if r1>r2
-  */
-static int compar_offset(const void *p1, const void *p2)
+/** \brief  Data offset and index of a record, used to sort records on offset
+ */
+typedef struct t64_rec_key_s {
+    uint32_t offset;    /**< data offset of record */
+    uint32_t index;     /**< index of record in the records array */
+} t64_rec_key_t;
+
+
+/** \brief  Allocate \a size bytes for \a image
+ *
+ * Uses the arena of \a image if it has one, the heap otherwise.
+ *
+ * \param[in]   image   t64 image
+ * \param[in]   size    number of bytes to allocate
+ *
+ * \return  pointer to memory, release with t64_release()
+ */
+static void *t64_alloc(const t64_image_t *image, size_t size)
 {
-    const t64_record_t *r1 = p1;
-    const t64_record_t *r2 = p2;
+    if (image->arena != NULL) {
+        return arena_alloc(image->arena, size);
+    }
+    return base_malloc(size);
+}
 
-    if (r1->offset < r2->offset) {
-        return -1;
-    } else if (r1->offset > r2->offset) {
-        return 1;
-    } else {
-        return 0;
+
+/** \brief  Release memory allocated with t64_alloc()
+ *
+ * Does nothing for images using an arena, the memory is released when the
+ * arena is reset.
+ *
+ * \param[in]   image   t64 image
+ * \param[in]   ptr     memory to release
+ */
+static void t64_release(const t64_image_t *image, void *ptr)
+{
+    if (image->arena == NULL) {
+        base_free(ptr);
     }
 }
 
 
-/** \brief  Comparison function for qsort() call to sort records on index
-  *
-  * \param[in]  p1  pointer to record 1
-  * \param[in]  p2  pointer to record 2
-  *
-  * \return -1 if r1<r2, 0 if r1==r2, 1 if r1>r2
-  */
-static int compar_index(const void *p1, const void *p2)
+/** \brief  Get records of \a image sorted on data offset
+ *
+ * Sorts compact (offset, index) pairs with an LSD radix sort on the offset,
+ * leaving the records themselves untouched. The sort is stable, so records
+ * with the same offset stay in directory order. Passes over bytes that are the
+ * same for all offsets (usually the upper bytes) are skipped.
+ *
+ * \param[in]   image   t64 image
+ *
+ * \return  array of \a image->rec_used keys, free with t64_release()
+ */
+static t64_rec_key_t *t64_sort_records(const t64_image_t *image)
 {
-    const t64_record_t *r1 = p1;
-    const t64_record_t *r2 = p2;
+    size_t count = (size_t)image->rec_used;
+    t64_rec_key_t *keys = t64_alloc(image, sizeof *keys * count);
+    t64_rec_key_t *temp;
+    size_t i;
+    int shift;
 
-    if (r1->index < r2->index) {
-        return -1;
-    } else if (r1->index > r2->index) {
-        return 1;
-    } else {
-        return 0;
+    for (i = 0; i < count; i++) {
+        keys[i].offset = image->records[i].offset;
+        keys[i].index = (uint32_t)i;
+    }
+    if (count < 2) {
+        return keys;
+    }
+
+    temp = t64_alloc(image, sizeof *temp * count);
+    for (shift = 0; shift < 32; shift += 8) {
+        size_t buckets[256];
+        size_t pos = 0;
+        t64_rec_key_t *swap;
+        int b;
+
+        memset(buckets, 0, sizeof buckets);
+        for (i = 0; i < count; i++) {
+            buckets[(keys[i].offset >> shift) & 0xff]++;
+        }
+        if (buckets[(keys[0].offset >> shift) & 0xff] == count) {
+            /* all keys have the same digit, nothing to do */
+            continue;
+        }
+        for (b = 0; b < 256; b++) {
+            size_t n = buckets[b];
+
+            buckets[b] = pos;
+            pos += n;
+        }
+        for (i = 0; i < count; i++) {
+            temp[buckets[(keys[i].offset >> shift) & 0xff]++] = keys[i];
+        }
+        swap = keys;
+        keys = temp;
+        temp = swap;
     }
+    t64_release(image, temp);
+    return keys;
 }
 
 
@@ -250,10 +348,14 @@ static void t64_read_record(t64_record_t *record, const unsigned char *data)
     record->offset = get_uint32(data + T64_REC_CONTENTS);
     record->start_addr = get_uint16(data + T64_REC_START_ADDR);
     record->end_addr = get_uint16(data + T64_REC_END_ADDR);
+    record->real_end_addr = record->end_addr;
     record->c64s_ftype = data[T64_REC_C64S_FILETYPE];
     record->c1541_ftype = data[T64_REC_C1541_FILETYPE];
     record->index = 0;
     record->status = T64_REC_OK;
+    record->fix_flags = 0;
+    record->hash = 0;
+    record->hashed = false;
 }
 
 
@@ -277,36 +379,21 @@ static void t64_write_record(t64_record_t *record, unsigned char *dest)
  *
  * \param[in]   image   t64 image
  * \param[in]   index   index in image
+ * \param[in]   name    filename of the record, translated to ASCII
  */
-static void t64_print_record(const t64_image_t *image, int index)
+static void t64_print_record(const t64_image_t *image, int index,
+                             const char *name)
 {
     t64_record_t *record = image->records + index;
     int size = record->end_addr - record->start_addr;
-    char filename_asc[T64_REC_FILENAME_LEN + 1];
-    int n;
-
-    /* copy and translate PETSCII filename */
-    filename_asc[T64_REC_FILENAME_LEN] = '\0';
-    pet_to_asc_str(filename_asc, record->filename, T64_REC_FILENAME_LEN);
-    /* strip padding */
-    n = T64_REC_FILENAME_LEN - 1;
-    while (n >= 0) {
-        if (filename_asc[n] == 0x20) {
-            filename_asc[n] = '\0';
-        }
-        n--;
-    }
-
-    /* print blocks and name */
-    n = printf("%5d  \"%s\"",
-                num_blocks((unsigned int)size),
-                filename_asc);
-    /* align filetype column */
-    while (n < 26) {
-        putchar(' ');
-        n++;
-    }
-    printf("%s  $%04x-$%04x  $%04x-$%04x  %s\n",
+    /* only show the name up to the first space */
+    int n = (int)strcspn(name, " ");
+
+    /* print blocks, name (aligning the filetype column) and the rest */
+    printf("%5d  \"%.*s\"%*s%s  $%04x-$%04x  $%04x-$%04x  %s\n",
+            num_blocks((unsigned int)size),
+            n, name,
+            17 - n, "",
             c1541_types[record->c1541_ftype & 0x07],
             record->start_addr, record->end_addr,
             record->start_addr, record->real_end_addr,
@@ -318,225 +405,785 @@ static void t64_print_record(const t64_image_t *image, int index)
 /* {{{ T64 image file handling */
 
 /** \brief  Allocate new, empty, t64 image
+ *
+ * \param[in]   arena   arena to allocate the image from (optional)
  *
  * \return  new t64 image
  */
-static t64_image_t *t64_new(void)
+static t64_image_t *t64_new(arena_t *arena)
 {
-    t64_image_t *image = base_malloc(sizeof *image);
+    t64_image_t *image;
+
+    if (arena != NULL) {
+        image = arena_alloc(arena, sizeof *image);
+    } else {
+        image = base_malloc(sizeof *image);
+    }
+    image->arena = arena;
     image->path = NULL;
     image->data = NULL;
     image->size = 0;
+    image->data_src = T64_DATA_NONE;
+    image->partial = false;
+    image->compressed = false;
     image->records = NULL;
     image->rec_max = 0;
     image->rec_used = 0;
     image->fixes = 0;
+    image->fix_flags = 0;
     return image;
 }
 
 
-/** \brief  Open t64 container
+/** \brief  Release image data of \a image
  *
- * \param[in]   path    path to container
- * \param[in]   quiet   don't output anything on stdout/stderr
- *
- * \return  image or NULL on failure
+ * \param[in,out]   image   t64 image
  */
-t64_image_t *t64_open(const char *path, int quiet)
+static void t64_free_data(t64_image_t *image)
 {
-    t64_image_t *image;
-    long size;
-    int i;
-
-    image = t64_new();
-    image->path = path;
-
-    size = fread_alloc(&(image->data), path);
-    if (size < 0) {
-        /* error already reported by fread_alloc() */
-        t64_free(image);
-        return NULL;
-    }
-    /* store image size */
-    image->size = (size_t)size;
-    /* parse header for required information */
-    if (!t64_parse_header(image, quiet)) {
-        /* header parsing failed, bail: */
-        t64_free(image);
-        return NULL;
-    }
-
-    /* allocate and read records */
-    image->records = base_malloc(sizeof *(image->records) * image->rec_used);
-    for (i = 0; i < image->rec_used; i++) {
-        t64_read_record(image->records + i,
-                image->data + T64_RECORDS_OFFSET + i * T64_RECORD_SIZE);
-        (image->records + i)->index= i;
+    switch (image->data_src) {
+        case T64_DATA_HEAP:
+            base_free(image->data);
+            break;
+        case T64_DATA_MAPPED:
+            base_unmap_file(image->data, image->size);
+            break;
+        case T64_DATA_BORROWED:
+            /* fall through */
+        case T64_DATA_ARENA:
+            /* fall through */
+        case T64_DATA_NONE:
+            /* fall through */
+        default:
+            break;
     }
-
-    return image;
+    image->data = NULL;
+    image->data_src = T64_DATA_NONE;
 }
 
 
-/** \brief  Free memory used by t64 image
+/** \brief  Make sure \a image owns a heap copy of its data
  *
- * \param[in]   image   t64 image
+ * Replaces a memory mapping or a borrowed buffer with a heap copy, for example
+ * when the image is about to be written back to the file it was mapped from.
+ *
+ * \param[in,out]   image   t64 image
  */
-void t64_free(t64_image_t *image)
+static void t64_own_data(t64_image_t *image)
 {
-    if (image->data != NULL) {
-        base_free(image->data);
-    }
-    if (image->records != NULL) {
-        base_free(image->records);
+    uint8_t *data;
+
+    if (image->data_src == T64_DATA_HEAP || image->data_src == T64_DATA_ARENA
+            || image->data == NULL) {
+        return;
     }
-    base_free(image);
+    data = base_malloc(image->size);
+    memcpy(data, image->data, image->size);
+    t64_free_data(image);
+    image->data = data;
+    image->data_src = T64_DATA_HEAP;
 }
 
 
-/** \brief  Verify data in \a image, optionally fixing it
+/** \brief  Check if \a image is large enough for header and directory
  *
  * \param[in]   image   t64 image
- * \param[in]   quiet   don't output anything on stdout/stderr
+ * \param[in]   records number of records in the directory
+ * \param[in]   quiet   don't output anything on stdout
  *
- * \return  number of fixes, or -1 on error
+ * \return  true if \a image contains the header and \a records records
+ * \throw   T64_ERR_T64_INVALID
  */
-int t64_verify(t64_image_t *image, int quiet)
+static bool t64_check_size(const t64_image_t *image, int records, int quiet)
 {
-    size_t rec_size;    /* file size according to record */
-    size_t act_size;    /* actual file size */
-    int i;
+    size_t required = T64_RECORDS_OFFSET + (size_t)records * T64_RECORD_SIZE;
 
-    /* check maximum record count */
-    if (image->rec_max == 0) {
-        if (!quiet) {
-            printf("t64fix: warning: maximum records count reported as "
-               "0, adjusting to 1\n");
-        }
-        image->rec_max = 1;
-        image->fixes++;
-    }
-    /* check number of used records */
-    if (image->rec_used == 0) {
+    if (image->size < required) {
         if (!quiet) {
-            printf("t64fix: warning: used records count reported as 0, "
-                    "adjusting to 1\n");
+            printf("t64fix: fatal: image too small for header and directory "
+                    "($%zx < $%zx bytes), aborting\n", image->size, required);
         }
-        /* this fix is required for the other fixes to work */
-        image->rec_used = 1;
-        image->fixes++;
+        t64_errno = T64_ERR_T64_INVALID;
+        return false;
     }
+    return true;
+}
 
-    /* Fix end addresses by sorting file records on data offset and then using
-     * either the data offset of the next entry, or the length of the t64 file
-     * to get the proper end address */
 
-    /* sort entries based on offset */
-    qsort(image->records, (size_t)(image->rec_used),
-            sizeof *(image->records), compar_offset);
+/** \brief  Read directory records of \a image
+ *
+ * \param[in,out]   image   t64 image
+ */
+static void t64_read_records(t64_image_t *image)
+{
+    int i;
 
-    /* process records, reporting any invalid data, optionally fixing it */
+    image->records = t64_alloc(image,
+                               sizeof *(image->records) * image->rec_used);
     for (i = 0; i < image->rec_used; i++) {
-        t64_record_t *record = image->records + i;
-        t64_record_t *next;
-
-        /* check file type */
-        if (record->c64s_ftype > 0x01) {
-            /* memory snapshot */
-            record->status = T64_REC_SKIPPED;
-        } else {
-            if (record->c1541_ftype < 0x80 || record->c1541_ftype >= 0x85) {
-                if (!quiet) {
-                    printf("t64fix: illegal value $%02x for C1541 file type, "
-                            "assuming $82 (prg)\n", record->c1541_ftype);
-                }
-                record->c1541_ftype = 0x82;
-                record->status = T64_REC_FIXED;
-                image->fixes++;
-            }
-
-            record = image->records + i;
-            if (i < image->rec_used - 1) {
-                next = image->records + i + 1;
-            } else {
-                next = NULL;
-            }
-
-
-            /* get reported size */
-            rec_size = (size_t)(record->end_addr - record->start_addr);
-            /* determine actual size */
-            if (i < image->rec_used - 1) {
-                act_size = (size_t)(next->offset - record->offset);
-            } else {
-                act_size = (size_t)(image->size - record->offset);
-            }
-            if (rec_size != act_size) {
-                if (i == image->rec_used -1 && rec_size < act_size) {
-                    /* don't fix last record when actual size is larger: some
-                     * T64's have padding for the last record */
-                    continue;
-                }
-                if (!quiet) {
-                    printf("t64fix: %d: reported size of $%04lx does not "
-                            "match actual size of $%04lx\n",
-                            i, (unsigned long)rec_size, (unsigned long)act_size);
-                }
-                record->status = T64_REC_FIXED;
-                image->fixes++;
-                record->real_end_addr = (unsigned short)(record->start_addr +
-                        act_size);
-            } else {
-                record->real_end_addr = record->end_addr;
-            }
-        }
-
+        t64_read_record(image->records + i,
+                image->data + T64_RECORDS_OFFSET + i * T64_RECORD_SIZE);
+        (image->records + i)->index = i;
     }
-    /* restore original record order */
-    qsort(image->records, (size_t)(image->rec_used),
-            sizeof *(image->records), compar_index);
-
-    return image->fixes;
 }
 
 
-/** \brief  Print a 79 chars wide separator on stdout
+/** \brief  Parse header and directory of \a image
+ *
+ * \param[in,out]   image   t64 image with its data loaded
+ * \param[in]       quiet   don't output anything on stdout/stderr
+ *
+ * \return  true on success
+ * \throw   T64_ERR_T64_INVALID
  */
-static void print_sep(void)
+static bool t64_parse(t64_image_t *image, int quiet)
 {
-    puts("-------------------------------------------------------------------"
-         "------------");
+    /* parse header for required information */
+    if (!t64_check_size(image, 0, quiet) || !t64_parse_header(image, quiet)
+            || !t64_check_size(image, image->rec_used, quiet)) {
+        return false;
+    }
+    t64_read_records(image);
+    return true;
 }
 
 
-/** \brief  Dump t64 image information and file records on stdout
+/** \brief  Replace gzip or zip compressed data of \a image with its contents
  *
- * \param[in]   image   t64 image
+ * Does nothing if the data of \a image isn't compressed.
+ *
+ * \param[in,out]   image   t64 image with its data loaded
+ * \param[in]       member  index of zip member, -1 to pick the T64 image
+ *
+ * \return  true on success
+ * \throw   T64_ERR_ARCHIVE
+ * \throw   T64_ERR_INDEX
+ * \throw   T64_ERR_T64_INVALID
  */
-void t64_dump(const t64_image_t *image)
+static bool t64_decompress(t64_image_t *image, int member)
 {
-    char tapename_asc[T64_HDR_NAME_LEN + 1];
-    char magic[T64_HDR_MAGIC_LEN + 1];
-    int i;
+    uint8_t *data;
+    long size;
+    STATS_START(t_read);
 
-    /* copy tapename, translate PETSCII to ASCII */
-    tapename_asc[T64_HDR_NAME_LEN] = '\0';  /* terminated name */
-    pet_to_asc_str(tapename_asc, image->tapename, T64_HDR_NAME_LEN);
-    /* remove padding */
-    i = T64_HDR_NAME_LEN - 1;
-    while (i >= 0 && tapename_asc[i] == 0x20) {
-        tapename_asc[i--] = '\0';
+    if (archive_detect(image->data, image->size) == ARCHIVE_NONE) {
+        if (member >= 0) {
+            t64_errno = T64_ERR_ARCHIVE;
+            return false;
+        }
+        return true;
     }
-
-    /* copy magic */
-    memcpy(magic, image->magic, T64_HDR_MAGIC_LEN);
-    magic[T64_HDR_MAGIC_LEN] = '\0';    /* terminate magic */
-    /* remove padding */
-    i = T64_HDR_MAGIC_LEN - 1;
-    while (i >= 0 && magic[i] == 0x20) {
-        magic[i--] = '\0';
+    size = archive_read(&data, image->data, image->size, member);
+    if (size < 0) {
+        return false;
     }
-
+    t64_free_data(image);
+    image->data = data;
+    image->size = (size_t)size;
+    image->data_src = T64_DATA_HEAP;
+    image->compressed = true;
+    STATS_STOP(STATS_PHASE_READ, t_read);
+    return true;
+}
+
+
+/** \brief  Open t64 container
+ *
+ * The file is mapped into memory if possible, with fread_alloc() as fallback
+ * for files that cannot be mapped. The mapping is private, so any fixes
+ * applied to the image data never end up in the original file.
+ *
+ * Images compressed with gzip or inside a zip archive are inflated straight
+ * into a buffer, see t64_open_member().
+ *
+ * \param[in]   path    path to container, "-" for stdin
+ * \param[in]   quiet   don't output anything on stdout/stderr
+ *
+ * \return  image or NULL on failure
+ */
+t64_image_t *t64_open(const char *path, int quiet)
+{
+    return t64_open_member(path, -1, quiet);
+}
+
+
+/** \brief  Open t64 container, selecting a member of a zip archive
+ *
+ * Like t64_open(), with \a member selecting the member of a zip archive by
+ * its index in the archive. With -1 the first member with a ".t64" extension
+ * (or the only member) is used, which also accepts uncompressed images.
+ *
+ * \param[in]   path    path to container, gzip stream or zip archive
+ * \param[in]   member  index of zip member or -1
+ * \param[in]   quiet   don't output anything on stdout/stderr
+ *
+ * \return  image or NULL on failure
+ * \throw   T64_ERR_ARCHIVE
+ * \throw   T64_ERR_INDEX
+ * \throw   T64_ERR_T64_INVALID
+ */
+t64_image_t *t64_open_member(const char *path, int member, int quiet)
+{
+    return t64_open_member_arena(path, member, quiet, NULL);
+}
+
+
+/** \brief  Open t64 container, allocating from \a arena
+ *
+ * Like t64_open_member(), but the image and its records are allocated from
+ * \a arena. Image data that has to be read in full (pipes, compressed images)
+ * still lives on the heap. The image must be freed with t64_free() before
+ * resetting \a arena, to release its mapping or heap data.
+ *
+ * \param[in]   path    path to container, gzip stream or zip archive
+ * \param[in]   member  index of zip member or -1
+ * \param[in]   quiet   don't output anything on stdout/stderr
+ * \param[in]   arena   arena (`NULL` to use the heap)
+ *
+ * \return  image or NULL on failure
+ * \throw   T64_ERR_ARCHIVE
+ * \throw   T64_ERR_INDEX
+ * \throw   T64_ERR_T64_INVALID
+ */
+t64_image_t *t64_open_member_arena(const char *path,
+                                   int member,
+                                   int quiet,
+                                   arena_t *arena)
+{
+    t64_image_t *image;
+    STATS_START(t_parse);
+
+    image = t64_new(arena);
+    image->path = path;
+
+    image->data = base_map_file(path, &(image->size));
+    if (image->data != NULL) {
+        image->data_src = T64_DATA_MAPPED;
+    } else {
+        long size = fread_alloc(&(image->data), path);
+
+        if (size < 0) {
+            /* error already reported by fread_alloc() */
+            t64_free(image);
+            return NULL;
+        }
+        /* store image size */
+        image->size = (size_t)size;
+        image->data_src = T64_DATA_HEAP;
+    }
+    if (!t64_decompress(image, member)) {
+        t64_free(image);
+        return NULL;
+    }
+    /* reading was timed by base_map_file(), fread_alloc() and
+     * t64_decompress() */
+    STATS_RESTART(t_parse);
+
+    if (!t64_parse(image, quiet)) {
+        t64_free(image);
+        return NULL;
+    }
+    STATS_STOP(STATS_PHASE_PARSE, t_parse);
+    return image;
+}
+
+
+/** \brief  Open t64 container from memory
+ *
+ * The image uses \a data directly instead of copying it, so \a data must stay
+ * valid and unchanged until the image is freed with t64_free(). The image
+ * never writes to \a data: t64_write() works on a private copy. Since there's
+ * no file backing the image, t64_write_in_place() will fail.
+ *
+ * Compressed \a data (gzip or zip) is inflated into a buffer owned by the
+ * image, in which case \a data isn't used after this call.
+ *
+ * \param[in]   data    image data
+ * \param[in]   size    size of \a data
+ * \param[in]   quiet   don't output anything on stdout/stderr
+ *
+ * \return  image or NULL on failure
+ * \throw   T64_ERR_T64_INVALID
+ */
+t64_image_t *t64_open_mem(const uint8_t *data, size_t size, int quiet)
+{
+    t64_image_t *image;
+    STATS_START(t_parse);
+
+    image = t64_new(NULL);
+    /* cast away const without upsetting -Wcast-qual, the image treats
+     * borrowed data as read-only */
+    image->data = (uint8_t *)(uintptr_t)data;
+    image->size = size;
+    image->data_src = T64_DATA_BORROWED;
+
+    if (!t64_decompress(image, -1) || !t64_parse(image, quiet)) {
+        t64_free(image);
+        return NULL;
+    }
+    STATS_STOP(STATS_PHASE_PARSE, t_parse);
+    return image;
+}
+
+
+/** \brief  Open t64 container, reading only its header and directory
+ *
+ * Reads exactly the header and the used directory records and gets the size
+ * of the image from the file system, so the cost in I/O doesn't depend on the
+ * size of the image. This is enough for t64_verify() and t64_dump(), but not
+ * for anything that needs the file data: the image is marked as partial.
+ *
+ * Falls back to t64_open() if the file isn't a regular file, is compressed or
+ * \a path is "-".
+ *
+ * \param[in]   path    path to container
+ * \param[in]   quiet   don't output anything on stdout/stderr
+ *
+ * \return  image or NULL on failure
+ */
+t64_image_t *t64_open_dir(const char *path, int quiet)
+{
+    return t64_open_dir_arena(path, quiet, NULL);
+}
+
+
+/** \brief  Open t64 container, reading only its header and directory into
+ *          \a arena
+ *
+ * Like t64_open_dir(), but the image, its data and its records are allocated
+ * from \a arena, so batch workers can release all of it by resetting their
+ * arena. The header is read into a local buffer first, which allows reading
+ * the directory straight into a single allocation for header and directory.
+ *
+ * \param[in]   path    path to container
+ * \param[in]   quiet   don't output anything on stdout/stderr
+ * \param[in]   arena   arena (`NULL` to use the heap)
+ *
+ * \return  image or NULL on failure
+ */
+t64_image_t *t64_open_dir_arena(const char *path, int quiet, arena_t *arena)
+{
+    t64_image_t *image;
+    uint8_t header[T64_RECORDS_OFFSET];
+    FILE *fp;
+    size_t size;
+    size_t dir_size;
+    STATS_START(t_read);
+    STATS_START(t_parse);
+
+    if (base_is_stdio(path)) {
+        return t64_open_member_arena(path, -1, quiet, arena);
+    }
+    errno = 0;
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        t64_errno = T64_ERR_IO;
+        return NULL;
+    }
+    if (!base_fsize(fp, &size) || size < T64_RECORDS_OFFSET) {
+        /* pipe or whatever: we need to read it all, the same goes for tiny
+         * files, which are either invalid or compressed */
+        fclose(fp);
+        return t64_open_member_arena(path, -1, quiet, arena);
+    }
+    /* avoid reading ahead, we want exactly the header and directory */
+    setvbuf(fp, NULL, _IONBF, 0);
+
+    /* read and parse header */
+    if (fread(header, 1, T64_RECORDS_OFFSET, fp) != T64_RECORDS_OFFSET) {
+        t64_errno = T64_ERR_IO;
+        fclose(fp);
+        return NULL;
+    }
+    if (archive_detect(header, T64_RECORDS_OFFSET) != ARCHIVE_NONE) {
+        /* compressed: the directory can only be had by inflating */
+        fclose(fp);
+        return t64_open_member_arena(path, -1, quiet, arena);
+    }
+    STATS_STOP(STATS_PHASE_READ, t_read);
+    STATS_RESTART(t_parse);
+
+    image = t64_new(arena);
+    image->path = path;
+    image->size = size;
+    image->partial = true;
+    image->data = header;   /* data_src stays T64_DATA_NONE for now */
+    if (!t64_parse_header(image, quiet)
+            || !t64_check_size(image, image->rec_used, quiet)) {
+        goto t64_open_dir_error;
+    }
+    STATS_STOP(STATS_PHASE_PARSE, t_parse);
+    STATS_RESTART(t_read);
+
+    /* read directory after a copy of the header */
+    dir_size = (size_t)image->rec_used * T64_RECORD_SIZE;
+    image->data = t64_alloc(image, T64_RECORDS_OFFSET + dir_size);
+    image->data_src = arena != NULL ? T64_DATA_ARENA : T64_DATA_HEAP;
+    memcpy(image->data, header, T64_RECORDS_OFFSET);
+    if (fread(image->data + T64_RECORDS_OFFSET, 1, dir_size, fp) != dir_size) {
+        t64_errno = T64_ERR_IO;
+        goto t64_open_dir_error;
+    }
+    fclose(fp);
+    STATS_STOP(STATS_PHASE_READ, t_read);
+    STATS_ADD(STATS_BYTES_READ, T64_RECORDS_OFFSET + dir_size);
+
+    STATS_RESTART(t_parse);
+    t64_read_records(image);
+    STATS_STOP(STATS_PHASE_PARSE, t_parse);
+    return image;
+
+t64_open_dir_error:
+    fclose(fp);
+    t64_free(image);
+    return NULL;
+}
+
+
+/** \brief  Open t64 container from the head of its file read earlier
+ *
+ * Like t64_open_dir_arena(), but the header and directory are taken from
+ * \a head, which holds the first \a len bytes of the file at \a path. Used by
+ * batch mode to parse images whose heads were read asynchronously. The part of
+ * the directory that's not in \a head, if any, is read from the file.
+ *
+ * Falls back to t64_open() for files that are too small or compressed.
+ *
+ * \param[in]   path    path to container
+ * \param[in]   head    start of the file
+ * \param[in]   len     number of bytes in \a head
+ * \param[in]   size    size of the file
+ * \param[in]   quiet   don't output anything on stdout/stderr
+ * \param[in]   arena   arena (`NULL` to use the heap)
+ *
+ * \return  image or NULL on failure
+ */
+t64_image_t *t64_open_dir_head(const char *path,
+                               const uint8_t *head,
+                               size_t len,
+                               size_t size,
+                               int quiet,
+                               arena_t *arena)
+{
+    t64_image_t *image;
+    size_t dir_size;
+    size_t required;
+    STATS_START(t_parse);
+
+    if (size < T64_RECORDS_OFFSET || len < T64_RECORDS_OFFSET
+            || archive_detect(head, len) != ARCHIVE_NONE) {
+        /* tiny, compressed or a short read: read it all */
+        return t64_open_member_arena(path, -1, quiet, arena);
+    }
+    STATS_ADD(STATS_BYTES_READ, len);
+
+    image = t64_new(arena);
+    image->path = path;
+    image->size = size;
+    image->partial = true;
+    /* cast away const without upsetting -Wcast-qual, the header is only read
+     * while data_src is T64_DATA_NONE */
+    image->data = (uint8_t *)(uintptr_t)head;
+    if (!t64_parse_header(image, quiet)
+            || !t64_check_size(image, image->rec_used, quiet)) {
+        t64_free(image);
+        return NULL;
+    }
+
+    dir_size = (size_t)image->rec_used * T64_RECORD_SIZE;
+    required = T64_RECORDS_OFFSET + dir_size;
+    image->data = t64_alloc(image, required);
+    image->data_src = arena != NULL ? T64_DATA_ARENA : T64_DATA_HEAP;
+    if (required <= len) {
+        memcpy(image->data, head, required);
+    } else {
+        /* directory continues past the head */
+        FILE *fp;
+        STATS_START(t_read);
+
+        memcpy(image->data, head, len);
+        errno = 0;
+        fp = fopen(path, "rb");
+        if (fp == NULL) {
+            t64_errno = T64_ERR_IO;
+            t64_free(image);
+            return NULL;
+        }
+        setvbuf(fp, NULL, _IONBF, 0);
+        if (fseek(fp, (long)len, SEEK_SET) != 0
+                || fread(image->data + len, 1, required - len, fp)
+                    != required - len) {
+            t64_errno = T64_ERR_IO;
+            fclose(fp);
+            t64_free(image);
+            return NULL;
+        }
+        fclose(fp);
+        STATS_STOP(STATS_PHASE_READ, t_read);
+        STATS_ADD(STATS_BYTES_READ, required - len);
+    }
+
+    t64_read_records(image);
+    STATS_STOP(STATS_PHASE_PARSE, t_parse);
+    return image;
+}
+
+
+/** \brief  Free memory used by t64 image
+ *
+ * For an image allocated from an arena only its mapping or heap data is
+ * released, the rest goes when the arena is reset.
+ *
+ * \param[in]   image   t64 image
+ */
+void t64_free(t64_image_t *image)
+{
+    t64_free_data(image);
+    if (image->arena != NULL) {
+        /* the image and its records are released with the arena */
+        return;
+    }
+    if (image->records != NULL) {
+        base_free(image->records);
+    }
+    base_free(image);
+}
+
+
+/** \brief  Hash the file data of the records of \a image
+ *
+ * Hashes the data from the offset of each record up to its (fixed) end
+ * address, records whose data lies outside the image aren't hashed.
+ *
+ * \param[in,out]   image   verified t64 image, not partial
+ */
+static void t64_hash_records(t64_image_t *image)
+{
+    int i;
+
+    for (i = 0; i < image->rec_used; i++) {
+        t64_record_t *record = image->records + i;
+        size_t size = (size_t)(record->real_end_addr - record->start_addr);
+
+        if (record->offset <= image->size
+                && size <= image->size - record->offset) {
+            record->hash = hash64(image->data + record->offset, size);
+            record->hashed = true;
+        }
+    }
+}
+
+
+/** \brief  Verify data in \a image, optionally fixing it
+ *
+ * When the file data of \a image is available (it wasn't opened with
+ * t64_open_dir()), the data of each record is hashed as well, see
+ * t64_record_t.hash.
+ *
+ * \param[in]   image   t64 image
+ * \param[in]   quiet   don't output anything on stdout/stderr
+ *
+ * \return  number of fixes, or -1 on error
+ */
+int t64_verify(t64_image_t *image, int quiet)
+{
+    t64_rec_key_t *keys;
+    size_t rec_size;    /* file size according to record */
+    size_t act_size;    /* actual file size */
+    int i;
+    STATS_START(t_verify);
+
+    /* no-op for parsed images, but t64_create() sets the counters itself */
+    t64_fix_counts(image, quiet);
+
+    /* Fix end addresses by sorting file records on data offset and then using
+     * either the data offset of the next entry, or the length of the t64 file
+     * to get the proper end address */
+    keys = t64_sort_records(image);
+
+    /* process records, reporting any invalid data, optionally fixing it */
+    for (i = 0; i < image->rec_used; i++) {
+        t64_record_t *record = image->records + keys[i].index;
+
+        /* check file type */
+        if (record->c64s_ftype > 0x01) {
+            /* memory snapshot */
+            record->status = T64_REC_SKIPPED;
+        } else {
+            if (record->c1541_ftype < 0x80 || record->c1541_ftype >= 0x85) {
+                if (!quiet) {
+                    printf("t64fix: illegal value $%02x for C1541 file type, "
+                            "assuming $82 (prg)\n", record->c1541_ftype);
+                }
+                record->c1541_ftype = 0x82;
+                record->status = T64_REC_FIXED;
+                record->fix_flags |= T64_FIX_FILETYPE;
+                image->fixes++;
+            }
+
+            /* get reported size */
+            rec_size = (size_t)(record->end_addr - record->start_addr);
+            /* determine actual size */
+            if (i < image->rec_used - 1) {
+                act_size = (size_t)(keys[i + 1].offset - record->offset);
+            } else {
+                act_size = (size_t)(image->size - record->offset);
+            }
+            if (rec_size != act_size) {
+                if (i == image->rec_used -1 && rec_size < act_size) {
+                    /* don't fix last record when actual size is larger: some
+                     * T64's have padding for the last record */
+                    record->real_end_addr = record->end_addr;
+                    continue;
+                }
+                if (!quiet) {
+                    printf("t64fix: %d: reported size of $%04lx does not "
+                            "match actual size of $%04lx\n",
+                            record->index,
+                            (unsigned long)rec_size, (unsigned long)act_size);
+                }
+                record->status = T64_REC_FIXED;
+                record->fix_flags |= T64_FIX_END_ADDR;
+                image->fixes++;
+                record->real_end_addr = (unsigned short)(record->start_addr +
+                        act_size);
+            } else {
+                record->real_end_addr = record->end_addr;
+            }
+        }
+
+    }
+    t64_release(image, keys);
+    if (!image->partial) {
+        t64_hash_records(image);
+    }
+
+    STATS_STOP(STATS_PHASE_VERIFY, t_verify);
+    if (stats_enabled) {
+        stats_add(STATS_IMAGES, 1);
+        stats_add(STATS_RECORDS, image->rec_used);
+        stats_tally_fixes(image->fix_flags);
+        for (i = 0; i < image->rec_used; i++) {
+            stats_tally_fixes(image->records[i].fix_flags);
+        }
+    }
+    return image->fixes;
+}
+
+
+/** \brief  Check if \a image is OK, without fixing anything
+ *
+ * A cheaper alternative to t64_verify() when only a yes or no is required:
+ * returns on the first inconsistency, doesn't touch \a image and only sorts
+ * the directory if the records aren't stored in order of their data. Fixes
+ * already applied when opening \a image (its header) count as inconsistency.
+ *
+ * \param[in]   image   t64 image, opened with quiet set to avoid the header
+ *                      warnings on stdout
+ *
+ * \return  true if t64_verify() would report no fixes
+ */
+bool t64_check(const t64_image_t *image)
+{
+    const t64_record_t *records = image->records;
+    t64_rec_key_t *keys = NULL;
+    bool ok = image->fix_flags == 0;
+    int last = image->rec_used - 1;
+    int i;
+    STATS_START(t_verify);
+
+    /* directories are nearly always in order of the data offsets */
+    for (i = 0; ok && i < last; i++) {
+        if (records[i].offset > records[i + 1].offset) {
+            keys = t64_sort_records(image);
+            break;
+        }
+    }
+
+    for (i = 0; ok && i <= last; i++) {
+        const t64_record_t *record;
+        size_t rec_size;
+        size_t act_size;
+
+        if (keys != NULL) {
+            record = records + keys[i].index;
+        } else {
+            record = records + i;
+        }
+        if (record->c64s_ftype > 0x01) {
+            /* memory snapshot */
+            continue;
+        }
+        if (record->c1541_ftype < 0x80 || record->c1541_ftype >= 0x85) {
+            ok = false;
+        } else {
+            rec_size = (size_t)(record->end_addr - record->start_addr);
+            if (i < last) {
+                act_size = (size_t)((keys != NULL ? keys[i + 1].offset
+                            : records[i + 1].offset) - record->offset);
+            } else {
+                act_size = (size_t)(image->size - record->offset);
+            }
+            /* padding after the last record is allowed */
+            ok = rec_size == act_size || (i == last && rec_size < act_size);
+        }
+    }
+    if (keys != NULL) {
+        t64_release(image, keys);
+    }
+
+    STATS_STOP(STATS_PHASE_VERIFY, t_verify);
+    if (stats_enabled) {
+        stats_add(STATS_IMAGES, 1);
+        stats_add(STATS_RECORDS, image->rec_used);
+    }
+    return ok;
+}
+
+
+/** \brief  Print a 79 chars wide separator on stdout
+ */
+static void print_sep(void)
+{
+    puts("-------------------------------------------------------------------"
+         "------------");
+}
+
+
+/** \brief  Dump t64 image information and file records on stdout
+ *
+ * \param[in]   image   t64 image
+ */
+void t64_dump(const t64_image_t *image)
+{
+    char tapename_asc[T64_HDR_NAME_LEN + 1];
+    char magic[T64_HDR_MAGIC_LEN + 1];
+    const size_t name_size = T64_REC_FILENAME_LEN + 1;
+    char *names;
+    int i;
+    STATS_START(t_output);
+
+    /* translate tapename and all filenames, removing padding */
+    pet_to_asc_names(tapename_asc, sizeof tapename_asc,
+                     image->tapename, T64_HDR_NAME_LEN,
+                     T64_HDR_NAME_LEN, 1, PET_CONV_ASCII);
+    names = base_malloc(name_size * ((size_t)image->rec_used + 1));
+    if (image->rec_used > 0) {
+        pet_to_asc_names(names, name_size,
+                         image->records[0].filename, sizeof *(image->records),
+                         T64_REC_FILENAME_LEN, (size_t)image->rec_used,
+                         PET_CONV_ASCII);
+    }
+
+    /* copy magic */
+    memcpy(magic, image->magic, T64_HDR_MAGIC_LEN);
+    magic[T64_HDR_MAGIC_LEN] = '\0';    /* terminate magic */
+    /* remove padding */
+    i = T64_HDR_MAGIC_LEN - 1;
+    while (i >= 0 && magic[i] == 0x20) {
+        magic[i--] = '\0';
+    }
+
     print_sep();
     printf("tape magic  : \"%s\"\n", magic);
     printf("tape version: %04x\n", image->version);
@@ -548,14 +1195,121 @@ void t64_dump(const t64_image_t *image)
     /* print file records */
     printf("blocks filename           type rep. memory  real memory  status\n");
     for (i = 0; i < image->rec_used; i++) {
-        t64_print_record(image, i);
+        t64_print_record(image, i, names + (size_t)i * name_size);
     }
+    base_free(names);
     print_sep();
     if (image->fixes > 0) {
         printf("faulty image: fixes applied: %d\n", image->fixes);
     } else {
         puts("OK, proper image");
     }
+    STATS_STOP(STATS_PHASE_OUTPUT, t_output);
+}
+
+
+/** \brief  Store corrected header and directory in the data of \a image
+ *
+ * After this the data of \a image is the fixed image, for writing it out or
+ * handing it to another program. Borrowed data is copied first, the buffer
+ * passed to t64_open_mem() is never written to.
+ *
+ * \param[in,out]   image   t64 image
+ *
+ * \return  boolean
+ * \throw   T64_ERR_PARTIAL
+ */
+bool t64_apply_fixes(t64_image_t *image)
+{
+    if (image->partial) {
+        t64_errno = T64_ERR_PARTIAL;
+        return false;
+    }
+
+    /* the fixes are applied to the image data, which we don't own */
+    if (image->data_src == T64_DATA_BORROWED) {
+        t64_own_data(image);
+    }
+
+    /* write corrected header in image data */
+    t64_write_header(image, image->data);
+
+    for (int i = 0; i < image->rec_used; i++) {
+        t64_write_record(image->records + i,
+                image->data + T64_RECORDS_OFFSET + (i * T64_RECORD_SIZE));
+    }
+    return true;
+}
+
+
+/** \brief  Generate the fixed header and directory of \a image
+ *
+ * \param[in]   image   t64 image
+ * \param[out]  size    size of the header and directory
+ *
+ * \return  fixed header and directory, free with base_free()
+ */
+static uint8_t *t64_fixed_dir(const t64_image_t *image, size_t *size)
+{
+    uint8_t *fixed;
+    size_t i;
+
+    *size = T64_RECORDS_OFFSET + (size_t)image->rec_used * T64_RECORD_SIZE;
+    fixed = base_malloc(*size);
+    memcpy(fixed, image->data, *size);
+    t64_write_header(image, fixed);
+    for (i = 0; i < image->rec_used; i++) {
+        t64_write_record(image->records + i,
+                fixed + T64_RECORDS_OFFSET + i * T64_RECORD_SIZE);
+    }
+    return fixed;
+}
+
+
+/** \brief  Write fixed copy of the image file of \a image to \a path
+ *
+ * The image file is copied with base_copy_file(), which lets the kernel copy
+ * or even share the data, then the fixed header and directory are written
+ * over the copy. The file data is never read by us, so \a image can be
+ * opened with t64_open_dir().
+ *
+ * \param[in,out]   image   t64 image with an uncompressed image file
+ * \param[in]       path    path of the copy
+ *
+ * \return  boolean
+ * \throw   T64_ERR_IO
+ */
+static bool t64_write_copy(t64_image_t *image, const char *path)
+{
+    uint8_t *fixed;
+    size_t size;
+    bool result;
+    FILE *fp;
+    STATS_START(t_write);
+
+    fp = base_copy_file(image->path, path);
+    if (fp == NULL) {
+        return false;
+    }
+    fixed = t64_fixed_dir(image, &size);
+    result = fseek(fp, 0, SEEK_SET) == 0 && fwrite(fixed, 1, size, fp) == size;
+    if (fclose(fp) != 0) {
+        result = false;
+    }
+    base_free(fixed);
+    if (!result) {
+        t64_errno = T64_ERR_IO;
+        remove(path);
+        return false;
+    }
+    if (!image->partial) {
+        /* keep the promise of t64_write() */
+        t64_apply_fixes(image);
+    }
+    STATS_STOP(STATS_PHASE_WRITE, t_write);
+    STATS_ADD(STATS_BYTES_WRITTEN, size);
+    STATS_ADD(STATS_FILES_WRITTEN, 1);
+    return true;
 }
 
 
@@ -564,23 +1318,36 @@ void t64_dump(const t64_image_t *image)
  * Write corrected image to host filesystem.
  *
  * This function stores corrected header and directory data in \a image before
- * writing to host.
+ * writing to host, see t64_apply_fixes().
+ *
+ * When \a image was read from an uncompressed file, the file is copied and
+ * only the header and directory are written, so this also works for images
+ * opened with t64_open_dir(), see t64_write_copy().
  *
  * \param[in]   image   t64 image
  * \param[in]   path    path/filename of image
  *
  * \return  boolean
+ * \throw   T64_ERR_PARTIAL
+ * \throw   T64_ERR_IO
  */
 bool t64_write(t64_image_t *image, const char *path)
 {
-    /* write corrected header in image data */
-    t64_write_header(image);
+    if (image->path != NULL && !image->compressed
+            && !base_is_stdio(image->path) && !base_is_stdio(path)
+            && !base_same_file(image->path, path)) {
+        return t64_write_copy(image, path);
+    }
 
-    for (int i = 0; i < image->rec_used; i++) {
-        t64_write_record(image->records + i,
-                image->data + T64_RECORDS_OFFSET + (i * T64_RECORD_SIZE));
+    /* truncating the file backing a mapping would pull the rug from under us */
+    if (image->data_src == T64_DATA_MAPPED && image->path != NULL
+            && base_same_file(image->path, path)) {
+        t64_own_data(image);
     }
 
+    if (!t64_apply_fixes(image)) {
+        return false;
+    }
     if (!fwrite_wrapper(path, image->data, image->size)) {
         return false;
     }
@@ -589,39 +1356,521 @@ bool t64_write(t64_image_t *image, const char *path)
 }
 
 
-/** \brief  Write PRG file into T64 image
+/** \brief  Function writing a run of changed bytes
  *
- * Write PRG file \a path into \a image and store its directory entry.
+ * \param[in,out]   arg     argument of the writer
+ * \param[in]       offset  offset of the run in the image
+ * \param[in]       data    fixed data of the run
+ * \param[in]       size    number of bytes in the run
  *
- * \param[in]   image   t64 image
- * \param[in]   path    path to PRG file
- * \param[in]   index   index in directory of \a image
- * \param[in]   quiet   don't print anything on stdout
+ * \return  false on error, with `t64_errno` set
+ */
+typedef bool (*t64_patch_func_t)(void *arg,
+                                 size_t offset,
+                                 const uint8_t *data,
+                                 size_t size);
+
+
+/** \brief  Run of changed bytes to write with t64_write_in_place() or
+ *          t64_write_patch()
+ */
+typedef struct t64_patch_run_s {
+    t64_patch_func_t func;      /**< writer for a run */
+    void *          arg;        /**< argument for \a func */
+    const uint8_t * data;       /**< fixed header and directory data */
+    size_t          start;      /**< offset of first byte of run */
+    size_t          end;        /**< offset of byte after the run */
+    long            written;    /**< total number of bytes written */
+    bool            ok;         /**< no error occurred */
+} t64_patch_run_t;
+
+
+/** \brief  Write pending run of changed bytes in \a run
  *
- * \return  true if succesfully written
+ * \param[in,out]   run     patch run
  */
-static bool store_prg_file(t64_image_t *image,
-                           const char *path,
-                           int index,
-                           bool quiet)
+static void t64_patch_run_flush(t64_patch_run_t *run)
 {
-    t64_record_t record;
-    uint8_t *data;
-    uint8_t petname[CBMDOS_FILENAME_MAX];
-    const char *ascname;
-    const char *ext;
-    long len;
+    size_t size = run->end - run->start;
 
-    len = fread_alloc(&data, path);
-    if (!quiet) {
-        printf(".. file '%s' is %ld ($%04lx) bytes.\n",
-               path, len, (unsigned long)len);
+    if (run->ok && size > 0) {
+        run->ok = run->func(run->arg, run->start, run->data + run->start,
+                            size);
+        run->written += (long)size;
+    }
+    run->start = 0;
+    run->end = 0;
+}
+
+
+/** \brief  Add \a size changed bytes at \a offset to \a run
+ *
+ * Extends the current run if the bytes directly follow it, otherwise the
+ * current run is written and a new one started.
+ *
+ * \param[in,out]   run     patch run
+ * \param[in]       offset  offset of changed bytes
+ * \param[in]       size    number of changed bytes
+ */
+static void t64_patch_run_add(t64_patch_run_t *run, size_t offset, size_t size)
+{
+    if (run->end == offset && run->end > run->start) {
+        run->end += size;
+    } else {
+        t64_patch_run_flush(run);
+        run->start = offset;
+        run->end = offset + size;
+    }
+}
+
+
+/** \brief  Pass the changes between \a fixed and the data of \a image to
+ *          \a func
+ *
+ * Only the header fields and directory records that differ are passed,
+ * adjacent changed fields and records are combined into a single run.
+ *
+ * \param[in]       image   t64 image
+ * \param[in]       fixed   fixed header and directory, see t64_fixed_dir()
+ * \param[in]       func    writer for a run of changed bytes
+ * \param[in,out]   arg     argument for \a func
+ * \param[out]      written number of bytes passed to \a func
+ *
+ * \return  false if \a func failed
+ */
+static bool t64_patch_runs(const t64_image_t *image,
+                           const uint8_t *fixed,
+                           t64_patch_func_t func,
+                           void *arg,
+                           long *written)
+{
+    t64_patch_run_t run;
+    size_t i;
+
+    run.func = func;
+    run.arg = arg;
+    run.data = fixed;
+    run.start = 0;
+    run.end = 0;
+    run.written = 0;
+    run.ok = true;
+
+    /* changed header fields */
+    for (i = 0; i < sizeof header_fields / sizeof header_fields[0]; i++) {
+        size_t offset = header_fields[i].offset;
+
+        if (memcmp(fixed + offset, image->data + offset,
+                    header_fields[i].size) != 0) {
+            t64_patch_run_add(&run, offset, header_fields[i].size);
+        }
+    }
+    /* changed records */
+    for (i = 0; i < image->rec_used; i++) {
+        size_t offset = T64_RECORDS_OFFSET + i * T64_RECORD_SIZE;
+
+        if (memcmp(fixed + offset, image->data + offset,
+                    T64_RECORD_SIZE) != 0) {
+            t64_patch_run_add(&run, offset, T64_RECORD_SIZE);
+        }
     }
-    if (len < 0) {
-        fprintf(stderr, "t64fix: failed to read file '%s'.\n", path);
-        base_free(data);
+    t64_patch_run_flush(&run);
+    *written = run.written;
+    return run.ok;
+}
+
+
+/** \brief  Write a run of changed bytes into an image file
+ *
+ * \param[in,out]   arg     image file (`FILE *`)
+ * \param[in]       offset  offset of the run
+ * \param[in]       data    fixed data of the run
+ * \param[in]       size    number of bytes in the run
+ *
+ * \return  false on error
+ * \throw   T64_ERR_IO
+ */
+static bool t64_patch_file(void *arg,
+                           size_t offset,
+                           const uint8_t *data,
+                           size_t size)
+{
+    FILE *fp = arg;
+
+    if (fseek(fp, (long)offset, SEEK_SET) != 0
+            || fwrite(data, 1, size, fp) != size) {
+        t64_errno = T64_ERR_IO;
         return false;
     }
+    return true;
+}
+
+
+/** \brief  Write fixes in \a image back into the image file
+ *
+ * Only the header fields and directory records that differ from the data read
+ * from the image file are written back, using positioned writes. Adjacent
+ * changed fields and records are combined into a single write. Nothing is
+ * written at all if no fixes were required.
+ *
+ * This only needs the header and directory, so \a image can be opened with
+ * t64_open_dir().
+ *
+ * With `T64_SYNC_ATOMIC` the image is copied to a temporary file next to it,
+ * the copy is patched and synced and then renamed over the original image,
+ * which means the entire image gets copied.
+ *
+ * \param[in,out]   image   t64 image
+ * \param[in]       sync    durability policy
+ *
+ * \return  number of bytes written, or -1 on error
+ * \throw   T64_ERR_IO
+ * \throw   T64_ERR_PARTIAL (image was opened with t64_open_mem())
+ * \throw   T64_ERR_COMPRESSED
+ */
+long t64_write_in_place(t64_image_t *image, t64_sync_t sync)
+{
+    uint8_t *fixed;
+    size_t size;
+    char *tmp_path = NULL;
+    long written;
+    FILE *fp;
+    bool ok;
+    STATS_START(t_write);
+
+    if (image->fixes == 0) {
+        return 0;
+    }
+    if (image->path == NULL) {
+        /* no file to write to */
+        t64_errno = T64_ERR_PARTIAL;
+        return -1;
+    }
+    if (image->compressed) {
+        /* the file contains the compressed image */
+        t64_errno = T64_ERR_COMPRESSED;
+        return -1;
+    }
+
+    fixed = t64_fixed_dir(image, &size);
+
+    errno = 0;
+    if (sync == T64_SYNC_ATOMIC) {
+        FILE *src = fopen(image->path, "rb");
+
+        if (src == NULL) {
+            t64_errno = T64_ERR_IO;
+            base_free(fixed);
+            return -1;
+        }
+        fp = base_fopen_tmp(image->path, &tmp_path);
+        if (fp != NULL && !base_fcopy(src, fp)) {
+            fclose(fp);
+            remove(tmp_path);
+            base_free(tmp_path);
+            fp = NULL;
+        }
+        fclose(src);
+    } else {
+        fp = fopen(image->path, "r+b");
+        if (fp == NULL) {
+            t64_errno = T64_ERR_IO;
+        }
+    }
+    if (fp == NULL) {
+        base_free(fixed);
+        return -1;
+    }
+
+    ok = t64_patch_runs(image, fixed, t64_patch_file, fp, &written);
+
+    if (ok && sync != T64_SYNC_NONE) {
+        ok = base_fsync(fp);
+    }
+    if (fclose(fp) != 0) {
+        t64_errno = T64_ERR_IO;
+        ok = false;
+    }
+    if (tmp_path != NULL) {
+        if (ok) {
+            ok = base_rename_replace(tmp_path, image->path);
+        }
+        if (!ok) {
+            remove(tmp_path);
+        }
+        base_free(tmp_path);
+    }
+
+    if (ok) {
+        /* the image data now matches the file again */
+        memcpy(image->data, fixed, size);
+    }
+    base_free(fixed);
+    STATS_STOP(STATS_PHASE_WRITE, t_write);
+    if (ok) {
+        STATS_ADD(STATS_BYTES_WRITTEN, written);
+        STATS_ADD(STATS_FILES_WRITTEN, 1);
+    }
+    return ok ? written : -1;
+}
+
+
+/** \brief  Add a run of changed bytes to an IPS patch
+ *
+ * \param[in,out]   arg     writer (`outbuf_t *`)
+ * \param[in]       offset  offset of the run
+ * \param[in]       data    fixed data of the run
+ * \param[in]       size    number of bytes in the run
+ *
+ * \return  false if the run can't be stored in an IPS patch
+ * \throw   T64_ERR_PATCH
+ */
+static bool t64_patch_ips(void *arg,
+                          size_t offset,
+                          const uint8_t *data,
+                          size_t size)
+{
+    return ips_record(arg, offset, data, size);
+}
+
+
+/** \brief  Write the fixes of \a image as an IPS patch
+ *
+ * The patch contains the same header fields and directory records that
+ * t64_write_in_place() would write, applying it to the image file gives the
+ * fixed image. For a compressed image the patch applies to the decompressed
+ * image. An image without fixes gives an empty patch.
+ *
+ * This only needs the header and directory, so \a image can be opened with
+ * t64_open_dir().
+ *
+ * \param[in]       image   verified t64 image
+ * \param[in,out]   out     writer for the patch
+ *
+ * \return  number of patched bytes, or -1 on error
+ * \throw   T64_ERR_PATCH
+ */
+long t64_write_patch(const t64_image_t *image, outbuf_t *out)
+{
+    uint8_t *fixed;
+    size_t size;
+    long written = 0;
+    bool ok = true;
+
+    ips_begin(out);
+    if (image->fixes > 0) {
+        fixed = t64_fixed_dir(image, &size);
+        ok = t64_patch_runs(image, fixed, t64_patch_ips, out, &written);
+        base_free(fixed);
+    }
+    ips_end(out);
+    return ok ? written : -1;
+}
+
+
+/** \brief  Write a compacted copy of \a image to \a path
+ *
+ * Rebuilds the image without unused directory slots (the maximum record count
+ * becomes the used record count) and with the file data stored contiguously
+ * after the directory, in the order of the old data offsets. The data of each
+ * file is copied up to its (fixed) end address, which drops padding after the
+ * last file; memory snapshots keep all data up to the next file. The header
+ * and directory are fixed as well, the order of the records is kept.
+ *
+ * The sizes are determined from the directory first, then the new image is
+ * copied out of the data of \a image in a single pass. The copy is written to
+ * a temporary file which is renamed to \a path, so \a path can be the image
+ * file of \a image itself.
+ *
+ * \param[in]   image   verified t64 image, not opened with t64_open_dir()
+ * \param[in]   path    path of the compacted image, "-" for stdout
+ *
+ * \return  size of the compacted image, or -1 on error
+ * \throw   T64_ERR_PARTIAL
+ * \throw   T64_ERR_COMPRESSED (\a path is the compressed image file)
+ * \throw   T64_ERR_T64_INVALID
+ * \throw   T64_ERR_IO
+ */
+long t64_write_compact(const t64_image_t *image, const char *path)
+{
+    t64_rec_key_t *keys;
+    size_t *sizes;
+    uint8_t *data;
+    size_t total;
+    size_t pos;
+    char *tmp_path;
+    FILE *fp;
+    bool ok = true;
+    int last = image->rec_used - 1;
+    int i;
+    STATS_START(t_write);
+
+    if (image->partial) {
+        t64_errno = T64_ERR_PARTIAL;
+        return -1;
+    }
+    if (image->compressed && image->path != NULL && !base_is_stdio(path)
+            && base_same_file(image->path, path)) {
+        t64_errno = T64_ERR_COMPRESSED;
+        return -1;
+    }
+
+    /* sizes of the file data, in order of their offsets */
+    keys = t64_sort_records(image);
+    sizes = base_malloc(sizeof *sizes * ((size_t)image->rec_used + 1));
+    total = T64_RECORDS_OFFSET + (size_t)image->rec_used * T64_RECORD_SIZE;
+    for (i = 0; i <= last; i++) {
+        const t64_record_t *record = image->records + keys[i].index;
+        size_t next = i < last ? keys[i + 1].offset : image->size;
+
+        if (record->offset > image->size || next < record->offset) {
+            ok = false;
+            break;
+        }
+        if (record->c64s_ftype > 0x01) {
+            /* memory snapshot: keep everything */
+            sizes[i] = next - record->offset;
+        } else {
+            sizes[i] = (size_t)(record->real_end_addr - record->start_addr);
+        }
+        if (sizes[i] > image->size - record->offset) {
+            ok = false;
+            break;
+        }
+        total += sizes[i];
+    }
+    if (!ok || total > UINT32_MAX) {
+        t64_errno = T64_ERR_T64_INVALID;
+        base_free(sizes);
+        t64_release(image, keys);
+        return -1;
+    }
+
+    /* copy header, directory and data */
+    data = base_malloc(total);
+    memcpy(data, image->data, T64_RECORDS_OFFSET);
+    t64_write_header(image, data);
+    set_uint16(data + T64_HDR_REC_MAX, image->rec_used);
+    pos = T64_RECORDS_OFFSET + (size_t)image->rec_used * T64_RECORD_SIZE;
+    for (i = 0; i <= last; i++) {
+        t64_record_t record = image->records[keys[i].index];
+        size_t entry = T64_RECORDS_OFFSET + keys[i].index * T64_RECORD_SIZE;
+
+        memcpy(data + entry, image->data + entry, T64_RECORD_SIZE);
+        memcpy(data + pos, image->data + record.offset, sizes[i]);
+        record.offset = (uint32_t)pos;
+        t64_write_record(&record, data + entry);
+        pos += sizes[i];
+    }
+    base_free(sizes);
+    t64_release(image, keys);
+
+    if (base_is_stdio(path)) {
+        base_set_binary(stdout);
+        ok = fwrite(data, 1, total, stdout) == total && fflush(stdout) == 0;
+        if (!ok) {
+            t64_errno = T64_ERR_IO;
+        }
+    } else {
+        errno = 0;
+        fp = base_fopen_tmp(path, &tmp_path);
+        if (fp == NULL) {
+            ok = false;
+        } else {
+            ok = fwrite(data, 1, total, fp) == total;
+            if (fclose(fp) != 0) {
+                ok = false;
+            }
+            if (!ok) {
+                t64_errno = T64_ERR_IO;
+            } else {
+                ok = base_rename_replace(tmp_path, path);
+            }
+            if (!ok) {
+                remove(tmp_path);
+            }
+            base_free(tmp_path);
+        }
+    }
+    STATS_STOP(STATS_PHASE_WRITE, t_write);
+    if (ok) {
+        STATS_ADD(STATS_BYTES_WRITTEN, total);
+        STATS_ADD(STATS_FILES_WRITTEN, 1);
+    }
+    base_free(data);
+    return ok ? (long)total : -1;
+}
+
+
+/** \brief  PRG file to store in a new T64 image
+ *
+ * Job object for reading a PRG file straight into its final location in the
+ * image data with the thread pool.
+ */
+typedef struct t64_prg_job_s {
+    const char *    path;       /**< path to PRG file */
+    uint8_t *       dest;       /**< destination of file data in image */
+    size_t          size;       /**< size of PRG file, including start address */
+    uint16_t        start_addr; /**< start address read from the PRG file */
+    bool            ok;         /**< file was read succesfully */
+    int             sys_errno;  /**< C library errno on failure */
+} t64_prg_job_t;
+
+
+/** \brief  Read PRG file of \a arg into the image data
+ *
+ * Reads the start address into the job object and the rest of the file
+ * directly into the image data, without any intermediate buffer.
+ *
+ * \param[in,out]   arg     PRG job
+ * \param[in]       worker  worker index (unused)
+ */
+static void t64_read_prg_job(void *arg, int worker)
+{
+    t64_prg_job_t *job = arg;
+    uint8_t addr[2];
+    size_t len = job->size - 2;
+    FILE *fp;
+    STATS_START(t_read);
+
+    (void)worker;
+
+    errno = 0;
+    fp = fopen(job->path, "rb");
+    if (fp == NULL) {
+        job->sys_errno = errno;
+        return;
+    }
+    if (fread(addr, 1, 2, fp) != 2
+            || fread(job->dest, 1, len, fp) != len
+            || fgetc(fp) != EOF) {
+        /* I/O error or the file changed size since we checked */
+        job->sys_errno = errno;
+    } else {
+        job->start_addr = get_uint16(addr);
+        job->ok = true;
+        STATS_ADD(STATS_BYTES_READ, job->size);
+    }
+    fclose(fp);
+    STATS_STOP(STATS_PHASE_READ, t_read);
+}
+
+
+/** \brief  Store directory entry of PRG file \a job in \a image
+ *
+ * \param[in,out]   image   t64 image
+ * \param[in]       job     PRG file, already read into the image data
+ * \param[in]       index   index in directory of \a image
+ * \param[in]       quiet   don't print anything on stdout
+ */
+static void store_prg_record(t64_image_t *image,
+                             const t64_prg_job_t *job,
+                             int index,
+                             bool quiet)
+{
+    t64_record_t record;
+    uint8_t petname[CBMDOS_FILENAME_MAX];
+    const char *ascname;
+    const char *ext;
 
     /* create directory record from file data */
     memset(&record, 0, sizeof(record));
@@ -629,7 +1878,7 @@ static bool store_prg_file(t64_image_t *image,
     /*
      * set PETSCII filename using the file's ASCII basename
      */
-    ascname = base_basename(path, &ext);
+    ascname = base_basename(job->path, &ext);
     asc_to_pet_str(petname, ascname, CBMDOS_FILENAME_MAX);
     /* pad filename with spaces */
     for (int i = CBMDOS_FILENAME_MAX - 1; i >=0; i--) {
@@ -640,8 +1889,8 @@ static bool store_prg_file(t64_image_t *image,
     memcpy(record.filename, petname, CBMDOS_FILENAME_MAX);
 
     /* set start, end and real_end */
-    record.start_addr = get_uint16(data);
-    record.end_addr = (uint16_t)(len - 2 + record.start_addr);
+    record.start_addr = job->start_addr;
+    record.end_addr = (uint16_t)(job->size - 2 + record.start_addr);
     record.real_end_addr = record.end_addr;
     if (!quiet) {
         printf(".... start address = $%04x\n", record.start_addr);
@@ -653,15 +1902,9 @@ static bool store_prg_file(t64_image_t *image,
     /* set CBMDOS file type and flags */
     record.c1541_ftype = CBMDOS_FILETYPE_PRG | CBMDOS_CLOSED_MASK;
 
-    /* realloc data after header + dir */
-    image->data = base_realloc(image->data, image->size + (size_t)len - 2);
-    /* copy file data stripped of load address */
-    memcpy(image->data + image->size, data + 2, (size_t)(len - 2));
-    /* store data size */
-    record.offset = (uint32_t)image->size;
-    image->size += (size_t)len - 2;
-    /* free file data */
-    base_free(data);
+    /* file data is already in place, just store its offset */
+    record.offset = (uint32_t)(job->dest - image->data);
+    record.index = index;
 
     /* store directory entry in t64 image instance, not its raw data */
     memcpy(image->records + index, &record, sizeof(record));
@@ -669,24 +1912,36 @@ static bool store_prg_file(t64_image_t *image,
     if (!quiet) {
         printf(".... added '%s'\n", ascname);
     }
-    return true;
 }
 
 
 /** \brief  Create T64 image and add files
+ *
+ * The sizes of all files are determined first, so the image data can be
+ * allocated in one go. The files are then read directly into their final
+ * location in the image data, using \a workers threads.
  *
  * \param[in]   path    name of T64 image to create
  * \param[in]   args    list of files to add
  * \param[in]   nargs   number of elements in \a args
+ * \param[in]   workers number of threads to read files with, 0 for one per
+ *                      processor
  * \param[in]   quiet   don't output anything on stdout
  *
  * \return  new T64 image instance or `NULL` on error
  */
-t64_image_t *t64_create(const char *path, const char **args, int nargs, bool quiet)
+t64_image_t *t64_create(const char *path,
+                        const char **args,
+                        int nargs,
+                        int workers,
+                        bool quiet)
 {
     t64_image_t *image;
+    t64_prg_job_t *prgs;
+    pool_t *pool;
     uint32_t dir_size;
     uint32_t data_offset;
+    uint64_t total;
     const char *img_name;
     const char *img_ext;
     size_t img_name_len;
@@ -696,7 +1951,11 @@ t64_image_t *t64_create(const char *path, const char **args, int nargs, bool qui
     if (!quiet) {
         printf("Creating new t64 image '%s':\n", path);
     }
-    image = t64_new();
+    if (nargs > 0xffff) {
+        fprintf(stderr, "t64fix: too many files (%d), maximum is %d.\n",
+                nargs, 0xffff);
+        return NULL;
+    }
 
     /* calculate directory size */
     dir_size = (unsigned int)nargs * T64_RECORD_SIZE;
@@ -709,21 +1968,83 @@ t64_image_t *t64_create(const char *path, const char **args, int nargs, bool qui
         printf(".. data offset = $%04x\n", (unsigned int)data_offset);
     }
 
+    /* determine size of all files */
+    prgs = base_malloc(sizeof *prgs * (size_t)nargs);
+    total = data_offset;
+    for (index = 0; index < nargs; index++) {
+        t64_prg_job_t *prg = prgs + index;
+
+        prg->path = args[index];
+        prg->ok = false;
+        prg->sys_errno = 0;
+        prg->start_addr = 0;
+        errno = 0;
+        if (!base_file_size(prg->path, &(prg->size))) {
+            fprintf(stderr, "t64fix: failed to read file '%s': %s.\n",
+                    prg->path, strerror(errno));
+            base_free(prgs);
+            return NULL;
+        }
+        if (prg->size < 2) {
+            fprintf(stderr, "t64fix: file '%s' is too small for a PRG file.\n",
+                    prg->path);
+            t64_errno = T64_ERR_IO;
+            errno = EINVAL;
+            base_free(prgs);
+            return NULL;
+        }
+        total += prg->size - 2;
+    }
+    if (total > UINT32_MAX) {
+        fprintf(stderr, "t64fix: total size of files is too large.\n");
+        base_free(prgs);
+        return NULL;
+    }
+
+    image = t64_new(NULL);
+
     /* allocate data for records */
     image->records = base_malloc(sizeof *(image->records) * (size_t)nargs);
 
-    /* allocate data for header and directory and initialize header */
-    image->data = base_malloc(data_offset);
-    image->size = data_offset;
+    /* allocate data for the entire image and initialize header */
+    image->data = base_malloc((size_t)total);
+    image->size = (size_t)total;
+    image->data_src = T64_DATA_HEAP;
     memset(image->data, 0, data_offset);
 
-    /* add files to image */
+    /* read files straight into the image */
+    pool = pool_new(nargs > 1 ? workers : 1);
+    total = data_offset;
+    for (index = 0; index < nargs; index++) {
+        prgs[index].dest = image->data + total;
+        total += prgs[index].size - 2;
+        pool_submit(pool, t64_read_prg_job, prgs + index);
+    }
+    pool_wait(pool);
+    pool_free(pool);
+
+    /* add directory entries */
     for (index = 0; index < nargs; index++) {
-        if (!store_prg_file(image, args[index], index, quiet)) {
+        const t64_prg_job_t *prg = prgs + index;
+
+        if (!quiet) {
+            printf(".. file '%s' is %zu ($%04zx) bytes.\n",
+                   prg->path, prg->size, prg->size);
+        }
+        if (!prg->ok) {
+            fprintf(stderr, "t64fix: failed to read file '%s': %s.\n",
+                    prg->path,
+                    prg->sys_errno != 0 ? strerror(prg->sys_errno)
+                                        : "file size changed");
+            t64_errno = T64_ERR_IO;
+            errno = prg->sys_errno;
+            base_free(prgs);
             t64_free(image);
             return NULL;
         }
+        store_prg_record(image, prg, index, quiet);
     }
+    base_free(prgs);
 
     /* set directory size and entry count */
     image->rec_used = (uint16_t)index;
@@ -28,16 +28,36 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "outbuf.h"
 #include "t64types.h"
 
 t64_image_t *   t64_open(const char *path, int quiet);
+t64_image_t *   t64_open_member(const char *path, int member, int quiet);
+t64_image_t *   t64_open_member_arena(const char *path, int member, int quiet,
+                                      arena_t *arena);
+t64_image_t *   t64_open_dir(const char *path, int quiet);
+t64_image_t *   t64_open_dir_arena(const char *path, int quiet,
+                                   arena_t *arena);
+t64_image_t *   t64_open_dir_head(const char *path,
+                                  const uint8_t *head,
+                                  size_t len,
+                                  size_t size,
+                                  int quiet,
+                                  arena_t *arena);
+t64_image_t *   t64_open_mem(const uint8_t *data, size_t size, int quiet);
 void            t64_free(t64_image_t *image);
 int             t64_verify(t64_image_t *image, int quiet);
+bool            t64_check(const t64_image_t *image);
 void            t64_dump(const t64_image_t *image);
+bool            t64_apply_fixes(t64_image_t *image);
 bool            t64_write(t64_image_t *image, const char *path);
+long            t64_write_in_place(t64_image_t *image, t64_sync_t sync);
+long            t64_write_patch(const t64_image_t *image, outbuf_t *out);
+long            t64_write_compact(const t64_image_t *image, const char *path);
 t64_image_t *   t64_create(const char *path,
                            const char **args,
                            int nargs,
+                           int workers,
                            bool quiet);
 
 #endif
@@ -26,7 +26,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef HAVE_T64TYPES_H
 #define HAVE_T64TYPES_H
 
+#include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "arena.h"
 
 
 #define T64_HDR_MAGIC       0x00    /**< magic 'C64*', unreliable */
@@ -63,6 +67,49 @@ typedef enum {
 } t64_status_t;
 
 
+/** \brief  Reasons for fixes, used as bit flags
+ *
+ * The header fixes are stored in the image, the others in the records.
+ */
+typedef enum {
+    T64_FIX_MAGIC       = 0x01, /**< header magic bytes */
+    T64_FIX_REC_MAX     = 0x02, /**< maximum record count of 0 */
+    T64_FIX_REC_USED    = 0x04, /**< used record count of 0 */
+    T64_FIX_REC_RANGE   = 0x08, /**< more used records than available */
+    T64_FIX_FILETYPE    = 0x10, /**< invalid C1541 file type */
+    T64_FIX_END_ADDR    = 0x20  /**< end address doesn't match data size */
+} t64_fix_t;
+
+/** \brief  Number of fix reasons in `t64_fix_t`
+ */
+#define T64_FIX_COUNT   6
+
+
+/** \brief  Enum indicating where the data of an image lives
+ *
+ * Used by t64_free() to determine how to release the data.
+ */
+typedef enum {
+    T64_DATA_NONE,      /**< no data */
+    T64_DATA_HEAP,      /**< heap-allocated, owned by the image */
+    T64_DATA_MAPPED,    /**< private memory mapping of the image file */
+    T64_DATA_BORROWED,  /**< caller's buffer passed to t64_open_mem(), never
+                             written to or freed by the image */
+    T64_DATA_ARENA      /**< allocated from the arena of the image, released
+                             by resetting the arena */
+} t64_data_src_t;
+
+
+/** \brief  Durability policy for writing fixes in place
+ */
+typedef enum {
+    T64_SYNC_NONE,      /**< leave flushing to the OS */
+    T64_SYNC_FSYNC,     /**< fsync the image after writing */
+    T64_SYNC_ATOMIC     /**< patch a copy, fsync it and rename it over the
+                             original image */
+} t64_sync_t;
+
+
 /** \brief  t64 file record type
  *
  * Contains information of a single file in the container
@@ -77,6 +124,11 @@ typedef struct t64_record_s {
     uint8_t         c1541_ftype;    /**< C1541 file type */
     int             index;          /**< index in container records */
     t64_status_t    status;         /**< record status (OK, fixed, skipped) */
+    unsigned int    fix_flags;      /**< fixes applied (`t64_fix_t` flags) */
+    uint64_t        hash;           /**< hash64() of the file data, valid if
+                                         \a hashed is set */
+    bool            hashed;         /**< \a hash is valid: the file data was
+                                         available to t64_verify() */
 } t64_record_t;
 
 
@@ -88,11 +140,22 @@ typedef struct t64_image_s {
     const char *    path;           /**< path to container file */
     uint8_t *       data;           /**< container file data */
     size_t          size;           /**< size of data */
+    t64_data_src_t  data_src;       /**< origin/owner of \a data */
+    bool            partial;        /**< \a data only contains the header and
+                                         directory, \a size is still the size
+                                         of the complete image */
+    bool            compressed;     /**< \a data was decompressed from a gzip
+                                         stream or zip archive at \a path */
     t64_record_t *  records;        /**< file records */
+    arena_t *       arena;          /**< arena the image, its records and
+                                         (unless mapped) its data were
+                                         allocated from, or `NULL` */
     uint16_t        rec_max;        /**< maximum number of records */
     uint16_t        rec_used;       /**< current number of records */
     uint16_t        version;        /**< tape version */
     int             fixes;          /**< number of fixes applied */
+    unsigned int    fix_flags;      /**< header fixes applied (`t64_fix_t`
+                                         flags) */
 } t64_image_t;
 
 #endif